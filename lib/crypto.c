@@ -26,6 +26,8 @@
 #include <openssl/evp.h>
 #include <openssl/err.h>
 #include <openssl/rand.h>
+#include <openssl/hmac.h>
+#include <openssl/crypto.h>
 #include <openssl/pem.h>
 
 #include <assert.h>
@@ -540,6 +542,20 @@ void sha_destroy(sha_ctx_t *ctx) {
     }
 }
 
+// HMAC SHA256
+
+void hmac_sha256(unsigned char mac[HMAC_SHA256_SIZE], const unsigned char *key, int key_len,
+                 const unsigned char *data, int data_len) {
+    unsigned int len = HMAC_SHA256_SIZE;
+    if (!HMAC(EVP_sha256(), key, key_len, data, data_len, mac, &len)) {
+        handle_error(__func__);
+    }
+}
+
+int crypto_memcmp(const void *a, const void *b, size_t len) {
+    return CRYPTO_memcmp(a, b, len);
+}
+
 int get_random_bytes(unsigned char *buf, int num) {
     return RAND_bytes(buf, num);
 }
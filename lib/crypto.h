@@ -108,6 +108,15 @@ void sha_final(sha_ctx_t *ctx, uint8_t *out, unsigned int *len);
 void sha_reset(sha_ctx_t *ctx);
 void sha_destroy(sha_ctx_t *ctx);
 
+// HMAC SHA256
+
+#define HMAC_SHA256_SIZE 32
+
+void hmac_sha256(unsigned char mac[HMAC_SHA256_SIZE], const unsigned char *key, int key_len,
+                 const unsigned char *data, int data_len);
+/* 0 if equal; the time taken does not depend on where a and b differ */
+int crypto_memcmp(const void *a, const void *b, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -41,6 +41,7 @@ struct httpd_s {
 
     int max_connections;
     int open_connections;
+    int hold_connections;                /* NOHOLD: open connections at which a new client replaces them */
     http_connection_t *connections;
 
     /* These variables only edited mutex locked */
@@ -70,6 +71,7 @@ httpd_init(logger_t *logger, httpd_callbacks_t *callbacks, int max_connections)
     }
 
     httpd->max_connections = max_connections;
+    httpd->hold_connections = 2;
     httpd->connections = calloc(max_connections, sizeof(http_connection_t));
     if (!httpd->connections) {
         free(httpd);
@@ -177,8 +179,8 @@ httpd_accept_connection(httpd_t *httpd, int server_fd, int is_ipv6)
 
 #ifdef NOHOLD
     /* remove existing connections to make way for new connections:
-     * this will only occur if max_connections > 2 */
-    if (httpd->open_connections >= 2)  {
+     * this will only occur if max_connections > hold_connections */
+    if (httpd->open_connections >= httpd->hold_connections)  {
         logger_log(httpd->logger, LOGGER_INFO, "Destroying current connections to allow connection by new client");
         for (int i = 0; i<httpd->max_connections; i++) {
             http_connection_t *connection = &httpd->connections[i];
@@ -440,6 +442,15 @@ httpd_start(httpd_t *httpd, unsigned short *port)
     return 1;
 }
 
+void
+httpd_set_hold_connections(httpd_t *httpd, int hold_connections)
+{
+    assert(httpd);
+    assert(hold_connections > 0);
+
+    httpd->hold_connections = hold_connections;
+}
+
 int
 httpd_is_running(httpd_t *httpd)
 {
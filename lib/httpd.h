@@ -32,6 +32,9 @@ typedef struct httpd_callbacks_s httpd_callbacks_t;
 
 httpd_t *httpd_init(logger_t *logger, httpd_callbacks_t *callbacks, int max_connections);
 
+/* (NOHOLD) with this many connections open, a new client replaces them (default 2) */
+void httpd_set_hold_connections(httpd_t *httpd, int hold_connections);
+
 int httpd_is_running(httpd_t *httpd);
 
 int httpd_start(httpd_t *httpd, unsigned short *port);
@@ -18,9 +18,12 @@
 #include "mirror_buffer.h"
 #include "raop_rtp.h"
 #include "raop_rtp.h"
+#include "byteutils.h"
 #include <stdint.h>
+#include <stdbool.h>
 #include "crypto.h"
 #include "compat.h"
+#include "raop_clock.h"
 #include <math.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -28,6 +31,16 @@
 #include <stdio.h>
 #include <inttypes.h>
 
+typedef struct mirror_decrypt_worker_s {
+    mirror_buffer_t *mirror_buffer;
+    thread_handle_t thread;
+    /* block-aligned chunk to decrypt from input to output, starting at keystream position "position" (len = 0: idle) */
+    const unsigned char *input;
+    unsigned char *output;
+    int len;
+    uint64_t position;
+} mirror_decrypt_worker_t;
+
 struct mirror_buffer_s {
     logger_t *logger;
     aes_ctx_t *aes_ctx;
@@ -35,17 +48,39 @@ struct mirror_buffer_s {
     uint8_t og[16];
     /* audio aes key is used in a hash for the video aes key and iv */
     unsigned char aeskey_audio[RAOP_AESKEY_LEN];
+
+    /* alternative audio aes key derivation (hashed/unhashed with the ecdh_secret), if one exists */
+    unsigned char aeskey_audio_alt[RAOP_AESKEY_LEN];
+    bool has_aeskey_alt;
+
+    /* video aes keys and ivs derived from aeskey_audio [0] and aeskey_audio_alt [1] */
+    unsigned char aeskey_video[2][RAOP_AESKEY_LEN];
+    unsigned char aesiv_video[2][RAOP_AESIV_LEN];
+    bool aes_initialized;
+    int key_variant;
+
+    /* keystream position: number of bytes decrypted since mirror_buffer_init_aes */
+    uint64_t position;
+
+    /* worker pool for decrypting large packets (IDR frames) in parallel, started when needed */
+    mirror_decrypt_worker_t workers[MIRROR_BUFFER_DECRYPT_THREADS];
+    int num_workers;
+    int parallel_probes;         /* large packets timed so far, up to MIRROR_BUFFER_PARALLEL_PROBES */
+    uint64_t parallel_min_nsecs; /* the fastest of them, in nsecs per MB */
+    int pending;
+    bool quit;
+    mutex_handle_t pool_mutex;
+    cond_handle_t pool_cond;
+    cond_handle_t done_cond;
 };
 
-void
-mirror_buffer_init_aes(mirror_buffer_t *mirror_buffer, const uint64_t *streamConnectionID)
+static void
+mirror_buffer_derive_video_key(const unsigned char *aeskey_audio, const uint64_t *streamConnectionID,
+                               unsigned char *aeskey, unsigned char *aesiv)
 {
     unsigned char aeskey_video[64];
     unsigned char aesiv_video[64];
 
-    assert(mirror_buffer);
-    assert(streamConnectionID);
-    
     /* AES key and IV */
     // Need secondary processing to use
     
@@ -54,21 +89,182 @@ mirror_buffer_init_aes(mirror_buffer_t *mirror_buffer, const uint64_t *streamCon
 
     sha_ctx_t *ctx = sha_init();
     sha_update(ctx, aeskey_video, strlen((char*) aeskey_video));
-    sha_update(ctx, mirror_buffer->aeskey_audio, RAOP_AESKEY_LEN);
+    sha_update(ctx, aeskey_audio, RAOP_AESKEY_LEN);
     sha_final(ctx, aeskey_video, NULL);
 
     sha_reset(ctx);
     sha_update(ctx, aesiv_video, strlen((char*) aesiv_video));
-    sha_update(ctx, mirror_buffer->aeskey_audio, RAOP_AESKEY_LEN);
+    sha_update(ctx, aeskey_audio, RAOP_AESKEY_LEN);
     sha_final(ctx, aesiv_video, NULL);
     sha_destroy(ctx);
 
+    memcpy(aeskey, aeskey_video, RAOP_AESKEY_LEN);
+    memcpy(aesiv, aesiv_video, RAOP_AESIV_LEN);
+}
+
+/* create an aes-ctr context positioned "position" bytes into the keystream: the counter (iv) is *
+ * advanced by position / 16 blocks, and if position is not block-aligned, the rest of the       *
+ * keystream of the current block is left in og for the carry-over in mirror_buffer_decrypt      */
+static aes_ctx_t *
+mirror_buffer_aes_ctx_at(const unsigned char *key, const unsigned char *iv, uint64_t position,
+                         uint8_t *og, int *nextDecryptCount)
+{
+    unsigned char counter[RAOP_AESIV_LEN];
+    uint64_t blocks = position / 16;
+    int carry = 0;
+    memcpy(counter, iv, RAOP_AESIV_LEN);
+    for (int i = RAOP_AESIV_LEN - 1; i >= 0; i--) {
+        int sum = counter[i] + (int) (blocks & 0xff) + carry;
+        counter[i] = (unsigned char) (sum & 0xff);
+        carry = sum >> 8;
+        blocks >>= 8;
+    }
+    aes_ctx_t *aes_ctx = aes_ctr_init(key, counter);
+    int offset = (int) (position % 16);
+    *nextDecryptCount = 0;
+    if (offset) {
+        memset(og, 0, 16);
+        aes_ctr_decrypt(aes_ctx, og, og, 16);
+        *nextDecryptCount = 16 - offset;
+    }
+    return aes_ctx;
+}
+
+/* decrypt len bytes starting at the block-aligned keystream position "position" */
+static void
+mirror_buffer_decrypt_blocks(mirror_buffer_t *mirror_buffer, const unsigned char *input, unsigned char *output,
+                             int len, uint64_t position)
+{
+    uint8_t og[16];
+    int nextDecryptCount;
+    int variant = mirror_buffer->key_variant;
+    assert(position % 16 == 0);
+    aes_ctx_t *aes_ctx = mirror_buffer_aes_ctx_at(mirror_buffer->aeskey_video[variant],
+                                                  mirror_buffer->aesiv_video[variant], position,
+                                                  og, &nextDecryptCount);
+    aes_ctr_decrypt(aes_ctx, input, output, len);
+    aes_ctr_destroy(aes_ctx);
+}
+
+static THREAD_RETVAL
+mirror_buffer_decrypt_worker(void *arg)
+{
+    mirror_decrypt_worker_t *worker = arg;
+    mirror_buffer_t *mirror_buffer = worker->mirror_buffer;
+
+    MUTEX_LOCK(mirror_buffer->pool_mutex);
+    while (1) {
+        while (!worker->len && !mirror_buffer->quit) {
+            COND_WAIT(mirror_buffer->pool_cond, mirror_buffer->pool_mutex);
+        }
+        if (mirror_buffer->quit) {
+            break;
+        }
+        MUTEX_UNLOCK(mirror_buffer->pool_mutex);
+        mirror_buffer_decrypt_blocks(mirror_buffer, worker->input, worker->output, worker->len, worker->position);
+        MUTEX_LOCK(mirror_buffer->pool_mutex);
+        worker->len = 0;
+        if (--mirror_buffer->pending == 0) {
+            COND_SIGNAL(mirror_buffer->done_cond);
+        }
+    }
+    MUTEX_UNLOCK(mirror_buffer->pool_mutex);
+    return 0;
+}
+
+/* split len bytes (a multiple of 16, at a block-aligned keystream position) into chunks of at least *
+ * MIRROR_BUFFER_PARALLEL_CHUNK bytes, decrypted by the worker pool and the calling thread            */
+static void
+mirror_buffer_decrypt_parallel(mirror_buffer_t *mirror_buffer, const unsigned char *input, unsigned char *output,
+                               int len, uint64_t position)
+{
+    int chunks = mirror_buffer->num_workers + 1;
+    int chunk = ((len / chunks + 15) / 16) * 16;
+    if (chunk < MIRROR_BUFFER_PARALLEL_CHUNK) {
+        chunk = MIRROR_BUFFER_PARALLEL_CHUNK;
+    }
+    int offset = 0;
+    MUTEX_LOCK(mirror_buffer->pool_mutex);
+    for (int i = 0; i < mirror_buffer->num_workers && len - offset > chunk; i++) {
+        mirror_decrypt_worker_t *worker = &mirror_buffer->workers[i];
+        worker->input = input + offset;
+        worker->output = output + offset;
+        worker->position = position + offset;
+        worker->len = chunk;
+        mirror_buffer->pending++;
+        offset += chunk;
+    }
+    COND_BROADCAST(mirror_buffer->pool_cond);
+    MUTEX_UNLOCK(mirror_buffer->pool_mutex);
+
+    /* the last chunk is decrypted by the calling thread */
+    mirror_buffer_decrypt_blocks(mirror_buffer, input + offset, output + offset, len - offset, position + offset);
+
+    MUTEX_LOCK(mirror_buffer->pool_mutex);
+    while (mirror_buffer->pending) {
+        COND_WAIT(mirror_buffer->done_cond, mirror_buffer->pool_mutex);
+    }
+    MUTEX_UNLOCK(mirror_buffer->pool_mutex);
+}
+
+static int
+mirror_buffer_cpu_count()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int) info.dwNumberOfProcessors;
+#else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return (cores > 0 ? (int) cores : 1);
+#endif
+}
+
+static void
+mirror_buffer_start_workers(mirror_buffer_t *mirror_buffer)
+{
+    /* the thread calling mirror_buffer_decrypt also decrypts a chunk, so use one worker less than the cores */
+    int num_workers = mirror_buffer_cpu_count() - 1;
+    if (num_workers > MIRROR_BUFFER_DECRYPT_THREADS) {
+        num_workers = MIRROR_BUFFER_DECRYPT_THREADS;
+    }
+    for (int i = 0; i < num_workers; i++) {
+        mirror_decrypt_worker_t *worker = &mirror_buffer->workers[mirror_buffer->num_workers];
+        worker->mirror_buffer = mirror_buffer;
+        THREAD_CREATE(worker->thread, mirror_buffer_decrypt_worker, worker);
+        if (worker->thread) {
+            mirror_buffer->num_workers++;
+        }
+    }
+    logger_log(mirror_buffer->logger, LOGGER_DEBUG, "mirror_buffer: decrypting a large packet took %.2f ms per MB: "
+               "%d worker threads for decryption of packets of %d bytes or more",
+               (double) mirror_buffer->parallel_min_nsecs / 1e6, mirror_buffer->num_workers,
+               MIRROR_BUFFER_PARALLEL_THRESHOLD);
+}
+
+void
+mirror_buffer_init_aes(mirror_buffer_t *mirror_buffer, const uint64_t *streamConnectionID)
+{
+    assert(mirror_buffer);
+    assert(streamConnectionID);
+
+    mirror_buffer_derive_video_key(mirror_buffer->aeskey_audio, streamConnectionID,
+                                   mirror_buffer->aeskey_video[0], mirror_buffer->aesiv_video[0]);
+    if (mirror_buffer->has_aeskey_alt) {
+        mirror_buffer_derive_video_key(mirror_buffer->aeskey_audio_alt, streamConnectionID,
+                                       mirror_buffer->aeskey_video[1], mirror_buffer->aesiv_video[1]);
+    }
+
     // Need to be initialized externally
-    mirror_buffer->aes_ctx = aes_ctr_init(aeskey_video, aesiv_video);
+    mirror_buffer->aes_ctx = aes_ctr_init(mirror_buffer->aeskey_video[0], mirror_buffer->aesiv_video[0]);
+    mirror_buffer->nextDecryptCount = 0;
+    mirror_buffer->key_variant = 0;
+    mirror_buffer->position = 0;
+    mirror_buffer->aes_initialized = true;
 }
 
 mirror_buffer_t *
-mirror_buffer_init(logger_t *logger, const unsigned char *aeskey)
+mirror_buffer_init(logger_t *logger, const unsigned char *aeskey, const unsigned char *aeskey_alt)
 {
     mirror_buffer_t *mirror_buffer;
     assert(aeskey);
@@ -77,40 +273,218 @@ mirror_buffer_init(logger_t *logger, const unsigned char *aeskey)
         return NULL;
     }
     memcpy(mirror_buffer->aeskey_audio, aeskey, RAOP_AESKEY_LEN);
+    if (aeskey_alt && memcmp(aeskey, aeskey_alt, RAOP_AESKEY_LEN)) {
+        memcpy(mirror_buffer->aeskey_audio_alt, aeskey_alt, RAOP_AESKEY_LEN);
+        mirror_buffer->has_aeskey_alt = true;
+    }
     mirror_buffer->logger = logger;
     mirror_buffer->nextDecryptCount = 0;
+    MUTEX_CREATE(mirror_buffer->pool_mutex);
+    COND_CREATE(mirror_buffer->pool_cond);
+    COND_CREATE(mirror_buffer->done_cond);
     return mirror_buffer;
 }
 
-void mirror_buffer_decrypt(mirror_buffer_t *mirror_buffer, unsigned char* input, unsigned char* output, int inputLen) {
+static void
+mirror_buffer_decrypt_ctx(aes_ctx_t *aes_ctx, uint8_t *og, int *nextDecryptCount,
+                          const unsigned char* input, unsigned char* output, int inputLen) {
     // Start decrypting
-    if (mirror_buffer->nextDecryptCount > 0) {//mirror_buffer->nextDecryptCount = 10
-        for (int i = 0; i < mirror_buffer->nextDecryptCount; i++) {
-            output[i] = (input[i] ^ mirror_buffer->og[(16 - mirror_buffer->nextDecryptCount) + i]);
+    if (*nextDecryptCount > 0) {//*nextDecryptCount = 10
+        for (int i = 0; i < *nextDecryptCount; i++) {
+            output[i] = (input[i] ^ og[(16 - *nextDecryptCount) + i]);
         }
     }
     // Handling encrypted bytes
-    int encryptlen = ((inputLen - mirror_buffer->nextDecryptCount) / 16) * 16;
+    int encryptlen = ((inputLen - *nextDecryptCount) / 16) * 16;
     // Aes decryption
-    aes_ctr_start_fresh_block(mirror_buffer->aes_ctx);
-    aes_ctr_decrypt(mirror_buffer->aes_ctx, input + mirror_buffer->nextDecryptCount,
-                    input + mirror_buffer->nextDecryptCount, encryptlen);
-    // Copy to output
-    memcpy(output + mirror_buffer->nextDecryptCount, input + mirror_buffer->nextDecryptCount, encryptlen);
-    // int outputlength = mirror_buffer->nextDecryptCount + encryptlen;
+    aes_ctr_start_fresh_block(aes_ctx);
+    aes_ctr_decrypt(aes_ctx, input + *nextDecryptCount,
+                    output + *nextDecryptCount, encryptlen);
+    // int outputlength = *nextDecryptCount + encryptlen;
     // Processing remaining length
-    int restlen = (inputLen - mirror_buffer->nextDecryptCount) % 16;
+    int restlen = (inputLen - *nextDecryptCount) % 16;
     int reststart = inputLen - restlen;
-    mirror_buffer->nextDecryptCount = 0;
+    *nextDecryptCount = 0;
     if (restlen > 0) {
-        memset(mirror_buffer->og, 0, 16);
-        memcpy(mirror_buffer->og, input + reststart, restlen);
-        aes_ctr_decrypt(mirror_buffer->aes_ctx, mirror_buffer->og, mirror_buffer->og, 16);
+        memset(og, 0, 16);
+        memcpy(og, input + reststart, restlen);
+        aes_ctr_decrypt(aes_ctx, og, og, 16);
         for (int j = 0; j < restlen; j++) {
-            output[reststart + j] = mirror_buffer->og[j];
+            output[reststart + j] = og[j];
         }
         //outputlength += restlen;
-        mirror_buffer->nextDecryptCount = 16 - restlen;// Difference 16-6=10 bytes
+        *nextDecryptCount = 16 - restlen;// Difference 16-6=10 bytes
+    }
+}
+
+void mirror_buffer_decrypt(mirror_buffer_t *mirror_buffer, const unsigned char* input, unsigned char* output, int inputLen) {
+    int nextDecryptCount = mirror_buffer->nextDecryptCount;
+    int encryptlen = ((inputLen - nextDecryptCount) / 16) * 16;
+    if (mirror_buffer->num_workers == 0 || encryptlen < MIRROR_BUFFER_PARALLEL_THRESHOLD) {
+        bool probe = (encryptlen >= MIRROR_BUFFER_PARALLEL_THRESHOLD &&
+                      mirror_buffer->parallel_probes < MIRROR_BUFFER_PARALLEL_PROBES);
+        uint64_t start = (probe ? raop_clock_get_time(NULL) : 0);
+        mirror_buffer_decrypt_ctx(mirror_buffer->aes_ctx, mirror_buffer->og, &mirror_buffer->nextDecryptCount,
+                                  input, output, inputLen);
+        mirror_buffer->position += inputLen;
+        if (probe) {
+            uint64_t nsecs = (raop_clock_get_time(NULL) - start) * 1048576 / (uint64_t) inputLen;
+            if (!mirror_buffer->parallel_probes++ || nsecs < mirror_buffer->parallel_min_nsecs) {
+                mirror_buffer->parallel_min_nsecs = nsecs;
+            }
+            if (mirror_buffer->parallel_probes == MIRROR_BUFFER_PARALLEL_PROBES &&
+                mirror_buffer->parallel_min_nsecs > MIRROR_BUFFER_PARALLEL_MIN_NSECS && mirror_buffer_cpu_count() > 1) {
+                mirror_buffer_start_workers(mirror_buffer);
+            }
+        }
+        return;
+    }
+
+    /* CTR mode is seekable: after the carry-over bytes, the block-aligned part is decrypted in parallel, *
+     * then the aes context is repositioned after it to decrypt the remaining (< 16) bytes as usual      */
+    for (int i = 0; i < nextDecryptCount; i++) {
+        output[i] = (input[i] ^ mirror_buffer->og[(16 - nextDecryptCount) + i]);
+    }
+    uint64_t position = mirror_buffer->position + nextDecryptCount;
+    mirror_buffer_decrypt_parallel(mirror_buffer, input + nextDecryptCount, output + nextDecryptCount, encryptlen, position);
+
+    int variant = mirror_buffer->key_variant;
+    aes_ctr_destroy(mirror_buffer->aes_ctx);
+    mirror_buffer->aes_ctx = mirror_buffer_aes_ctx_at(mirror_buffer->aeskey_video[variant],
+                                                      mirror_buffer->aesiv_video[variant], position + encryptlen,
+                                                      mirror_buffer->og, &mirror_buffer->nextDecryptCount);
+    int done = nextDecryptCount + encryptlen;
+    mirror_buffer_decrypt_ctx(mirror_buffer->aes_ctx, mirror_buffer->og, &mirror_buffer->nextDecryptCount,
+                              input + done, output + done, inputLen - done);
+    mirror_buffer->position += inputLen;
+}
+
+uint64_t
+mirror_buffer_get_position(mirror_buffer_t *mirror_buffer)
+{
+    return mirror_buffer->position;
+}
+
+/* a correctly-decrypted video packet is a sequence of h264 NAL units, each prefixed by its   *
+ * 4-byte size, with the "forbidden_zero_bit" of each NAL header unset; the sizes must exactly *
+ * add up to the packet size                                                                   */
+static bool
+mirror_buffer_valid_nalus(const unsigned char *data, int len)
+{
+    int nalu_size = 0;
+    while (nalu_size < len) {
+        if (nalu_size + 5 > len) {
+            return false;
+        }
+        int nc_len = byteutils_get_int_be((unsigned char *) data, nalu_size);
+        if (nc_len <= 0 || nc_len > len - nalu_size - 4) {
+            return false;
+        }
+        if (data[nalu_size + 4] & 0x80) {
+            return false;
+        }
+        nalu_size += 4 + nc_len;
+    }
+    return (len > 0 && nalu_size == len);
+}
+
+/* try to decrypt "encrypted" (a copy of a video packet that started at keystream position "position") *
+ * with key variant "variant" starting at keystream position "start"                                   */
+static bool
+mirror_buffer_try_key(mirror_buffer_t *mirror_buffer, const unsigned char *encrypted, unsigned char *scratch,
+                      int len, int variant, uint64_t start)
+{
+    uint8_t og[16];
+    int nextDecryptCount;
+    aes_ctx_t *aes_ctx = mirror_buffer_aes_ctx_at(mirror_buffer->aeskey_video[variant],
+                                                  mirror_buffer->aesiv_video[variant], start,
+                                                  og, &nextDecryptCount);
+    bool valid = false;
+    memcpy(scratch, encrypted, len);
+    /* the first NAL header is checked before decrypting the rest of the packet */
+    int head = (len < 16 ? len : 16);
+    mirror_buffer_decrypt_ctx(aes_ctx, og, &nextDecryptCount, scratch, scratch, head);
+    int nc_len = (head >= 5 ? (int) byteutils_get_int_be(scratch, 0) : -1);
+    if (nc_len > 0 && nc_len <= len - 4 && !(scratch[4] & 0x80)) {
+        mirror_buffer_decrypt_ctx(aes_ctx, og, &nextDecryptCount, scratch + head, scratch + head, len - head);
+        valid = mirror_buffer_valid_nalus(scratch, len);
+    }
+    aes_ctr_destroy(aes_ctx);
+    return valid;
+}
+
+bool
+mirror_buffer_find_key(mirror_buffer_t *mirror_buffer, const unsigned char *encrypted, int len, uint64_t position,
+                       int *variant, uint64_t *found_position)
+{
+    assert(mirror_buffer);
+    if (!mirror_buffer->aes_initialized || len <= 0) {
+        return false;
+    }
+    unsigned char *scratch = (unsigned char *) malloc(len);
+    if (!scratch) {
+        return false;
+    }
+    bool found = false;
+    int variants = (mirror_buffer->has_aeskey_alt ? 2 : 1);
+
+    /* candidates, most likely first: the other key derivation at the current keystream position,  *
+     * then both derivations with the keystream position shifted by up to MIRROR_BUFFER_RESYNC_WINDOW *
+     * bytes (CTR carry-over out of step), then both derivations from the start of the keystream     */
+    for (int shift = 0; !found && shift <= MIRROR_BUFFER_RESYNC_WINDOW; shift++) {
+        for (int sign = 1; !found && sign >= -1; sign -= 2) {
+            if (shift == 0 && sign < 0) {
+                continue;
+            }
+            int64_t delta = (int64_t) sign * shift;
+            if (delta < 0 && (uint64_t) -delta > position) {
+                continue;
+            }
+            for (int i = 0; !found && i < variants; i++) {
+                int v = (mirror_buffer->key_variant + variants - i) % variants;
+                if (v == mirror_buffer->key_variant && delta == 0) {
+                    continue;    /* the key that is failing */
+                }
+                if (mirror_buffer_try_key(mirror_buffer, encrypted, scratch, len, v, position + delta)) {
+                    *variant = v;
+                    *found_position = position + delta;
+                    found = true;
+                }
+            }
+        }
+    }
+    for (int v = 0; !found && position > MIRROR_BUFFER_RESYNC_WINDOW && v < variants; v++) {
+        if (mirror_buffer_try_key(mirror_buffer, encrypted, scratch, len, v, 0)) {
+            *variant = v;
+            *found_position = 0;
+            found = true;
+        }
+    }
+    free(scratch);
+    return found;
+}
+
+void
+mirror_buffer_set_key(mirror_buffer_t *mirror_buffer, int variant, uint64_t position)
+{
+    assert(mirror_buffer);
+    assert(variant == 0 || (variant == 1 && mirror_buffer->has_aeskey_alt));
+    aes_ctx_t *aes_ctx = mirror_buffer_aes_ctx_at(mirror_buffer->aeskey_video[variant],
+                                                  mirror_buffer->aesiv_video[variant], position,
+                                                  mirror_buffer->og, &mirror_buffer->nextDecryptCount);
+    aes_ctr_destroy(mirror_buffer->aes_ctx);
+    mirror_buffer->aes_ctx = aes_ctx;
+    mirror_buffer->key_variant = variant;
+    mirror_buffer->position = position;
+}
+
+/* a new stream connection restarts the keystream of the key in use */
+void
+mirror_buffer_reset(mirror_buffer_t *mirror_buffer)
+{
+    assert(mirror_buffer);
+    if (mirror_buffer->aes_initialized) {
+        mirror_buffer_set_key(mirror_buffer, mirror_buffer->key_variant, 0);
     }
 }
 
@@ -118,6 +492,16 @@ void
 mirror_buffer_destroy(mirror_buffer_t *mirror_buffer)
 {
     if (mirror_buffer) {
+        MUTEX_LOCK(mirror_buffer->pool_mutex);
+        mirror_buffer->quit = true;
+        COND_BROADCAST(mirror_buffer->pool_cond);
+        MUTEX_UNLOCK(mirror_buffer->pool_mutex);
+        for (int i = 0; i < mirror_buffer->num_workers; i++) {
+            THREAD_JOIN(mirror_buffer->workers[i].thread);
+        }
+        MUTEX_DESTROY(mirror_buffer->pool_mutex);
+        COND_DESTROY(mirror_buffer->pool_cond);
+        COND_DESTROY(mirror_buffer->done_cond);
         aes_ctr_destroy(mirror_buffer->aes_ctx);
         free(mirror_buffer);
     }
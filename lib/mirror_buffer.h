@@ -19,13 +19,35 @@
 #define MIRROR_BUFFER_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "logger.h"
 
+/* largest shift (bytes) of the keystream position tried when resynchronizing the aes-ctr decryption */
+#define MIRROR_BUFFER_RESYNC_WINDOW 64
+
+/* packets with at least MIRROR_BUFFER_PARALLEL_THRESHOLD bytes to decrypt are split into chunks *
+ * of at least MIRROR_BUFFER_PARALLEL_CHUNK bytes, decrypted by up to MIRROR_BUFFER_DECRYPT_THREADS *
+ * worker threads in addition to the calling thread.  The workers are only started if the first     *
+ * MIRROR_BUFFER_PARALLEL_PROBES such packets all took more than MIRROR_BUFFER_PARALLEL_MIN_NSECS   *
+ * per MB to decrypt in the calling thread (no AES instructions): with them, a 1 MB IDR frame takes *
+ * less than 0.2 ms, and the handoff to the workers would cost more than it saves                   */
+#define MIRROR_BUFFER_PARALLEL_THRESHOLD 262144
+#define MIRROR_BUFFER_PARALLEL_CHUNK 65536
+#define MIRROR_BUFFER_DECRYPT_THREADS 3
+#define MIRROR_BUFFER_PARALLEL_PROBES 4
+#define MIRROR_BUFFER_PARALLEL_MIN_NSECS 1000000
+
 typedef struct mirror_buffer_s mirror_buffer_t;
 
 
-mirror_buffer_t *mirror_buffer_init( logger_t *logger, const unsigned char *aeskey);
+mirror_buffer_t *mirror_buffer_init( logger_t *logger, const unsigned char *aeskey, const unsigned char *aeskey_alt);
 void mirror_buffer_init_aes(mirror_buffer_t *mirror_buffer, const uint64_t *streamConnectionID);
-void mirror_buffer_decrypt(mirror_buffer_t *raop_mirror, unsigned char* input, unsigned char* output, int datalen);
+/* output may be input (decrypts in place); input is only read, and may be read-only memory */
+void mirror_buffer_decrypt(mirror_buffer_t *raop_mirror, const unsigned char* input, unsigned char* output, int datalen);
+uint64_t mirror_buffer_get_position(mirror_buffer_t *mirror_buffer);
+bool mirror_buffer_find_key(mirror_buffer_t *mirror_buffer, const unsigned char *encrypted, int len, uint64_t position,
+                            int *variant, uint64_t *found_position);
+void mirror_buffer_set_key(mirror_buffer_t *mirror_buffer, int variant, uint64_t position);
+void mirror_buffer_reset(mirror_buffer_t *mirror_buffer);
 void mirror_buffer_destroy(mirror_buffer_t *mirror_buffer);
 #endif //MIRROR_BUFFER_H
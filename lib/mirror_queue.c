@@ -0,0 +1,136 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include "mirror_queue.h"
+#include "threads.h"
+
+/* head is only written by the consumer, tail by the producer; each reads the other's index with      *
+ * acquire semantics, so the item slots it then reads (or reuses) are those published before it.       *
+ * A stage about to sleep sets its "waiting" flag and checks the queue again; the other stage checks  *
+ * that flag after moving its index.  With sequentially consistent ordering of these four operations,  *
+ * at least one of them sees the other, so a wakeup cannot be lost.                                    */
+struct mirror_queue_s {
+    void **items;
+    unsigned int mask;
+    unsigned int head;
+    unsigned int tail;
+    int closed;
+
+    int consumer_waiting;
+    int producer_waiting;
+    mutex_handle_t mutex;
+    cond_handle_t cond;
+};
+
+mirror_queue_t *
+mirror_queue_init(unsigned int capacity)
+{
+    mirror_queue_t *queue = calloc(1, sizeof(mirror_queue_t));
+    if (!queue) {
+        return NULL;
+    }
+    unsigned int size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    queue->items = calloc(size, sizeof(void *));
+    if (!queue->items) {
+        free(queue);
+        return NULL;
+    }
+    queue->mask = size - 1;
+    MUTEX_CREATE(queue->mutex);
+    COND_CREATE(queue->cond);
+    return queue;
+}
+
+static void
+mirror_queue_wake(mirror_queue_t *queue, int *waiting)
+{
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+        MUTEX_LOCK(queue->mutex);
+        __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+        COND_SIGNAL(queue->cond);
+        MUTEX_UNLOCK(queue->mutex);
+    }
+}
+
+bool
+mirror_queue_push(mirror_queue_t *queue, void *item)
+{
+    unsigned int tail = queue->tail;
+    while (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) > queue->mask) {
+        MUTEX_LOCK(queue->mutex);
+        __atomic_store_n(&queue->producer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (tail - __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) > queue->mask &&
+            !__atomic_load_n(&queue->closed, __ATOMIC_SEQ_CST)) {
+            COND_WAIT(queue->cond, queue->mutex);
+        }
+        __atomic_store_n(&queue->producer_waiting, 0, __ATOMIC_SEQ_CST);
+        MUTEX_UNLOCK(queue->mutex);
+        if (__atomic_load_n(&queue->closed, __ATOMIC_SEQ_CST)) {
+            return false;
+        }
+    }
+    queue->items[tail & queue->mask] = item;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_SEQ_CST);
+    mirror_queue_wake(queue, &queue->consumer_waiting);
+    return true;
+}
+
+void *
+mirror_queue_pop(mirror_queue_t *queue)
+{
+    unsigned int head = queue->head;
+    while (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+        if (__atomic_load_n(&queue->closed, __ATOMIC_SEQ_CST) &&
+            head == __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST)) {
+            return NULL;
+        }
+        MUTEX_LOCK(queue->mutex);
+        __atomic_store_n(&queue->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (head == __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) &&
+            !__atomic_load_n(&queue->closed, __ATOMIC_SEQ_CST)) {
+            COND_WAIT(queue->cond, queue->mutex);
+        }
+        __atomic_store_n(&queue->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+        MUTEX_UNLOCK(queue->mutex);
+    }
+    void *item = queue->items[head & queue->mask];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_SEQ_CST);
+    mirror_queue_wake(queue, &queue->producer_waiting);
+    return item;
+}
+
+void
+mirror_queue_close(mirror_queue_t *queue)
+{
+    MUTEX_LOCK(queue->mutex);
+    __atomic_store_n(&queue->closed, 1, __ATOMIC_SEQ_CST);
+    COND_BROADCAST(queue->cond);
+    MUTEX_UNLOCK(queue->mutex);
+}
+
+void
+mirror_queue_destroy(mirror_queue_t *queue)
+{
+    if (queue) {
+        assert(queue->head == queue->tail);
+        MUTEX_DESTROY(queue->mutex);
+        COND_DESTROY(queue->cond);
+        free(queue->items);
+        free(queue);
+    }
+}
@@ -0,0 +1,40 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * bounded single-producer, single-consumer queue of pointers, connecting the stages of the
+ * mirror thread pipeline.  Push and pop are lock-free while the queue is neither full nor empty;
+ * a stage that must wait sleeps on a condition variable until the other stage wakes it.
+ */
+
+#ifndef MIRROR_QUEUE_H
+#define MIRROR_QUEUE_H
+
+#include <stdbool.h>
+
+typedef struct mirror_queue_s mirror_queue_t;
+
+/* capacity is rounded up to a power of 2 */
+mirror_queue_t *mirror_queue_init(unsigned int capacity);
+
+/* producer: waits while the queue is full; returns false (item not queued) if it was closed */
+bool mirror_queue_push(mirror_queue_t *queue, void *item);
+
+/* consumer: waits while the queue is empty; returns NULL once it is closed and empty */
+void *mirror_queue_pop(mirror_queue_t *queue);
+
+/* producer: no more items will be pushed (the consumer still gets the queued ones) */
+void mirror_queue_close(mirror_queue_t *queue);
+
+void mirror_queue_destroy(mirror_queue_t *queue);
+
+#endif //MIRROR_QUEUE_H
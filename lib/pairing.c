@@ -95,6 +95,9 @@ pairing_init_generate(const char * keyfile)
 
     pairing->ed = ed25519_key_generate(keyfile);
 
+    /* do the one-time SRP group setup now, not during the first pin pairing */
+    srp_prepare_group(SRP_NG);
+
     return pairing;
 }
 
@@ -147,6 +150,14 @@ pairing_session_set_setup_status(pairing_session_t *session)
     session->status = STATUS_SETUP;
 }
 
+/* pair-verify completed: the client proved it holds the key it paired with */
+bool
+pairing_session_is_verified(pairing_session_t *session)
+{
+    assert(session);
+    return (session->status == STATUS_FINISHED);
+}
+
 int
 pairing_session_check_handshake_status(pairing_session_t *session)
 {
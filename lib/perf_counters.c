@@ -0,0 +1,186 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE                      /* RUSAGE_THREAD */
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "perf_counters.h"
+
+static const char *perf_counter_names[PERF_COUNTERS] = { "cycles", "instructions", "llc_misses", "branch_misses",
+                                                         "context_switches" };
+
+struct perf_counters_s {
+    int group_fd;
+    int fds[PERF_COUNTERS];
+    int index[PERF_COUNTERS];            /* position in the group read, -1 if not opened */
+    int count;
+    bool rusage_switches;                /* context switches from getrusage() instead */
+    unsigned int available;
+};
+
+#ifdef __linux__
+/* hardware counters count user space only (allowed with perf_event_paranoid <= 2); context switches *
+ * happen in the kernel, and fall back to getrusage() if the kernel may not be observed             */
+static const struct {
+    uint32_t type;
+    uint64_t config;
+    bool user_only;
+} perf_events[PERF_COUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, true },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, true },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, true },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, true },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, false },
+};
+
+static int
+perf_event_open(struct perf_event_attr *attr, int group_fd) {
+    /* pid 0, cpu -1: the calling thread, on any cpu */
+    return (int) syscall(__NR_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+perf_counters_t *
+perf_counters_open(void) {
+    perf_counters_t *counters = (perf_counters_t *) calloc(1, sizeof(perf_counters_t));
+    if (!counters) {
+        return NULL;
+    }
+    counters->group_fd = -1;
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = perf_events[i].user_only;
+        attr.exclude_hv = 1;
+        counters->fds[i] = perf_event_open(&attr, counters->group_fd);
+        counters->index[i] = -1;
+        if (counters->fds[i] < 0) {
+            continue;
+        }
+        if (counters->group_fd < 0) {
+            counters->group_fd = counters->fds[i];
+        }
+        counters->index[i] = counters->count++;
+        counters->available |= 1u << i;
+    }
+    if (counters->index[PERF_CONTEXT_SWITCHES] < 0) {
+        counters->rusage_switches = true;
+        counters->available |= 1u << PERF_CONTEXT_SWITCHES;
+    }
+    return counters;
+}
+
+void
+perf_counters_read(perf_counters_t *counters, uint64_t values[PERF_COUNTERS]) {
+    uint64_t group[PERF_COUNTERS + 1];
+    memset(values, 0, PERF_COUNTERS * sizeof(uint64_t));
+    if (counters->count && read(counters->group_fd, group, sizeof(group)) > 0) {
+        for (int i = 0; i < PERF_COUNTERS; i++) {
+            if (counters->index[i] >= 0 && counters->index[i] < (int) group[0]) {
+                values[i] = group[1 + counters->index[i]];
+            }
+        }
+    }
+    if (counters->rusage_switches) {
+        struct rusage usage;
+        if (!getrusage(RUSAGE_THREAD, &usage)) {
+            values[PERF_CONTEXT_SWITCHES] = (uint64_t) (usage.ru_nvcsw + usage.ru_nivcsw);
+        }
+    }
+}
+
+void
+perf_counters_close(perf_counters_t *counters) {
+    if (!counters) {
+        return;
+    }
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (counters->fds[i] >= 0) {
+            close(counters->fds[i]);
+        }
+    }
+    free(counters);
+}
+#else
+perf_counters_t *
+perf_counters_open(void) {
+    return NULL;
+}
+
+void
+perf_counters_read(perf_counters_t *counters, uint64_t values[PERF_COUNTERS]) {
+    memset(values, 0, PERF_COUNTERS * sizeof(uint64_t));
+}
+
+void
+perf_counters_close(perf_counters_t *counters) {
+    free(counters);
+}
+#endif
+
+unsigned int
+perf_counters_available(const perf_counters_t *counters) {
+    return (counters ? counters->available : 0);
+}
+
+void
+perf_counters_add(perf_counters_t *counters, uint64_t start[PERF_COUNTERS], perf_stage_t *stage) {
+    uint64_t end[PERF_COUNTERS];
+    perf_counters_read(counters, end);
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        stage->counts[i] += end[i] - start[i];
+        start[i] = end[i];
+    }
+    stage->samples++;
+    stage->available = counters->available;
+}
+
+int
+perf_stage_to_json(char *out, size_t len, const perf_stage_t *stage) {
+    double samples = (double) (stage->samples ? stage->samples : 1);
+    unsigned int cycles_and_instructions = (1u << PERF_CYCLES) | (1u << PERF_INSTRUCTIONS);
+    int n;
+    if ((stage->available & cycles_and_instructions) == cycles_and_instructions && stage->counts[PERF_CYCLES]) {
+        n = snprintf(out, len, "{\"samples\":%llu,\"ipc\":%.2f", (unsigned long long) stage->samples,
+                     (double) stage->counts[PERF_INSTRUCTIONS] / (double) stage->counts[PERF_CYCLES]);
+    } else {
+        n = snprintf(out, len, "{\"samples\":%llu,\"ipc\":null", (unsigned long long) stage->samples);
+    }
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (n < 0 || (size_t) n >= len) {
+            return n;
+        }
+        if (stage->available & (1u << i)) {
+            n += snprintf(out + n, len - n, ",\"%s\":%.1f", perf_counter_names[i], (double) stage->counts[i] / samples);
+        } else {
+            n += snprintf(out + n, len - n, ",\"%s\":null", perf_counter_names[i]);
+        }
+    }
+    if (n >= 0 && (size_t) n < len) {
+        n += snprintf(out + n, len - n, "}");
+    }
+    return n;
+}
@@ -0,0 +1,69 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * hardware performance counters (Linux perf_event_open) of the calling thread, read at the boundaries
+ * of the stages of the stream threads, and summed per stage.  Counters that cannot be opened (no PMU
+ * in a VM, perf_event_paranoid, seccomp in a container, or not Linux) are left out.
+ */
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum perf_counter_e {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_CONTEXT_SWITCHES,
+    PERF_COUNTERS
+};
+
+typedef struct perf_stage_s {
+    uint64_t samples;                    /* times the stage ran */
+    uint64_t counts[PERF_COUNTERS];
+    unsigned int available;              /* bit (1 << counter) set if the counter was read */
+} perf_stage_t;
+
+typedef struct perf_counters_s perf_counters_t;
+
+/* opens the counters of the calling thread; NULL if none are available (not Linux) */
+perf_counters_t *perf_counters_open(void);
+
+/* bit (1 << counter) set for each counter that was opened */
+unsigned int perf_counters_available(const perf_counters_t *counters);
+
+/* current values (all counters with a single read) */
+void perf_counters_read(perf_counters_t *counters, uint64_t values[PERF_COUNTERS]);
+
+/* adds the counts since "start" (from perf_counters_read) to the stage, and sets "start" to the current *
+ * values, for a stage that follows at once                                                             */
+void perf_counters_add(perf_counters_t *counters, uint64_t start[PERF_COUNTERS], perf_stage_t *stage);
+
+void perf_counters_close(perf_counters_t *counters);
+
+/* JSON object with the per-sample means of the stage (null for counters that were not available), *
+ * and instructions per cycle; returns the length, as snprintf                                      */
+int perf_stage_to_json(char *out, size_t len, const perf_stage_t *stage);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //PERF_COUNTERS_H
@@ -32,6 +32,34 @@
 #include "compat.h"
 #include "raop_rtp_mirror.h"
 #include "raop_ntp.h"
+#include "raop_qoe.h"
+#include "threads.h"
+
+/* a client that starts a new session within this time after its previous one ended is reconnecting */
+#define QOE_RECONNECT_WINDOW (60 * 1000000000ULL)
+#define QOE_HISTORY_LEN 16
+
+typedef struct qoe_history_s {
+    char device_id[64];
+    uint64_t end_time;
+    unsigned int reconnects;
+} qoe_history_t;
+
+typedef struct raop_conn_s raop_conn_t;
+
+/* the stream threads of a session, already told to stop, that the reaper thread joins (and destroys) */
+typedef struct raop_teardown_s {
+    raop_conn_t *conn;
+    raop_rtp_t *raop_rtp;
+    raop_rtp_mirror_t *raop_rtp_mirror;
+    raop_ntp_t *raop_ntp;
+    bool destroy;                   /* destroy the objects, not only stop them */
+    const char *end_reason;         /* report the session quality with this end reason (NULL: no report) */
+    bool destroy_conn;              /* the connection is closed: free it afterwards */
+    uint64_t start_time;
+    unsigned int sessions_started;
+    struct raop_teardown_s *next;
+} raop_teardown_t;
 
 struct raop_s {
     /* Callbacks for audio and video */
@@ -46,6 +74,12 @@ struct raop_s {
 
     dnssd_t *dnssd;
 
+    /* local wall clock used for timing (NULL: system clock) */
+    raop_clock_t *clock;
+
+    /* ring file for the clients' streaming reports, owned by the caller (NULL: not stored) */
+    report_log_t *report_log;
+
     /* local network ports */  
     unsigned short port;
     unsigned short timing_lport;
@@ -63,8 +97,14 @@ struct raop_s {
     uint8_t overscanned;
     uint8_t clientFPSdata;
 
+    /* threads in the mirror pipeline (1-3) */
+    uint8_t mirror_stages;
+
     int audio_delay_micros;
     int max_ntp_timeouts;
+    int grace_secs;
+    bool alac_fast_start;
+    bool perf_counters;
 
      /* for temporary storage of pin during pair-pin start */
      unsigned short pin;
@@ -72,6 +112,19 @@ struct raop_s {
   
      /* public key as string */
      char pk_str[2*ED25519_KEY_SIZE + 1];
+
+    /* recently ended sessions, for counting reconnects (reaper_mutex locked) */
+    qoe_history_t qoe_history[QOE_HISTORY_LEN];
+    int qoe_history_index;
+
+    /* session teardowns waiting for the reaper thread */
+    thread_handle_t reaper_thread;
+    mutex_handle_t reaper_mutex;
+    cond_handle_t reaper_cond;
+    raop_teardown_t *reaper_head;
+    raop_teardown_t *reaper_tail;
+    bool reaper_running;
+    unsigned int sessions_started;  /* reaper_mutex locked */
 };
 
 struct raop_conn_s {
@@ -88,8 +141,253 @@ struct raop_conn_s {
     unsigned char *remote;
     int remotelen;
 
+    /* session quality summary, reported once when the session ends */
+    raop_qoe_t qoe;
+    bool qoe_started;
+    bool qoe_reported;
+
+    /* teardowns of this connection's streams not yet done by the reaper thread (reaper_mutex locked) */
+    int teardown_pending;
+
+    /* SETUP admitted the client after its fairplay (and, with a pin, pairing) setup: photos are accepted */
+    bool admitted;
 };
-typedef struct raop_conn_s raop_conn_t;
+
+static void
+raop_conn_qoe_start(raop_conn_t *conn, const char *device_id, const char *model, const char *name) {
+    raop_qoe_t *qoe = &conn->qoe;
+    raop_t *raop = conn->raop;
+    snprintf(qoe->device_id, sizeof(qoe->device_id), "%s", device_id ? device_id : "");
+    snprintf(qoe->model, sizeof(qoe->model), "%s", model ? model : "");
+    snprintf(qoe->name, sizeof(qoe->name), "%s", name ? name : "");
+    qoe->start_time = raop_clock_get_time(NULL);
+    qoe->video_frames_rendered = -1;
+    MUTEX_LOCK(raop->reaper_mutex);
+    raop->sessions_started++;
+    for (int i = 0; i < QOE_HISTORY_LEN; i++) {
+        qoe_history_t *prev = &raop->qoe_history[i];
+        if (prev->end_time && !strcmp(prev->device_id, qoe->device_id) &&
+            qoe->start_time < prev->end_time + QOE_RECONNECT_WINDOW) {
+            qoe->reconnects = prev->reconnects + 1;
+            break;
+        }
+    }
+    MUTEX_UNLOCK(raop->reaper_mutex);
+    conn->qoe_started = true;
+}
+
+/* called when the session ends, after the audio and video threads have been joined (reaper thread) */
+static void
+raop_conn_qoe_report(raop_conn_t *conn, const char *end_reason) {
+    raop_qoe_t *qoe = &conn->qoe;
+    raop_t *raop = conn->raop;
+    if (!conn->qoe_started || conn->qoe_reported) {
+        return;
+    }
+    conn->qoe_reported = true;
+    qoe->end_time = raop_clock_get_time(NULL);
+    qoe->end_reason = (qoe->reset ? "reset" : end_reason);
+
+    /* replace this client's previous entry, or the oldest one */
+    MUTEX_LOCK(raop->reaper_mutex);
+    int index = raop->qoe_history_index;
+    for (int i = 0; i < QOE_HISTORY_LEN; i++) {
+        if (!strcmp(raop->qoe_history[i].device_id, qoe->device_id)) {
+            index = i;
+            break;
+        }
+    }
+    if (index == raop->qoe_history_index) {
+        raop->qoe_history_index = (raop->qoe_history_index + 1) % QOE_HISTORY_LEN;
+    }
+    snprintf(raop->qoe_history[index].device_id, sizeof(raop->qoe_history[index].device_id), "%s", qoe->device_id);
+    raop->qoe_history[index].end_time = qoe->end_time;
+    raop->qoe_history[index].reconnects = qoe->reconnects;
+    MUTEX_UNLOCK(raop->reaper_mutex);
+
+    if (raop->callbacks.report_qoe) {
+        raop->callbacks.report_qoe(raop->callbacks.cls, qoe);
+    }
+}
+
+static void
+raop_teardown_run(raop_t *raop, raop_teardown_t *teardown) {
+    raop_conn_t *conn = teardown->conn;
+    /* all threads were told to stop together, so these joins wait (at most) for the slowest one */
+    if (teardown->raop_rtp) {
+        if (teardown->destroy) {
+            raop_rtp_destroy(teardown->raop_rtp);
+        } else {
+            raop_rtp_stop(teardown->raop_rtp);
+        }
+    }
+    if (teardown->raop_rtp_mirror) {
+        if (teardown->destroy) {
+            raop_rtp_mirror_destroy(teardown->raop_rtp_mirror);
+        } else {
+            raop_rtp_mirror_stop(teardown->raop_rtp_mirror);
+        }
+    }
+    if (teardown->raop_ntp) {
+        raop_ntp_destroy(teardown->raop_ntp);
+    }
+    uint64_t latency = raop_clock_get_time(NULL) - teardown->start_time;
+    if (teardown->raop_rtp || teardown->raop_rtp_mirror || teardown->raop_ntp) {
+        logger_log(raop->logger, LOGGER_INFO, "%s: stream threads stopped after %.1f ms",
+                   (teardown->destroy_conn ? "connection closed" : "TEARDOWN"), (double) latency / 1e6);
+    }
+    if (teardown->end_reason) {
+        conn->qoe.teardown_time = latency;
+        raop_conn_qoe_report(conn, teardown->end_reason);
+    }
+    if (!teardown->destroy_conn) {
+        return;
+    }
+
+    /* do not flush the video of a session that started in the meantime: a session cannot start (and use *
+     * the renderer) while the flush is under way, as raop_conn_qoe_start needs reaper_mutex              */
+    MUTEX_LOCK(raop->reaper_mutex);
+    if (raop->callbacks.video_flush && teardown->sessions_started == raop->sessions_started) {
+        raop->callbacks.video_flush(raop->callbacks.cls);
+    }
+    MUTEX_UNLOCK(raop->reaper_mutex);
+    free(conn->local);
+    free(conn->remote);
+    pairing_session_destroy(conn->session);
+    fairplay_destroy(conn->fairplay);
+    free(conn);
+}
+
+static THREAD_RETVAL
+raop_reaper_thread(void *arg) {
+    raop_t *raop = arg;
+    MUTEX_LOCK(raop->reaper_mutex);
+    while (1) {
+        raop_teardown_t *teardown = raop->reaper_head;
+        if (!teardown) {
+            if (!raop->reaper_running) {
+                break;
+            }
+            COND_WAIT(raop->reaper_cond, raop->reaper_mutex);
+            continue;
+        }
+        raop->reaper_head = teardown->next;
+        if (!raop->reaper_head) {
+            raop->reaper_tail = NULL;
+        }
+        MUTEX_UNLOCK(raop->reaper_mutex);
+
+        raop_conn_t *conn = (teardown->destroy_conn ? NULL : teardown->conn);
+        raop_teardown_run(raop, teardown);
+        free(teardown);
+
+        MUTEX_LOCK(raop->reaper_mutex);
+        if (conn) {
+            conn->teardown_pending--;
+            COND_BROADCAST(raop->reaper_cond);
+        }
+    }
+    MUTEX_UNLOCK(raop->reaper_mutex);
+    return 0;
+}
+
+/* tells the given stream threads to stop, and leaves joining them (and the rest of the teardown) to the reaper *
+ * thread, so that the httpd thread can answer at once and serve the other connections                         */
+static void
+raop_teardown(raop_conn_t *conn, raop_rtp_t *raop_rtp, raop_rtp_mirror_t *raop_rtp_mirror, raop_ntp_t *raop_ntp,
+              bool destroy, const char *end_reason, bool destroy_conn) {
+    raop_t *raop = conn->raop;
+    if (raop_rtp) {
+        raop_rtp_signal_stop(raop_rtp);
+    }
+    if (raop_rtp_mirror) {
+        raop_rtp_mirror_signal_stop(raop_rtp_mirror);
+    }
+    if (raop_ntp) {
+        raop_ntp_signal_stop(raop_ntp);
+    }
+
+    raop_teardown_t teardown_sync;
+    raop_teardown_t *teardown = (raop_teardown_t *) malloc(sizeof(raop_teardown_t));
+    bool sync = (teardown == NULL);
+    if (sync) {
+        teardown = &teardown_sync;
+    }
+    teardown->conn = conn;
+    teardown->raop_rtp = raop_rtp;
+    teardown->raop_rtp_mirror = raop_rtp_mirror;
+    teardown->raop_ntp = raop_ntp;
+    teardown->destroy = destroy;
+    teardown->end_reason = end_reason;
+    teardown->destroy_conn = destroy_conn;
+    teardown->start_time = raop_clock_get_time(NULL);
+    teardown->next = NULL;
+
+    MUTEX_LOCK(raop->reaper_mutex);
+    teardown->sessions_started = raop->sessions_started;
+    if (sync || !raop->reaper_thread) {
+        MUTEX_UNLOCK(raop->reaper_mutex);
+        raop_teardown_run(raop, teardown);
+        if (!sync) {
+            free(teardown);
+        }
+        return;
+    }
+    if (raop->reaper_tail) {
+        raop->reaper_tail->next = teardown;
+    } else {
+        raop->reaper_head = teardown;
+    }
+    raop->reaper_tail = teardown;
+    if (!destroy_conn) {
+        conn->teardown_pending++;
+    }
+    COND_BROADCAST(raop->reaper_cond);
+    MUTEX_UNLOCK(raop->reaper_mutex);
+}
+
+/* a stream cannot be restarted until its threads have been joined.  This connection's stops that the reaper *
+ * thread has not started are taken off its queue and done here, so SETUP never waits behind the teardowns of  *
+ * other connections: only a stop of this connection already being done by the reaper thread is waited for   *
+ * (the stopped threads were told to stop at TEARDOWN, and exit within one 5 ms select timeout)               */
+static void
+raop_teardown_finish(raop_conn_t *conn) {
+    raop_t *raop = conn->raop;
+    raop_teardown_t *claimed = NULL, **claimed_tail = &claimed;
+    MUTEX_LOCK(raop->reaper_mutex);
+    raop_teardown_t *prev = NULL;
+    for (raop_teardown_t *teardown = raop->reaper_head; teardown; ) {
+        raop_teardown_t *next = teardown->next;
+        if (teardown->conn == conn && !teardown->destroy_conn) {
+            if (prev) {
+                prev->next = next;
+            } else {
+                raop->reaper_head = next;
+            }
+            if (raop->reaper_tail == teardown) {
+                raop->reaper_tail = prev;
+            }
+            teardown->next = NULL;
+            *claimed_tail = teardown;
+            claimed_tail = &teardown->next;
+            conn->teardown_pending--;
+        } else {
+            prev = teardown;
+        }
+        teardown = next;
+    }
+    while (conn->teardown_pending) {
+        COND_WAIT(raop->reaper_cond, raop->reaper_mutex);
+    }
+    MUTEX_UNLOCK(raop->reaper_mutex);
+
+    while (claimed) {
+        raop_teardown_t *next = claimed->next;
+        raop_teardown_run(raop, claimed);
+        free(claimed);
+        claimed = next;
+    }
+}
 
 #include "raop_handlers.h"
 
@@ -174,6 +472,31 @@ conn_request(void *ptr, http_request_t *request, http_response_t **response) {
     method = http_request_get_method(request);
     url = http_request_get_url(request);
     cseq = http_request_get_header(request, "CSeq");
+    if (method && url && !cseq) {
+        /* AirPlay photo requests are HTTP, not RTSP */
+        int status = 0;
+        bool photo_request = ((!strcmp(method, "PUT") && !strcmp(url, "/photo")) ||
+                              (!strcmp(method, "POST") && !strcmp(url, "/stop")));
+        if (photo_request && !conn->admitted) {
+            logger_log(conn->raop->logger, LOGGER_WARNING, "%s %s refused: connection has not been set up by an "
+                       "admitted client", method, url);
+            status = 403;
+        } else if (!strcmp(method, "PUT") && !strcmp(url, "/photo")) {
+            status = raop_handler_photo(conn, request);
+        } else if (!strcmp(method, "POST") && !strcmp(url, "/stop")) {
+            if (conn->raop->callbacks.stop_photo) {
+                conn->raop->callbacks.stop_photo(conn->raop->callbacks.cls);
+            }
+            status = 200;
+        }
+        if (status) {
+            logger_log(conn->raop->logger, LOGGER_DEBUG, "%s %s HTTP/1.1: status %d", method, url, status);
+            *response = http_response_init("HTTP/1.1", status, (status == 200 ? "OK" : "Error"));
+            http_response_add_header(*response, "Content-Length", "0");
+            http_response_finish(*response, NULL, 0);
+            return;
+        }
+    }
     if (!method || !cseq) {
         return;
     }
@@ -234,6 +557,7 @@ conn_request(void *ptr, http_request_t *request, http_response_t **response) {
     } else if (!strcmp(method, "OPTIONS")) {
         handler = &raop_handler_options;
     } else if (!strcmp(method, "SETUP")) {
+        raop_teardown_finish(conn);
         handler = &raop_handler_setup;
     } else if (!strcmp(method, "GET_PARAMETER")) {
         handler = &raop_handler_get_parameter;
@@ -299,23 +623,18 @@ conn_request(void *ptr, http_request_t *request, http_response_t **response) {
         if (teardown_96) {
             if (conn->raop_rtp) {
 	        /* Stop our audio RTP session */
-                raop_rtp_stop(conn->raop_rtp);
+                raop_teardown(conn, conn->raop_rtp, NULL, NULL, false, NULL, false);
             }
         } else if (teardown_110) {
             if (conn->raop_rtp_mirror) {
                 /* Stop our video RTP session */
-                raop_rtp_mirror_stop(conn->raop_rtp_mirror);
+                raop_teardown(conn, NULL, conn->raop_rtp_mirror, NULL, false, NULL, false);
             }
         } else {
             /* Destroy our sessions */
-            if (conn->raop_rtp) {
-                raop_rtp_destroy(conn->raop_rtp);
-                conn->raop_rtp = NULL;
-            }
-            if (conn->raop_rtp_mirror) {
-                raop_rtp_mirror_destroy(conn->raop_rtp_mirror);
-                conn->raop_rtp_mirror = NULL;
-            }
+            raop_teardown(conn, conn->raop_rtp, conn->raop_rtp_mirror, NULL, true, "teardown", false);
+            conn->raop_rtp = NULL;
+            conn->raop_rtp_mirror = NULL;
         }
     }
     if (handler != NULL) {
@@ -374,27 +693,9 @@ conn_destroy(void *ptr) {
         conn->raop->callbacks.conn_destroy(conn->raop->callbacks.cls);
     }
 
-    if (conn->raop_rtp) {
-        /* This is done in case TEARDOWN was not called */
-        raop_rtp_destroy(conn->raop_rtp);
-    }
-    if (conn->raop_rtp_mirror) {
-        /* This is done in case TEARDOWN was not called */
-        raop_rtp_mirror_destroy(conn->raop_rtp_mirror);
-    }
-    if (conn->raop_ntp) {
-        raop_ntp_destroy(conn->raop_ntp);
-    }
-
-    if (conn->raop->callbacks.video_flush) {
-        conn->raop->callbacks.video_flush(conn->raop->callbacks.cls);
-    }
-
-    free(conn->local);
-    free(conn->remote);
-    pairing_session_destroy(conn->session);
-    fairplay_destroy(conn->fairplay);
-    free(conn);
+    /* raop_rtp and raop_rtp_mirror are still there if TEARDOWN was not called; *
+     * the connection is freed by the reaper thread after they are destroyed   */
+    raop_teardown(conn, conn->raop_rtp, conn->raop_rtp_mirror, conn->raop_ntp, true, "disconnect", true);
 }
 
 raop_t *
@@ -487,9 +788,20 @@ raop_init(int max_clients, raop_callbacks_t *callbacks, const char* keyfile) {
     /* initialize switch for display of client's streaming data records */    
     raop->clientFPSdata = 0;
 
+    raop->mirror_stages = 1;
+
     raop->max_ntp_timeouts = 0;
+    raop->grace_secs = 0;
+    raop->alac_fast_start = false;
+    raop->perf_counters = false;
     raop->audio_delay_micros = 250000;
 
+    /* if the reaper thread cannot be started, teardowns are done synchronously */
+    MUTEX_CREATE(raop->reaper_mutex);
+    COND_CREATE(raop->reaper_cond);
+    raop->reaper_running = true;
+    THREAD_CREATE(raop->reaper_thread, raop_reaper_thread, raop);
+
     return raop;
 }
 
@@ -499,6 +811,17 @@ raop_destroy(raop_t *raop) {
         raop_stop(raop);
         pairing_destroy(raop->pairing);
         httpd_destroy(raop->httpd);
+
+        /* the reaper thread finishes the teardowns still waiting */
+        if (raop->reaper_thread) {
+            MUTEX_LOCK(raop->reaper_mutex);
+            raop->reaper_running = false;
+            COND_BROADCAST(raop->reaper_cond);
+            MUTEX_UNLOCK(raop->reaper_mutex);
+            THREAD_JOIN(raop->reaper_thread);
+        }
+        MUTEX_DESTROY(raop->reaper_mutex);
+        COND_DESTROY(raop->reaper_cond);
         logger_destroy(raop->logger);
         free(raop);
 
@@ -544,9 +867,29 @@ int raop_set_plist(raop_t *raop, const char *plist_item, const int value) {
     } else if (strcmp(plist_item, "clientFPSdata") == 0) {
         raop->clientFPSdata = (value ? 1 : 0);
         if ((int) raop->clientFPSdata  != value) retval = 1;
+    } else if (strcmp(plist_item, "mirror_stages") == 0) {
+        if (value >= 1 && value <= 3) {
+            raop->mirror_stages = (uint8_t) value;
+        }
+        if ((int) raop->mirror_stages != value) retval = 1;
     } else if (strcmp(plist_item, "max_ntp_timeouts") == 0) {
         raop->max_ntp_timeouts = (value > 0 ? value : 0);
         if (raop->max_ntp_timeouts != value) retval = 1;
+    } else if (strcmp(plist_item, "grace_secs") == 0) {
+        raop->grace_secs = (value > 0 ? value : 0);
+        if (raop->grace_secs != value) retval = 1;
+    } else if (strcmp(plist_item, "alac_fast_start") == 0) {
+        raop->alac_fast_start = (value ? true : false);
+        if ((int) raop->alac_fast_start != value) retval = 1;
+    } else if (strcmp(plist_item, "perf_counters") == 0) {
+        raop->perf_counters = (value ? true : false);
+        if ((int) raop->perf_counters != value) retval = 1;
+    } else if (strcmp(plist_item, "hold_connections") == 0) {
+        if (value > 0) {
+            httpd_set_hold_connections(raop->httpd, value);
+        } else {
+            retval = 1;
+        }
     } else if (strcmp(plist_item, "audio_delay_micros") == 0) {
         if (value >= 0 && value <= 10 * SECOND_IN_USECS) {     
             raop->audio_delay_micros = value;
@@ -608,6 +951,20 @@ raop_set_dnssd(raop_t *raop, dnssd_t *dnssd) {
     raop->dnssd = dnssd;
 }
 
+/* replaces the system clock used for NTP and RTP timing by a (virtual) clock owned by the caller */
+void
+raop_set_clock(raop_t *raop, raop_clock_t *clock) {
+    assert(raop);
+    raop->clock = clock;
+}
+
+/* stores the streaming reports of mirror sessions that start after this call in report_log */
+void
+raop_set_report_log(raop_t *raop, report_log_t *report_log) {
+    assert(raop);
+    raop->report_log = report_log;
+}
+
 
 int
 raop_start(raop_t *raop, unsigned short *port) {
@@ -21,6 +21,8 @@
 #include "dnssd.h"
 #include "stream.h"
 #include "raop_ntp.h"
+#include "raop_qoe.h"
+#include "report_log.h"
 
 #if defined (WIN32) && defined(DLL_EXPORT)
 # define RAOP_API __declspec(dllexport)
@@ -51,7 +53,7 @@ struct raop_callbacks_s {
     void  (*conn_teardown)(void *cls, bool *teardown_96, bool *teardown_110 );
     void  (*audio_flush)(void *cls);
     void  (*video_flush)(void *cls);
-    void  (*audio_set_volume)(void *cls, float volume);
+    void  (*audio_set_volume)(void *cls, raop_ntp_t *ntp, float volume);
     void  (*audio_set_metadata)(void *cls, const void *buffer, int buflen);
     void  (*audio_set_coverart)(void *cls, const void *buffer, int buflen);
     void  (*audio_remote_control_id)(void *cls, const char *dacp_id, const char *active_remote_header);
@@ -62,10 +64,19 @@ struct raop_callbacks_s {
     void  (*display_pin) (void *cls, char * pin);
     void  (*register_client) (void *cls, const char *device_id, const char *pk_str);
     bool  (*check_register) (void *cls, const char *pk_str);
+    bool  (*display_photo) (void *cls, const char *asset_key, const char *data, int datalen, bool display);
+    void  (*stop_photo) (void *cls);
+    /* the audio stream of the connection (identified by its ntp, as in audio_process) has stopped */
+    void  (*audio_stop) (void *cls, raop_ntp_t *ntp);
+    /* session quality summary, once per session when it ends (qoe is only valid during the call) */
+    void  (*report_qoe) (void *cls, raop_qoe_t *qoe);
+    /* running session counters while video is streamed, at most every RAOP_QOE_PROGRESS_INTERVAL *
+     * (from the mirror deliver stage; counters written by other threads are read without locks)  */
+    void  (*report_qoe_progress) (void *cls, const raop_qoe_t *qoe);
 };
 typedef struct raop_callbacks_s raop_callbacks_t;
-raop_ntp_t *raop_ntp_init(logger_t *logger, raop_callbacks_t *callbacks, const char *remote, int remote_addr_len,
-                          unsigned short timing_rport, timing_protocol_t *time_protocol);
+raop_ntp_t *raop_ntp_init(logger_t *logger, raop_callbacks_t *callbacks, raop_clock_t *clock, const char *remote,
+                          int remote_addr_len, unsigned short timing_rport, timing_protocol_t *time_protocol);
 
   RAOP_API raop_t *raop_init(int max_clients, raop_callbacks_t *callbacks, const char* keyfile);
 RAOP_API void raop_set_log_level(raop_t *raop, int level);
@@ -80,6 +91,8 @@ RAOP_API int raop_start(raop_t *raop, unsigned short *port);
 RAOP_API int raop_is_running(raop_t *raop);
 RAOP_API void raop_stop(raop_t *raop);
 RAOP_API void raop_set_dnssd(raop_t *raop, dnssd_t *dnssd);
+RAOP_API void raop_set_clock(raop_t *raop, raop_clock_t *clock);
+RAOP_API void raop_set_report_log(raop_t *raop, report_log_t *report_log);
 RAOP_API void raop_destroy(raop_t *raop);
 
 #ifdef __cplusplus
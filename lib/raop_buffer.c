@@ -59,6 +59,9 @@ struct raop_buffer_s {
     unsigned short first_seqnum;
     unsigned short last_seqnum;
 
+    /* packets skipped at dequeue because they never arrived */
+    uint64_t lost;
+
     /* RTP buffer entries */
     raop_buffer_entry_t entries[RAOP_BUFFER_LENGTH];
 };
@@ -255,6 +258,7 @@ raop_buffer_dequeue(raop_buffer_t *raop_buffer, unsigned int *length, uint64_t *
     /* Update buffer and validate entry */
     raop_buffer->first_seqnum += 1;
     if (!entry->filled) {
+        raop_buffer->lost++;
         return NULL;
     }
     entry->filled = 0;
@@ -270,6 +274,16 @@ raop_buffer_dequeue(raop_buffer_t *raop_buffer, unsigned int *length, uint64_t *
     return data;
 }
 
+uint64_t raop_buffer_get_lost(raop_buffer_t *raop_buffer) {
+    return raop_buffer->lost;
+}
+
+/* packets from the next one to be played to the last one received (including gaps) */
+unsigned int raop_buffer_get_depth(raop_buffer_t *raop_buffer) {
+    short entry_count = seqnum_cmp(raop_buffer->last_seqnum, raop_buffer->first_seqnum) + 1;
+    return (raop_buffer->is_empty || entry_count <= 0 ? 0 : (unsigned int) entry_count);
+}
+
 void raop_buffer_handle_resends(raop_buffer_t *raop_buffer, raop_resend_cb_t resend_cb, void *opaque) {
     assert(raop_buffer);
     assert(resend_cb);
@@ -0,0 +1,190 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ *=================================================================
+ * clock and timer abstraction used by raop_ntp, raop_rtp and raop_rtp_mirror
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+
+#include "raop_clock.h"
+
+#define SECOND_IN_NSECS 1000000000ULL
+
+/* longest real-time slice a virtual-clock wait sleeps before re-checking the virtual time */
+#define RAOP_CLOCK_VIRTUAL_POLL 1000000ULL
+
+struct raop_clock_s {
+    raop_clock_type_t type;
+
+    mutex_handle_t mutex;
+
+    /* virtual time base_time corresponds to real time real_base */
+    uint64_t base_time;
+    uint64_t real_base;
+    double speed;
+};
+
+static uint64_t
+raop_clock_get_real_time(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_REALTIME, &time);
+    return ((uint64_t) time.tv_nsec) + (uint64_t) time.tv_sec * SECOND_IN_NSECS;
+}
+
+static uint64_t
+raop_clock_get_virtual_time_locked(raop_clock_t *raop_clock)
+{
+    uint64_t time = raop_clock->base_time;
+    if (raop_clock->speed > 0) {
+        time += (uint64_t) ((double) (raop_clock_get_real_time() - raop_clock->real_base) * raop_clock->speed);
+    }
+    return time;
+}
+
+/* real-time duration of the next sleep while waiting for "remaining" nsecs of clock time */
+static uint64_t
+raop_clock_real_slice(raop_clock_t *raop_clock, uint64_t remaining)
+{
+    uint64_t slice = RAOP_CLOCK_VIRTUAL_POLL;
+    if (raop_clock->speed > 0) {
+        uint64_t scaled = (uint64_t) ((double) remaining / raop_clock->speed);
+        if (scaled < slice) {
+            slice = scaled;
+        }
+    }
+    return slice;
+}
+
+raop_clock_t *
+raop_clock_init(raop_clock_type_t type, uint64_t start_time, double speed)
+{
+    raop_clock_t *raop_clock = calloc(1, sizeof(raop_clock_t));
+    if (!raop_clock) {
+        return NULL;
+    }
+    raop_clock->type = type;
+    raop_clock->base_time = start_time;
+    raop_clock->real_base = raop_clock_get_real_time();
+    raop_clock->speed = (speed > 0 ? speed : 0);
+    MUTEX_CREATE(raop_clock->mutex);
+    return raop_clock;
+}
+
+void
+raop_clock_destroy(raop_clock_t *raop_clock)
+{
+    if (raop_clock) {
+        MUTEX_DESTROY(raop_clock->mutex);
+        free(raop_clock);
+    }
+}
+
+raop_clock_type_t
+raop_clock_get_type(raop_clock_t *raop_clock)
+{
+    return (raop_clock ? raop_clock->type : RAOP_CLOCK_SYSTEM);
+}
+
+uint64_t
+raop_clock_get_time(raop_clock_t *raop_clock)
+{
+    if (!raop_clock || raop_clock->type == RAOP_CLOCK_SYSTEM) {
+        return raop_clock_get_real_time();
+    }
+    MUTEX_LOCK(raop_clock->mutex);
+    uint64_t time = raop_clock_get_virtual_time_locked(raop_clock);
+    MUTEX_UNLOCK(raop_clock->mutex);
+    return time;
+}
+
+void
+raop_clock_set_time(raop_clock_t *raop_clock, uint64_t time)
+{
+    if (!raop_clock || raop_clock->type != RAOP_CLOCK_VIRTUAL) {
+        return;
+    }
+    MUTEX_LOCK(raop_clock->mutex);
+    raop_clock->base_time = time;
+    raop_clock->real_base = raop_clock_get_real_time();
+    MUTEX_UNLOCK(raop_clock->mutex);
+}
+
+void
+raop_clock_advance(raop_clock_t *raop_clock, uint64_t nsecs)
+{
+    if (!raop_clock || raop_clock->type != RAOP_CLOCK_VIRTUAL) {
+        return;
+    }
+    MUTEX_LOCK(raop_clock->mutex);
+    raop_clock->base_time = raop_clock_get_virtual_time_locked(raop_clock) + nsecs;
+    raop_clock->real_base = raop_clock_get_real_time();
+    MUTEX_UNLOCK(raop_clock->mutex);
+}
+
+int
+raop_clock_cond_wait(raop_clock_t *raop_clock, cond_handle_t *cond, mutex_handle_t *mutex, uint64_t timeout)
+{
+    struct timespec wait_time;
+    uint64_t deadline = raop_clock_get_time(raop_clock) + timeout;
+    while (1) {
+        uint64_t now = raop_clock_get_time(raop_clock);
+        if (now >= deadline) {
+            return ETIMEDOUT;
+        }
+        uint64_t slice = deadline - now;
+        if (raop_clock && raop_clock->type == RAOP_CLOCK_VIRTUAL) {
+            slice = raop_clock_real_slice(raop_clock, slice);
+        }
+        uint64_t real_deadline = raop_clock_get_real_time() + slice;
+        wait_time.tv_sec = real_deadline / SECOND_IN_NSECS;
+        wait_time.tv_nsec = real_deadline % SECOND_IN_NSECS;
+        int ret = pthread_cond_timedwait(cond, mutex, &wait_time);
+        if (ret != ETIMEDOUT) {
+            return ret;
+        }
+        if (!raop_clock || raop_clock->type == RAOP_CLOCK_SYSTEM) {
+            return ETIMEDOUT;
+        }
+    }
+}
+
+int
+raop_clock_select(raop_clock_t *raop_clock, int nfds, fd_set *rfds, uint64_t timeout)
+{
+    struct timeval tv;
+    if (!raop_clock || raop_clock->type == RAOP_CLOCK_SYSTEM) {
+        tv.tv_sec = timeout / SECOND_IN_NSECS;
+        tv.tv_usec = (timeout % SECOND_IN_NSECS) / 1000;
+        return select(nfds, rfds, NULL, NULL, &tv);
+    }
+
+    /* virtual clock: poll the sockets in short real-time slices until the virtual timeout expires */
+    fd_set fds;
+    uint64_t deadline = raop_clock_get_time(raop_clock) + timeout;
+    while (1) {
+        uint64_t now = raop_clock_get_time(raop_clock);
+        uint64_t slice = (now < deadline ? raop_clock_real_slice(raop_clock, deadline - now) : 0);
+        memcpy(&fds, rfds, sizeof(fd_set));
+        tv.tv_sec = 0;
+        tv.tv_usec = slice / 1000;
+        int ret = select(nfds, &fds, NULL, NULL, &tv);
+        if (ret != 0 || now >= deadline) {
+            memcpy(rfds, &fds, sizeof(fd_set));
+            return ret;
+        }
+    }
+}
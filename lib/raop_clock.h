@@ -0,0 +1,58 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ *=================================================================
+ * clock and timer abstraction used by raop_ntp, raop_rtp and raop_rtp_mirror
+ */
+
+#ifndef RAOP_CLOCK_H
+#define RAOP_CLOCK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "compat.h"
+
+typedef struct raop_clock_s raop_clock_t;
+
+typedef enum raop_clock_type_e { RAOP_CLOCK_SYSTEM, RAOP_CLOCK_VIRTUAL } raop_clock_type_t;
+
+/* RAOP_CLOCK_SYSTEM follows the system Unix time (CLOCK_REALTIME).
+ * RAOP_CLOCK_VIRTUAL starts at start_time (nsecs) and only moves when
+ * raop_clock_advance() or raop_clock_set_time() is called, or, if speed > 0,
+ * runs at "speed" times real time (e.g. speed = 1000 simulates an hour in 3.6 s) */
+raop_clock_t *raop_clock_init(raop_clock_type_t type, uint64_t start_time, double speed);
+void raop_clock_destroy(raop_clock_t *raop_clock);
+
+raop_clock_type_t raop_clock_get_type(raop_clock_t *raop_clock);
+
+/* time in nano seconds; a NULL raop_clock means the system clock */
+uint64_t raop_clock_get_time(raop_clock_t *raop_clock);
+
+/* virtual clock only: no effect on the system clock */
+void raop_clock_set_time(raop_clock_t *raop_clock, uint64_t time);
+void raop_clock_advance(raop_clock_t *raop_clock, uint64_t nsecs);
+
+/* pthread_cond_timedwait for "timeout" nsecs of clock time: returns 0 if signalled,
+ * ETIMEDOUT otherwise.  mutex must be locked by the caller, as for pthread_cond_timedwait */
+int raop_clock_cond_wait(raop_clock_t *raop_clock, cond_handle_t *cond, mutex_handle_t *mutex, uint64_t timeout);
+
+/* select() on the read descriptors in rfds with a timeout of "timeout" nsecs of clock time */
+int raop_clock_select(raop_clock_t *raop_clock, int nfds, fd_set *rfds, uint64_t timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //RAOP_CLOCK_H
@@ -584,6 +584,9 @@ raop_handler_setup(raop_conn_t *conn,
 	if (conn->raop->callbacks.report_client_request) {
             conn->raop->callbacks.report_client_request(conn->raop->callbacks.cls, deviceID, model, name, &admit_client);
         }
+        if (admit_client) {
+            raop_conn_qoe_start(conn, deviceID, model, name);
+        }
         free (deviceID);
         deviceID = NULL;
         free (model);
@@ -621,6 +624,7 @@ raop_handler_setup(raop_conn_t *conn,
         }
         int ret = fairplay_decrypt(conn->fairplay, (unsigned char*) eaeskey, aeskey);
         logger_log(conn->raop->logger, LOGGER_DEBUG, "fairplay_decrypt ret = %d", ret);
+        conn->admitted = (ret == 0 && (!conn->raop->use_pin || pairing_session_is_verified(conn->session)));
         if (logger_debug) {
             char *str = utils_data_to_string(aeskey, 16, 16);
             logger_log(conn->raop->logger, LOGGER_DEBUG, "16 byte aeskey (fairplay-decrypted from ekey):\n%s", str);
@@ -634,36 +638,42 @@ raop_handler_setup(raop_conn_t *conn,
 #ifdef OLD_PROTOCOL_CLIENT_USER_AGENT_LIST    /* set in global.h */
         if (strstr(OLD_PROTOCOL_CLIENT_USER_AGENT_LIST, user_agent)) old_protocol = true;
 #endif
-        if  (old_protocol) {    /* some windows AirPlay-client emulators use old AirPlay 1 protocol with unhashed AES key */
-            logger_log(conn->raop->logger, LOGGER_INFO, "Client identifed as using old protocol (unhashed) AES audio key)");
-        } else {
-            unsigned char ecdh_secret[X25519_KEY_SIZE];
-            if (pairing_get_ecdh_secret_key(conn->session, ecdh_secret)) {
-                /* In this case  (legacy) pairing with client was successfully set up and created the shared ecdh_secret:
-                 * aeskey must now be hashed with it
-                 *
-                 * If byte 27 of features ("supports legacy pairing") is turned off, the client does not request pairsetup
-                 * and does NOT set up pairing (this eliminates a 5 second delay in connecting with no apparent bad effects).
-                 * In this case, ecdh_secret does not exist, so aeskey should NOT be hashed with it.
-
-                 * UxPlay may be able to function with byte 27 turned off because it currently does not support connections 
-                 * with more than one client at a time. AppleTV supports up to 12 clients, uses pairing to give each a distinct
-                 * SessionID and ecdh_secret.
+        /* the derivation (hashed or unhashed) not used here is kept as an alternative key for the video stream,
+         * which will switch to it if video decryption fails persistently */
+        unsigned char aeskey_alt[16];
+        bool has_aeskey_alt = false;
+        unsigned char ecdh_secret[X25519_KEY_SIZE];
+        if (pairing_get_ecdh_secret_key(conn->session, ecdh_secret)) {
+            /* In this case  (legacy) pairing with client was successfully set up and created the shared ecdh_secret:
+             * aeskey must now be hashed with it
+             *
+             * If byte 27 of features ("supports legacy pairing") is turned off, the client does not request pairsetup
+             * and does NOT set up pairing (this eliminates a 5 second delay in connecting with no apparent bad effects).
+             * In this case, ecdh_secret does not exist, so aeskey should NOT be hashed with it.
+
+             * UxPlay may be able to function with byte 27 turned off because it currently does not support connections 
+             * with more than one client at a time. AppleTV supports up to 12 clients, uses pairing to give each a distinct
+             * SessionID and ecdh_secret.
             
-                 * The "old protocol" Windows AirPlay client AirMyPC seems not to respect the byte 27 setting, and always sets
-                 * up the  ecdh_secret, but decryption fails if aeskey is hashed.*/
+             * The "old protocol" Windows AirPlay client AirMyPC seems not to respect the byte 27 setting, and always sets
+             * up the  ecdh_secret, but decryption fails if aeskey is hashed.*/
 
-                if (logger_debug) {
-                    char *str = utils_data_to_string(ecdh_secret, X25519_KEY_SIZE, 16);
-                    logger_log(conn->raop->logger, LOGGER_DEBUG, "32 byte shared ecdh_secret:\n%s", str);
-                    free(str);
-                }
-                memcpy(eaeskey, aeskey, 16);
-                sha_ctx_t *ctx = sha_init();
-                sha_update(ctx, eaeskey, 16);
-                sha_update(ctx, ecdh_secret, 32);
-                sha_final(ctx, eaeskey, NULL);
-                sha_destroy(ctx);
+            if (logger_debug) {
+                char *str = utils_data_to_string(ecdh_secret, X25519_KEY_SIZE, 16);
+                logger_log(conn->raop->logger, LOGGER_DEBUG, "32 byte shared ecdh_secret:\n%s", str);
+                free(str);
+            }
+            memcpy(eaeskey, aeskey, 16);
+            sha_ctx_t *ctx = sha_init();
+            sha_update(ctx, eaeskey, 16);
+            sha_update(ctx, ecdh_secret, 32);
+            sha_final(ctx, eaeskey, NULL);
+            sha_destroy(ctx);
+            has_aeskey_alt = true;
+            if (old_protocol) {
+                memcpy(aeskey_alt, eaeskey, 16);
+            } else {
+                memcpy(aeskey_alt, aeskey, 16);
                 memcpy(aeskey, eaeskey, 16);
                 if (logger_debug) {
                     char *str = utils_data_to_string(aeskey, 16, 16);
@@ -672,6 +682,9 @@ raop_handler_setup(raop_conn_t *conn,
                 }
             }
         }
+        if  (old_protocol) {    /* some windows AirPlay-client emulators use old AirPlay 1 protocol with unhashed AES key */
+            logger_log(conn->raop->logger, LOGGER_INFO, "Client identifed as using old protocol (unhashed) AES audio key)");
+        }
 
         // Time port
         plist_t req_is_remote_control_only_node = plist_dict_get_item(req_root_node, "isRemoteControlOnly");
@@ -738,13 +751,26 @@ raop_handler_setup(raop_conn_t *conn,
                          conn->remote[8], conn->remote[9], conn->remote[10], conn->remote[11],
                          conn->remote[12], conn->remote[13], conn->remote[14], conn->remote[15]);
             }
-            conn->raop_ntp = raop_ntp_init(conn->raop->logger, &conn->raop->callbacks, remote,
+            conn->raop_ntp = raop_ntp_init(conn->raop->logger, &conn->raop->callbacks, conn->raop->clock, remote,
                                            conn->remotelen, (unsigned short) timing_rport, &time_protocol);
+            raop_ntp_set_qoe(conn->raop_ntp, &conn->qoe);
+            raop_ntp_set_grace_period(conn->raop_ntp, conn->raop->grace_secs);
             raop_ntp_start(conn->raop_ntp, &timing_lport, conn->raop->max_ntp_timeouts);
             conn->raop_rtp = raop_rtp_init(conn->raop->logger, &conn->raop->callbacks, conn->raop_ntp,
                                            remote, conn->remotelen, aeskey, aesiv);
             conn->raop_rtp_mirror = raop_rtp_mirror_init(conn->raop->logger, &conn->raop->callbacks,
-                                                         conn->raop_ntp, remote, conn->remotelen, aeskey);
+                                                         conn->raop_ntp, remote, conn->remotelen, aeskey,
+                                                         (has_aeskey_alt ? aeskey_alt : NULL));
+            if (conn->raop_rtp) {
+                raop_rtp_set_qoe(conn->raop_rtp, &conn->qoe);
+                raop_rtp_set_fast_start(conn->raop_rtp, conn->raop->alac_fast_start);
+                raop_rtp_set_perf_counters(conn->raop_rtp, conn->raop->perf_counters);
+            }
+            if (conn->raop_rtp_mirror) {
+                raop_rtp_mirror_set_qoe(conn->raop_rtp_mirror, &conn->qoe);
+                raop_rtp_mirror_set_report_log(conn->raop_rtp_mirror, conn->raop->report_log);
+                raop_rtp_mirror_set_perf_counters(conn->raop_rtp_mirror, conn->raop->perf_counters);
+            }
         }
 
         plist_t res_event_port_node = plist_new_uint(conn->raop->port);
@@ -780,7 +806,9 @@ raop_handler_setup(raop_conn_t *conn,
 
                     if (conn->raop_rtp_mirror) {
                         raop_rtp_init_mirror_aes(conn->raop_rtp_mirror, &stream_connection_id);
-                        raop_rtp_start_mirror(conn->raop_rtp_mirror, &dport, conn->raop->clientFPSdata);
+                        raop_rtp_start_mirror(conn->raop_rtp_mirror, &dport, conn->raop->clientFPSdata,
+                                              conn->raop->mirror_stages);
+                        snprintf(conn->qoe.video_codec, sizeof(conn->qoe.video_codec), "h264");
                         logger_log(conn->raop->logger, LOGGER_DEBUG, "Mirroring initialized successfully");
                     } else {
                         logger_log(conn->raop->logger, LOGGER_ERR, "Mirroring not initialized at SETUP, playing will fail!");
@@ -847,6 +875,7 @@ raop_handler_setup(raop_conn_t *conn,
 
                     if (conn->raop_rtp) {
                         raop_rtp_start_audio(conn->raop_rtp, &remote_cport, &cport, &dport, &ct, &sr);
+                        raop_qoe_set_audio_codec(&conn->qoe, ct);
                         logger_log(conn->raop->logger, LOGGER_DEBUG, "RAOP initialized success");
                     } else {
                         logger_log(conn->raop->logger, LOGGER_ERR, "RAOP not initialized at SETUP, playing will fail!");
@@ -994,3 +1023,40 @@ raop_handler_record(raop_conn_t *conn,
     http_response_add_header(response, "Audio-Latency", audio_latency);
     http_response_add_header(response, "Audio-Jack-Status", "connected; type=analog");
 }
+
+/* AirPlay photo (PUT /photo) is plain HTTP/1.1 without CSeq: returns the HTTP status code.      *
+ * X-Apple-AssetAction "cacheOnly" only caches (and decodes) the photo, "displayCached" displays  *
+ * a previously-cached photo (the request has no body), otherwise the photo is displayed.         */
+static int
+raop_handler_photo(raop_conn_t *conn, http_request_t *request)
+{
+    const char *asset_key = http_request_get_header(request, "X-Apple-AssetKey");
+    const char *asset_action = http_request_get_header(request, "X-Apple-AssetAction");
+    const char *data = NULL;
+    int datalen = 0;
+    bool display = true;
+
+    if (!asset_key) {
+        asset_key = "";
+    }
+    if (asset_action && !strcmp(asset_action, "cacheOnly")) {
+        display = false;
+    }
+    if (!asset_action || strcmp(asset_action, "displayCached")) {
+        data = http_request_get_data(request, &datalen);
+        if (!data || datalen <= 0) {
+            logger_log(conn->raop->logger, LOGGER_WARNING, "raop_handler_photo: no photo data for asset %s", asset_key);
+            return 400;
+        }
+    }
+    logger_log(conn->raop->logger, LOGGER_DEBUG, "raop_handler_photo: asset %s action %s, %d bytes",
+               asset_key, (asset_action ? asset_action : "display"), datalen);
+    if (!conn->raop->callbacks.display_photo) {
+        return 501;
+    }
+    if (!conn->raop->callbacks.display_photo(conn->raop->callbacks.cls, asset_key, data, datalen, display)) {
+        /* "displayCached" asset is not in the cache: client will resend the photo */
+        return 412;
+    }
+    return 200;
+}
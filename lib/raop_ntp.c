@@ -35,6 +35,7 @@
 #include "netutils.h"
 #include "byteutils.h"
 #include "utils.h"
+#include "raop_clock.h"
 
 #define SECOND_IN_NSECS 1000000000UL
 #define RAOP_NTP_DATA_COUNT   8
@@ -43,6 +44,9 @@
 #define RAOP_NTP_S_RHO   ((1ull    << 32) / 1000u) // system clock precision
 #define RAOP_NTP_MAX_DIST ((1500ull << 32) / 1000u) // maximum allowed distance
 #define RAOP_NTP_MAX_DISP ((16ull   << 32))         // maximum dispersion
+#define RAOP_NTP_POLL_INTERVAL (3 * SECOND_IN_NSECS)
+#define RAOP_NTP_HOLD_POLL_MIN (SECOND_IN_NSECS / 4)  // fast polling while the session is held,
+#define RAOP_NTP_HOLD_POLL_MAX (SECOND_IN_NSECS)      // backing off to once per second
 
 #define RAOP_NTP_CLOCK_BASE (2208988800ull << 32)
 
@@ -57,8 +61,17 @@ struct raop_ntp_s {
     logger_t *logger;
     raop_callbacks_t callbacks;
 
+    // The local wall clock (NULL: system Unix time)
+    raop_clock_t *clock;
+
     int max_ntp_timeouts;
 
+    /* when the client stops answering, hold the session this long (nsecs) before resetting the connection */
+    uint64_t grace_period;
+    /* set while holding; "resumes" counts holds that ended with the client answering again */
+    int on_hold;
+    unsigned int resumes;
+
     thread_handle_t thread;
     mutex_handle_t run_mutex;
 
@@ -88,11 +101,15 @@ struct raop_ntp_s {
     /* These variables only edited mutex locked */
     int running;
     int joined;
+    int stopping;   /* told to stop, not yet joined */
 
     // UDP socket
     int tsock;
 
     timing_protocol_t time_protocol;
+
+    /* session quality counters (only written by the ntp thread) */
+    raop_qoe_t *qoe;
 };
 
 
@@ -137,7 +154,7 @@ raop_ntp_parse_remote(raop_ntp_t *raop_ntp, const char *remote, int remote_addr_
     return 0;
 }
 
-raop_ntp_t *raop_ntp_init(logger_t *logger, raop_callbacks_t *callbacks, const char *remote,
+raop_ntp_t *raop_ntp_init(logger_t *logger, raop_callbacks_t *callbacks, raop_clock_t *clock, const char *remote,
                           int remote_addr_len, unsigned short timing_rport, timing_protocol_t *time_protocol) {
     raop_ntp_t *raop_ntp;
 
@@ -150,6 +167,7 @@ raop_ntp_t *raop_ntp_init(logger_t *logger, raop_callbacks_t *callbacks, const c
     }
     raop_ntp->time_protocol = *time_protocol;
     raop_ntp->logger = logger;
+    raop_ntp->clock = clock;
     memcpy(&raop_ntp->callbacks, callbacks, sizeof(raop_callbacks_t));    
     raop_ntp->timing_rport = timing_rport;
 
@@ -176,6 +194,7 @@ raop_ntp_t *raop_ntp_init(logger_t *logger, raop_callbacks_t *callbacks, const c
     raop_ntp->sync_delay = 0;
     raop_ntp->sync_dispersion = 0;
     raop_ntp->sync_offset = 0;
+    raop_ntp->qoe = NULL;
 
     MUTEX_CREATE(raop_ntp->run_mutex);
     MUTEX_CREATE(raop_ntp->wait_mutex);
@@ -272,6 +291,11 @@ raop_ntp_thread(void *arg)
     int timeout_counter = 0;
     bool conn_reset = false;
     bool logger_debug = (logger_get_level(raop_ntp->logger) >= LOGGER_DEBUG);
+    uint64_t poll_interval = RAOP_NTP_POLL_INTERVAL;
+    uint64_t hold_start = 0;
+    /* a hold ends in a reset after the -reset limit plus the grace period (never with -reset 0) */
+    uint64_t hold_limit = (raop_ntp->max_ntp_timeouts > 0 ?
+                           raop_ntp->max_ntp_timeouts * RAOP_NTP_POLL_INTERVAL + raop_ntp->grace_period : 0);
       
     while (1) {
         MUTEX_LOCK(raop_ntp->run_mutex);
@@ -302,19 +326,57 @@ raop_ntp_thread(void *arg)
             response_len = recvfrom(raop_ntp->tsock, (char *)response, sizeof(response), 0, NULL, NULL);
             if (response_len < 0) {
                 timeout_counter++;
+                if (raop_ntp->qoe) {
+                    raop_ntp->qoe->ntp_timeouts++;
+                }
                 char time[30];
-                int level = (timeout_counter == 1 ? LOGGER_DEBUG : LOGGER_ERR);
+                int level = (timeout_counter == 1 || hold_start ? LOGGER_DEBUG : LOGGER_ERR);
                 ntp_timestamp_to_time(send_time, time, sizeof(time));
                 logger_log(raop_ntp->logger, level, "raop_ntp receive timeout %d (limit %d) (request sent %s)",
                            timeout_counter, raop_ntp->max_ntp_timeouts, time);
-                if (timeout_counter ==  raop_ntp->max_ntp_timeouts) {
-                    conn_reset = true;   /* client is no longer responding */
-                    break;
+                if (!raop_ntp->grace_period) {
+                    if (timeout_counter == raop_ntp->max_ntp_timeouts) {
+                        conn_reset = true;   /* client is no longer responding */
+                        break;
+                    }
+                } else if (!hold_start) {
+                    /* from the first missed reply, keep the session (keys, streams, decoder and last video frame) *
+                     * and poll more often, so that a client that comes back is noticed within a fraction of a sec */
+                    hold_start = raop_clock_get_time(raop_ntp->clock);
+                    __atomic_store_n(&raop_ntp->on_hold, 1, __ATOMIC_RELAXED);
+                    poll_interval = RAOP_NTP_HOLD_POLL_MIN;
+                    if (hold_limit) {
+                        logger_log(raop_ntp->logger, LOGGER_INFO, "raop_ntp: client is not responding, holding the session"
+                                   " for up to %.0f secs", (double) hold_limit / SECOND_IN_NSECS);
+                    } else {
+                        logger_log(raop_ntp->logger, LOGGER_INFO, "raop_ntp: client is not responding, holding the session");
+                    }
+                } else {
+                    uint64_t now = raop_clock_get_time(raop_ntp->clock);
+                    if (hold_limit && now - hold_start >= hold_limit) {
+                        logger_log(raop_ntp->logger, LOGGER_ERR, "raop_ntp: client did not come back within %.0f secs",
+                                   (double) hold_limit / SECOND_IN_NSECS);
+                        conn_reset = true;
+                        break;
+                    }
+                    poll_interval = (2 * poll_interval < RAOP_NTP_HOLD_POLL_MAX ? 2 * poll_interval : RAOP_NTP_HOLD_POLL_MAX);
                 }
 	    } else {
                 //local time of the server when the NTP response packet returns
                 int64_t t3 = (int64_t) raop_ntp_get_local_time(raop_ntp);
                 timeout_counter = 0;
+                if (hold_start) {
+                    uint64_t now = raop_clock_get_time(raop_ntp->clock);
+                    logger_log(raop_ntp->logger, LOGGER_INFO, "raop_ntp: client is responding again after %.1f secs,"
+                               " session resumed", (double) (now - hold_start) / SECOND_IN_NSECS);
+                    hold_start = 0;
+                    poll_interval = RAOP_NTP_POLL_INTERVAL;
+                    __atomic_store_n(&raop_ntp->resumes, raop_ntp->resumes + 1, __ATOMIC_RELEASE);
+                    __atomic_store_n(&raop_ntp->on_hold, 0, __ATOMIC_RELAXED);
+                    if (raop_ntp->qoe) {
+                        raop_ntp->qoe->ntp_holds++;
+                    }
+                }
 
                 // Local time of the server when the NTP request packet leaves the server
                 int64_t t0 = (int64_t) byteutils_get_ntp_timestamp(response, 8);
@@ -366,15 +428,27 @@ raop_ntp_thread(void *arg)
                 MUTEX_UNLOCK(raop_ntp->sync_params_mutex);
 
                 logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp sync correction = %lld", correction);
+                if (raop_ntp->qoe) {
+                    raop_qoe_t *qoe = raop_ntp->qoe;
+                    if (qoe->ntp_samples++ == 0) {
+                        qoe->ntp_offset_first = offset;
+                    } else {
+                        qoe->ntp_correction_sum += (uint64_t) (correction < 0 ? -correction : correction);
+                    }
+                    int64_t drift = offset - qoe->ntp_offset_first;
+                    qoe->ntp_offset_last = drift;
+                    if (drift < qoe->ntp_offset_min) {
+                        qoe->ntp_offset_min = drift;
+                    } else if (drift > qoe->ntp_offset_max) {
+                        qoe->ntp_offset_max = drift;
+                    }
+                }
             }
         }
 
-        // Sleep for 3 seconds
-        struct timespec wait_time;
+        // Sleep for 3 seconds (less while holding the session)
         MUTEX_LOCK(raop_ntp->wait_mutex);
-        clock_gettime(CLOCK_REALTIME, &wait_time);
-        wait_time.tv_sec += 3;
-        pthread_cond_timedwait(&raop_ntp->wait_cond, &raop_ntp->wait_mutex, &wait_time);
+        raop_clock_cond_wait(raop_ntp->clock, &raop_ntp->wait_cond, &raop_ntp->wait_mutex, poll_interval);
         MUTEX_UNLOCK(raop_ntp->wait_mutex);
     }
 
@@ -384,6 +458,9 @@ raop_ntp_thread(void *arg)
     MUTEX_UNLOCK(raop_ntp->run_mutex);
 
     logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp exiting thread");
+    if (conn_reset && raop_ntp->qoe) {
+        raop_ntp->qoe->reset = true;
+    }
     if (conn_reset && raop_ntp->callbacks.conn_reset) {
         const bool video_reset = false;   /* leave "frozen video" in place */
         raop_ntp->callbacks.conn_reset(raop_ntp->callbacks.cls, timeout_counter, video_reset);
@@ -391,6 +468,38 @@ raop_ntp_thread(void *arg)
     return 0;
 }
 
+void
+raop_ntp_set_qoe(raop_ntp_t *raop_ntp, raop_qoe_t *qoe)
+{
+    assert(raop_ntp);
+    raop_ntp->qoe = qoe;
+}
+
+void
+raop_ntp_set_grace_period(raop_ntp_t *raop_ntp, unsigned int grace_secs)
+{
+    assert(raop_ntp);
+    raop_ntp->grace_period = (uint64_t) grace_secs * SECOND_IN_NSECS;
+}
+
+uint64_t
+raop_ntp_get_grace_period(raop_ntp_t *raop_ntp)
+{
+    return raop_ntp->grace_period;
+}
+
+bool
+raop_ntp_is_on_hold(raop_ntp_t *raop_ntp)
+{
+    return __atomic_load_n(&raop_ntp->on_hold, __ATOMIC_RELAXED);
+}
+
+unsigned int
+raop_ntp_get_resumes(raop_ntp_t *raop_ntp)
+{
+    return __atomic_load_n(&raop_ntp->resumes, __ATOMIC_ACQUIRE);
+}
+
 void
 raop_ntp_start(raop_ntp_t *raop_ntp, unsigned short *timing_lport, int max_ntp_timeouts)
 {
@@ -429,8 +538,9 @@ raop_ntp_start(raop_ntp_t *raop_ntp, unsigned short *timing_lport, int max_ntp_t
     MUTEX_UNLOCK(raop_ntp->run_mutex);
 }
 
+/* tells the time thread to stop, without waiting for it (raop_ntp_stop joins it) */
 void
-raop_ntp_stop(raop_ntp_t *raop_ntp)
+raop_ntp_signal_stop(raop_ntp_t *raop_ntp)
 {
     assert(raop_ntp);
 
@@ -442,6 +552,7 @@ raop_ntp_stop(raop_ntp_t *raop_ntp)
         return;
     }
     raop_ntp->running = 0;
+    raop_ntp->stopping = 1;
     MUTEX_UNLOCK(raop_ntp->run_mutex);
 
     logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp stopping time thread");
@@ -454,6 +565,20 @@ raop_ntp_stop(raop_ntp_t *raop_ntp)
         closesocket(raop_ntp->tsock);
         raop_ntp->tsock = -1;
     }
+}
+
+void
+raop_ntp_stop(raop_ntp_t *raop_ntp)
+{
+    raop_ntp_signal_stop(raop_ntp);
+
+    MUTEX_LOCK(raop_ntp->run_mutex);
+    if (!raop_ntp->stopping) {
+        MUTEX_UNLOCK(raop_ntp->run_mutex);
+        return;
+    }
+    raop_ntp->stopping = 0;
+    MUTEX_UNLOCK(raop_ntp->run_mutex);
 
     THREAD_JOIN(raop_ntp->thread);
 
@@ -486,12 +611,18 @@ uint64_t raop_remote_timestamp_to_nano_seconds(raop_ntp_t *raop_ntp, uint64_t ti
 }
 /**
  * Returns the current time in nano seconds according to the local wall clock.
- * The system Unix time is used as the local wall clock.
+ * The system Unix time is used as the local wall clock, unless a (virtual) clock was
+ * supplied with raop_set_clock().
  */
 uint64_t raop_ntp_get_local_time(raop_ntp_t *raop_ntp) {
-    struct timespec time;
-    clock_gettime(CLOCK_REALTIME, &time);
-    return ((uint64_t) time.tv_nsec) + (uint64_t) time.tv_sec * SECOND_IN_NSECS;
+    return raop_clock_get_time(raop_ntp->clock);
+}
+
+/**
+ * Returns the clock used as the local wall clock (NULL means the system clock).
+ */
+raop_clock_t *raop_ntp_get_clock(raop_ntp_t *raop_ntp) {
+    return raop_ntp->clock;
 }
 
 /**
@@ -22,13 +22,29 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include "logger.h"
+#include "raop_clock.h"
+#include "raop_qoe.h"
 
 typedef struct raop_ntp_s raop_ntp_t;
 
 typedef enum timing_protocol_e { NTP, TP_NONE, TP_OTHER, TP_UNSPECIFIED } timing_protocol_t;
 
+/* attach the session quality counters (before raop_ntp_start) */
+void raop_ntp_set_qoe(raop_ntp_t *raop_ntp, raop_qoe_t *qoe);
+
+/* from the first missed reply, hold the session (polling the client more often) for up to the max_ntp_timeouts *
+ * limit plus grace_secs before resetting the connection (0: no hold, reset at the limit)                        */
+void raop_ntp_set_grace_period(raop_ntp_t *raop_ntp, unsigned int grace_secs);
+uint64_t raop_ntp_get_grace_period(raop_ntp_t *raop_ntp);
+
+/* true while the client is not responding and the session is held; resumes counts the holds that ended *
+ * with the client responding again (streams can compare it with an earlier value to resync)             */
+bool raop_ntp_is_on_hold(raop_ntp_t *raop_ntp);
+unsigned int raop_ntp_get_resumes(raop_ntp_t *raop_ntp);
+
 void raop_ntp_start(raop_ntp_t *raop_ntp, unsigned short *timing_lport, int max_ntp_timeouts);
 
+void raop_ntp_signal_stop(raop_ntp_t *raop_ntp);
 void raop_ntp_stop(raop_ntp_t *raop_ntp);
 
 unsigned short raop_ntp_get_port(raop_ntp_t *raop_ntp);
@@ -39,6 +55,7 @@ uint64_t raop_ntp_timestamp_to_nano_seconds(uint64_t ntp_timestamp, bool account
 uint64_t raop_remote_timestamp_to_nano_seconds(raop_ntp_t *raop_ntp, uint64_t timestamp);
 
 uint64_t raop_ntp_get_local_time(raop_ntp_t *raop_ntp);
+raop_clock_t *raop_ntp_get_clock(raop_ntp_t *raop_ntp);
 uint64_t raop_ntp_get_remote_time(raop_ntp_t *raop_ntp);
 uint64_t raop_ntp_convert_remote_time(raop_ntp_t *raop_ntp, uint64_t remote_time);
 uint64_t raop_ntp_convert_local_time(raop_ntp_t *raop_ntp, uint64_t local_time);
@@ -0,0 +1,177 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "raop_qoe.h"
+
+#define QOE_JSON_LEN 4096
+#define QOE_PERF_JSON_LEN 2048
+
+static const char *perf_stage_names[QOE_PERF_STAGES] = { "mirror_decrypt", "nal_walk", "video_push", "audio_enqueue",
+                                                         "audio_push" };
+
+void
+raop_qoe_add_latency(raop_qoe_t *qoe, int64_t latency) {
+    if (latency < 0) {
+        latency = 0;
+    }
+    uint64_t bin = (uint64_t) latency / 1000000;
+    if (bin >= RAOP_QOE_LATENCY_BINS) {
+        bin = RAOP_QOE_LATENCY_BINS - 1;
+    }
+    qoe->latency_hist[bin]++;
+    qoe->latency_count++;
+    qoe->latency_sum += (uint64_t) latency;
+}
+
+void
+raop_qoe_set_audio_codec(raop_qoe_t *qoe, unsigned char ct) {
+    const char *codec;
+    switch (ct) {
+    case 2:
+        codec = "ALAC";
+        break;
+    case 4:
+        codec = "AAC";
+        break;
+    case 8:
+        codec = "AAC-ELD";
+        break;
+    default:
+        codec = "unknown";
+        break;
+    }
+    snprintf(qoe->audio_codec, sizeof(qoe->audio_codec), "%s", codec);
+}
+
+/* the smallest latency (msecs, upper edge of its bin) that is not exceeded by "percent" % of the frames */
+static unsigned int
+latency_percentile(const raop_qoe_t *qoe, unsigned int percent) {
+    uint64_t target = (qoe->latency_count * percent + 99) / 100;
+    uint64_t count = 0;
+    for (unsigned int i = 0; i < RAOP_QOE_LATENCY_BINS; i++) {
+        count += qoe->latency_hist[i];
+        if (count >= target) {
+            return i + 1;
+        }
+    }
+    return RAOP_QOE_LATENCY_BINS;
+}
+
+/* JSON string value (with quotes) of a client-supplied string, or null */
+static void
+json_string(char *out, size_t len, const char *str) {
+    if (!str[0]) {
+        snprintf(out, len, "null");
+        return;
+    }
+    size_t n = 0;
+    out[n++] = '"';
+    for (const unsigned char *c = (const unsigned char *) str; *c && n + 8 < len; c++) {
+        if (*c == '"' || *c == '\\') {
+            out[n++] = '\\';
+            out[n++] = *c;
+        } else if (*c < 0x20) {
+            n += snprintf(out + n, len - n, "\\u%04x", *c);
+        } else {
+            out[n++] = *c;
+        }
+    }
+    out[n++] = '"';
+    out[n] = '\0';
+}
+
+char *
+raop_qoe_to_json(const raop_qoe_t *qoe) {
+    char device_id[6 * sizeof(qoe->device_id) + 3];
+    char model[6 * sizeof(qoe->model) + 3];
+    char name[6 * sizeof(qoe->name) + 3];
+    char audio_codec[6 * sizeof(qoe->audio_codec) + 3];
+    char video_codec[6 * sizeof(qoe->video_codec) + 3];
+    char rendered[24];
+    json_string(device_id, sizeof(device_id), qoe->device_id);
+    json_string(model, sizeof(model), qoe->model);
+    json_string(name, sizeof(name), qoe->name);
+    json_string(audio_codec, sizeof(audio_codec), qoe->audio_codec);
+    json_string(video_codec, sizeof(video_codec), qoe->video_codec);
+    if (qoe->video_frames_rendered < 0) {
+        snprintf(rendered, sizeof(rendered), "null");
+    } else {
+        snprintf(rendered, sizeof(rendered), "%lld", (long long) qoe->video_frames_rendered);
+    }
+
+    double duration = 0.0;
+    if (qoe->end_time > qoe->start_time) {
+        duration = (double) (qoe->end_time - qoe->start_time) / 1e9;
+    }
+    double latency_mean = 0.0;
+    unsigned int latency_p95 = 0, latency_p99 = 0;
+    if (qoe->latency_count) {
+        latency_mean = (double) qoe->latency_sum / (double) qoe->latency_count / 1e6;
+        latency_p95 = latency_percentile(qoe, 95);
+        latency_p99 = latency_percentile(qoe, 99);
+    }
+    double resend_success = 0.0;
+    if (qoe->resent_packets + qoe->audio_lost) {
+        /* fraction of the missing packets that were recovered in time */
+        resend_success = (double) qoe->resent_packets / (double) (qoe->resent_packets + qoe->audio_lost);
+    }
+    double correction_mean = 0.0;
+    if (qoe->ntp_samples > 1) {
+        correction_mean = (double) qoe->ntp_correction_sum / (double) (qoe->ntp_samples - 1) / 1e3;
+    }
+
+    /* ,"perf":{...} only for sessions measured with -perf */
+    char perf[QOE_PERF_JSON_LEN] = "";
+    int perf_len = 0;
+    for (int i = 0; i < QOE_PERF_STAGES; i++) {
+        if (!qoe->perf[i].samples || perf_len < 0 || perf_len >= (int) sizeof(perf)) {
+            continue;
+        }
+        perf_len += snprintf(perf + perf_len, sizeof(perf) - perf_len, "%s\"%s\":", (perf_len ? "," : ",\"perf\":{"),
+                             perf_stage_names[i]);
+        if (perf_len < (int) sizeof(perf)) {
+            perf_len += perf_stage_to_json(perf + perf_len, sizeof(perf) - perf_len, &qoe->perf[i]);
+        }
+    }
+    if (perf_len > 0 && perf_len < (int) sizeof(perf) - 1) {
+        strcat(perf, "}");
+    } else {
+        perf[0] = '\0';
+    }
+
+    char *json = (char *) malloc(QOE_JSON_LEN);
+    if (!json) {
+        return NULL;
+    }
+    snprintf(json, QOE_JSON_LEN,
+             "{\"client\":{\"name\":%s,\"model\":%s,\"deviceID\":%s},"
+             "\"start\":%.3f,\"duration\":%.3f,\"end\":\"%s\",\"reconnects\":%u,\"teardown_ms\":%.1f,"
+             "\"video\":{\"codec\":%s,\"frames\":%llu,\"rendered\":%s,\"bytes\":%llu,\"decrypt_failures\":%llu,"
+             "\"latency_ms\":{\"mean\":%.1f,\"p95\":%u,\"p99\":%u}},"
+             "\"audio\":{\"codec\":%s,\"frames\":%llu,\"gaps\":%llu,\"resend_requests\":%llu,\"resent\":%llu,"
+             "\"resend_success\":%.3f},"
+             "\"ntp\":{\"samples\":%llu,\"timeouts\":%llu,\"holds\":%u,\"offset_drift_us\":%.1f,\"correction_mean_us\":%.1f}%s}",
+             name, model, device_id,
+             (double) qoe->start_time / 1e9, duration, qoe->end_reason ? qoe->end_reason : "disconnect",
+             qoe->reconnects, (double) qoe->teardown_time / 1e6,
+             video_codec, (unsigned long long) qoe->video_frames, rendered, (unsigned long long) qoe->video_bytes,
+             (unsigned long long) qoe->decrypt_failures, latency_mean, latency_p95, latency_p99,
+             audio_codec, (unsigned long long) qoe->audio_frames, (unsigned long long) qoe->audio_lost,
+             (unsigned long long) qoe->resend_requests, (unsigned long long) qoe->resent_packets, resend_success,
+             (unsigned long long) qoe->ntp_samples, (unsigned long long) qoe->ntp_timeouts, qoe->ntp_holds,
+             (double) (qoe->ntp_offset_max - qoe->ntp_offset_min) / 1e3, correction_mean, perf);
+    return json;
+}
@@ -0,0 +1,108 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * per-session quality-of-experience summary.  Each group of counters has a single writer thread
+ * (noted below), and is only read after that thread has been joined (or has stopped writing) at
+ * the end of the session, so the counters are updated without locks or formatting.  During the
+ * session, they may also be sampled without locks (for display only) by report_qoe_progress.
+ */
+
+#ifndef RAOP_QOE_H
+#define RAOP_QOE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "perf_counters.h"
+
+/* 1 msec bins; the last bin also counts all latencies beyond it */
+#define RAOP_QOE_LATENCY_BINS 1024
+
+/* minimum interval (nsecs) between report_qoe_progress calls */
+#define RAOP_QOE_PROGRESS_INTERVAL 500000000
+
+/* stages measured with hardware performance counters (-perf) */
+enum raop_qoe_perf_stage_e {
+    QOE_PERF_MIRROR_DECRYPT,             /* mirror process stage */
+    QOE_PERF_NAL_WALK,                   /* mirror process stage */
+    QOE_PERF_VIDEO_PUSH,                 /* mirror deliver stage: video renderer callbacks */
+    QOE_PERF_AUDIO_ENQUEUE,              /* audio rtp thread: decryption and buffering of a packet */
+    QOE_PERF_AUDIO_PUSH,                 /* audio rtp thread: audio renderer callback */
+    QOE_PERF_STAGES
+};
+
+typedef struct raop_qoe_s {
+    /* session identity (from SETUP, written by the httpd thread) */
+    char device_id[64];
+    char model[64];
+    char name[128];
+    char audio_codec[16];
+    char video_codec[16];
+    uint64_t start_time;                 /* nsecs, local system clock */
+    uint64_t end_time;
+    const char *end_reason;              /* "teardown", "reset" or "disconnect" */
+    unsigned int reconnects;             /* consecutive sessions of this client that started < 60 secs apart */
+    uint64_t teardown_time;              /* nsecs from TEARDOWN (or disconnection) until the stream threads stopped */
+
+    /* video (frames and bytes written by the mirror deliver stage, the rest by the process stage) */
+    uint64_t video_frames;
+    uint64_t video_bytes;
+    uint64_t decrypt_failures;
+    uint64_t latency_count;
+    uint64_t latency_sum;                /* nsecs */
+    uint32_t latency_hist[RAOP_QOE_LATENCY_BINS];
+
+    /* filled in by the application before formatting: frames that reached the videosink */
+    int64_t video_frames_rendered;       /* -1: unknown */
+
+    /* audio (written by the audio rtp thread) */
+    uint64_t audio_frames;
+    uint64_t audio_lost;                 /* packets never received (played as gaps) */
+    uint64_t resend_requests;            /* resend requests sent to the client */
+    uint64_t resent_packets;             /* resent packets that filled a gap in time */
+    unsigned int audio_buffered;         /* packets waiting in the jitter buffer (current) */
+
+    /* NTP clock sync (written by the ntp thread) */
+    uint64_t ntp_samples;
+    uint64_t ntp_timeouts;
+    unsigned int ntp_holds;              /* outages bridged by holding the session (-grace) */
+    int64_t ntp_offset_first;
+    int64_t ntp_offset_min;              /* relative to ntp_offset_first */
+    int64_t ntp_offset_max;
+    int64_t ntp_offset_last;             /* relative to ntp_offset_first (current) */
+    uint64_t ntp_correction_sum;         /* sum of the size of the offset changes between samples (nsecs) */
+
+    /* hardware performance counters per stage (each written by the thread that runs the stage) */
+    perf_stage_t perf[QOE_PERF_STAGES];
+
+    /* a stream thread requested a connection reset */
+    bool reset;
+} raop_qoe_t;
+
+/* audio compression type ct: 2 = ALAC, 4 = AAC, 8 = AAC-ELD */
+void raop_qoe_set_audio_codec(raop_qoe_t *qoe, unsigned char ct);
+
+/* record the latency (nsecs) of a received video frame (mirror process stage) */
+void raop_qoe_add_latency(raop_qoe_t *qoe, int64_t latency);
+
+/* single-line JSON summary of the session (no trailing newline), to be freed by the caller */
+char *raop_qoe_to_json(const raop_qoe_t *qoe);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //RAOP_QOE_H
@@ -32,6 +32,7 @@
 #include "mirror_buffer.h"
 #include "stream.h"
 #include "utils.h"
+#include "perf_counters.h"
 
 #define NO_FLUSH (-42)
 
@@ -40,6 +41,11 @@
 #define SEC SECOND_IN_NSECS
 
 #define DELAY_AAC  0.275  //empirical, matches audio latency of about -0.25 sec after first clock sync event
+#define DELAY_ALAC 1.75   // next_rtp - sync_rtp = 77175 (ALAC): packets are sent this far ahead of their play time
+#define MAX_SLEW (SEC / 2)   // larger differences between provisional and exact timing are corrected at once
+#define MAX_SLEW_ALAC (2 * SEC)   // (ALAC fast start: covers DELAY_ALAC - DELAY_AAC)
+#define SLEW_RATE 200        // the difference is reduced by (audio time)/SLEW_RATE, i.e. 5 msecs per second
+#define AUDIO_OUTAGE_GAP (SEC / 2)   // after a held outage, audio is resynced if no packet arrived for this long
 
 /* note: it is unclear what will happen in the unlikely event that this code is running at the time of the unix-time 
  * epoch event on 2038-01-19 at 3:14:08 UTC ! (but Apple will surely have removed AirPlay "legacy pairing" by then!) */
@@ -63,6 +69,8 @@ struct raop_rtp_s {
     uint64_t rtp_start_time;
     uint64_t rtp_time;
     bool rtp_clock_started;
+    bool fast_start;   /* ALAC: play before the first rtp sync, with provisional timing */
+    bool perf_counters;   /* per-stage hardware performance counters in qoe (-perf) */
 
     // Transmission Stats, could be used if a playout buffer is needed
     // float interarrival_jitter; // As defined by RTP RFC 3550, Section 6.4.1
@@ -75,6 +83,9 @@ struct raop_rtp_s {
     /* Buffer to handle all resends */
     raop_buffer_t *buffer;
 
+    /* session quality counters (only written by the rtp thread) */
+    raop_qoe_t *qoe;
+
     /* Remote address as sockaddr */
     struct sockaddr_storage remote_saddr;
     socklen_t remote_saddr_len;
@@ -83,6 +94,7 @@ struct raop_rtp_s {
     /* These variables only edited mutex locked */
     int running;
     int joined;
+    int stopping;   /* told to stop, not yet joined */
 
     float volume;
     int volume_changed;
@@ -170,6 +182,9 @@ raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, raop_ntp_t *ntp, co
     raop_rtp->ntp_start_time = 0;
     raop_rtp->rtp_start_time = 0;
     raop_rtp->rtp_clock_started = false;
+    raop_rtp->fast_start = false;
+    raop_rtp->perf_counters = false;
+    raop_rtp->qoe = NULL;
 
     
     raop_rtp->dacp_id = NULL;
@@ -227,6 +242,9 @@ raop_rtp_resend_callback(void *opaque, unsigned short seqnum, unsigned short cou
 
     logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp got resend request %d %d", seqnum, count);
     ourseqnum = raop_rtp->control_seqnum++;
+    if (raop_rtp->qoe) {
+        raop_rtp->qoe->resend_requests++;
+    }
 
     /* Fill the request buffer */
     packet[0] = 0x80;
@@ -342,7 +360,7 @@ raop_rtp_process_events(raop_rtp_t *raop_rtp, void *cb_data)
     if (volume_changed) {
         //raop_buffer_flush(raop_rtp->buffer, flush); /* seems to be unnecessary, may cause audio artefacts */
         if (raop_rtp->callbacks.audio_set_volume) {
-            raop_rtp->callbacks.audio_set_volume(raop_rtp->callbacks.cls, volume);
+            raop_rtp->callbacks.audio_set_volume(raop_rtp->callbacks.cls, raop_rtp->ntp, volume);
         }
     }
 
@@ -459,6 +477,12 @@ raop_rtp_thread_udp(void *arg)
     double sync_adjustment = 0;
     unsigned short seqnum1 = 0, seqnum2 = 0;
 
+    /* provisional timing (before the first sync) is followed by a slew to the exact timing (fast start) */
+    bool provisional = false;
+    int64_t slew = 0;
+    uint64_t slew_rtp = 0;
+    bool first_sound = true;
+
     assert(raop_rtp);
     bool logger_debug = (logger_get_level(raop_rtp->logger) >= LOGGER_DEBUG);
     raop_rtp->ntp_start_time = raop_ntp_get_local_time(raop_rtp->ntp);
@@ -469,22 +493,31 @@ raop_rtp_thread_udp(void *arg)
 
     int no_resend = (raop_rtp->control_rport == 0); /* true when control_rport is not set */
 
+    /* for resyncing after a network outage during which the session was held (-grace) */
+    unsigned int ntp_resumes = raop_ntp_get_resumes(raop_rtp->ntp);
+    uint64_t last_audio_time = 0;
+
+    /* per-stage hardware performance counters (-perf) */
+    perf_counters_t *perf = NULL;
+    uint64_t perf_start[PERF_COUNTERS];
+    if (raop_rtp->perf_counters && raop_rtp->qoe) {
+        perf = perf_counters_open();
+        if (!(perf_counters_available(perf) & (1u << PERF_CYCLES))) {
+            logger_log(raop_rtp->logger, LOGGER_INFO, "raop_rtp: hardware performance counters are not available");
+        }
+    }
+
     logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp start_time = %8.6f (raop_rtp audio)",
                ((double) raop_rtp->ntp_start_time) / SEC);
 
     while(1) {
         fd_set rfds;
-        struct timeval tv;
         int nfds, ret;	
         /* Check if we are still running and process callbacks */
         if (raop_rtp_process_events(raop_rtp, NULL)) {
             break;
         }
 
-        /* Set timeout value to 5ms */
-        tv.tv_sec = 0;
-        tv.tv_usec = 5000;
-
         /* Get the correct nfds value */
         nfds = raop_rtp->csock+1;
         if (raop_rtp->dsock >= nfds)
@@ -495,7 +528,8 @@ raop_rtp_thread_udp(void *arg)
         FD_SET(raop_rtp->csock, &rfds);
         FD_SET(raop_rtp->dsock, &rfds);
 
-        ret = select(nfds, &rfds, NULL, NULL, &tv);
+        /* select with timeout value 5ms */
+        ret = raop_clock_select(raop_ntp_get_clock(raop_rtp->ntp), nfds, &rfds, 5000000);
         if (ret == 0) {
             /* Timeout happened */
             continue;
@@ -535,6 +569,9 @@ raop_rtp_thread_udp(void *arg)
                     logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp resent audio packet: seqnum=%u", seqnum);
                     int result = raop_buffer_enqueue(raop_rtp->buffer, resent_packet, resent_packetlen, &ntp_time, &rtp_time, 1);
                     assert(result >= 0);
+                    if (result == 1 && raop_rtp->qoe) {
+                        raop_rtp->qoe->resent_packets++;
+                    }
                 } else if (logger_debug) {
                     /* type_c = 0x56 packets  with length 8 have been reported */
                     char *str = utils_data_to_string(packet, packetlen, 16);
@@ -610,8 +647,9 @@ raop_rtp_thread_udp(void *arg)
           * The secnum and rtp_timestamp in the packet header increment according to the same
           * pattern as ALAC packets with audio content */	
 
-         /* The first ALAC packet with data seems to be decoded just before the first sync event
-          * so its dequeuing should be delayed until the first rtp sync has occurred */
+         /* The first ALAC packet with data seems to be decoded just before the first sync event;
+          * its dequeuing is delayed until the first rtp sync has occurred, or (-alacfast) it is dequeued
+          * at once with provisional timing */
 
 
 	if (FD_ISSET(raop_rtp->dsock, &rfds)) {
@@ -637,6 +675,21 @@ raop_rtp_thread_udp(void *arg)
             uint64_t rtp_time = rtp64_time(raop_rtp, &rtp_timestamp);
 	    uint64_t ntp_time = 0;
 
+	    if (raop_rtp->ct == 2 && !have_synced && !provisional && raop_rtp->fast_start) {
+                /* provisional offset for ALAC: packets at the start of a stream may be sent in a burst, which arrive *
+                 * early; the latest arrival (relative to rtp time) is from a packet sent in real time, DELAY_ALAC   *
+                 * ahead of its play time.  It is played DELAY_AAC after arrival, and the difference is slewed out   *
+                 * after the first sync.  The offset is fixed once the first frame is played, so a packet that      *
+                 * arrives late does not move the timing of the frames that follow it                               */
+                int64_t sync_ntp =  ((int64_t) raop_ntp_get_local_time(raop_rtp->ntp)) - ((int64_t) raop_rtp->ntp_start_time);
+                int64_t sync_rtp = ((int64_t) rtp_time) - ((int64_t) raop_rtp->rtp_start_time);
+                double adjustment = ((double) sync_ntp) - raop_rtp->rtp_clock_rate * sync_rtp;
+                if (rtp_count == 0 || adjustment > sync_adjustment) {
+                    sync_adjustment = adjustment;
+                }
+                rtp_count++;
+            }
+
 	    if (raop_rtp->ct == 2 && packetlen == 44)  continue;   /* ignore the ALAC packets with format information only. */
 
 	    if (have_synced) {
@@ -665,11 +718,32 @@ raop_rtp_thread_udp(void *arg)
 	    } else {
                 no_data_yet = false;
 	    }
+
+            /* the first packet after an audio gap during (or ending) a held outage restarts the buffer at its  *
+             * seqnum, instead of requesting resends of the packets lost during the outage; a hold that starts *
+             * at a single missed NTP reply while audio keeps arriving changes nothing                         */
+            uint64_t audio_time = raop_ntp_get_local_time(raop_rtp->ntp);
+            unsigned int resumes = raop_ntp_get_resumes(raop_rtp->ntp);
+            if ((raop_ntp_is_on_hold(raop_rtp->ntp) || resumes != ntp_resumes) && last_audio_time &&
+                audio_time - last_audio_time > AUDIO_OUTAGE_GAP) {
+                unsigned short seqnum = byteutils_get_short_be(packet, 2);
+                raop_buffer_flush(raop_rtp->buffer, seqnum);
+                logger_log(raop_rtp->logger, LOGGER_INFO, "raop_rtp: audio resynced at seqnum %u after network outage", seqnum);
+            }
+            last_audio_time = audio_time;
+            ntp_resumes = resumes;
+
+            if (perf) {
+                perf_counters_read(perf, perf_start);
+            }
             int result = raop_buffer_enqueue(raop_rtp->buffer, packet, packetlen, &ntp_time, &rtp_time, 1);
             assert(result >= 0);
+            if (perf) {
+                perf_counters_add(perf, perf_start, &raop_rtp->qoe->perf[QOE_PERF_AUDIO_ENQUEUE]);
+            }
 
-	    if (raop_rtp->ct == 2 && !have_synced) {
-                /* in ALAC Audio-only  mode wait until the first sync before dequeing */
+	    if (raop_rtp->ct == 2 && !have_synced && !raop_rtp->fast_start) {
+                /* in ALAC Audio-only  mode wait until the first sync before dequeing (unless fast start) */
                 continue;
             } else {
             // Render continuous buffer entries
@@ -693,15 +767,55 @@ raop_rtp_thread_udp(void *arg)
                         audio_data.ntp_time_remote = ntp_timestamp;
                         audio_data.ntp_time_local  = raop_ntp_convert_remote_time(raop_rtp->ntp, audio_data.ntp_time_remote);
                         audio_data.sync_status = 1;
+                        if (provisional) {
+                            /* first frame timed exactly: with fast start, continue from the provisional timing, and slew to *
+                             * the exact one; otherwise (as for AAC-ELD) the exact timing is used at once                    */
+                            double elapsed_time =  raop_rtp->rtp_clock_rate * (rtp64_timestamp - raop_rtp->rtp_start_time) + sync_adjustment
+                                + DELAY_AAC * SECOND_IN_NSECS;
+                            int64_t max_slew = (!raop_rtp->fast_start ? 0 : (raop_rtp->ct == 2 ? MAX_SLEW_ALAC : MAX_SLEW));
+                            slew = ((int64_t) (raop_rtp->ntp_start_time + (uint64_t) elapsed_time)) - ((int64_t) audio_data.ntp_time_local);
+                            slew_rtp = rtp64_timestamp;
+                            provisional = false;
+                            logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp audio: provisional timing was %+.3f secs from exact timing%s",
+                                       (double) slew / SEC, (slew > max_slew || slew < -max_slew ? ", corrected at once" : ", slewing"));
+                            if (slew > max_slew || slew < -max_slew) {
+                                slew = 0;
+                            }
+                        }
+                        if (slew) {
+                            int64_t step = (int64_t) (raop_rtp->rtp_clock_rate * (rtp64_timestamp - slew_rtp) / SLEW_RATE);
+                            slew_rtp = rtp64_timestamp;
+                            slew = (slew > 0 ? (slew > step ? slew - step : 0) : (-slew > step ? slew + step : 0));
+                            audio_data.ntp_time_local += slew;
+                        }
                     } else {
                         double elapsed_time =  raop_rtp->rtp_clock_rate * (rtp64_timestamp - raop_rtp->rtp_start_time) + sync_adjustment
-                            + DELAY_AAC * SECOND_IN_NSECS; 
+                            + DELAY_AAC * SECOND_IN_NSECS;
                         audio_data.ntp_time_local = raop_rtp->ntp_start_time + (uint64_t) elapsed_time;
                         audio_data.ntp_time_remote = raop_ntp_convert_local_time(raop_rtp->ntp, audio_data.ntp_time_local);
                         audio_data.sync_status = 0;
+                        provisional = true;
+                    }
+                    if (first_sound) {
+                        /* time to first sound: when the first frame reaches the renderer, and when it is to be played */
+                        uint64_t ntp_now = raop_ntp_get_local_time(raop_rtp->ntp);
+                        logger_log(raop_rtp->logger, LOGGER_INFO, "first audio frame %s %.3f secs after the audio stream started, "
+                                   "to be played at %+.3f secs", (have_synced ? "(after rtp sync)" : "(provisional timing)"),
+                                   (double) (ntp_now - raop_rtp->ntp_start_time) / SEC,
+                                   (double) ((int64_t) audio_data.ntp_time_local - (int64_t) raop_rtp->ntp_start_time) / SEC);
+                        first_sound = false;
+                    }
+                    if (perf) {
+                        perf_counters_read(perf, perf_start);
                     }
                     raop_rtp->callbacks.audio_process(raop_rtp->callbacks.cls, raop_rtp->ntp, &audio_data);
+                    if (perf) {
+                        perf_counters_add(perf, perf_start, &raop_rtp->qoe->perf[QOE_PERF_AUDIO_PUSH]);
+                    }
                     free(payload);
+                    if (raop_rtp->qoe) {
+                        raop_rtp->qoe->audio_frames++;
+                    }
                     if (logger_debug) {
                         uint64_t ntp_now = raop_ntp_get_local_time(raop_rtp->ntp);
                         int64_t latency = ((int64_t) ntp_now) - ((int64_t) audio_data.ntp_time_local); 
@@ -712,6 +826,11 @@ raop_rtp_thread_udp(void *arg)
                     }
                 }
 
+                if (raop_rtp->qoe) {
+                    raop_rtp->qoe->audio_lost = raop_buffer_get_lost(raop_rtp->buffer);
+                    raop_rtp->qoe->audio_buffered = raop_buffer_get_depth(raop_rtp->buffer);
+                }
+
                 /* Handle possible resend requests */
                 if (!no_resend) {
                     raop_buffer_handle_resends(raop_rtp->buffer, raop_rtp_resend_callback, raop_rtp);
@@ -720,6 +839,8 @@ raop_rtp_thread_udp(void *arg)
         }
     }
 
+    perf_counters_close(perf);
+
     // Ensure running reflects the actual state
     MUTEX_LOCK(raop_rtp->run_mutex);
     raop_rtp->running = false;
@@ -730,6 +851,28 @@ raop_rtp_thread_udp(void *arg)
     return 0;
 }
 
+/* attach the session quality counters (before raop_rtp_start_audio) */
+void
+raop_rtp_set_qoe(raop_rtp_t *raop_rtp, raop_qoe_t *qoe)
+{
+    assert(raop_rtp);
+    raop_rtp->qoe = qoe;
+}
+
+void
+raop_rtp_set_fast_start(raop_rtp_t *raop_rtp, bool fast_start)
+{
+    assert(raop_rtp);
+    raop_rtp->fast_start = fast_start;
+}
+
+void
+raop_rtp_set_perf_counters(raop_rtp_t *raop_rtp, bool enable)
+{
+    assert(raop_rtp);
+    raop_rtp->perf_counters = enable;
+}
+
 // Start rtp service, using two udp ports
 void
 raop_rtp_start_audio(raop_rtp_t *raop_rtp,  unsigned short *control_rport, unsigned short *control_lport,
@@ -879,8 +1022,9 @@ raop_rtp_flush(raop_rtp_t *raop_rtp, int next_seq)
     MUTEX_UNLOCK(raop_rtp->run_mutex);
 }
 
+/* tells the audio thread to stop, without waiting for it (raop_rtp_stop joins it) */
 void
-raop_rtp_stop(raop_rtp_t *raop_rtp)
+raop_rtp_signal_stop(raop_rtp_t *raop_rtp)
 {
     assert(raop_rtp);
 
@@ -892,11 +1036,30 @@ raop_rtp_stop(raop_rtp_t *raop_rtp)
         return;
     }
     raop_rtp->running = 0;
+    raop_rtp->stopping = 1;
+    MUTEX_UNLOCK(raop_rtp->run_mutex);
+}
+
+void
+raop_rtp_stop(raop_rtp_t *raop_rtp)
+{
+    raop_rtp_signal_stop(raop_rtp);
+
+    MUTEX_LOCK(raop_rtp->run_mutex);
+    if (!raop_rtp->stopping) {
+        MUTEX_UNLOCK(raop_rtp->run_mutex);
+        return;
+    }
+    raop_rtp->stopping = 0;
     MUTEX_UNLOCK(raop_rtp->run_mutex);
 
     /* Join the thread */
     THREAD_JOIN(raop_rtp->thread);
 
+    if (raop_rtp->callbacks.audio_stop) {
+        raop_rtp->callbacks.audio_stop(raop_rtp->callbacks.cls, raop_rtp->ntp);
+    }
+
     if (raop_rtp->csock != -1) closesocket(raop_rtp->csock);
     if (raop_rtp->dsock != -1) closesocket(raop_rtp->dsock);
 
@@ -22,6 +22,7 @@
 #include "raop.h"
 #include "logger.h"
 #include "raop_ntp.h"
+#include "raop_qoe.h"
 
 #define RAOP_AESIV_LEN  16
 #define RAOP_AESKEY_LEN 16
@@ -32,6 +33,9 @@ typedef struct raop_rtp_s raop_rtp_t;
 raop_rtp_t *raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, raop_ntp_t *ntp, const char *remote, 
                           int remotelen, const unsigned char *aeskey, const unsigned char *aesiv);
 
+void raop_rtp_set_qoe(raop_rtp_t *raop_rtp, raop_qoe_t *qoe);
+void raop_rtp_set_fast_start(raop_rtp_t *raop_rtp, bool fast_start);
+void raop_rtp_set_perf_counters(raop_rtp_t *raop_rtp, bool enable);
 void raop_rtp_start_audio(raop_rtp_t *raop_rtp, unsigned short *control_rport, unsigned short *control_lport,
                           unsigned short *data_lport, unsigned char *ct, unsigned int *sr);
 
@@ -41,6 +45,7 @@ void raop_rtp_set_coverart(raop_rtp_t *raop_rtp, const char *data, int datalen);
 void raop_rtp_remote_control_id(raop_rtp_t *raop_rtp, const char *dacp_id, const char *active_remote_header);
 void raop_rtp_set_progress(raop_rtp_t *raop_rtp, unsigned int start, unsigned int curr, unsigned int end);
 void raop_rtp_flush(raop_rtp_t *raop_rtp, int next_seq);
+void raop_rtp_signal_stop(raop_rtp_t *raop_rtp);
 void raop_rtp_stop(raop_rtp_t *raop_rtp);
 int raop_rtp_is_running(raop_rtp_t *raop_rtp);
 void raop_rtp_destroy(raop_rtp_t *raop_rtp);
@@ -35,6 +35,8 @@
 #include "logger.h"
 #include "byteutils.h"
 #include "mirror_buffer.h"
+#include "mirror_queue.h"
+#include "perf_counters.h"
 #include "stream.h"
 #include "utils.h"
 #include "plist/plist.h"
@@ -92,6 +94,7 @@ struct raop_rtp_mirror_s {
     /* These variables only edited mutex locked */
     int running;
     int joined;
+    int stopping;   /* told to stop, not yet joined */
 
     int flush;
     thread_handle_t thread_mirror;
@@ -104,8 +107,79 @@ struct raop_rtp_mirror_s {
 
      /* switch for displaying client FPS data */
      uint8_t show_client_FPS_data;
+
+    /* consecutive video packets that failed decryption (only used in the mirror thread) */
+    int decrypt_failures;
+
+    /* session quality counters (only written by the mirror threads) */
+    raop_qoe_t *qoe;
+    /* time of the last report_qoe_progress call (only used in the deliver stage) */
+    uint64_t qoe_progress_time;
+
+    /* per-stage hardware performance counters in qoe (-perf) */
+    bool perf_counters;
+
+    /* ring file for the client's streaming reports (NULL: not stored) */
+    report_log_t *report_log;
+
+    /* pipeline of 1 to 3 stages: receive -> decrypt+parse (process) -> deliver, connected by queues *
+     * (NULL when the next stage runs in the same thread).  The AES-CTR keystream is only advanced by *
+     * the process stage, which handles the packets in the order they were received                  */
+    uint8_t stages;
+    mirror_queue_t *packet_queue;
+    mirror_queue_t *output_queue;
+    thread_handle_t thread_process;
+    thread_handle_t thread_deliver;
+
+    /* background search for a working video decryption key: the search thread tries the *
+     * alternative key derivations on a copy of a failing packet, the process stage swaps *
+     * in the key that validates before decrypting its next packet                         */
+    thread_handle_t thread_resync;
+    mutex_handle_t resync_mutex;
+    int resync_state;
+    unsigned char *resync_packet;
+    int resync_packet_len;
+    uint64_t resync_position;
+    int resync_variant;
+    uint64_t resync_found_position;
 };
 
+/* packets (or frames) that may be waiting between two stages */
+#define MIRROR_QUEUE_LEN 16
+
+/* a packet received from the client: 128 byte header and payload */
+typedef struct mirror_packet_s {
+    unsigned char header[128];
+    unsigned char *payload;
+    int payload_size;
+    bool new_stream;                /* first packet of a stream connection reconnected by the client (-grace) */
+} mirror_packet_t;
+
+/* output of the process stage, delivered to the callbacks in order */
+typedef enum mirror_output_type_e { MIRROR_OUTPUT_FRAME, MIRROR_OUTPUT_SIZE, MIRROR_OUTPUT_PAUSE } mirror_output_type_t;
+
+typedef struct mirror_output_s {
+    mirror_output_type_t type;
+    h264_decode_struct h264_data;   /* FRAME: h264_data.data is freed after delivery */
+    float size[4];                  /* SIZE: width_source, height_source, width, height */
+} mirror_output_t;
+
+/* state of the process stage, carried from packet to packet */
+typedef struct mirror_process_state_s {
+    unsigned char *sps_pps;
+    bool prepend_sps_pps;
+    int sps_pps_len;
+    uint64_t ntp_timestamp_nal;
+    bool h265_video_detected;
+    bool logger_debug;
+    perf_counters_t *perf;               /* counters of the thread running the process stage, or NULL */
+} mirror_process_state_t;
+
+/* persistent decryption failure triggers a key search after this many consecutive bad packets */
+#define DECRYPT_FAILURE_LIMIT 5
+
+enum resync_state_e { RESYNC_IDLE, RESYNC_SEARCHING, RESYNC_FOUND, RESYNC_FAILED };
+
 static int
 raop_rtp_mirror_parse_remote(raop_rtp_mirror_t *raop_rtp_mirror, const char *remote, int remotelen)
 {
@@ -132,7 +206,8 @@ raop_rtp_mirror_parse_remote(raop_rtp_mirror_t *raop_rtp_mirror, const char *rem
 
 #define NO_FLUSH (-42)
 raop_rtp_mirror_t *raop_rtp_mirror_init(logger_t *logger, raop_callbacks_t *callbacks, raop_ntp_t *ntp,
-                                        const char *remote, int remotelen, const unsigned char *aeskey)
+                                        const char *remote, int remotelen, const unsigned char *aeskey,
+                                        const unsigned char *aeskey_alt)
 {
     raop_rtp_mirror_t *raop_rtp_mirror;
 
@@ -147,7 +222,7 @@ raop_rtp_mirror_t *raop_rtp_mirror_init(logger_t *logger, raop_callbacks_t *call
     raop_rtp_mirror->ntp = ntp;
 
     memcpy(&raop_rtp_mirror->callbacks, callbacks, sizeof(raop_callbacks_t));
-    raop_rtp_mirror->buffer = mirror_buffer_init(logger, aeskey);
+    raop_rtp_mirror->buffer = mirror_buffer_init(logger, aeskey, aeskey_alt);
     if (!raop_rtp_mirror->buffer) {
         free(raop_rtp_mirror);
         return NULL;
@@ -159,8 +234,13 @@ raop_rtp_mirror_t *raop_rtp_mirror_init(logger_t *logger, raop_callbacks_t *call
     raop_rtp_mirror->running = 0;
     raop_rtp_mirror->joined = 1;
     raop_rtp_mirror->flush = NO_FLUSH;
+    raop_rtp_mirror->resync_state = RESYNC_IDLE;
+    raop_rtp_mirror->qoe = NULL;
+    raop_rtp_mirror->qoe_progress_time = 0;
+    raop_rtp_mirror->perf_counters = false;
 
     MUTEX_CREATE(raop_rtp_mirror->run_mutex);
+    MUTEX_CREATE(raop_rtp_mirror->resync_mutex);
     return raop_rtp_mirror;
 }
 
@@ -170,9 +250,667 @@ raop_rtp_init_mirror_aes(raop_rtp_mirror_t *raop_rtp_mirror, uint64_t *streamCon
     mirror_buffer_init_aes(raop_rtp_mirror->buffer, streamConnectionID);
 }
 
+static THREAD_RETVAL
+raop_rtp_mirror_resync_thread(void *arg)
+{
+    raop_rtp_mirror_t *raop_rtp_mirror = arg;
+    assert(raop_rtp_mirror);
+    int variant = 0;
+    uint64_t found_position = 0;
+    uint64_t start = raop_ntp_get_local_time(raop_rtp_mirror->ntp);
+    bool found = mirror_buffer_find_key(raop_rtp_mirror->buffer, raop_rtp_mirror->resync_packet,
+                                        raop_rtp_mirror->resync_packet_len, raop_rtp_mirror->resync_position,
+                                        &variant, &found_position);
+    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: video key search took %8.6f secs",
+               (double) (raop_ntp_get_local_time(raop_rtp_mirror->ntp) - start) / SEC);
+    MUTEX_LOCK(raop_rtp_mirror->resync_mutex);
+    raop_rtp_mirror->resync_variant = variant;
+    raop_rtp_mirror->resync_found_position = found_position;
+    raop_rtp_mirror->resync_state = (found ? RESYNC_FOUND : RESYNC_FAILED);
+    MUTEX_UNLOCK(raop_rtp_mirror->resync_mutex);
+    return 0;
+}
+
+/* called by the mirror thread before decrypting each video packet:  switches to a key found by the *
+ * search thread, or starts a search (on a copy of the still-encrypted packet) if decryption has    *
+ * failed persistently  */
+static void
+raop_rtp_mirror_check_decryption(raop_rtp_mirror_t *raop_rtp_mirror, const unsigned char *packet, int len)
+{
+    MUTEX_LOCK(raop_rtp_mirror->resync_mutex);
+    int state = raop_rtp_mirror->resync_state;
+    MUTEX_UNLOCK(raop_rtp_mirror->resync_mutex);
+
+    switch (state) {
+    case RESYNC_SEARCHING:
+        return;
+    case RESYNC_FOUND:
+    case RESYNC_FAILED:
+        THREAD_JOIN(raop_rtp_mirror->thread_resync);
+        free(raop_rtp_mirror->resync_packet);
+        raop_rtp_mirror->resync_packet = NULL;
+        raop_rtp_mirror->resync_state = RESYNC_IDLE;
+        raop_rtp_mirror->decrypt_failures = 0;
+        if (state == RESYNC_FAILED) {
+            logger_log(raop_rtp_mirror->logger, LOGGER_WARNING,
+                       "raop_rtp_mirror: no alternative video decryption key was found");
+            return;
+        }
+        /* the keystream has moved on by the packets decrypted while the search was running */
+        uint64_t position = raop_rtp_mirror->resync_found_position +
+            (mirror_buffer_get_position(raop_rtp_mirror->buffer) - raop_rtp_mirror->resync_position);
+        int64_t shift = (int64_t) raop_rtp_mirror->resync_found_position - (int64_t) raop_rtp_mirror->resync_position;
+        mirror_buffer_set_key(raop_rtp_mirror->buffer, raop_rtp_mirror->resync_variant, position);
+        logger_log(raop_rtp_mirror->logger, LOGGER_INFO,
+                   "raop_rtp_mirror: switched to %s aes key derivation, keystream position shifted by %lld bytes",
+                   (raop_rtp_mirror->resync_variant ? "alternative" : "original"), (long long) shift);
+        return;
+    default:
+        break;
+    }
+
+    if (raop_rtp_mirror->decrypt_failures < DECRYPT_FAILURE_LIMIT) {
+        return;
+    }
+    logger_log(raop_rtp_mirror->logger, LOGGER_WARNING,
+               "raop_rtp_mirror: decryption failed for %d consecutive video packets, searching for the correct key",
+               raop_rtp_mirror->decrypt_failures);
+    raop_rtp_mirror->resync_packet = (unsigned char *) malloc(len);
+    if (!raop_rtp_mirror->resync_packet) {
+        return;
+    }
+    memcpy(raop_rtp_mirror->resync_packet, packet, len);
+    raop_rtp_mirror->resync_packet_len = len;
+    raop_rtp_mirror->resync_position = mirror_buffer_get_position(raop_rtp_mirror->buffer);
+    raop_rtp_mirror->resync_state = RESYNC_SEARCHING;
+    THREAD_CREATE(raop_rtp_mirror->thread_resync, raop_rtp_mirror_resync_thread, raop_rtp_mirror);
+    if (!raop_rtp_mirror->thread_resync) {
+        free(raop_rtp_mirror->resync_packet);
+        raop_rtp_mirror->resync_packet = NULL;
+        raop_rtp_mirror->resync_state = RESYNC_IDLE;
+        raop_rtp_mirror->decrypt_failures = 0;
+    }
+}
+
+/* waits for a key search that is still running, and discards its result */
+static void
+raop_rtp_mirror_end_key_search(raop_rtp_mirror_t *raop_rtp_mirror)
+{
+    MUTEX_LOCK(raop_rtp_mirror->resync_mutex);
+    int resync_state = raop_rtp_mirror->resync_state;
+    MUTEX_UNLOCK(raop_rtp_mirror->resync_mutex);
+    if (resync_state != RESYNC_IDLE) {
+        THREAD_JOIN(raop_rtp_mirror->thread_resync);
+        free(raop_rtp_mirror->resync_packet);
+        raop_rtp_mirror->resync_packet = NULL;
+        raop_rtp_mirror->resync_state = RESYNC_IDLE;
+    }
+    raop_rtp_mirror->decrypt_failures = 0;
+}
+
+/* opens the performance counters of a stage thread (-perf) */
+static perf_counters_t *
+raop_rtp_mirror_open_perf_counters(raop_rtp_mirror_t *raop_rtp_mirror)
+{
+    if (!raop_rtp_mirror->perf_counters || !raop_rtp_mirror->qoe) {
+        return NULL;
+    }
+    perf_counters_t *perf = perf_counters_open();
+    if (!perf_counters_available(perf)) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror: no performance counters are available");
+    } else if (!(perf_counters_available(perf) & (1u << PERF_CYCLES))) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_INFO, "raop_rtp_mirror: hardware performance counters are not available");
+    }
+    return perf;
+}
+
+/* delivers the output of the process stage to the renderer callbacks, in order; perf: counters of the calling thread */
+static void
+raop_rtp_mirror_deliver(raop_rtp_mirror_t *raop_rtp_mirror, mirror_output_t *output, perf_counters_t *perf)
+{
+    uint64_t perf_start[PERF_COUNTERS];
+    switch (output->type) {
+    case MIRROR_OUTPUT_FRAME:
+        if (perf) {
+            perf_counters_read(perf, perf_start);
+        }
+        raop_rtp_mirror->callbacks.video_resume(raop_rtp_mirror->callbacks.cls);
+        raop_rtp_mirror->callbacks.video_process(raop_rtp_mirror->callbacks.cls, raop_rtp_mirror->ntp, &output->h264_data);
+        if (perf) {
+            perf_counters_add(perf, perf_start, &raop_rtp_mirror->qoe->perf[QOE_PERF_VIDEO_PUSH]);
+        }
+        if (raop_rtp_mirror->qoe) {
+            raop_rtp_mirror->qoe->video_frames++;
+            raop_rtp_mirror->qoe->video_bytes += output->h264_data.data_len;
+            if (raop_rtp_mirror->callbacks.report_qoe_progress) {
+                uint64_t now = raop_ntp_get_local_time(raop_rtp_mirror->ntp);
+                if (now - raop_rtp_mirror->qoe_progress_time >= RAOP_QOE_PROGRESS_INTERVAL) {
+                    raop_rtp_mirror->qoe_progress_time = now;
+                    raop_rtp_mirror->callbacks.report_qoe_progress(raop_rtp_mirror->callbacks.cls, raop_rtp_mirror->qoe);
+                }
+            }
+        }
+        free(output->h264_data.data);
+        break;
+    case MIRROR_OUTPUT_SIZE:
+        if (raop_rtp_mirror->callbacks.video_report_size) {
+            raop_rtp_mirror->callbacks.video_report_size(raop_rtp_mirror->callbacks.cls, &output->size[0], &output->size[1],
+                                                         &output->size[2], &output->size[3]);
+        }
+        break;
+    case MIRROR_OUTPUT_PAUSE:
+        raop_rtp_mirror->callbacks.video_pause(raop_rtp_mirror->callbacks.cls);
+        break;
+    }
+}
+
+/* the process stage hands its output to the deliver stage, or delivers it itself */
+static void
+raop_rtp_mirror_output(raop_rtp_mirror_t *raop_rtp_mirror, mirror_output_t *output, perf_counters_t *perf)
+{
+    if (raop_rtp_mirror->output_queue) {
+        mirror_output_t *item = malloc(sizeof(mirror_output_t));
+        assert(item);
+        memcpy(item, output, sizeof(mirror_output_t));
+        if (mirror_queue_push(raop_rtp_mirror->output_queue, item)) {
+            return;
+        }
+        free(item);
+    }
+    raop_rtp_mirror_deliver(raop_rtp_mirror, output, perf);
+}
+
+/* decrypts, validates and rewrites one packet received from the client (process stage) */
+static void
+raop_rtp_mirror_process(raop_rtp_mirror_t *raop_rtp_mirror, mirror_process_state_t *st, mirror_packet_t *mirror_packet)
+{
+    unsigned char *packet = mirror_packet->header;
+    unsigned char *payload = mirror_packet->payload;
+    int payload_size = mirror_packet->payload_size;
+    uint64_t ntp_timestamp_raw = 0;
+    uint64_t ntp_timestamp_remote = 0;
+    uint64_t ntp_timestamp_local  = 0;
+    unsigned char nal_start_code[4] = { 0x00, 0x00, 0x00, 0x01 };
+
+    char packet_description[13] = {0};
+    char *p = packet_description;
+    int n = sizeof(packet_description);
+    for (int i = 4; i < 8; i++) {
+        snprintf(p, n, "%2.2x ", (unsigned int) packet[i]);
+        n -= 3;
+        p += 3;
+    }
+    ntp_timestamp_raw = byteutils_get_long(packet, 8);
+    ntp_timestamp_remote = raop_ntp_timestamp_to_nano_seconds(ntp_timestamp_raw, false);
+
+    if (mirror_packet->new_stream) {
+        /* the client restarts the aes-ctr keystream on the new connection (if it does not, the key search finds it) */
+        raop_rtp_mirror_end_key_search(raop_rtp_mirror);
+        mirror_buffer_reset(raop_rtp_mirror->buffer);
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: video decryption restarted for the reconnected stream");
+    }
+
+    /* packet[4] + packet[5] identify the payload type:   values seen are:               *
+     * 0x00 0x00: encrypted packet containing a non-IDR  type 1 VCL NAL unit             *
+     * 0x00 0x10: encrypted packet containing an IDR type 5 VCL NAL unit                 *
+     * 0x01 0x00: unencrypted packet containing a type 7 SPS NAL + a type 8 PPS NAL unit *
+     * 0x02 0x00: unencrypted packet (old protocol) no payload, sent once every second    *
+     * 0x05 0x00  unencrypted packet with a "streaming report", sent once per second.    */
+
+    /* packet[6] + packet[7] may list a payload "option":    values seen are:            *
+     * 0x00 0x00 : encrypted and "streaming report" packets                              *
+     * 0x1e 0x00 : old protocol (seen in AirMyPC) no-payload once-per-second packets     *
+     * 0x16 0x01 : seen in most unencrypted SPS+PPS packets                              *
+     * 0x56 0x01 : occasionally seen in unencrypted  SPS+PPS packets (why different?)    */
+
+    /* unencrypted packets with a SPS and a PPS NAL are sent initially, and also when a  *
+     * change in video format (e.g. width, height) subsequently occurs. They seem always *
+     * to be followed by a packet with a type 5 encrypted IDR VCL NAL, with an identical *
+     * timestamp.  On M1/M2 Mac clients, this type 5 NAL is prepended with a type 6 SEI  *
+     * NAL unit.  Here we prepend the SPS+PPS NALs to the next encrypted packet, which   *
+     * always has the same timestamp, and is (almost?) always an IDR NAL unit.           */
+
+    /* Unencrypted SPS/PPS packets also have image-size data in (parts of) packet[16:127] */
+
+    /* "streaming report" packets have no timestamp in packet[8:15] */
+
+
+    switch (packet[4]) {
+    case  0x00:
+        // Normal video data (VCL NAL)
+
+        // Conveniently, the video data is already stamped with the remote wall clock time,
+        // so no additional clock syncing needed. The only thing odd here is that the video
+        // ntp time stamps don't include the SECONDS_FROM_1900_TO_1970, so it's really just
+        // counting nano seconds since last boot.
+
+        ntp_timestamp_local = raop_ntp_convert_remote_time(raop_rtp_mirror->ntp, ntp_timestamp_remote);
+        uint64_t ntp_now = raop_ntp_get_local_time(raop_rtp_mirror->ntp);
+        int64_t latency = ((int64_t) ntp_now) - ((int64_t) ntp_timestamp_local);
+        if (raop_rtp_mirror->qoe) {
+            raop_qoe_add_latency(raop_rtp_mirror->qoe, latency);
+        }
+        if (st->logger_debug) {
+            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
+                       "raop_rtp video: now = %8.6f, ntp = %8.6f, latency = %8.6f, ts = %8.6f, %s",
+                       (double) ntp_now / SEC, (double) ntp_timestamp_local / SEC, (double) latency / SEC,
+                       (double) ntp_timestamp_remote / SEC, packet_description);
+        }
+
+        unsigned char* payload_out;
+        unsigned char* payload_decrypted;
+        /*
+         * nal_types:1   Coded non-partitioned slice of a non-IDR picture
+         *           5   Coded non-partitioned slice of an IDR picture
+         *           6   Supplemental enhancement information (SEI)
+         *           7   Sequence parameter set (SPS)
+         *           8   Picture parameter set (PPS)
+         *
+         * if a previous unencrypted packet contains an SPS (type 7) and PPS (type 8) NAL which has not 
+         * yet been sent, it should be prepended to the current NAL.    The M1 Macs have increased the h264 level, 
+         * and now the first  encrypted packet after the  unencrypted SPS+PPS packet may also contain a SEI (type 6) NAL 
+         * prepended to its VCL NAL.
+         *
+         * The flag prepend_sps_pps = true will signal that the  previous packet contained a SPS NAL + a PPS NAL, 
+         * that has not yet been sent.   This will trigger prepending it to the current NAL, and the prepend_sps_pps 
+         * flag will be set to false after it has been prepended.  */
+
+        if (st->prepend_sps_pps & (ntp_timestamp_raw != st->ntp_timestamp_nal)) {
+                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
+                           "raop_rtp_mirror: prepended sps_pps timestamp does not match timestamp of "
+                           "video payload\n%llu\n%llu , discarding", ntp_timestamp_raw, st->ntp_timestamp_nal);
+                free (st->sps_pps);
+                st->sps_pps = NULL;
+                st->prepend_sps_pps = false;
+        }
+
+        if (st->prepend_sps_pps) {
+            assert(st->sps_pps);
+            payload_out = (unsigned char*)  malloc(payload_size + st->sps_pps_len);
+            payload_decrypted = payload_out + st->sps_pps_len;
+            memcpy(payload_out, st->sps_pps, st->sps_pps_len);
+            free (st->sps_pps);
+            st->sps_pps = NULL;
+        } else {
+            /* decrypt in place: the received payload becomes the output frame */
+            payload_out = payload;
+            payload_decrypted = payload_out;
+            mirror_packet->payload = NULL;
+        }
+        // Decrypt data
+        uint64_t perf_start[PERF_COUNTERS];
+        if (st->perf) {
+            perf_counters_read(st->perf, perf_start);
+        }
+        raop_rtp_mirror_check_decryption(raop_rtp_mirror, payload, payload_size);
+        mirror_buffer_decrypt(raop_rtp_mirror->buffer, payload, payload_decrypted, payload_size);
+        if (st->perf) {
+            perf_counters_add(st->perf, perf_start, &raop_rtp_mirror->qoe->perf[QOE_PERF_MIRROR_DECRYPT]);
+        }
+
+        // It seems the AirPlay protocol prepends NALs with their size, which we're replacing with the 4-byte
+        // start code for the NAL Byte-Stream Format.
+        bool valid_data = true;
+        int nalu_size = 0;
+        int nalus_count = 0;
+        while (nalu_size < payload_size) {
+            int nc_len = byteutils_get_int_be(payload_decrypted, nalu_size);
+            if (nc_len < 0 || nalu_size + 4 > payload_size) {
+                valid_data = false;
+                break;
+            }
+            memcpy(payload_decrypted + nalu_size, nal_start_code, 4);
+            nalu_size += 4;
+            nalus_count++;
+            /* first bit of h264 nalu MUST be 0 ("forbidden_zero_bit") */
+            if (payload_decrypted[nalu_size] & 0x80) {
+                valid_data = false;
+                break;
+            }
+            int nalu_type = payload_decrypted[nalu_size] & 0x1f;
+            int ref_idc = (payload_decrypted[nalu_size] >> 5);
+            /* check for unsupported h265 video (sometimes sent by macOS in high-def screen mirroring) */
+            if (payload_decrypted[nalu_size + 1] == 0x01) {
+                switch (payload_decrypted[nalu_size]) {
+                case 0x28:    // h265 IDR type 20 NAL
+                case 0x02:    // h265 non-IDR type 1 NAL
+                    ref_idc = 0;
+                    st->h265_video_detected = true;
+                    break;
+                default:
+                    break;
+                }
+                if (st->h265_video_detected) {
+                    break;
+                }
+            }
+            switch (nalu_type) {
+            case 14:  /* Prefix NALu , seen before all VCL Nalu's in AirMyPc */
+            case 5:   /*IDR, slice_layer_without_partitioning */
+            case 1:   /*non-IDR, slice_layer_without_partitioning */
+                break;
+            case 2:   /* slice data partition A */
+            case 3:   /* slice data partition B */
+            case 4:   /* slice data partition C */
+                logger_log(raop_rtp_mirror->logger, LOGGER_INFO,
+                           "unexpected partitioned VCL NAL unit: nalu_type = %d, ref_idc = %d, nalu_size = %d,"
+                           "processed bytes %d, payloadsize = %d nalus_count = %d",
+                           nalu_type, ref_idc, nc_len, nalu_size, payload_size, nalus_count);
+                break;
+            case 6:
+                if (st->logger_debug) {
+                    char *str = utils_data_to_string(payload_decrypted + nalu_size, nc_len, 16); 
+                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror SEI NAL size = %d", nc_len);		
+                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
+                               "raop_rtp_mirror h264 Supplemental Enhancement Information:\n%s", str);
+                    free(str);
+                }
+                break;
+            case 7:
+                if (st->logger_debug) {
+                    char *str = utils_data_to_string(payload_decrypted + nalu_size, nc_len, 16); 
+                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror SPS NAL size = %d", nc_len);		
+                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
+                               "raop_rtp_mirror h264 Sequence Parameter Set:\n%s", str);
+                    free(str);
+                }
+                break;
+            case 8:
+                if (st->logger_debug) {
+                    char *str = utils_data_to_string(payload_decrypted + nalu_size, nc_len, 16); 
+                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror PPS NAL size = %d", nc_len);		
+                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
+                               "raop_rtp_mirror h264 Picture Parameter Set :\n%s", str);
+                    free(str);
+                }
+                break;
+            default:
+                logger_log(raop_rtp_mirror->logger, LOGGER_INFO,
+                           "unexpected non-VCL NAL unit: nalu_type = %d, ref_idc = %d, nalu_size = %d,"
+                           "processed bytes %d, payloadsize = %d nalus_count = %d",
+                           nalu_type, ref_idc, nc_len, nalu_size, payload_size, nalus_count);
+                break;
+            }
+            nalu_size += nc_len;
+        }
+        if (st->perf) {
+            perf_counters_add(st->perf, perf_start, &raop_rtp_mirror->qoe->perf[QOE_PERF_NAL_WALK]);
+        }
+        if (st->h265_video_detected) {
+            logger_log(raop_rtp_mirror->logger, LOGGER_ERR,
+                       "unsupported h265 video detected");
+            free (payload_out);
+            break;
+        }
+        if (nalu_size != payload_size) valid_data = false;
+        if(!valid_data) {
+            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "nalu marked as invalid");
+            payload_out[0] = 1; /* mark video data as invalid h264 (failed decryption) */
+            raop_rtp_mirror->decrypt_failures++;
+            if (raop_rtp_mirror->qoe) {
+                raop_rtp_mirror->qoe->decrypt_failures++;
+            }
+        } else {
+            raop_rtp_mirror->decrypt_failures = 0;
+        }
+
+        payload_decrypted = NULL;
+        h264_decode_struct h264_data;
+        h264_data.ntp_time_local = ntp_timestamp_local;
+        h264_data.ntp_time_remote = ntp_timestamp_remote;
+        h264_data.nal_count = nalus_count;   /*nal_count will be the number of nal units in the packet */
+        h264_data.data_len = payload_size;
+        h264_data.data = payload_out;
+        if (st->prepend_sps_pps) {
+            h264_data.data_len += st->sps_pps_len;
+            h264_data.nal_count += 2;
+            st->prepend_sps_pps =  false;
+        }
+        mirror_output_t frame;
+        frame.type = MIRROR_OUTPUT_FRAME;
+        frame.h264_data = h264_data;
+        raop_rtp_mirror_output(raop_rtp_mirror, &frame, st->perf);
+        break;
+    case 0x01:
+        // The information in the payload contains an SPS and a PPS NAL
+        // The sps_pps is not encrypted
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "\nReceived unencrypted codec packet from client:"
+                   " payload_size %d header %s ts_client = %8.6f",
+                   payload_size, packet_description, (double) ntp_timestamp_remote / SEC);
+        if (payload_size == 0) {
+            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror, discard type 0x01 packet with no payload");
+            break;
+        }
+        st->ntp_timestamp_nal = ntp_timestamp_raw;
+        float width = byteutils_get_float(packet, 16);
+        float height = byteutils_get_float(packet, 20);
+        float width_source = byteutils_get_float(packet, 40);
+        float height_source = byteutils_get_float(packet, 44);
+        if (width != width_source || height != height_source) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: Unexpected : data  %f,"
+                   " %f != width_source = %f, height_source = %f", width, height, width_source, height_source);
+        }
+        width = byteutils_get_float(packet, 48);
+        height = byteutils_get_float(packet, 52);
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: unidentified extra header data  %f, %f", width, height);
+        width = byteutils_get_float(packet, 56);
+        height = byteutils_get_float(packet, 60);
+        mirror_output_t size;
+        size.type = MIRROR_OUTPUT_SIZE;
+        size.size[0] = width_source;
+        size.size[1] = height_source;
+        size.size[2] = width;
+        size.size[3] = height;
+        raop_rtp_mirror_output(raop_rtp_mirror, &size, st->perf);
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror width_source = %f height_source = %f width = %f height = %f",
+                   width_source, height_source, width, height);
+
+        short sps_size = byteutils_get_short_be(payload,6);
+        unsigned char *sequence_parameter_set = payload + 8;
+        short pps_size = byteutils_get_short_be(payload, sps_size + 9);
+        unsigned char *picture_parameter_set = payload + sps_size + 11;
+        int data_size = 6;
+        if (st->logger_debug) {
+            char *str = utils_data_to_string(payload, data_size, 16);
+            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: SPS+PPS header size = %d", data_size);		
+            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror h264 SPS+PPS header:\n%s", str);
+            free(str);
+            str = utils_data_to_string(sequence_parameter_set, sps_size,16);
+            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror SPS NAL size = %d",  sps_size);		
+            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror h264 Sequence Parameter Set:\n%s", str);
+            free(str);
+            str = utils_data_to_string(picture_parameter_set, pps_size, 16);
+            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror PPS NAL size = %d", pps_size);
+            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror h264 Picture Parameter Set:\n%s", str);
+            free(str);
+        }
+        data_size = payload_size - sps_size - pps_size - 11; 
+        if (data_size > 0 && st->logger_debug) {
+            char *str = utils_data_to_string (picture_parameter_set + pps_size, data_size, 16);
+            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "remainder size = %d", data_size);
+            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "remainder of SPS+PPS packet:\n%s", str);
+            free(str);
+        } else if (data_size < 0) {
+            logger_log(raop_rtp_mirror->logger, LOGGER_ERR, " pps_sps error: packet remainder size = %d < 0", data_size);
+        }
+
+        // Copy the sps and pps into a buffer to prepend to the next NAL unit.
+        if (st->sps_pps) {
+            free(st->sps_pps);
+            st->sps_pps = NULL;
+        }
+        st->sps_pps_len = sps_size + pps_size + 8;
+        st->sps_pps = (unsigned char*) malloc(st->sps_pps_len);
+        assert(st->sps_pps);
+        memcpy(st->sps_pps, nal_start_code, 4);
+        memcpy(st->sps_pps + 4, sequence_parameter_set, sps_size);
+        memcpy(st->sps_pps + sps_size + 4, nal_start_code, 4); 
+        memcpy(st->sps_pps + sps_size + 8, payload + sps_size + 11, pps_size);
+        st->prepend_sps_pps = true;
+
+        // h264codec_t h264;
+        // h264.version = payload[0];
+        // h264.profile_high = payload[1];
+        // h264.compatibility = payload[2];
+        // h264.level = payload[3];
+        // h264.reserved_6_and_nal = payload[4];
+        // h264.reserved_3_and_sps = payload[5];
+        // h264.sps_size =  sps_size;
+        // h264.sequence_parameter_set = malloc(h264.sps_size);
+        // memcpy(h264.sequence_parameter_set, sequence_parameter_set, sps_size);
+        // h264.number_of_pps = payload[h264.sps_size + 8];
+        // h264.pps_size = pps_size;
+        // h264.picture_parameter_set = malloc(h264.pps_size);
+        // memcpy(h264.picture_parameter_set, picture_parameter_set, pps_size);
+        mirror_output_t pause;
+        pause.type = MIRROR_OUTPUT_PAUSE;
+        raop_rtp_mirror_output(raop_rtp_mirror, &pause, st->perf);
+        break;
+    case 0x02:
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "\nReceived old-protocol once-per-second packet from client:"
+                   " payload_size %d header %s ts_raw = %llu", payload_size, packet_description, ntp_timestamp_raw);
+        /* "old protocol" (used by AirMyPC), rest of 128-byte  packet is empty  */
+    case 0x05:
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "\nReceived video streaming performance info packet from client:"
+                   " payload_size %d header %s ts_raw = %llu", payload_size, packet_description, ntp_timestamp_raw);
+        /* payloads with packet[4] = 0x05 have no timestamp, and carry video info from the client as a binary plist *
+         * Sometimes (e.g, when the client has a locked screen), there is a 25kB trailer attached to the packet.    *
+         * This 25000 Byte trailer with unidentified content seems to be the same data each time it is sent.        */
+
+        if (payload_size && (raop_rtp_mirror->show_client_FPS_data || raop_rtp_mirror->report_log)) {
+            //char *str = utils_data_to_string(packet, 128, 16);
+            //logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "type 5 video packet header:\n%s", str);
+            //free (str);
+
+            int plist_size = payload_size;
+            if (payload_size > 25000) {
+                plist_size = payload_size - 25000;
+                if (st->logger_debug) {
+                    char *str = utils_data_to_string(payload + plist_size, 16, 16);
+                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
+                               "video_info packet had 25kB trailer; first 16 bytes are:\n%s", str);
+                free(str);
+                }
+            }
+            if (plist_size && raop_rtp_mirror->report_log) {
+                uint64_t session = (raop_rtp_mirror->qoe ? raop_rtp_mirror->qoe->start_time : 0);
+                report_log_append(raop_rtp_mirror->report_log, raop_clock_get_time(NULL), session, payload, plist_size);
+            }
+            if (plist_size && raop_rtp_mirror->show_client_FPS_data) {
+                char *plist_xml;
+                uint32_t plist_len;
+                plist_t root_node = NULL;
+                plist_from_bin((char *) payload, plist_size, &root_node);
+                plist_to_xml(root_node, &plist_xml, &plist_len);
+                logger_log(raop_rtp_mirror->logger, LOGGER_INFO, "%s", plist_xml);
+                free(plist_xml);
+            }
+        }
+        break;
+    default:
+        logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "\nReceived unexpected TCP packet from client, "
+                   "size %d, %s ts_raw = %llu", payload_size, packet_description, ntp_timestamp_raw);
+        break;
+    }
+
+
+    free(mirror_packet->payload);
+    mirror_packet->payload = NULL;
+}
+
+static THREAD_RETVAL
+raop_rtp_mirror_deliver_thread(void *arg)
+{
+    raop_rtp_mirror_t *raop_rtp_mirror = arg;
+    mirror_output_t *output;
+    perf_counters_t *perf = raop_rtp_mirror_open_perf_counters(raop_rtp_mirror);
+    while ((output = mirror_queue_pop(raop_rtp_mirror->output_queue))) {
+        raop_rtp_mirror_deliver(raop_rtp_mirror, output, perf);
+        free(output);
+    }
+    perf_counters_close(perf);
+    return 0;
+}
+
+static THREAD_RETVAL
+raop_rtp_mirror_process_thread(void *arg)
+{
+    raop_rtp_mirror_t *raop_rtp_mirror = arg;
+    mirror_process_state_t state;
+    memset(&state, 0, sizeof(state));
+    state.logger_debug = (logger_get_level(raop_rtp_mirror->logger) >= LOGGER_DEBUG);
+    state.perf = raop_rtp_mirror_open_perf_counters(raop_rtp_mirror);
+    mirror_packet_t *mirror_packet;
+    while ((mirror_packet = mirror_queue_pop(raop_rtp_mirror->packet_queue))) {
+        raop_rtp_mirror_process(raop_rtp_mirror, &state, mirror_packet);
+        free(mirror_packet);
+    }
+    free(state.sps_pps);
+    perf_counters_close(state.perf);
+    if (raop_rtp_mirror->output_queue) {
+        mirror_queue_close(raop_rtp_mirror->output_queue);
+        THREAD_JOIN(raop_rtp_mirror->thread_deliver);
+    }
+    return 0;
+}
+
+/* starts the process (and deliver) stage threads; falls back to fewer stages if a thread cannot start */
+static void
+raop_rtp_mirror_start_stages(raop_rtp_mirror_t *raop_rtp_mirror)
+{
+    raop_rtp_mirror->packet_queue = NULL;
+    raop_rtp_mirror->output_queue = NULL;
+    if (raop_rtp_mirror->stages >= 3) {
+        raop_rtp_mirror->output_queue = mirror_queue_init(MIRROR_QUEUE_LEN);
+        if (raop_rtp_mirror->output_queue) {
+            THREAD_CREATE(raop_rtp_mirror->thread_deliver, raop_rtp_mirror_deliver_thread, raop_rtp_mirror);
+            if (!raop_rtp_mirror->thread_deliver) {
+                mirror_queue_destroy(raop_rtp_mirror->output_queue);
+                raop_rtp_mirror->output_queue = NULL;
+            }
+        }
+    }
+    if (raop_rtp_mirror->stages >= 2) {
+        raop_rtp_mirror->packet_queue = mirror_queue_init(MIRROR_QUEUE_LEN);
+        if (raop_rtp_mirror->packet_queue) {
+            THREAD_CREATE(raop_rtp_mirror->thread_process, raop_rtp_mirror_process_thread, raop_rtp_mirror);
+            if (!raop_rtp_mirror->thread_process) {
+                mirror_queue_destroy(raop_rtp_mirror->packet_queue);
+                raop_rtp_mirror->packet_queue = NULL;
+            }
+        }
+    }
+    if (!raop_rtp_mirror->packet_queue && raop_rtp_mirror->output_queue) {
+        mirror_queue_close(raop_rtp_mirror->output_queue);
+        THREAD_JOIN(raop_rtp_mirror->thread_deliver);
+        mirror_queue_destroy(raop_rtp_mirror->output_queue);
+        raop_rtp_mirror->output_queue = NULL;
+    }
+    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: %d-stage pipeline (receive%s%s)",
+               1 + (raop_rtp_mirror->packet_queue ? 1 : 0) + (raop_rtp_mirror->output_queue ? 1 : 0),
+               (raop_rtp_mirror->packet_queue ? " -> decrypt+parse" : ", decrypt+parse"),
+               (raop_rtp_mirror->output_queue ? " -> deliver" : ", deliver"));
+}
+
+/* drains the queues and joins the stage threads (which finish the packets already received) */
+static void
+raop_rtp_mirror_stop_stages(raop_rtp_mirror_t *raop_rtp_mirror)
+{
+    if (raop_rtp_mirror->packet_queue) {
+        mirror_queue_close(raop_rtp_mirror->packet_queue);
+        THREAD_JOIN(raop_rtp_mirror->thread_process);
+        mirror_queue_destroy(raop_rtp_mirror->packet_queue);
+        raop_rtp_mirror->packet_queue = NULL;
+    }
+    if (raop_rtp_mirror->output_queue) {
+        mirror_queue_destroy(raop_rtp_mirror->output_queue);
+        raop_rtp_mirror->output_queue = NULL;
+    }
+}
+
 #define RAOP_PACKET_LEN 32768
 /**
- * Mirror
+ * Mirror (receive stage)
  */
 static THREAD_RETVAL
 raop_rtp_mirror_thread(void *arg)
@@ -183,23 +921,28 @@ raop_rtp_mirror_thread(void *arg)
     int stream_fd = -1;
     unsigned char packet[128];
     memset(packet, 0 , 128);
-    unsigned char* sps_pps = NULL;
-    bool prepend_sps_pps = false;
-    int sps_pps_len = 0;
     unsigned char* payload = NULL;
     unsigned int readstart = 0;
     bool conn_reset = false;
-    uint64_t ntp_timestamp_nal = 0;
-    uint64_t ntp_timestamp_raw = 0;
-    uint64_t ntp_timestamp_remote = 0;
-    uint64_t ntp_timestamp_local  = 0;
-    unsigned char nal_start_code[4] = { 0x00, 0x00, 0x00, 0x01 };
-    bool logger_debug = (logger_get_level(raop_rtp_mirror->logger) >= LOGGER_DEBUG);
-    bool h265_video_detected = false;
+
+    /* process stage state, used here if there is no separate process stage */
+    mirror_process_state_t state;
+    memset(&state, 0, sizeof(state));
+    state.logger_debug = (logger_get_level(raop_rtp_mirror->logger) >= LOGGER_DEBUG);
+
+    /* with a grace period (-grace), a lost stream connection is held open for the client to reconnect */
+    raop_clock_t *clock = raop_ntp_get_clock(raop_rtp_mirror->ntp);
+    uint64_t grace_period = raop_ntp_get_grace_period(raop_rtp_mirror->ntp);
+    uint64_t stream_lost_time = 0;
+    bool new_stream = false;
+
+    raop_rtp_mirror_start_stages(raop_rtp_mirror);
+    if (!raop_rtp_mirror->packet_queue) {
+        state.perf = raop_rtp_mirror_open_perf_counters(raop_rtp_mirror);
+    }
 
     while (1) {
         fd_set rfds;
-        struct timeval tv;
         int nfds, ret;
         MUTEX_LOCK(raop_rtp_mirror->run_mutex);
         if (!raop_rtp_mirror->running) {
@@ -209,9 +952,12 @@ raop_rtp_mirror_thread(void *arg)
         }
         MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
 
-        /* Set timeout valu to 5ms */
-        tv.tv_sec = 0;
-        tv.tv_usec = 5000;
+        if (stream_lost_time && raop_clock_get_time(clock) - stream_lost_time > grace_period) {
+            logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror: client did not reconnect the video stream"
+                       " within %.0f secs", (double) grace_period / SEC);
+            conn_reset = true;
+            break;
+        }
 
         /* Get the correct nfds value and set rfds */
         FD_ZERO(&rfds);
@@ -222,7 +968,8 @@ raop_rtp_mirror_thread(void *arg)
             FD_SET(stream_fd, &rfds);
             nfds = stream_fd+1;
         }
-        ret = select(nfds, &rfds, NULL, NULL, &tv);
+        /* select with timeout value 5ms */
+        ret = raop_clock_select(raop_ntp_get_clock(raop_rtp_mirror->ntp), nfds, &rfds, 5000000);
         if (ret == 0) {
             /* Timeout happened */
             continue;
@@ -277,6 +1024,12 @@ raop_rtp_mirror_thread(void *arg)
                            "raop_rtp_mirror could not set stream socket keepalive probes %d %s", errno, strerror(errno));
             }
             readstart = 0;
+            if (stream_lost_time) {
+                logger_log(raop_rtp_mirror->logger, LOGGER_INFO, "raop_rtp_mirror: video stream reconnected after %.1f secs",
+                           (double) (raop_clock_get_time(clock) - stream_lost_time) / SEC);
+                stream_lost_time = 0;
+                new_stream = true;
+            }
         }
 
         if (stream_fd != -1 && FD_ISSET(stream_fd, &rfds)) {
@@ -299,46 +1052,13 @@ raop_rtp_mirror_thread(void *arg)
                 if (errno == EAGAIN || errno == EWOULDBLOCK) continue; // Timeouts can happen even if the connection is fine
                 logger_log(raop_rtp_mirror->logger, LOGGER_ERR,
                            "raop_rtp_mirror error  in header recv: %d %s", errno, strerror(errno));
+                if (grace_period) goto stream_lost;
                 if (errno == ECONNRESET) conn_reset = true;; 
                 break;
             }
 
             /*packet[0:3] contains the payload size */
             int payload_size = byteutils_get_int(packet, 0);
-            char packet_description[13] = {0};
-	    char *p = packet_description;
-            int n = sizeof(packet_description);
-	    for (int i = 4; i < 8; i++) {
-                snprintf(p, n, "%2.2x ", (unsigned int) packet[i]);
-                n -= 3;
-                p += 3;
-	    }
-            ntp_timestamp_raw = byteutils_get_long(packet, 8);
-            ntp_timestamp_remote = raop_ntp_timestamp_to_nano_seconds(ntp_timestamp_raw, false);
-
-	    /* packet[4] + packet[5] identify the payload type:   values seen are:               *
-             * 0x00 0x00: encrypted packet containing a non-IDR  type 1 VCL NAL unit             *
-             * 0x00 0x10: encrypted packet containing an IDR type 5 VCL NAL unit                 *
-             * 0x01 0x00: unencrypted packet containing a type 7 SPS NAL + a type 8 PPS NAL unit *
-             * 0x02 0x00: unencrypted packet (old protocol) no payload, sent once every second    *
-             * 0x05 0x00  unencrypted packet with a "streaming report", sent once per second.    */
-
-	    /* packet[6] + packet[7] may list a payload "option":    values seen are:            *
-             * 0x00 0x00 : encrypted and "streaming report" packets                              *
-             * 0x1e 0x00 : old protocol (seen in AirMyPC) no-payload once-per-second packets     *
-             * 0x16 0x01 : seen in most unencrypted SPS+PPS packets                              *
-             * 0x56 0x01 : occasionally seen in unencrypted  SPS+PPS packets (why different?)    */
-
-            /* unencrypted packets with a SPS and a PPS NAL are sent initially, and also when a  *
-             * change in video format (e.g. width, height) subsequently occurs. They seem always *
-             * to be followed by a packet with a type 5 encrypted IDR VCL NAL, with an identical *
-             * timestamp.  On M1/M2 Mac clients, this type 5 NAL is prepended with a type 6 SEI  *
-             * NAL unit.  Here we prepend the SPS+PPS NALs to the next encrypted packet, which   *
-             * always has the same timestamp, and is (almost?) always an IDR NAL unit.           */
-
-            /* Unencrypted SPS/PPS packets also have image-size data in (parts of) packet[16:127] */
-
-            /* "streaming report" packets have no timestamp in packet[8:15] */
 
             if (payload == NULL) {
                 payload = malloc(payload_size);
@@ -359,326 +1079,61 @@ raop_rtp_mirror_thread(void *arg)
             } else if (ret == -1) {
                 if (errno == EAGAIN || errno == EWOULDBLOCK) continue; // Timeouts can happen even if the connection is fine
                 logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error in recv: %d %s", errno, strerror(errno));
+                if (grace_period) goto stream_lost;
                 if (errno == ECONNRESET) conn_reset = true;
                 break;
             }
 
-	    switch (packet[4]) {
-            case  0x00:
-                // Normal video data (VCL NAL)
-
-                // Conveniently, the video data is already stamped with the remote wall clock time,
-                // so no additional clock syncing needed. The only thing odd here is that the video
-                // ntp time stamps don't include the SECONDS_FROM_1900_TO_1970, so it's really just
-                // counting nano seconds since last boot.
-
-                ntp_timestamp_local = raop_ntp_convert_remote_time(raop_rtp_mirror->ntp, ntp_timestamp_remote);
-                if (logger_debug) {
-                    uint64_t ntp_now = raop_ntp_get_local_time(raop_rtp_mirror->ntp);
-                    int64_t latency = ((int64_t) ntp_now) - ((int64_t) ntp_timestamp_local);
-                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
-                               "raop_rtp video: now = %8.6f, ntp = %8.6f, latency = %8.6f, ts = %8.6f, %s",
-                               (double) ntp_now / SEC, (double) ntp_timestamp_local / SEC, (double) latency / SEC,
-                               (double) ntp_timestamp_remote / SEC, packet_description);
-                }
-
-                unsigned char* payload_out;
-		unsigned char* payload_decrypted;
-                /*
-                 * nal_types:1   Coded non-partitioned slice of a non-IDR picture
-                 *           5   Coded non-partitioned slice of an IDR picture
-                 *           6   Supplemental enhancement information (SEI)
-                 *           7   Sequence parameter set (SPS)
-                 *           8   Picture parameter set (PPS)
-                 *
-                 * if a previous unencrypted packet contains an SPS (type 7) and PPS (type 8) NAL which has not 
-                 * yet been sent, it should be prepended to the current NAL.    The M1 Macs have increased the h264 level, 
-                 * and now the first  encrypted packet after the  unencrypted SPS+PPS packet may also contain a SEI (type 6) NAL 
-                 * prepended to its VCL NAL.
-                 *
-                 * The flag prepend_sps_pps = true will signal that the  previous packet contained a SPS NAL + a PPS NAL, 
-                 * that has not yet been sent.   This will trigger prepending it to the current NAL, and the prepend_sps_pps 
-                 * flag will be set to false after it has been prepended.  */
-
-                if (prepend_sps_pps & (ntp_timestamp_raw != ntp_timestamp_nal)) {
-                        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
-                                   "raop_rtp_mirror: prepended sps_pps timestamp does not match timestamp of "
-                                   "video payload\n%llu\n%llu , discarding", ntp_timestamp_raw, ntp_timestamp_nal);
-                        free (sps_pps);
-		        sps_pps = NULL;
-                        prepend_sps_pps = false;
-                }
-		
-                if (prepend_sps_pps) {
-                    assert(sps_pps);
-                    payload_out = (unsigned char*)  malloc(payload_size + sps_pps_len);
-                    payload_decrypted = payload_out + sps_pps_len;
-                    memcpy(payload_out, sps_pps, sps_pps_len);
-                    free (sps_pps);
-		    sps_pps = NULL;
-                } else {
-                    payload_out = (unsigned char*)  malloc(payload_size);
-                    payload_decrypted = payload_out;
-                }
-                // Decrypt data
-                mirror_buffer_decrypt(raop_rtp_mirror->buffer, payload, payload_decrypted, payload_size);
-
-                // It seems the AirPlay protocol prepends NALs with their size, which we're replacing with the 4-byte
-                // start code for the NAL Byte-Stream Format.
-                bool valid_data = true;
-                int nalu_size = 0;
-                int nalus_count = 0;
-                while (nalu_size < payload_size) {
-                    int nc_len = byteutils_get_int_be(payload_decrypted, nalu_size);
-                    if (nc_len < 0 || nalu_size + 4 > payload_size) {
-                        valid_data = false;
-                        break;
-                    }
-                    memcpy(payload_decrypted + nalu_size, nal_start_code, 4);
-                    nalu_size += 4;
-                    nalus_count++;
-                    /* first bit of h264 nalu MUST be 0 ("forbidden_zero_bit") */
-                    if (payload_decrypted[nalu_size] & 0x80) {
-                        valid_data = false;
-                        break;
-                    }
-                    int nalu_type = payload_decrypted[nalu_size] & 0x1f;
-                    int ref_idc = (payload_decrypted[nalu_size] >> 5);
-                    /* check for unsupported h265 video (sometimes sent by macOS in high-def screen mirroring) */
-                    if (payload_decrypted[nalu_size + 1] == 0x01) {
-                        switch (payload_decrypted[nalu_size]) {
-                        case 0x28:    // h265 IDR type 20 NAL
-                        case 0x02:    // h265 non-IDR type 1 NAL
-                            ref_idc = 0;
-                            h265_video_detected = true;
-                            break;
-                        default:
-                            break;
-                        }
-                        if (h265_video_detected) {
-                            break;
-                        }
-                    }
-                    switch (nalu_type) {
-                    case 14:  /* Prefix NALu , seen before all VCL Nalu's in AirMyPc */
-                    case 5:   /*IDR, slice_layer_without_partitioning */
-                    case 1:   /*non-IDR, slice_layer_without_partitioning */
-                        break;
-	            case 2:   /* slice data partition A */
-                    case 3:   /* slice data partition B */
-                    case 4:   /* slice data partition C */
-                        logger_log(raop_rtp_mirror->logger, LOGGER_INFO,
-                                   "unexpected partitioned VCL NAL unit: nalu_type = %d, ref_idc = %d, nalu_size = %d,"
-                                   "processed bytes %d, payloadsize = %d nalus_count = %d",
-                                   nalu_type, ref_idc, nc_len, nalu_size, payload_size, nalus_count);
-                        break;
-                    case 6:
-                        if (logger_debug) {
-                            char *str = utils_data_to_string(payload_decrypted + nalu_size, nc_len, 16); 
-                            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror SEI NAL size = %d", nc_len);		
-                            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
-                                       "raop_rtp_mirror h264 Supplemental Enhancement Information:\n%s", str);
-                            free(str);
-                        }
-                        break;
-                    case 7:
-                        if (logger_debug) {
-                            char *str = utils_data_to_string(payload_decrypted + nalu_size, nc_len, 16); 
-                            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror SPS NAL size = %d", nc_len);		
-                            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
-                                       "raop_rtp_mirror h264 Sequence Parameter Set:\n%s", str);
-                            free(str);
-                        }
-                        break;
-                    case 8:
-                        if (logger_debug) {
-                            char *str = utils_data_to_string(payload_decrypted + nalu_size, nc_len, 16); 
-                            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror PPS NAL size = %d", nc_len);		
-                            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
-                                       "raop_rtp_mirror h264 Picture Parameter Set :\n%s", str);
-                            free(str);
-                        }
-                        break;
-                    default:
-                        logger_log(raop_rtp_mirror->logger, LOGGER_INFO,
-                                   "unexpected non-VCL NAL unit: nalu_type = %d, ref_idc = %d, nalu_size = %d,"
-                                   "processed bytes %d, payloadsize = %d nalus_count = %d",
-                                   nalu_type, ref_idc, nc_len, nalu_size, payload_size, nalus_count);
-			break;
-		    }
-                    nalu_size += nc_len;
-                }
-                if (h265_video_detected) {
-                    logger_log(raop_rtp_mirror->logger, LOGGER_ERR,
-                               "unsupported h265 video detected");
-                    free (payload_out);
-                    break;
-                }
-                if (nalu_size != payload_size) valid_data = false;
-                if(!valid_data) {
-                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "nalu marked as invalid");
-                    payload_out[0] = 1; /* mark video data as invalid h264 (failed decryption) */
-                }
-
-                payload_decrypted = NULL;
-                h264_decode_struct h264_data;
-                h264_data.ntp_time_local = ntp_timestamp_local;
-                h264_data.ntp_time_remote = ntp_timestamp_remote;
-                h264_data.nal_count = nalus_count;   /*nal_count will be the number of nal units in the packet */
-                h264_data.data_len = payload_size;
-                h264_data.data = payload_out;
-                if (prepend_sps_pps) {
-                    h264_data.data_len += sps_pps_len;
-                    h264_data.nal_count += 2;
-		    prepend_sps_pps =  false;
-                }
-                raop_rtp_mirror->callbacks.video_resume(raop_rtp_mirror->callbacks.cls);
-                raop_rtp_mirror->callbacks.video_process(raop_rtp_mirror->callbacks.cls, raop_rtp_mirror->ntp, &h264_data);
-                free(payload_out);
-                break;
-            case 0x01:
-                // The information in the payload contains an SPS and a PPS NAL
-                // The sps_pps is not encrypted
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "\nReceived unencrypted codec packet from client:"
-                           " payload_size %d header %s ts_client = %8.6f",
-			   payload_size, packet_description, (double) ntp_timestamp_remote / SEC);
-                if (payload_size == 0) {
-                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror, discard type 0x01 packet with no payload");
-                    break;
-                }
-                ntp_timestamp_nal = ntp_timestamp_raw;
-                float width = byteutils_get_float(packet, 16);
-                float height = byteutils_get_float(packet, 20);
-                float width_source = byteutils_get_float(packet, 40);
-                float height_source = byteutils_get_float(packet, 44);
-                if (width != width_source || height != height_source) {
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: Unexpected : data  %f,"
-                           " %f != width_source = %f, height_source = %f", width, height, width_source, height_source);
-                }
-                width = byteutils_get_float(packet, 48);
-                height = byteutils_get_float(packet, 52);
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: unidentified extra header data  %f, %f", width, height);
-                width = byteutils_get_float(packet, 56);
-                height = byteutils_get_float(packet, 60);
-                if (raop_rtp_mirror->callbacks.video_report_size) {
-                    raop_rtp_mirror->callbacks.video_report_size(raop_rtp_mirror->callbacks.cls, &width_source, &height_source, &width, &height);
-                }
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror width_source = %f height_source = %f width = %f height = %f",
-                           width_source, height_source, width, height);
-
-                short sps_size = byteutils_get_short_be(payload,6);
-                unsigned char *sequence_parameter_set = payload + 8;
-                short pps_size = byteutils_get_short_be(payload, sps_size + 9);
-                unsigned char *picture_parameter_set = payload + sps_size + 11;
-                int data_size = 6;
-                if (logger_debug) {
-                    char *str = utils_data_to_string(payload, data_size, 16);
-                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: SPS+PPS header size = %d", data_size);		
-                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror h264 SPS+PPS header:\n%s", str);
-                    free(str);
-                    str = utils_data_to_string(sequence_parameter_set, sps_size,16);
-                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror SPS NAL size = %d",  sps_size);		
-                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror h264 Sequence Parameter Set:\n%s", str);
-                    free(str);
-                    str = utils_data_to_string(picture_parameter_set, pps_size, 16);
-                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror PPS NAL size = %d", pps_size);
-                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror h264 Picture Parameter Set:\n%s", str);
-                    free(str);
-                }
-                data_size = payload_size - sps_size - pps_size - 11; 
-                if (data_size > 0 && logger_debug) {
-                    char *str = utils_data_to_string (picture_parameter_set + pps_size, data_size, 16);
-                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "remainder size = %d", data_size);
-                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "remainder of SPS+PPS packet:\n%s", str);
-                    free(str);
-                } else if (data_size < 0) {
-                    logger_log(raop_rtp_mirror->logger, LOGGER_ERR, " pps_sps error: packet remainder size = %d < 0", data_size);
-                }
-
-                // Copy the sps and pps into a buffer to prepend to the next NAL unit.
-                if (sps_pps) {
-                    free(sps_pps);
-                    sps_pps = NULL;
-                }
-		sps_pps_len = sps_size + pps_size + 8;
-                sps_pps = (unsigned char*) malloc(sps_pps_len);
-                assert(sps_pps);
-                memcpy(sps_pps, nal_start_code, 4);
-                memcpy(sps_pps + 4, sequence_parameter_set, sps_size);
-                memcpy(sps_pps + sps_size + 4, nal_start_code, 4); 
-                memcpy(sps_pps + sps_size + 8, payload + sps_size + 11, pps_size);
-                prepend_sps_pps = true;
-
-                // h264codec_t h264;
-                // h264.version = payload[0];
-                // h264.profile_high = payload[1];
-                // h264.compatibility = payload[2];
-                // h264.level = payload[3];
-                // h264.reserved_6_and_nal = payload[4];
-                // h264.reserved_3_and_sps = payload[5];
-                // h264.sps_size =  sps_size;
-                // h264.sequence_parameter_set = malloc(h264.sps_size);
-                // memcpy(h264.sequence_parameter_set, sequence_parameter_set, sps_size);
-                // h264.number_of_pps = payload[h264.sps_size + 8];
-                // h264.pps_size = pps_size;
-                // h264.picture_parameter_set = malloc(h264.pps_size);
-                // memcpy(h264.picture_parameter_set, picture_parameter_set, pps_size);
-                raop_rtp_mirror->callbacks.video_pause(raop_rtp_mirror->callbacks.cls);
-                break;
-            case 0x02:
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "\nReceived old-protocol once-per-second packet from client:"
-                           " payload_size %d header %s ts_raw = %llu", payload_size, packet_description, ntp_timestamp_raw);
-                /* "old protocol" (used by AirMyPC), rest of 128-byte  packet is empty  */
-            case 0x05:
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "\nReceived video streaming performance info packet from client:"
-                           " payload_size %d header %s ts_raw = %llu", payload_size, packet_description, ntp_timestamp_raw);
-                /* payloads with packet[4] = 0x05 have no timestamp, and carry video info from the client as a binary plist *
-                 * Sometimes (e.g, when the client has a locked screen), there is a 25kB trailer attached to the packet.    *
-                 * This 25000 Byte trailer with unidentified content seems to be the same data each time it is sent.        */
-
-                if (payload_size && raop_rtp_mirror->show_client_FPS_data) {
-                    //char *str = utils_data_to_string(packet, 128, 16);
-                    //logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "type 5 video packet header:\n%s", str);
-                    //free (str);
-		    
-                    int plist_size = payload_size;
-                    if (payload_size > 25000) {
-		        plist_size = payload_size - 25000;
-                        if (logger_debug) {
-                            char *str = utils_data_to_string(payload + plist_size, 16, 16);
-                            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG,
-                                       "video_info packet had 25kB trailer; first 16 bytes are:\n%s", str);
-                        free(str);
-                        }
-                    }
-                    if (plist_size) {
-                        char *plist_xml;
-                        uint32_t plist_len;
-                        plist_t root_node = NULL;
-                        plist_from_bin((char *) payload, plist_size, &root_node);
-                        plist_to_xml(root_node, &plist_xml, &plist_len);
-                        logger_log(raop_rtp_mirror->logger, LOGGER_INFO, "%s", plist_xml);
-                        free(plist_xml);
-                    }
-                }
-                break;
-            default:
-                logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "\nReceived unexpected TCP packet from client, "
-                           "size %d, %s ts_raw = %llu", payload_size, packet_description, ntp_timestamp_raw);
-                break;
+            if (raop_rtp_mirror->packet_queue) {
+                mirror_packet_t *mirror_packet = malloc(sizeof(mirror_packet_t));
+                assert(mirror_packet);
+                memcpy(mirror_packet->header, packet, 128);
+                mirror_packet->payload = payload;
+                mirror_packet->payload_size = payload_size;
+                mirror_packet->new_stream = new_stream;
+                mirror_queue_push(raop_rtp_mirror->packet_queue, mirror_packet);
+            } else {
+                mirror_packet_t mirror_packet;
+                memcpy(mirror_packet.header, packet, 128);
+                mirror_packet.payload = payload;
+                mirror_packet.payload_size = payload_size;
+                mirror_packet.new_stream = new_stream;
+                raop_rtp_mirror_process(raop_rtp_mirror, &state, &mirror_packet);
             }
-
-            free(payload);
             payload = NULL;
+            new_stream = false;
             memset(packet, 0, 128);
             readstart = 0;
         }
+        continue;
+
+    stream_lost:
+        /* keep the session (keys, decoder, last frame) and accept the client's new stream connection */
+        closesocket(stream_fd);
+        stream_fd = -1;
+        free(payload);
+        payload = NULL;
+        memset(packet, 0, 128);
+        readstart = 0;
+        if (!stream_lost_time) {
+            stream_lost_time = raop_clock_get_time(clock);
+            logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror: video stream lost, waiting up to %.0f secs"
+                       " for the client to reconnect it", (double) grace_period / SEC);
+        }
     }
 
     /* Close the stream file descriptor */
     if (stream_fd != -1) {
         closesocket(stream_fd);
     }
+    free(payload);
+
+    raop_rtp_mirror_stop_stages(raop_rtp_mirror);
+    free(state.sps_pps);
+    perf_counters_close(state.perf);
+
+    /* Wait for a video key search that is still running */
+    raop_rtp_mirror_end_key_search(raop_rtp_mirror);
 
     // Ensure running reflects the actual state
     MUTEX_LOCK(raop_rtp_mirror->run_mutex);
@@ -686,6 +1141,9 @@ raop_rtp_mirror_thread(void *arg)
     MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
 
     logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror exiting TCP thread");
+    if (conn_reset && raop_rtp_mirror->qoe) {
+        raop_rtp_mirror->qoe->reset = true;
+    }
     if (conn_reset && raop_rtp_mirror->callbacks.conn_reset) {
         const bool video_reset = false;   /* leave "frozen video" showing */
         raop_rtp_mirror->callbacks.conn_reset(raop_rtp_mirror->callbacks.cls, 0, video_reset);
@@ -723,9 +1181,34 @@ raop_rtp_init_mirror_sockets(raop_rtp_mirror_t *raop_rtp_mirror, int use_ipv6)
     return -1;
 }
 
+/* store the client's streaming reports in report_log (before raop_rtp_start_mirror) */
+void
+raop_rtp_mirror_set_report_log(raop_rtp_mirror_t *raop_rtp_mirror, report_log_t *report_log)
+{
+    assert(raop_rtp_mirror);
+    raop_rtp_mirror->report_log = report_log;
+}
+
+/* measure the stages with hardware performance counters, stored in the session quality counters *
+ * (before raop_rtp_start_mirror)                                                                  */
+void
+raop_rtp_mirror_set_perf_counters(raop_rtp_mirror_t *raop_rtp_mirror, bool enable)
+{
+    assert(raop_rtp_mirror);
+    raop_rtp_mirror->perf_counters = enable;
+}
+
+/* attach the session quality counters (before raop_rtp_start_mirror) */
+void
+raop_rtp_mirror_set_qoe(raop_rtp_mirror_t *raop_rtp_mirror, raop_qoe_t *qoe)
+{
+    assert(raop_rtp_mirror);
+    raop_rtp_mirror->qoe = qoe;
+}
+
 void
 raop_rtp_start_mirror(raop_rtp_mirror_t *raop_rtp_mirror, unsigned short *mirror_data_lport,
-                      uint8_t show_client_FPS_data)
+                      uint8_t show_client_FPS_data, uint8_t stages)
 {
     logger_log(raop_rtp_mirror->logger, LOGGER_INFO, "raop_rtp_mirror starting mirroring");
     int use_ipv6 = 0;
@@ -733,6 +1216,7 @@ raop_rtp_start_mirror(raop_rtp_mirror_t *raop_rtp_mirror, unsigned short *mirror
     assert(raop_rtp_mirror);
     assert(mirror_data_lport);
     raop_rtp_mirror->show_client_FPS_data = show_client_FPS_data;
+    raop_rtp_mirror->stages = (stages < 1 ? 1 : (stages > 3 ? 3 : stages));
 
     MUTEX_LOCK(raop_rtp_mirror->run_mutex);
     if (raop_rtp_mirror->running || !raop_rtp_mirror->joined) {
@@ -761,7 +1245,8 @@ raop_rtp_start_mirror(raop_rtp_mirror_t *raop_rtp_mirror, unsigned short *mirror
     MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
 }
 
-void raop_rtp_mirror_stop(raop_rtp_mirror_t *raop_rtp_mirror) {
+/* tells the mirror thread to stop, without waiting for it (raop_rtp_mirror_stop joins it) */
+void raop_rtp_mirror_signal_stop(raop_rtp_mirror_t *raop_rtp_mirror) {
     assert(raop_rtp_mirror);
 
     /* Check that we are running and thread is not
@@ -772,12 +1257,25 @@ void raop_rtp_mirror_stop(raop_rtp_mirror_t *raop_rtp_mirror) {
         return;
     }
     raop_rtp_mirror->running = 0;
+    raop_rtp_mirror->stopping = 1;
     MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
 
     if (raop_rtp_mirror->mirror_data_sock != -1) {
         closesocket(raop_rtp_mirror->mirror_data_sock);
         raop_rtp_mirror->mirror_data_sock = -1;
     }
+}
+
+void raop_rtp_mirror_stop(raop_rtp_mirror_t *raop_rtp_mirror) {
+    raop_rtp_mirror_signal_stop(raop_rtp_mirror);
+
+    MUTEX_LOCK(raop_rtp_mirror->run_mutex);
+    if (!raop_rtp_mirror->stopping) {
+        MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
+        return;
+    }
+    raop_rtp_mirror->stopping = 0;
+    MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
 
     /* Join the thread */
     THREAD_JOIN(raop_rtp_mirror->thread_mirror);
@@ -792,6 +1290,7 @@ void raop_rtp_mirror_destroy(raop_rtp_mirror_t *raop_rtp_mirror) {
     if (raop_rtp_mirror) {
         raop_rtp_mirror_stop(raop_rtp_mirror);
         MUTEX_DESTROY(raop_rtp_mirror->run_mutex);
+        MUTEX_DESTROY(raop_rtp_mirror->resync_mutex);
         mirror_buffer_destroy(raop_rtp_mirror->buffer);
 	free(raop_rtp_mirror);
     }
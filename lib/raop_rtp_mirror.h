@@ -21,14 +21,24 @@
 #include <stdint.h>
 #include "raop.h"
 #include "logger.h"
+#include "raop_qoe.h"
+#include "report_log.h"
 
 typedef struct raop_rtp_mirror_s raop_rtp_mirror_t;
 typedef struct h264codec_s h264codec_t;
 
 raop_rtp_mirror_t *raop_rtp_mirror_init(logger_t *logger, raop_callbacks_t *callbacks, raop_ntp_t *ntp,
-                                        const char *remote, int remotelen, const unsigned char *aeskey);
+                                        const char *remote, int remotelen, const unsigned char *aeskey,
+                                        const unsigned char *aeskey_alt);
 void raop_rtp_init_mirror_aes(raop_rtp_mirror_t *raop_rtp_mirror, uint64_t *streamConnectionID);
-void raop_rtp_start_mirror(raop_rtp_mirror_t *raop_rtp_mirror, unsigned short *mirror_data_lport, uint8_t show_client_FPS_data);
+void raop_rtp_mirror_set_qoe(raop_rtp_mirror_t *raop_rtp_mirror, raop_qoe_t *qoe);
+void raop_rtp_mirror_set_report_log(raop_rtp_mirror_t *raop_rtp_mirror, report_log_t *report_log);
+void raop_rtp_mirror_set_perf_counters(raop_rtp_mirror_t *raop_rtp_mirror, bool enable);
+/* stages: 1 = receive, decrypt+parse and deliver in one thread; 2 = separate receive thread; *
+ * 3 = also a separate deliver thread (the three stages are connected by bounded queues)      */
+void raop_rtp_start_mirror(raop_rtp_mirror_t *raop_rtp_mirror, unsigned short *mirror_data_lport, uint8_t show_client_FPS_data,
+                           uint8_t stages);
+void raop_rtp_mirror_signal_stop(raop_rtp_mirror_t *raop_rtp_mirror);
 void raop_rtp_mirror_stop(raop_rtp_mirror_t *raop_rtp_mirror);
 void raop_rtp_mirror_destroy(raop_rtp_mirror_t *raop_rtp_mirror);
 #endif //RAOP_RTP_MIRROR_H
@@ -0,0 +1,402 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "report_log.h"
+#include "threads.h"
+
+#define REPORT_LOG_MAGIC "UXPREPT1"
+#define REPORT_LOG_HEADER_SIZE 4096
+
+/* file layout: this header (padded to REPORT_LOG_HEADER_SIZE), then "capacity" records.  Record n (counting *
+ * from the creation of the file) is in slot n % capacity.  The writer sets "writing" to n + 1 before it     *
+ * writes record n, and "count" to n + 1 after, so a reader can tell if a slot changed while it copied it    */
+typedef struct report_log_header_s {
+    char magic[8];
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t capacity;
+    uint32_t columns;                                  /* fields, in the order in which they first appear */
+    uint64_t count;                                    /* records appended since the file was created */
+    uint64_t writing;
+    char keys[REPORT_LOG_COLUMNS][REPORT_LOG_KEY_LEN];
+} report_log_header_t;
+
+struct report_log_s {
+    report_log_header_t *header;
+    report_log_record_t *records;
+    size_t size;
+    bool writable;
+    mutex_handle_t mutex;
+};
+
+#ifdef _WIN32
+report_log_t *
+report_log_open(const char *filename, unsigned int records) {
+    errno = ENOSYS;
+    return NULL;
+}
+
+report_log_t *
+report_log_open_read(const char *filename) {
+    errno = ENOSYS;
+    return NULL;
+}
+
+void
+report_log_close(report_log_t *log) {
+}
+#else
+static bool
+header_is_valid(const report_log_header_t *header, size_t size) {
+    return (!memcmp(header->magic, REPORT_LOG_MAGIC, sizeof(header->magic)) &&
+            header->header_size == REPORT_LOG_HEADER_SIZE &&
+            header->record_size == sizeof(report_log_record_t) &&
+            header->capacity > 0 && header->columns <= REPORT_LOG_COLUMNS &&
+            size == REPORT_LOG_HEADER_SIZE + (size_t) header->capacity * sizeof(report_log_record_t));
+}
+
+static report_log_t *
+report_log_map(const char *filename, unsigned int records, bool writable) {
+    int fd = open(filename, (writable ? O_RDWR | O_CREAT : O_RDONLY), 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t) st.st_size;
+    bool create = false;
+    if (size == 0 && writable) {
+        if (records == 0) {
+            records = REPORT_LOG_DEFAULT_RECORDS;
+        }
+        size = REPORT_LOG_HEADER_SIZE + (size_t) records * sizeof(report_log_record_t);
+        if (ftruncate(fd, (off_t) size) < 0) {
+            close(fd);
+            return NULL;
+        }
+        create = true;
+    } else if (size < REPORT_LOG_HEADER_SIZE) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    void *map = mmap(NULL, size, (writable ? PROT_READ | PROT_WRITE : PROT_READ), MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    report_log_header_t *header = (report_log_header_t *) map;
+    if (create) {
+        memcpy(header->magic, REPORT_LOG_MAGIC, sizeof(header->magic));
+        header->header_size = REPORT_LOG_HEADER_SIZE;
+        header->record_size = sizeof(report_log_record_t);
+        header->capacity = records;
+    } else if (!header_is_valid(header, size)) {
+        /* never overwrite a file that is not a report log */
+        munmap(map, size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    report_log_t *log = (report_log_t *) calloc(1, sizeof(report_log_t));
+    if (!log) {
+        munmap(map, size);
+        return NULL;
+    }
+    log->header = header;
+    log->records = (report_log_record_t *) ((char *) map + REPORT_LOG_HEADER_SIZE);
+    log->size = size;
+    log->writable = writable;
+    MUTEX_CREATE(log->mutex);
+    return log;
+}
+
+report_log_t *
+report_log_open(const char *filename, unsigned int records) {
+    return report_log_map(filename, records, true);
+}
+
+report_log_t *
+report_log_open_read(const char *filename) {
+    return report_log_map(filename, 0, false);
+}
+
+void
+report_log_close(report_log_t *log) {
+    if (log) {
+        munmap(log->header, log->size);
+        MUTEX_DESTROY(log->mutex);
+        free(log);
+    }
+}
+#endif
+
+/* a report is read in place from its binary plist ("bplist00"), without building a libplist tree: only the *
+ * dicts, numbers and booleans are decoded.  Keys that are not ASCII strings (and other objects) are skipped */
+#define BPLIST_TRAILER_SIZE 32
+#define BPLIST_MAX_DEPTH 4
+
+typedef struct bplist_s {
+    const unsigned char *data;
+    size_t len;
+    size_t offset_table;
+    unsigned int offset_size;
+    unsigned int ref_size;
+    uint64_t objects;
+} bplist_t;
+
+static uint64_t
+get_uint_be(const unsigned char *b, unsigned int size) {
+    uint64_t value = 0;
+    for (unsigned int i = 0; i < size; i++) {
+        value = (value << 8) | b[i];
+    }
+    return value;
+}
+
+static bool
+bplist_init(bplist_t *bplist, const unsigned char *data, size_t len, uint64_t *top) {
+    if (len < 8 + BPLIST_TRAILER_SIZE || memcmp(data, "bplist00", 8)) {
+        return false;
+    }
+    const unsigned char *trailer = data + len - BPLIST_TRAILER_SIZE;
+    bplist->data = data;
+    bplist->len = len - BPLIST_TRAILER_SIZE;
+    bplist->offset_size = trailer[6];
+    bplist->ref_size = trailer[7];
+    bplist->objects = get_uint_be(trailer + 8, 8);
+    *top = get_uint_be(trailer + 16, 8);
+    uint64_t offset_table = get_uint_be(trailer + 24, 8);
+    if (bplist->offset_size < 1 || bplist->offset_size > 8 || bplist->ref_size < 1 || bplist->ref_size > 8 ||
+        *top >= bplist->objects || offset_table > bplist->len ||
+        bplist->objects > (bplist->len - offset_table) / bplist->offset_size) {
+        return false;
+    }
+    bplist->offset_table = (size_t) offset_table;
+    return true;
+}
+
+/* the marker byte of object ref, and the offset of the bytes after it; false if out of range */
+static bool
+bplist_object(const bplist_t *bplist, uint64_t ref, uint8_t *marker, size_t *offset) {
+    if (ref >= bplist->objects) {
+        return false;
+    }
+    uint64_t object = get_uint_be(bplist->data + bplist->offset_table + ref * bplist->offset_size,
+                                  bplist->offset_size);
+    if (object < 8 || object >= bplist->offset_table) {
+        return false;
+    }
+    *marker = bplist->data[object];
+    *offset = (size_t) object + 1;
+    return true;
+}
+
+/* the count in the low nibble of a marker, or (if it is 0xf) in the int object that follows */
+static bool
+bplist_count(const bplist_t *bplist, uint8_t marker, size_t *offset, uint64_t *count) {
+    if ((marker & 0x0f) != 0x0f) {
+        *count = marker & 0x0f;
+        return true;
+    }
+    if (*offset >= bplist->len || (bplist->data[*offset] & 0xf0) != 0x10) {
+        return false;
+    }
+    unsigned int size = 1u << (bplist->data[*offset] & 0x0f);
+    if (size > 8 || *offset + 1 + size > bplist->len) {
+        return false;
+    }
+    *count = get_uint_be(bplist->data + *offset + 1, size);
+    *offset += 1 + size;
+    return true;
+}
+
+/* the numeric value of an int, real or boolean object */
+static bool
+bplist_number(const bplist_t *bplist, uint8_t marker, size_t offset, float *value) {
+    if (marker == 0x08 || marker == 0x09) {
+        *value = (marker == 0x09 ? 1.0f : 0.0f);
+        return true;
+    }
+    unsigned int size = 1u << (marker & 0x0f);
+    if (size > 8 || offset + size > bplist->len) {
+        return false;
+    }
+    uint64_t bits = get_uint_be(bplist->data + offset, size);
+    switch (marker & 0xf0) {
+    case 0x10:
+        /* only 8-byte ints are signed */
+        *value = (size == 8 ? (float) (int64_t) bits : (float) bits);
+        return true;
+    case 0x20:
+        if (size == 4) {
+            uint32_t bits32 = (uint32_t) bits;
+            float real;
+            memcpy(&real, &bits32, sizeof(real));
+            *value = real;
+            return true;
+        } else if (size == 8) {
+            double real;
+            memcpy(&real, &bits, sizeof(real));
+            *value = (float) real;
+            return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+/* calls found(log, key, value, record) for each numeric item of the dict object ref (keys of nested dicts *
+ * are joined by ".")                                                                                       */
+static void
+report_log_walk(report_log_t *log, const bplist_t *bplist, uint64_t ref, const char *prefix, int depth,
+                report_log_record_t *record, void (*found)(report_log_t *, const char *, float, report_log_record_t *)) {
+    uint8_t marker;
+    size_t offset;
+    uint64_t count;
+    if (depth > BPLIST_MAX_DEPTH || !bplist_object(bplist, ref, &marker, &offset) || (marker & 0xf0) != 0xd0 ||
+        !bplist_count(bplist, marker, &offset, &count) || count > (bplist->len - offset) / (2 * bplist->ref_size)) {
+        return;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t key_ref = get_uint_be(bplist->data + offset + i * bplist->ref_size, bplist->ref_size);
+        uint64_t value_ref = get_uint_be(bplist->data + offset + (count + i) * bplist->ref_size, bplist->ref_size);
+        uint8_t key_marker, value_marker;
+        size_t key_offset, value_offset;
+        uint64_t key_len;
+        if (!bplist_object(bplist, key_ref, &key_marker, &key_offset) || (key_marker & 0xf0) != 0x50 ||
+            !bplist_count(bplist, key_marker, &key_offset, &key_len) || key_len > bplist->len - key_offset ||
+            !bplist_object(bplist, value_ref, &value_marker, &value_offset)) {
+            continue;
+        }
+        char path[REPORT_LOG_KEY_LEN];
+        int len = snprintf(path, sizeof(path), "%s%s%.*s", prefix, (prefix[0] ? "." : ""),
+                           (int) (key_len < sizeof(path) ? key_len : sizeof(path)),
+                           (const char *) bplist->data + key_offset);
+        if (len >= (int) sizeof(path)) {
+            continue;
+        }
+        float value;
+        if ((value_marker & 0xf0) == 0xd0) {
+            report_log_walk(log, bplist, value_ref, path, depth + 1, record, found);
+        } else if (bplist_number(bplist, value_marker, value_offset, &value)) {
+            found(log, path, value, record);
+        }
+    }
+}
+
+/* a field seen for the first time takes the next free column (records stored before have NAN there) */
+static void
+set_value(report_log_t *log, const char *key, float value, report_log_record_t *record) {
+    report_log_header_t *header = log->header;
+    uint32_t i;
+    for (i = 0; i < header->columns; i++) {
+        if (!strcmp(header->keys[i], key)) {
+            record->values[i] = value;
+            return;
+        }
+    }
+    if (i < REPORT_LOG_COLUMNS) {
+        /* a reader takes the column count first: the name must be in place before it is counted */
+        snprintf(header->keys[i], REPORT_LOG_KEY_LEN, "%s", key);
+        __atomic_store_n(&header->columns, i + 1, __ATOMIC_RELEASE);
+        record->values[i] = value;
+    }
+}
+
+void
+report_log_append(report_log_t *log, uint64_t time, uint64_t session, const unsigned char *bplist, int len) {
+    if (!log || !log->writable || len <= 0) {
+        return;
+    }
+    bplist_t plist;
+    uint64_t top;
+    uint8_t marker;
+    size_t offset;
+    if (!bplist_init(&plist, bplist, (size_t) len, &top) || !bplist_object(&plist, top, &marker, &offset) ||
+        (marker & 0xf0) != 0xd0) {
+        return;
+    }
+
+    report_log_record_t record;
+    record.time = time;
+    record.session = session;
+    for (int i = 0; i < REPORT_LOG_COLUMNS; i++) {
+        record.values[i] = NAN;
+    }
+
+    MUTEX_LOCK(log->mutex);
+    report_log_header_t *header = log->header;
+    report_log_walk(log, &plist, top, "", 0, &record, set_value);
+    uint64_t count = header->count;
+    __atomic_store_n(&header->writing, count + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    log->records[count % header->capacity] = record;
+    __atomic_store_n(&header->count, count + 1, __ATOMIC_RELEASE);
+    MUTEX_UNLOCK(log->mutex);
+}
+
+unsigned int
+report_log_export_csv(report_log_t *log, FILE *out, uint64_t time_from, uint64_t time_to) {
+    report_log_header_t *header = log->header;
+    uint32_t columns = __atomic_load_n(&header->columns, __ATOMIC_ACQUIRE);
+    fprintf(out, "time,session");
+    for (uint32_t i = 0; i < columns; i++) {
+        fprintf(out, ",%s", header->keys[i]);
+    }
+    fprintf(out, "\n");
+
+    unsigned int written = 0;
+    uint64_t count = __atomic_load_n(&header->count, __ATOMIC_ACQUIRE);
+    uint64_t first = (count > header->capacity ? count - header->capacity : 0);
+    for (uint64_t n = first; n < count; n++) {
+        report_log_record_t record = log->records[n % header->capacity];
+        /* a writer may have reused the slot while it was copied */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&header->writing, __ATOMIC_RELAXED) > n + header->capacity) {
+            continue;
+        }
+        if (record.time < time_from || record.time >= time_to) {
+            continue;
+        }
+        fprintf(out, "%llu.%03llu,%llu.%03llu", (unsigned long long) (record.time / 1000000000),
+                (unsigned long long) (record.time % 1000000000 / 1000000),
+                (unsigned long long) (record.session / 1000000000),
+                (unsigned long long) (record.session % 1000000000 / 1000000));
+        for (uint32_t i = 0; i < columns; i++) {
+            if (isnan(record.values[i])) {
+                fprintf(out, ",");
+            } else {
+                fprintf(out, ",%.9g", (double) record.values[i]);
+            }
+        }
+        fprintf(out, "\n");
+        written++;
+    }
+    return written;
+}
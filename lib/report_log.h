@@ -0,0 +1,62 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * time series of the "streaming reports" (type 0x05 mirror packets) sent by the client once per second,
+ * stored in a memory-mapped ring file.  Each record holds the numeric fields of one report (nested dicts
+ * give "dict.key"), in up to REPORT_LOG_COLUMNS columns whose names are kept in the file header: a field
+ * takes the next free column when it first appears, in any report, and is NAN in records without it.
+ */
+
+#ifndef REPORT_LOG_H
+#define REPORT_LOG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define REPORT_LOG_COLUMNS 32
+#define REPORT_LOG_KEY_LEN 48
+#define REPORT_LOG_DEFAULT_RECORDS 36000   /* 10 hours of reports (5 MB) */
+
+typedef struct report_log_s report_log_t;
+
+typedef struct report_log_record_s {
+    uint64_t time;                        /* nsecs, local system clock (Unix time) */
+    uint64_t session;                     /* start time of the session (as in its -qoe summary), 0 if unknown */
+    float values[REPORT_LOG_COLUMNS];     /* NAN: not in this report */
+} report_log_record_t;
+
+/* opens (or creates, with room for "records" reports) the ring file for writing; NULL on failure (errno set) */
+report_log_t *report_log_open(const char *filename, unsigned int records);
+
+/* opens an existing ring file for reading (it may still be written by a running UxPlay) */
+report_log_t *report_log_open_read(const char *filename);
+
+void report_log_close(report_log_t *log);
+
+/* appends the numeric fields of a report (binary plist, without any trailer); safe to call from several threads */
+void report_log_append(report_log_t *log, uint64_t time, uint64_t session, const unsigned char *bplist, int len);
+
+/* writes the records with time_from <= time < time_to as CSV (header line with the column names first); *
+ * returns the number of records written                                                                  */
+unsigned int report_log_export_csv(report_log_t *log, FILE *out, uint64_t time_from, uint64_t time_to);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //REPORT_LOG_H
@@ -46,14 +46,21 @@
 #include <openssl/sha.h>
 #include <openssl/crypto.h>
 #include <openssl/rand.h>
+#include <pthread.h>
 #include "srp.h"
 
 static int	g_initialized = 0;
 
+/* number of idle BN_CTX kept for reuse */
+#define SRP_BN_CTX_POOL_SIZE 4
+
 typedef struct
 {
     BIGNUM     * N;
     BIGNUM     * g;
+    /* standard groups are parsed once and shared: they are never freed */
+    int          shared;
+    BN_MONT_CTX * mont;
 } NGConstant;
 
 struct NGHex
@@ -202,41 +209,122 @@ static struct NGHex global_Ng_constants[] = {
 };
 
 
-static NGConstant * new_ng( SRP_NGType ng_type, const char * n_hex, const char * g_hex )
+static NGConstant      global_ng[ SRP_NG_CUSTOM ];
+static pthread_once_t  global_ng_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t global_ng_mutex;
+
+static BN_CTX        * bn_ctx_pool[ SRP_BN_CTX_POOL_SIZE ];
+static int             bn_ctx_pool_count = 0;
+
+static void init_global_ng()
 {
-    NGConstant * ng   = (NGConstant *) malloc( sizeof(NGConstant) );
-    ng->N             = BN_new();
-    ng->g             = BN_new();
+    BN_CTX *ctx = BN_CTX_new();
+    pthread_mutex_init( &global_ng_mutex, NULL );
+    for ( int idx = 0; idx < SRP_NG_CUSTOM; idx++ )
+    {
+        NGConstant *ng = &global_ng[ idx ];
+        ng->shared = 1;
+        BN_hex2bn( &ng->N, global_Ng_constants[ idx ].n_hex );
+        BN_hex2bn( &ng->g, global_Ng_constants[ idx ].g_hex );
+        ng->mont = BN_MONT_CTX_new();
+        if ( ng->mont && ctx && !BN_MONT_CTX_set( ng->mont, ng->N, ctx ) )
+        {
+            BN_MONT_CTX_free( ng->mont );
+            ng->mont = 0;
+        }
+    }
+    BN_CTX_free( ctx );
+}
 
-    if( !ng || !ng->N || !ng->g )
-       return 0;
+static BN_CTX * get_bn_ctx()
+{
+    BN_CTX *ctx = 0;
+    pthread_once( &global_ng_once, init_global_ng );
+    pthread_mutex_lock( &global_ng_mutex );
+    if ( bn_ctx_pool_count > 0 )
+        ctx = bn_ctx_pool[ --bn_ctx_pool_count ];
+    pthread_mutex_unlock( &global_ng_mutex );
+    return ( ctx ? ctx : BN_CTX_new() );
+}
+
+static void put_bn_ctx( BN_CTX *ctx )
+{
+    if ( !ctx )
+        return;
+    pthread_mutex_lock( &global_ng_mutex );
+    if ( bn_ctx_pool_count < SRP_BN_CTX_POOL_SIZE )
+    {
+        bn_ctx_pool[ bn_ctx_pool_count++ ] = ctx;
+        ctx = 0;
+    }
+    pthread_mutex_unlock( &global_ng_mutex );
+    BN_CTX_free( ctx );
+}
 
+static NGConstant * new_ng( SRP_NGType ng_type, const char * n_hex, const char * g_hex )
+{
     if ( ng_type != SRP_NG_CUSTOM )
     {
-        int idx = ng_type;
-        if ( ng_type > SRP_NG_CUSTOM )
-           idx -= 1;
-        n_hex = global_Ng_constants[ idx ].n_hex;
-        g_hex = global_Ng_constants[ idx ].g_hex;
+        pthread_once( &global_ng_once, init_global_ng );
+        NGConstant *ng = &global_ng[ ng_type ];
+        return ( ng->N && ng->g && ng->mont ) ? ng : 0;
     }
+
+    NGConstant * ng   = (NGConstant *) calloc( 1, sizeof(NGConstant) );
+    if ( !ng )
+       return 0;
+    ng->N             = BN_new();
+    ng->g             = BN_new();
+    ng->mont          = BN_MONT_CTX_new();
+
+    if( !ng->N || !ng->g || !ng->mont )
+       goto error;
+
     BN_hex2bn( &ng->N, n_hex );
     BN_hex2bn( &ng->g, g_hex );
 
-    return ng;
+    BN_CTX *ctx = get_bn_ctx();
+    int ret = ( ctx && BN_MONT_CTX_set( ng->mont, ng->N, ctx ) );
+    put_bn_ctx( ctx );
+    if ( ret )
+       return ng;
+
+ error:
+    BN_free( ng->N );
+    BN_free( ng->g );
+    BN_MONT_CTX_free( ng->mont );
+    free( ng );
+    return 0;
 }
 
 static void delete_ng( NGConstant * ng )
 {
-   if (ng)
+   if (ng && !ng->shared)
    {
       BN_free( ng->N );
       BN_free( ng->g );
+      BN_MONT_CTX_free( ng->mont );
       ng->N = 0;
       ng->g = 0;
       free(ng);
    }
 }
 
+/* r = a^e mod N, with the cached Montgomery context (as BN_mod_exp() does, this is not constant-time) */
+static int mod_exp( BIGNUM * r, const BIGNUM * a, const BIGNUM * e, NGConstant * ng, BN_CTX * ctx )
+{
+    return BN_mod_exp_mont( r, a, e, ng->N, ctx, ng->mont );
+}
+
+/* r = g^e mod N: the generators of the standard groups fit in a word, for which BN_mod_exp() */
+/* uses the faster BN_mod_exp_mont_word()                                                    */
+static int mod_exp_g( BIGNUM * r, const BIGNUM * e, NGConstant * ng, BN_CTX * ctx )
+{
+    if ( BN_num_bytes( ng->g ) <= (int) sizeof(BN_ULONG) )
+        return BN_mod_exp_mont_word( r, BN_get_word( ng->g ), e, ng->N, ctx, ng->mont );
+    return mod_exp( r, ng->g, e, ng, ctx );
+}
+
 typedef struct HashCTX_s {
    EVP_MD_CTX *digest_ctx;
 } HashCTX_t;
@@ -614,6 +702,14 @@ void srp_random_seed( const unsigned char * random_data, int data_length )
 }
 
 
+void srp_prepare_group( SRP_NGType ng_type )
+{
+    if ( ng_type == SRP_NG_CUSTOM )
+        return;
+    new_ng( ng_type, 0, 0 );
+}
+
+
 void srp_create_salted_verification_key( SRP_HashAlgorithm alg,
                                          SRP_NGType ng_type, const char * username,
                                          const unsigned char * password, int len_password,
@@ -624,7 +720,7 @@ void srp_create_salted_verification_key( SRP_HashAlgorithm alg,
     BIGNUM     * s   = BN_new();
     BIGNUM     * v   = BN_new();
     BIGNUM     * x   = 0;
-    BN_CTX     * ctx = BN_CTX_new();
+    BN_CTX     * ctx = get_bn_ctx();
     NGConstant * ng  = new_ng( ng_type, n_hex, g_hex );
 
     if( !s || !v || !ctx || !ng )
@@ -642,7 +738,7 @@ void srp_create_salted_verification_key( SRP_HashAlgorithm alg,
     if( !x )
        goto cleanup_and_exit;
 
-    BN_mod_exp(v, ng->g, x, ng->N, ctx);
+    mod_exp_g(v, x, ng, ctx);
 
     *len_s   = BN_num_bytes(s);
     *len_v   = BN_num_bytes(v);
@@ -661,7 +757,7 @@ void srp_create_salted_verification_key( SRP_HashAlgorithm alg,
     BN_free(s);
     BN_free(v);
     BN_free(x);
-    BN_CTX_free(ctx);
+    put_bn_ctx(ctx);
 }
 #ifdef APPLE_VARIANT
 
@@ -681,7 +777,7 @@ void srp_create_server_ephemeral_key( SRP_HashAlgorithm alg, SRP_NGType ng_type,
   BIGNUM             *B    = BN_new();
   BIGNUM             *b    = BN_new();
   BIGNUM             *k    = 0;
-  BN_CTX             *ctx  = BN_CTX_new();
+  BN_CTX             *ctx  = get_bn_ctx();
   NGConstant         *ng   = new_ng( ng_type, n_hex, g_hex );
 
   *len_B   = 0;
@@ -704,13 +800,13 @@ void srp_create_server_ephemeral_key( SRP_HashAlgorithm alg, SRP_NGType ng_type,
   if (rfc5054_compat)
     {
       BN_mod_mul(tmp1, k, v, ng->N, ctx);
-      BN_mod_exp(tmp2, ng->g, b, ng->N, ctx);
+      mod_exp_g(tmp2, b, ng, ctx);
       BN_mod_add(B, tmp1, tmp2, ng->N, ctx);
     }
   else
     {
       BN_mul(tmp1, k, v, ctx);
-      BN_mod_exp(tmp2, ng->g, b, ng->N, ctx);
+      mod_exp_g(tmp2, b, ng, ctx);
       BN_add(B, tmp1, tmp2);
     }
 
@@ -725,7 +821,7 @@ void srp_create_server_ephemeral_key( SRP_HashAlgorithm alg, SRP_NGType ng_type,
    BN_free(b);
    BN_free(tmp1);
    BN_free(tmp2);
-   BN_CTX_free(ctx);
+   put_bn_ctx(ctx);
 }
 #endif
 
@@ -754,7 +850,7 @@ struct SRPVerifier *  srp_verifier_new( SRP_HashAlgorithm alg, SRP_NGType ng_typ
     BIGNUM             *k    = 0;
     BIGNUM             *tmp1 = BN_new();
     BIGNUM             *tmp2 = BN_new();
-    BN_CTX             *ctx  = BN_CTX_new();
+    BN_CTX             *ctx  = get_bn_ctx();
     int                 ulen = strlen(username) + 1;
     NGConstant         *ng   = new_ng( ng_type, n_hex, g_hex );
     struct SRPVerifier *ver  = 0;
@@ -818,13 +914,13 @@ struct SRPVerifier *  srp_verifier_new( SRP_HashAlgorithm alg, SRP_NGType ng_typ
        if (rfc5054_compat)
        {
           BN_mod_mul(tmp1, k, v, ng->N, ctx);
-          BN_mod_exp(tmp2, ng->g, b, ng->N, ctx);
+          mod_exp_g(tmp2, b, ng, ctx);
           BN_mod_add(B, tmp1, tmp2, ng->N, ctx);
        }
        else
        {
           BN_mul(tmp1, k, v, ctx);
-          BN_mod_exp(tmp2, ng->g, b, ng->N, ctx);
+          mod_exp_g(tmp2, b, ng, ctx);
           BN_add(B, tmp1, tmp2);
        }
 
@@ -841,9 +937,9 @@ struct SRPVerifier *  srp_verifier_new( SRP_HashAlgorithm alg, SRP_NGType ng_typ
        }
 
        /* S = (A *(v^u)) ^ b */
-       BN_mod_exp(tmp1, v, u, ng->N, ctx);
+       mod_exp(tmp1, v, u, ng, ctx);
        BN_mul(tmp2, A, tmp1, ctx);
-       BN_mod_exp(S, tmp2, b, ng->N, ctx);
+       mod_exp(S, tmp2, b, ng, ctx);
 
 #ifdef APPLE_VARIANT
        hash_session_key(alg, S, ver->session_key);
@@ -884,7 +980,7 @@ struct SRPVerifier *  srp_verifier_new( SRP_HashAlgorithm alg, SRP_NGType ng_typ
     BN_free(b);
     BN_free(tmp1);
     BN_free(tmp2);
-    BN_CTX_free(ctx);
+    put_bn_ctx(ctx);
 
     return ver;
 }
@@ -1056,10 +1152,10 @@ int srp_user_get_session_key_length( struct SRPUser * usr )
 void  srp_user_start_authentication( struct SRPUser * usr, const char ** username, 
                                      const unsigned char ** bytes_A, int * len_A )
 {
-    BN_CTX  *ctx  = BN_CTX_new();
+    BN_CTX  *ctx  = get_bn_ctx();
     BN_rand(usr->a, 256, -1, 0);
-    BN_mod_exp(usr->A, usr->ng->g, usr->a, usr->ng->N, ctx);
-    BN_CTX_free(ctx);
+    mod_exp_g(usr->A, usr->a, usr->ng, ctx);
+    put_bn_ctx(ctx);
 
     *len_A   = BN_num_bytes(usr->A);
     *bytes_A = (const unsigned char *)malloc( *len_A );
@@ -1092,7 +1188,7 @@ void  srp_user_process_challenge( struct SRPUser * usr,
     BIGNUM *tmp1 = BN_new();
     BIGNUM *tmp2 = BN_new();
     BIGNUM *tmp3 = BN_new();
-    BN_CTX *ctx  = BN_CTX_new();
+    BN_CTX *ctx  = get_bn_ctx();
 
     *len_M = 0;
     *bytes_M = 0;
@@ -1124,15 +1220,15 @@ void  srp_user_process_challenge( struct SRPUser * usr,
     /* SRP-6a safety check */
     if ( !BN_is_zero(B) && !BN_is_zero(u) )
     {
-        BN_mod_exp(v, usr->ng->g, x, usr->ng->N, ctx);
+        mod_exp_g(v, x, usr->ng, ctx);
 
         /* S = (B - k*(g^x)) ^ (a + ux) */
         BN_mul(tmp1, u, x, ctx);
         BN_add(tmp2, usr->a, tmp1);             /* tmp2 = (a + ux)      */
-        BN_mod_exp(tmp1, usr->ng->g, x, usr->ng->N, ctx);
+        mod_exp_g(tmp1, x, usr->ng, ctx);
         BN_mul(tmp3, k, tmp1, ctx);             /* tmp3 = k*(g^x)       */
         BN_sub(tmp1, B, tmp3);                  /* tmp1 = (B - K*(g^x)) */
-        BN_mod_exp(usr->S, tmp1, tmp2, usr->ng->N, ctx);
+        mod_exp(usr->S, tmp1, tmp2, usr->ng, ctx);
 
 #ifdef APPLE_VARIANT    
         hash_session_key(usr->hash_alg, usr->S, usr->session_key);
@@ -1162,7 +1258,7 @@ void  srp_user_process_challenge( struct SRPUser * usr,
     BN_free(tmp1);
     BN_free(tmp2);
     BN_free(tmp3);
-    BN_CTX_free(ctx);
+    put_bn_ctx(ctx);
 }
 
 void srp_user_verify_session( struct SRPUser * usr, const unsigned char * bytes_HAMK )
@@ -109,6 +109,13 @@ typedef enum
 void srp_random_seed( const unsigned char * random_data, int data_length );
 
 
+/* The standard groups are parsed (with a Montgomery context for N) once, on first use.
+ * This optional function does that for group ng_type in advance, so that this cost is
+ * not paid during the first authentication.
+ */
+void srp_prepare_group( SRP_NGType ng_type );
+
+
 /* Out: bytes_s, len_s, bytes_v, len_v
  * 
  * The caller is responsible for freeing the memory allocated for bytes_s and bytes_v
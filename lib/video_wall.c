@@ -0,0 +1,1175 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Protocol (all integers big-endian):
+ *
+ * TCP messages: 1 byte type, 3 zero bytes, uint32 payload length, payload.
+ *   CHALLENGE (ingest -> display): 16 random bytes (the ingest nonce), sent when the display node connects
+ *   HELLO  (display -> ingest): 16 random bytes (the display nonce), HMAC-SHA256 of ("hello", both nonces,
+ *          tile label) keyed with the shared secret, tile label
+ *   WELCOME (ingest -> display): HMAC-SHA256 of ("welcome", both nonces, tile label) keyed with the shared secret
+ *   FRAME  (ingest -> display): AES-128-GCM encrypted (uint32 seq, uint32 nal_count, uint64 pts (ingest clock),
+ *          Annex-B access unit), 16 byte GCM tag
+ *   REPORT (display -> ingest): uint32 seq, int64 lateness, uint64 clock sync error (nsecs)
+ *
+ * Each side proves it knows the shared secret (HELLO, WELCOME) before the other side trusts it.  The FRAME
+ * key of a connection is HMAC-SHA256 of ("frame", both nonces) keyed with the shared secret: bytes 0-15 are
+ * the AES key, and bytes 16-23, followed by the number of frames sent before on the connection (uint64),
+ * are the IV of a frame.  A replayed, reordered or altered frame fails the GCM tag check, and the display
+ * node drops the connection.
+ *
+ * UDP clock sync on the same port number (display -> ingest -> display):
+ *   "UXWT", 4 zero bytes, uint64 t1 (display clock); the ingest node appends uint64 t2 (receive)
+ *   and uint64 t3 (send) in its clock.  As in raop_ntp, the sample with the smallest round-trip
+ *   delay among the last WALL_SYNC_SAMPLES gives the offset between the two clocks.
+ *
+ * The ingest node sends no frames, and answers no clock-sync requests, until a display node on that host
+ * has answered its challenge with the shared secret: the frames are decrypted mirror video.  The display node
+ * takes no frames from an ingest node that cannot answer its nonce.
+ *
+ * Both clocks are the system clock (CLOCK_REALTIME) used by the GStreamer pipelines, so the ingest
+ * node's pts (the AirPlay client's timestamp mapped by raop_ntp) can be presented on every display.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#ifdef _WIN32
+#define CAST (char *)
+#else
+#define CAST
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#endif
+
+#include "video_wall.h"
+#include "compat.h"
+#include "netutils.h"
+#include "byteutils.h"
+#include "raop_clock.h"
+#include "crypto.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define SECOND_IN_NSECS 1000000000UL
+#define WALL_MAX_NODES 16
+#define WALL_HEADER_LEN 8
+#define WALL_FRAME_HEADER_LEN (WALL_HEADER_LEN + 16)
+#define WALL_TAG_LEN 16                           /* GCM tag at the end of a FRAME */
+#define WALL_REPORT_LEN (WALL_HEADER_LEN + 20)
+#define WALL_MAX_TILE_LEN 32
+#define WALL_MAX_CONTROL_LEN (WALL_CHALLENGE_LEN + HMAC_SHA256_SIZE + WALL_MAX_TILE_LEN)   /* HELLO, the largest *
+                                                                                          * display -> ingest message */
+#define WALL_MAX_FRAME_LEN (16 * 1024 * 1024)
+#define WALL_NODE_BACKLOG (32 * 1024 * 1024)      /* unsent data queued for one display node */
+#define WALL_GOP_CACHE (16 * 1024 * 1024)         /* frames since the last IDR, sent to nodes that join late */
+#define WALL_SYNC_MAGIC "UXWT"
+#define WALL_SYNC_REQUEST_LEN 16
+#define WALL_SYNC_RESPONSE_LEN 32
+#define WALL_SYNC_SAMPLES 8
+#define WALL_SYNC_INTERVAL (SECOND_IN_NSECS / 2)
+#define WALL_SKEW_SLOTS 256
+#define WALL_PTS_RING 128
+#define WALL_STATS_INTERVAL (5 * SECOND_IN_NSECS)
+#define WALL_RECONNECT_INTERVAL (2 * SECOND_IN_NSECS)
+#define WALL_CHALLENGE_LEN 16
+#define WALL_HELLO_TIMEOUT (5 * SECOND_IN_NSECS)   /* to answer the challenge */
+
+typedef enum wall_message_e { WALL_HELLO = 1, WALL_FRAME, WALL_REPORT, WALL_CHALLENGE, WALL_WELCOME } wall_message_t;
+
+typedef struct wall_buffer_s {
+    unsigned char *data;
+    size_t start;
+    size_t len;
+    size_t size;
+} wall_buffer_t;
+
+/* FRAME encryption of one connection */
+typedef struct wall_cipher_s {
+    unsigned char key[16];
+    unsigned char salt[8];
+    uint64_t count;           /* frames encrypted (or decrypted) on the connection */
+} wall_cipher_t;
+
+typedef struct video_wall_node_s {
+    int fd;
+    struct sockaddr_storage addr;
+    unsigned char challenge[WALL_CHALLENGE_LEN];
+    wall_cipher_t cipher;
+    uint64_t connect_time;
+    bool ready;               /* HELLO received with the right key: frames are sent */
+    bool wait_idr;
+    bool failed;
+    char tile[WALL_MAX_CONTROL_LEN + 1];
+    wall_buffer_t in;
+    wall_buffer_t out;
+    /* statistics since the last report */
+    unsigned int frames;
+    unsigned int skipped;
+    int64_t lateness_sum;
+    int64_t lateness_max;
+    uint64_t sync_error;
+} video_wall_node_t;
+
+typedef struct wall_skew_slot_s {
+    uint32_t seq;
+    int expected;
+    int count;
+    int64_t min;
+    int64_t max;
+} wall_skew_slot_t;
+
+typedef struct wall_sync_sample_s {
+    int64_t offset;
+    int64_t delay;
+} wall_sync_sample_t;
+
+typedef struct wall_pts_s {
+    uint64_t pts;
+    uint32_t seq;
+} wall_pts_t;
+
+struct video_wall_s {
+    logger_t *logger;
+    bool ingest;
+    unsigned char *key;
+    int key_len;
+
+    thread_handle_t thread;
+    mutex_handle_t mutex;
+    cond_handle_t cond;
+    bool running;
+
+    /* ingest node */
+    int listen_fd;
+    int sync_fd;
+    video_wall_node_t *nodes[WALL_MAX_NODES];
+    uint32_t seq;
+    wall_buffer_t frame;      /* the FRAME being sent, before encryption */
+    wall_buffer_t gop;
+    bool gop_valid;
+    wall_skew_slot_t skew[WALL_SKEW_SLOTS];
+    unsigned int skew_frames;
+    int64_t skew_sum;
+    int64_t skew_max;
+
+    /* display node */
+    char *host;
+    unsigned short port;
+    char *tile;
+    video_wall_callbacks_t callbacks;
+    int fd;
+    mutex_handle_t send_mutex;
+    wall_buffer_t in;
+    wall_cipher_t cipher;
+    uint64_t start_time;
+    wall_sync_sample_t samples[WALL_SYNC_SAMPLES];
+    int sample_count;
+    int sample_index;
+    int64_t offset;           /* ingest clock - display clock */
+    uint64_t sync_error;
+    wall_pts_t pts_ring[WALL_PTS_RING];
+    int pts_index;
+};
+
+static uint64_t wall_time() {
+    return raop_clock_get_time(NULL);
+}
+
+static void put_be32(unsigned char *b, uint32_t value) {
+    b[0] = (unsigned char) (value >> 24);
+    b[1] = (unsigned char) (value >> 16);
+    b[2] = (unsigned char) (value >> 8);
+    b[3] = (unsigned char) value;
+}
+
+static void put_be64(unsigned char *b, uint64_t value) {
+    put_be32(b, (uint32_t) (value >> 32));
+    put_be32(b + 4, (uint32_t) value);
+}
+
+static void put_header(unsigned char *b, wall_message_t type, uint32_t len) {
+    b[0] = (unsigned char) type;
+    b[1] = b[2] = b[3] = 0;
+    put_be32(b + 4, len);
+}
+
+static int set_nonblocking(int fd) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(fd, FIONBIO, &mode);
+#else
+    int flags = fcntl(fd, F_GETFL, 0);
+    return (flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+#endif
+}
+
+static void set_nodelay(int fd) {
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, CAST &nodelay, sizeof(nodelay));
+}
+
+/* make room for "extra" more bytes, without letting the buffer hold more than max bytes */
+static bool wall_buffer_reserve(wall_buffer_t *buf, size_t extra, size_t max) {
+    if (buf->len + extra > max) {
+        return false;
+    }
+    if (buf->start + buf->len + extra <= buf->size) {
+        return true;
+    }
+    if (buf->start) {
+        memmove(buf->data, buf->data + buf->start, buf->len);
+        buf->start = 0;
+        if (buf->len + extra <= buf->size) {
+            return true;
+        }
+    }
+    size_t size = (buf->size ? 2 * buf->size : 65536);
+    while (size < buf->len + extra) {
+        size *= 2;
+    }
+    unsigned char *data = realloc(buf->data, size);
+    if (!data) {
+        return false;
+    }
+    buf->data = data;
+    buf->size = size;
+    return true;
+}
+
+static void wall_buffer_append(wall_buffer_t *buf, const unsigned char *data, size_t len) {
+    memcpy(buf->data + buf->start + buf->len, data, len);
+    buf->len += len;
+}
+
+static void wall_buffer_consume(wall_buffer_t *buf, size_t len) {
+    buf->start += len;
+    buf->len -= len;
+    if (!buf->len) {
+        buf->start = 0;
+    }
+}
+
+static void wall_buffer_free(wall_buffer_t *buf) {
+    free(buf->data);
+    memset(buf, 0, sizeof(wall_buffer_t));
+}
+
+static bool socket_would_block() {
+    int err = SOCKET_GET_ERROR();
+    return (err == SOCKET_ERRORNAME(EAGAIN) || err == SOCKET_ERRORNAME(EWOULDBLOCK) || err == SOCKET_ERRORNAME(EINTR));
+}
+
+/* read what is available from fd into buf: returns false if the connection was closed or failed */
+static bool wall_buffer_recv(wall_buffer_t *buf, int fd, size_t max) {
+    if (!wall_buffer_reserve(buf, 65536, max + 65536)) {
+        return false;
+    }
+    int n = recv(fd, CAST (buf->data + buf->start + buf->len), 65536, 0);
+    if (n > 0) {
+        buf->len += n;
+        return true;
+    }
+    return (n < 0 && socket_would_block());
+}
+
+/* the next complete message in buf, or NULL */
+static unsigned char *wall_buffer_message(wall_buffer_t *buf, wall_message_t *type, uint32_t *len) {
+    if (buf->len < WALL_HEADER_LEN) {
+        return NULL;
+    }
+    unsigned char *header = buf->data + buf->start;
+    *type = (wall_message_t) header[0];
+    *len = byteutils_get_int_be(header, 4);
+    if (buf->len < WALL_HEADER_LEN + (size_t) *len) {
+        return NULL;
+    }
+    return header + WALL_HEADER_LEN;
+}
+
+/* an IDR frame (with its SPS and PPS) can start decoding: look for NAL unit type 5 */
+static bool wall_frame_is_idr(const unsigned char *data, int len, int nal_count) {
+    for (int i = 0; i + 4 < len && nal_count > 0; i++) {
+        if (data[i] == 0x00 && data[i + 1] == 0x00 && data[i + 2] == 0x00 && data[i + 3] == 0x01) {
+            if ((data[i + 4] & 0x1f) == 5) {
+                return true;
+            }
+            nal_count--;
+            i += 3;
+        }
+    }
+    return false;
+}
+
+/* HMAC-SHA256 of (label, both nonces, tile label) keyed with the shared secret */
+static void wall_mac(video_wall_t *wall, unsigned char mac[HMAC_SHA256_SIZE], const char *label,
+                     const unsigned char ingest_nonce[WALL_CHALLENGE_LEN],
+                     const unsigned char display_nonce[WALL_CHALLENGE_LEN], const char *tile, uint32_t tile_len) {
+    unsigned char data[8 + 2 * WALL_CHALLENGE_LEN + WALL_MAX_TILE_LEN];
+    size_t label_len = strlen(label);
+    assert(label_len <= 8 && tile_len <= WALL_MAX_TILE_LEN);
+    memcpy(data, label, label_len);
+    memcpy(data + label_len, ingest_nonce, WALL_CHALLENGE_LEN);
+    memcpy(data + label_len + WALL_CHALLENGE_LEN, display_nonce, WALL_CHALLENGE_LEN);
+    memcpy(data + label_len + 2 * WALL_CHALLENGE_LEN, tile, tile_len);
+    hmac_sha256(mac, wall->key, wall->key_len, data, (int) (label_len + 2 * WALL_CHALLENGE_LEN + tile_len));
+}
+
+static void wall_cipher_init(video_wall_t *wall, wall_cipher_t *cipher, const unsigned char *ingest_nonce,
+                             const unsigned char *display_nonce) {
+    unsigned char secret[HMAC_SHA256_SIZE];
+    wall_mac(wall, secret, "frame", ingest_nonce, display_nonce, "", 0);
+    memcpy(cipher->key, secret, sizeof(cipher->key));
+    memcpy(cipher->salt, secret + sizeof(cipher->key), sizeof(cipher->salt));
+    cipher->count = 0;
+}
+
+/* the IV of the next frame: never reused with the key of the connection */
+static void wall_cipher_next_iv(wall_cipher_t *cipher, unsigned char iv[16]) {
+    memcpy(iv, cipher->salt, sizeof(cipher->salt));
+    put_be64(iv + 8, cipher->count++);
+}
+
+/*--------------------------------------------- ingest node ---------------------------------------------*/
+
+/* write as much queued data as the socket accepts: returns false if the connection failed */
+static bool wall_node_flush(video_wall_node_t *node) {
+    while (node->out.len) {
+        int n = send(node->fd, CAST (node->out.data + node->out.start), node->out.len, MSG_NOSIGNAL);
+        if (n > 0) {
+            wall_buffer_consume(&node->out, n);
+        } else {
+            return (n < 0 && socket_would_block());
+        }
+    }
+    return true;
+}
+
+static void wall_node_close(video_wall_t *wall, int i) {
+    video_wall_node_t *node = wall->nodes[i];
+    logger_log(wall->logger, LOGGER_INFO, "video wall: display node %s disconnected",
+               (node->ready ? node->tile : "(no tile)"));
+    closesocket(node->fd);
+    wall_buffer_free(&node->in);
+    wall_buffer_free(&node->out);
+    free(node);
+    wall->nodes[i] = NULL;
+}
+
+static void wall_ingest_accept(video_wall_t *wall) {
+    struct sockaddr_storage saddr;
+    socklen_t saddrlen = sizeof(saddr);
+    int fd = accept(wall->listen_fd, (struct sockaddr *) &saddr, &saddrlen);
+    if (fd < 0) {
+        return;
+    }
+    for (int i = 0; i < WALL_MAX_NODES; i++) {
+        if (!wall->nodes[i]) {
+            video_wall_node_t *node = calloc(1, sizeof(video_wall_node_t));
+            if (!node || set_nonblocking(fd) < 0) {
+                free(node);
+                break;
+            }
+            set_nodelay(fd);
+            node->fd = fd;
+            memcpy(&node->addr, &saddr, sizeof(saddr));
+            node->connect_time = wall_time();
+            node->wait_idr = true;
+            wall->nodes[i] = node;
+
+            /* nothing else is sent until the display node answers with the shared secret */
+            unsigned char challenge[WALL_HEADER_LEN + WALL_CHALLENGE_LEN];
+            get_random_bytes(node->challenge, WALL_CHALLENGE_LEN);
+            put_header(challenge, WALL_CHALLENGE, WALL_CHALLENGE_LEN);
+            memcpy(challenge + WALL_HEADER_LEN, node->challenge, WALL_CHALLENGE_LEN);
+            wall_buffer_reserve(&node->out, sizeof(challenge), WALL_NODE_BACKLOG);
+            wall_buffer_append(&node->out, challenge, sizeof(challenge));
+            node->failed = !wall_node_flush(node);
+            return;
+        }
+    }
+    logger_log(wall->logger, LOGGER_ERR, "video wall: refused display node connection (limit is %d nodes)",
+               WALL_MAX_NODES);
+    closesocket(fd);
+}
+
+static bool wall_same_host(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+    if (a->ss_family != b->ss_family) {
+        return false;
+    }
+    if (a->ss_family == AF_INET) {
+        return !memcmp(&((const struct sockaddr_in *) a)->sin_addr, &((const struct sockaddr_in *) b)->sin_addr,
+                       sizeof(struct in_addr));
+    }
+    if (a->ss_family == AF_INET6) {
+        return !memcmp(&((const struct sockaddr_in6 *) a)->sin6_addr, &((const struct sockaddr_in6 *) b)->sin6_addr,
+                       sizeof(struct in6_addr));
+    }
+    return false;
+}
+
+/* clock-sync requests are only answered for hosts with a display node that knows the shared secret */
+static bool wall_host_is_ready(video_wall_t *wall, const struct sockaddr_storage *saddr) {
+    bool ready = false;
+    MUTEX_LOCK(wall->mutex);
+    for (int i = 0; i < WALL_MAX_NODES && !ready; i++) {
+        video_wall_node_t *node = wall->nodes[i];
+        ready = (node && node->ready && !node->failed && wall_same_host(&node->addr, saddr));
+    }
+    MUTEX_UNLOCK(wall->mutex);
+    return ready;
+}
+
+static void wall_ingest_answer_sync(video_wall_t *wall) {
+    unsigned char packet[WALL_SYNC_RESPONSE_LEN];
+    struct sockaddr_storage saddr;
+    socklen_t saddrlen = sizeof(saddr);
+    int len = recvfrom(wall->sync_fd, CAST packet, sizeof(packet), 0, (struct sockaddr *) &saddr, &saddrlen);
+    uint64_t t2 = wall_time();
+    if (len != WALL_SYNC_REQUEST_LEN || memcmp(packet, WALL_SYNC_MAGIC, 4) || !wall_host_is_ready(wall, &saddr)) {
+        return;
+    }
+    put_be64(packet + 16, t2);
+    put_be64(packet + 24, wall_time());
+    sendto(wall->sync_fd, CAST packet, sizeof(packet), 0, (struct sockaddr *) &saddr, saddrlen);
+}
+
+static void wall_ingest_report(video_wall_t *wall, video_wall_node_t *node, const unsigned char *payload) {
+    uint32_t seq = byteutils_get_int_be((unsigned char *) payload, 0);
+    int64_t lateness = (int64_t) byteutils_get_long_be((unsigned char *) payload, 4);
+    node->sync_error = byteutils_get_long_be((unsigned char *) payload, 12);
+    node->frames++;
+    node->lateness_sum += lateness;
+    if (node->frames == 1 || lateness > node->lateness_max) {
+        node->lateness_max = lateness;
+    }
+
+    /* all nodes present the frame at pts, or at once if it reached the videosink late */
+    wall_skew_slot_t *slot = &wall->skew[seq % WALL_SKEW_SLOTS];
+    if (slot->seq != seq || !slot->expected) {
+        return;
+    }
+    int64_t presented = (lateness > 0 ? lateness : 0);
+    if (!slot->count || presented < slot->min) slot->min = presented;
+    if (!slot->count || presented > slot->max) slot->max = presented;
+    if (++slot->count == slot->expected) {
+        int64_t skew = slot->max - slot->min;
+        wall->skew_frames++;
+        wall->skew_sum += skew;
+        if (skew > wall->skew_max) {
+            wall->skew_max = skew;
+        }
+        slot->expected = 0;
+    }
+}
+
+/* queue a FRAME (its plaintext payload) for a display node, encrypted with the key of the connection: *
+ * returns false if the display node's backlog has no room for it                                    */
+static bool wall_node_queue_frame(video_wall_node_t *node, const unsigned char *payload, uint32_t len) {
+    unsigned char iv[16];
+    if (!wall_buffer_reserve(&node->out, WALL_HEADER_LEN + len + WALL_TAG_LEN, WALL_NODE_BACKLOG)) {
+        return false;
+    }
+    unsigned char *message = node->out.data + node->out.start + node->out.len;
+    put_header(message, WALL_FRAME, len + WALL_TAG_LEN);
+    wall_cipher_next_iv(&node->cipher, iv);
+    gcm_encrypt(payload, (int) len, message + WALL_HEADER_LEN, node->cipher.key, iv, message + WALL_HEADER_LEN + len);
+    node->out.len += WALL_HEADER_LEN + len + WALL_TAG_LEN;
+    return true;
+}
+
+/* the display node knows the shared secret: answer its nonce, and start it with the frames since the *
+ * last IDR frame, if cached.  Returns false if the display node did not prove it has the key         */
+static bool wall_ingest_hello(video_wall_t *wall, video_wall_node_t *node, const unsigned char *payload, uint32_t len) {
+    unsigned char mac[HMAC_SHA256_SIZE];
+    unsigned char welcome[WALL_HEADER_LEN + HMAC_SHA256_SIZE];
+    char host[64] = { 0 };
+    if (len <= WALL_CHALLENGE_LEN + HMAC_SHA256_SIZE) {
+        return false;
+    }
+    const unsigned char *nonce = payload;
+    const char *tile = (const char *) payload + WALL_CHALLENGE_LEN + HMAC_SHA256_SIZE;
+    len -= WALL_CHALLENGE_LEN + HMAC_SHA256_SIZE;
+    wall_mac(wall, mac, "hello", node->challenge, nonce, tile, len);
+    if (crypto_memcmp(mac, payload + WALL_CHALLENGE_LEN, HMAC_SHA256_SIZE)) {
+        getnameinfo((struct sockaddr *) &node->addr, sizeof(node->addr), host, sizeof(host), NULL, 0, NI_NUMERICHOST);
+        logger_log(wall->logger, LOGGER_WARNING, "video wall: refused display node at %s: wrong key (-wallkey)", host);
+        return false;
+    }
+    memcpy(node->tile, tile, len);
+    node->tile[len] = '\0';
+    node->ready = true;
+    put_header(welcome, WALL_WELCOME, HMAC_SHA256_SIZE);
+    wall_mac(wall, welcome + WALL_HEADER_LEN, "welcome", node->challenge, nonce, tile, len);
+    wall_buffer_reserve(&node->out, sizeof(welcome), WALL_NODE_BACKLOG);
+    wall_buffer_append(&node->out, welcome, sizeof(welcome));
+    wall_cipher_init(wall, &node->cipher, node->challenge, nonce);
+
+    if (wall->gop_valid && wall->gop.len) {
+        /* the cached frames are kept unencrypted, as each connection has its own key */
+        size_t offset = 0;
+        while (offset < wall->gop.len) {
+            unsigned char *message = wall->gop.data + wall->gop.start + offset;
+            uint32_t frame_len = byteutils_get_int_be(message, 4);
+            if (!wall_node_queue_frame(node, message + WALL_HEADER_LEN, frame_len)) {
+                break;
+            }
+            offset += WALL_HEADER_LEN + frame_len;
+        }
+        node->wait_idr = (offset < wall->gop.len);
+    }
+    logger_log(wall->logger, LOGGER_INFO, "video wall: display node %s joined%s", node->tile,
+               (node->wait_idr ? ", waiting for the next IDR frame" : ""));
+    return true;
+}
+
+/* handle messages from a display node: returns false on a protocol error */
+static bool wall_ingest_read(video_wall_t *wall, video_wall_node_t *node) {
+    wall_message_t type;
+    uint32_t len;
+    unsigned char *payload;
+    while ((payload = wall_buffer_message(&node->in, &type, &len))) {
+        if (len > WALL_MAX_CONTROL_LEN) {
+            return false;
+        }
+        if (type == WALL_HELLO && !node->ready) {
+            if (!wall_ingest_hello(wall, node, payload, len)) {
+                return false;
+            }
+        } else if (!node->ready) {
+            return false;
+        } else if (type == WALL_REPORT && len == WALL_REPORT_LEN - WALL_HEADER_LEN) {
+            wall_ingest_report(wall, node, payload);
+        }
+        wall_buffer_consume(&node->in, WALL_HEADER_LEN + len);
+    }
+    return (node->in.len <= WALL_HEADER_LEN + WALL_MAX_CONTROL_LEN);
+}
+
+static void wall_ingest_log_stats(video_wall_t *wall) {
+    int count = 0;
+    uint64_t sync_error = 0;
+    for (int i = 0; i < WALL_MAX_NODES; i++) {
+        video_wall_node_t *node = wall->nodes[i];
+        if (!node || !node->ready) {
+            continue;
+        }
+        count++;
+        if (node->sync_error > sync_error) {
+            sync_error = node->sync_error;
+        }
+        if (node->frames) {
+            logger_log(wall->logger, LOGGER_DEBUG, "video wall: node %s presented %u frames, lateness mean %.2f ms, "
+                       "max %.2f ms, clock sync +/- %.2f ms, %u frames skipped", node->tile, node->frames,
+                       (double) node->lateness_sum / node->frames / 1e6, (double) node->lateness_max / 1e6,
+                       (double) node->sync_error / 1e6, node->skipped);
+        }
+        node->frames = 0;
+        node->skipped = 0;
+        node->lateness_sum = 0;
+        node->lateness_max = 0;
+    }
+    if (wall->skew_frames) {
+        logger_log(wall->logger, LOGGER_INFO, "video wall: %d display nodes, inter-node skew mean %.2f ms, max %.2f ms "
+                   "over %u frames (clock sync +/- %.2f ms)", count, (double) wall->skew_sum / wall->skew_frames / 1e6,
+                   (double) wall->skew_max / 1e6, wall->skew_frames, (double) sync_error / 1e6);
+    }
+    wall->skew_frames = 0;
+    wall->skew_sum = 0;
+    wall->skew_max = 0;
+}
+
+static THREAD_RETVAL video_wall_ingest_thread(void *arg) {
+    video_wall_t *wall = (video_wall_t *) arg;
+    uint64_t stats_time = wall_time();
+    while (1) {
+        fd_set rfds, wfds;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_SET(wall->listen_fd, &rfds);
+        FD_SET(wall->sync_fd, &rfds);
+        int nfds = (wall->listen_fd > wall->sync_fd ? wall->listen_fd : wall->sync_fd) + 1;
+        MUTEX_LOCK(wall->mutex);
+        if (!wall->running) {
+            MUTEX_UNLOCK(wall->mutex);
+            break;
+        }
+        for (int i = 0; i < WALL_MAX_NODES; i++) {
+            video_wall_node_t *node = wall->nodes[i];
+            if (node && !node->ready && wall_time() - node->connect_time > WALL_HELLO_TIMEOUT) {
+                node->failed = true;
+            }
+            if (node && node->failed) {
+                wall_node_close(wall, i);
+            } else if (node) {
+                FD_SET(node->fd, &rfds);
+                if (node->out.len) {
+                    FD_SET(node->fd, &wfds);
+                }
+                if (node->fd >= nfds) {
+                    nfds = node->fd + 1;
+                }
+            }
+        }
+        MUTEX_UNLOCK(wall->mutex);
+
+        /* frames are normally sent by video_wall_ingest_send: this only drains backlogs */
+        struct timeval tv = { 0, 20000 };
+        int ret = select(nfds, &rfds, &wfds, NULL, &tv);
+        if (ret < 0) {
+            if (socket_would_block()) {
+                continue;
+            }
+            logger_log(wall->logger, LOGGER_ERR, "video wall: select error %d", SOCKET_GET_ERROR());
+            break;
+        }
+        if (FD_ISSET(wall->sync_fd, &rfds)) {
+            wall_ingest_answer_sync(wall);
+        }
+        MUTEX_LOCK(wall->mutex);
+        if (FD_ISSET(wall->listen_fd, &rfds)) {
+            wall_ingest_accept(wall);
+        }
+        for (int i = 0; i < WALL_MAX_NODES; i++) {
+            video_wall_node_t *node = wall->nodes[i];
+            if (!node || node->failed || (!FD_ISSET(node->fd, &rfds) && !FD_ISSET(node->fd, &wfds))) {
+                continue;
+            }
+            if (FD_ISSET(node->fd, &rfds)) {
+                node->failed = !wall_buffer_recv(&node->in, node->fd, WALL_HEADER_LEN + WALL_MAX_CONTROL_LEN) ||
+                               !wall_ingest_read(wall, node);
+            }
+            if (!node->failed && FD_ISSET(node->fd, &wfds)) {
+                node->failed = !wall_node_flush(node);
+            }
+        }
+        uint64_t now = wall_time();
+        if (now - stats_time >= WALL_STATS_INTERVAL) {
+            wall_ingest_log_stats(wall);
+            stats_time = now;
+        }
+        MUTEX_UNLOCK(wall->mutex);
+    }
+    return 0;
+}
+
+/* a socket bound to port on address (a numeric IPv4 or IPv6 address), or on all IPv4 interfaces */
+static int wall_bind_socket(const char *address, unsigned short port, int use_udp) {
+    struct addrinfo hints, *result;
+    char service[8];
+    int fd = -1;
+#ifndef _WIN32
+    int reuseaddr = 1;
+#else
+    const char reuseaddr = 1;
+#endif
+    snprintf(service, sizeof(service), "%u", port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = (address ? AF_UNSPEC : AF_INET);
+    hints.ai_socktype = (use_udp ? SOCK_DGRAM : SOCK_STREAM);
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+    if (getaddrinfo(address, service, &hints, &result)) {
+        return -1;
+    }
+    fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (fd >= 0 && (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof(reuseaddr)) < 0 ||
+                    bind(fd, result->ai_addr, result->ai_addrlen) < 0)) {
+        closesocket(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+video_wall_t *video_wall_ingest_init(logger_t *logger, const char *address, unsigned short port, const char *key) {
+    assert(key && *key);
+    video_wall_t *wall = calloc(1, sizeof(video_wall_t));
+    if (!wall) {
+        return NULL;
+    }
+    wall->logger = logger;
+    wall->ingest = true;
+    wall->fd = -1;
+    wall->listen_fd = wall_bind_socket(address, port, 0);
+    wall->sync_fd = wall_bind_socket(address, port, 1);
+    if (wall->listen_fd < 0 || wall->sync_fd < 0 || listen(wall->listen_fd, WALL_MAX_NODES) < 0 ||
+        set_nonblocking(wall->listen_fd) < 0) {
+        logger_log(logger, LOGGER_ERR, "video wall: could not open TCP and UDP port %u on %s", port,
+                   (address ? address : "all interfaces"));
+        if (wall->listen_fd >= 0) closesocket(wall->listen_fd);
+        if (wall->sync_fd >= 0) closesocket(wall->sync_fd);
+        free(wall);
+        return NULL;
+    }
+    wall->key = (unsigned char *) strdup(key);
+    wall->key_len = (int) strlen(key);
+    MUTEX_CREATE(wall->mutex);
+    COND_CREATE(wall->cond);
+    MUTEX_CREATE(wall->send_mutex);
+    wall->running = true;
+    THREAD_CREATE(wall->thread, video_wall_ingest_thread, wall);
+    logger_log(logger, LOGGER_INFO, "video wall: ingest node, display nodes connect to %s port %u",
+               (address ? address : "any interface"), port);
+    return wall;
+}
+
+void video_wall_ingest_send(video_wall_t *wall, const unsigned char *data, int data_len, int nal_count, uint64_t pts) {
+    unsigned char header[WALL_FRAME_HEADER_LEN];
+    bool idr = wall_frame_is_idr(data, data_len, nal_count);
+    size_t len = WALL_FRAME_HEADER_LEN + data_len;
+    if (data_len <= 0 || data_len > WALL_MAX_FRAME_LEN) {
+        return;
+    }
+
+    MUTEX_LOCK(wall->mutex);
+    uint32_t seq = wall->seq++;
+    put_header(header, WALL_FRAME, (uint32_t) (len - WALL_HEADER_LEN));
+    put_be32(header + 8, seq);
+    put_be32(header + 12, (uint32_t) nal_count);
+    put_be64(header + 16, pts);
+    wall->frame.start = 0;
+    wall->frame.len = 0;
+    if (!wall_buffer_reserve(&wall->frame, len, len)) {
+        MUTEX_UNLOCK(wall->mutex);
+        return;
+    }
+    wall_buffer_append(&wall->frame, header, WALL_FRAME_HEADER_LEN);
+    wall_buffer_append(&wall->frame, data, data_len);
+
+    /* the cache of frames since the last IDR frame lets a late display node start decoding */
+    if (idr) {
+        wall->gop.start = 0;
+        wall->gop.len = 0;
+        wall->gop_valid = true;
+    }
+    if (wall->gop_valid) {
+        if (wall_buffer_reserve(&wall->gop, len, WALL_GOP_CACHE)) {
+            wall_buffer_append(&wall->gop, wall->frame.data, len);
+        } else {
+            wall_buffer_free(&wall->gop);
+            wall->gop_valid = false;
+        }
+    }
+
+    wall_skew_slot_t *slot = &wall->skew[seq % WALL_SKEW_SLOTS];
+    memset(slot, 0, sizeof(wall_skew_slot_t));
+    slot->seq = seq;
+    for (int i = 0; i < WALL_MAX_NODES; i++) {
+        video_wall_node_t *node = wall->nodes[i];
+        if (!node || !node->ready || node->failed) {
+            continue;
+        }
+        if (node->wait_idr && !idr) {
+            node->skipped++;
+            continue;
+        }
+        /* a node that cannot keep up skips to the next IDR frame (the queued data is never cut short) */
+        if (!wall_node_queue_frame(node, wall->frame.data + WALL_HEADER_LEN, (uint32_t) (len - WALL_HEADER_LEN))) {
+            if (!node->wait_idr) {
+                logger_log(wall->logger, LOGGER_INFO, "video wall: display node %s is too slow, "
+                           "skipping to the next IDR frame", node->tile);
+            }
+            node->wait_idr = true;
+            node->skipped++;
+            continue;
+        }
+        node->wait_idr = false;
+        node->failed = !wall_node_flush(node);
+        if (!node->failed) {
+            slot->expected++;
+        }
+    }
+    if (slot->expected < 2) {
+        slot->expected = 0;    /* skew needs at least two nodes */
+    }
+    MUTEX_UNLOCK(wall->mutex);
+}
+
+/*--------------------------------------------- display node ---------------------------------------------*/
+
+static int wall_node_send(video_wall_t *wall, const unsigned char *message, int len) {
+    int ret = 0;
+    MUTEX_LOCK(wall->send_mutex);
+    if (wall->fd >= 0) {
+        for (int sent = 0; sent < len; ) {
+            int n = send(wall->fd, CAST (message + sent), len - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                ret = -1;
+                break;
+            }
+            sent += n;
+        }
+    }
+    MUTEX_UNLOCK(wall->send_mutex);
+    return ret;
+}
+
+static void wall_node_request_sync(int sync_fd) {
+    unsigned char request[WALL_SYNC_REQUEST_LEN] = { 0 };
+    memcpy(request, WALL_SYNC_MAGIC, 4);
+    put_be64(request + 8, wall_time());
+    send(sync_fd, CAST request, sizeof(request), 0);
+}
+
+static void wall_node_sync_response(video_wall_t *wall, int sync_fd) {
+    unsigned char response[WALL_SYNC_RESPONSE_LEN];
+    int len = recv(sync_fd, CAST response, sizeof(response), 0);
+    int64_t t4 = (int64_t) wall_time();
+    if (len != WALL_SYNC_RESPONSE_LEN || memcmp(response, WALL_SYNC_MAGIC, 4)) {
+        return;
+    }
+    int64_t t1 = (int64_t) byteutils_get_long_be(response, 8);
+    int64_t t2 = (int64_t) byteutils_get_long_be(response, 16);
+    int64_t t3 = (int64_t) byteutils_get_long_be(response, 24);
+
+    MUTEX_LOCK(wall->mutex);
+    wall_sync_sample_t *sample = &wall->samples[wall->sample_index];
+    sample->offset = ((t2 - t1) + (t3 - t4)) / 2;
+    sample->delay = (t4 - t1) - (t3 - t2);
+    wall->sample_index = (wall->sample_index + 1) % WALL_SYNC_SAMPLES;
+    if (wall->sample_count < WALL_SYNC_SAMPLES) {
+        wall->sample_count++;
+    }
+    int best = 0;
+    for (int i = 1; i < wall->sample_count; i++) {
+        if (wall->samples[i].delay < wall->samples[best].delay) {
+            best = i;
+        }
+    }
+    wall->offset = wall->samples[best].offset;
+    wall->sync_error = (uint64_t) (wall->samples[best].delay > 0 ? wall->samples[best].delay / 2 : 0);
+    MUTEX_UNLOCK(wall->mutex);
+}
+
+/* returns false if the frame is not from the ingest node that answered our nonce */
+static bool wall_node_frame(video_wall_t *wall, unsigned char *payload, uint32_t len) {
+    unsigned char iv[16];
+    if (len <= WALL_FRAME_HEADER_LEN - WALL_HEADER_LEN + WALL_TAG_LEN) {
+        return false;
+    }
+    len -= WALL_TAG_LEN;
+    wall_cipher_next_iv(&wall->cipher, iv);
+    if (gcm_decrypt(payload, (int) len, payload, wall->cipher.key, iv, payload + len) < 0) {
+        logger_log(wall->logger, LOGGER_ERR, "video wall: a frame from ingest node %s:%u failed authentication",
+                   wall->host, wall->port);
+        return false;
+    }
+    uint32_t seq = byteutils_get_int_be(payload, 0);
+    int nal_count = (int) byteutils_get_int_be(payload, 4);
+    uint64_t pts = byteutils_get_long_be(payload, 8);
+    int data_len = (int) (len - (WALL_FRAME_HEADER_LEN - WALL_HEADER_LEN));
+
+    MUTEX_LOCK(wall->mutex);
+    pts = (uint64_t) ((int64_t) pts - wall->offset);
+    /* cached frames from before this node started are still decoded (and then dropped as late) */
+    if (pts < wall->start_time) {
+        pts = wall->start_time;
+    }
+    wall->pts_ring[wall->pts_index].pts = pts;
+    wall->pts_ring[wall->pts_index].seq = seq;
+    wall->pts_index = (wall->pts_index + 1) % WALL_PTS_RING;
+    MUTEX_UNLOCK(wall->mutex);
+
+    wall->callbacks.video_frame(wall->callbacks.cls, payload + WALL_FRAME_HEADER_LEN - WALL_HEADER_LEN, data_len,
+                                nal_count, pts);
+    return true;
+}
+
+/* wait (up to WALL_HELLO_TIMEOUT) for the next message from the ingest node, reading at most max bytes */
+static unsigned char *wall_node_wait_message(video_wall_t *wall, int fd, size_t max, wall_message_t *type,
+                                             uint32_t *len) {
+    unsigned char *payload = NULL;
+    uint64_t deadline = wall_time() + WALL_HELLO_TIMEOUT;
+    while (!(payload = wall_buffer_message(&wall->in, type, len)) && wall_time() < deadline) {
+        fd_set rfds;
+        struct timeval tv = { 0, 200000 };
+        FD_ZERO(&rfds);
+        FD_SET(fd, &rfds);
+        if (select(fd + 1, &rfds, NULL, NULL, &tv) > 0 && !wall_buffer_recv(&wall->in, fd, max)) {
+            break;
+        }
+    }
+    return payload;
+}
+
+/* connect to the ingest node, and synchronize with its clock before joining the wall */
+static int wall_node_connect(video_wall_t *wall, int *sync_fd) {
+    struct addrinfo hints, *result, *rp;
+    char port[8];
+    int fd = -1;
+    snprintf(port, sizeof(port), "%u", wall->port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(wall->host, port, &hints, &result)) {
+        logger_log(wall->logger, LOGGER_ERR, "video wall: cannot resolve ingest node %s", wall->host);
+        return -1;
+    }
+    for (rp = result; rp; rp = rp->ai_next) {
+        fd = socket(rp->ai_family, SOCK_STREAM, IPPROTO_TCP);
+        if (fd >= 0 && connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+            *sync_fd = socket(rp->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+            if (*sync_fd >= 0 && connect(*sync_fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+                break;
+            }
+            if (*sync_fd >= 0) closesocket(*sync_fd);
+            *sync_fd = -1;
+        }
+        if (fd >= 0) closesocket(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    if (fd < 0) {
+        return -1;
+    }
+    set_nodelay(fd);
+    MUTEX_LOCK(wall->send_mutex);
+    wall->fd = fd;
+    MUTEX_UNLOCK(wall->send_mutex);
+
+    /* answer the ingest node's challenge with the shared secret, and have it answer ours */
+    wall_message_t type;
+    uint32_t len;
+    unsigned char challenge[WALL_CHALLENGE_LEN];
+    unsigned char *payload = wall_node_wait_message(wall, fd, WALL_HEADER_LEN + WALL_CHALLENGE_LEN, &type, &len);
+    if (!payload || type != WALL_CHALLENGE || len != WALL_CHALLENGE_LEN) {
+        logger_log(wall->logger, LOGGER_ERR, "video wall: no challenge from ingest node %s:%s", wall->host, port);
+        return -1;
+    }
+    memcpy(challenge, payload, WALL_CHALLENGE_LEN);
+    wall_buffer_consume(&wall->in, WALL_HEADER_LEN + len);
+    unsigned char hello[WALL_HEADER_LEN + WALL_MAX_CONTROL_LEN];
+    unsigned char *nonce = hello + WALL_HEADER_LEN;
+    uint32_t tile_len = (uint32_t) strlen(wall->tile);
+    put_header(hello, WALL_HELLO, WALL_CHALLENGE_LEN + HMAC_SHA256_SIZE + tile_len);
+    get_random_bytes(nonce, WALL_CHALLENGE_LEN);
+    wall_mac(wall, nonce + WALL_CHALLENGE_LEN, "hello", challenge, nonce, wall->tile, tile_len);
+    memcpy(nonce + WALL_CHALLENGE_LEN + HMAC_SHA256_SIZE, wall->tile, tile_len);
+    if (wall_node_send(wall, hello, WALL_HEADER_LEN + WALL_CHALLENGE_LEN + HMAC_SHA256_SIZE + tile_len) < 0) {
+        return -1;
+    }
+    unsigned char mac[HMAC_SHA256_SIZE];
+    wall_mac(wall, mac, "welcome", challenge, nonce, wall->tile, tile_len);
+    payload = wall_node_wait_message(wall, fd, WALL_FRAME_HEADER_LEN + WALL_TAG_LEN + WALL_MAX_FRAME_LEN, &type, &len);
+    if (!payload || type != WALL_WELCOME || len != HMAC_SHA256_SIZE || crypto_memcmp(mac, payload, HMAC_SHA256_SIZE)) {
+        /* an ingest node that refuses our key closes the connection: one that does not know the key is refused */
+        logger_log(wall->logger, LOGGER_ERR, "video wall: ingest node %s:%s did not accept or prove the key "
+                   "(do both nodes use the same -wallkey?)", wall->host, port);
+        return -1;
+    }
+    wall_buffer_consume(&wall->in, WALL_HEADER_LEN + len);
+    wall_cipher_init(wall, &wall->cipher, challenge, nonce);
+
+    MUTEX_LOCK(wall->mutex);
+    wall->sample_count = 0;
+    wall->sample_index = 0;
+    MUTEX_UNLOCK(wall->mutex);
+    for (int i = 0; i < WALL_SYNC_SAMPLES; i++) {
+        fd_set rfds;
+        struct timeval tv = { 0, 200000 };
+        wall_node_request_sync(*sync_fd);
+        FD_ZERO(&rfds);
+        FD_SET(*sync_fd, &rfds);
+        if (select(*sync_fd + 1, &rfds, NULL, NULL, &tv) > 0) {
+            wall_node_sync_response(wall, *sync_fd);
+        }
+    }
+    if (!wall->sample_count) {
+        logger_log(wall->logger, LOGGER_ERR, "video wall: no clock sync response from ingest node %s:%s",
+                   wall->host, port);
+        return -1;
+    }
+    logger_log(wall->logger, LOGGER_INFO, "video wall: tile %s connected to ingest node %s:%s, clock offset %.3f ms "
+               "(+/- %.3f ms)", wall->tile, wall->host, port, (double) wall->offset / 1e6, (double) wall->sync_error / 1e6);
+    return fd;
+}
+
+static void wall_node_disconnect(video_wall_t *wall, int sync_fd) {
+    MUTEX_LOCK(wall->send_mutex);
+    if (wall->fd >= 0) {
+        closesocket(wall->fd);
+    }
+    wall->fd = -1;
+    MUTEX_UNLOCK(wall->send_mutex);
+    if (sync_fd >= 0) {
+        closesocket(sync_fd);
+    }
+    wall->in.start = 0;
+    wall->in.len = 0;
+}
+
+static THREAD_RETVAL video_wall_node_thread(void *arg) {
+    video_wall_t *wall = (video_wall_t *) arg;
+    int fd = -1;
+    int sync_fd = -1;
+    uint64_t sync_time = 0;
+    while (1) {
+        MUTEX_LOCK(wall->mutex);
+        bool running = wall->running;
+        MUTEX_UNLOCK(wall->mutex);
+        if (!running) {
+            break;
+        }
+        if (fd < 0) {
+            fd = wall_node_connect(wall, &sync_fd);
+            if (fd < 0) {
+                wall_node_disconnect(wall, sync_fd);
+                sync_fd = -1;
+                MUTEX_LOCK(wall->mutex);
+                if (wall->running) {
+                    raop_clock_cond_wait(NULL, &wall->cond, &wall->mutex, WALL_RECONNECT_INTERVAL);
+                }
+                MUTEX_UNLOCK(wall->mutex);
+                continue;
+            }
+            sync_time = wall_time();
+        }
+
+        fd_set rfds;
+        struct timeval tv = { 0, 100000 };
+        FD_ZERO(&rfds);
+        FD_SET(fd, &rfds);
+        FD_SET(sync_fd, &rfds);
+        int ret = select((fd > sync_fd ? fd : sync_fd) + 1, &rfds, NULL, NULL, &tv);
+        if (ret < 0 && !socket_would_block()) {
+            logger_log(wall->logger, LOGGER_ERR, "video wall: select error %d", SOCKET_GET_ERROR());
+            break;
+        }
+        if (ret > 0 && FD_ISSET(sync_fd, &rfds)) {
+            wall_node_sync_response(wall, sync_fd);
+        }
+        bool connected = true;
+        if (ret > 0 && FD_ISSET(fd, &rfds)) {
+            connected = wall_buffer_recv(&wall->in, fd, WALL_FRAME_HEADER_LEN + WALL_TAG_LEN + WALL_MAX_FRAME_LEN);
+        }
+        /* (frames may have arrived with the WELCOME message) */
+        wall_message_t type;
+        uint32_t len;
+        unsigned char *payload;
+        while (connected && (payload = wall_buffer_message(&wall->in, &type, &len))) {
+            if (type == WALL_FRAME) {
+                connected = wall_node_frame(wall, payload, len);
+            }
+            wall_buffer_consume(&wall->in, WALL_HEADER_LEN + len);
+        }
+        if (!connected) {
+            logger_log(wall->logger, LOGGER_ERR, "video wall: lost connection to ingest node %s:%u, reconnecting",
+                       wall->host, wall->port);
+            wall_node_disconnect(wall, sync_fd);
+            fd = -1;
+            sync_fd = -1;
+            MUTEX_LOCK(wall->mutex);
+            if (wall->running) {
+                raop_clock_cond_wait(NULL, &wall->cond, &wall->mutex, WALL_RECONNECT_INTERVAL);
+            }
+            MUTEX_UNLOCK(wall->mutex);
+            continue;
+        }
+        uint64_t now = wall_time();
+        if (now - sync_time >= WALL_SYNC_INTERVAL) {
+            wall_node_request_sync(sync_fd);
+            sync_time = now;
+        }
+    }
+    wall_node_disconnect(wall, sync_fd);
+    return 0;
+}
+
+video_wall_t *video_wall_node_init(logger_t *logger, const char *host, unsigned short port, const char *tile,
+                                   const char *key, video_wall_callbacks_t *callbacks) {
+    assert(callbacks && callbacks->video_frame);
+    assert(key && *key);
+    if (strlen(tile) > WALL_MAX_TILE_LEN) {
+        return NULL;
+    }
+    video_wall_t *wall = calloc(1, sizeof(video_wall_t));
+    if (!wall) {
+        return NULL;
+    }
+    wall->logger = logger;
+    wall->ingest = false;
+    wall->listen_fd = -1;
+    wall->sync_fd = -1;
+    wall->fd = -1;
+    wall->host = strdup(host);
+    wall->tile = strdup(tile);
+    wall->key = (unsigned char *) strdup(key);
+    wall->key_len = (int) strlen(key);
+    wall->port = port;
+    memcpy(&wall->callbacks, callbacks, sizeof(video_wall_callbacks_t));
+    wall->start_time = wall_time();
+    MUTEX_CREATE(wall->mutex);
+    COND_CREATE(wall->cond);
+    MUTEX_CREATE(wall->send_mutex);
+    wall->running = true;
+    THREAD_CREATE(wall->thread, video_wall_node_thread, wall);
+    return wall;
+}
+
+void video_wall_node_report(video_wall_t *wall, uint64_t pts, int64_t lateness) {
+    unsigned char report[WALL_REPORT_LEN];
+    bool found = false;
+    MUTEX_LOCK(wall->mutex);
+    for (int i = 1; i <= WALL_PTS_RING; i++) {
+        wall_pts_t *entry = &wall->pts_ring[(wall->pts_index + WALL_PTS_RING - i) % WALL_PTS_RING];
+        if (entry->pts == pts) {
+            put_be32(report + 8, entry->seq);
+            found = true;
+            break;
+        }
+    }
+    uint64_t sync_error = wall->sync_error;
+    MUTEX_UNLOCK(wall->mutex);
+    if (!found) {
+        return;
+    }
+    put_header(report, WALL_REPORT, WALL_REPORT_LEN - WALL_HEADER_LEN);
+    put_be64(report + 12, (uint64_t) lateness);
+    put_be64(report + 20, sync_error);
+    wall_node_send(wall, report, WALL_REPORT_LEN);
+}
+
+void video_wall_destroy(video_wall_t *wall) {
+    if (!wall) {
+        return;
+    }
+    MUTEX_LOCK(wall->mutex);
+    wall->running = false;
+    COND_SIGNAL(wall->cond);
+    MUTEX_UNLOCK(wall->mutex);
+    if (wall->thread) {
+        THREAD_JOIN(wall->thread);
+    }
+    if (wall->ingest) {
+        for (int i = 0; i < WALL_MAX_NODES; i++) {
+            if (wall->nodes[i]) {
+                wall_node_close(wall, i);
+            }
+        }
+        closesocket(wall->listen_fd);
+        closesocket(wall->sync_fd);
+        wall_buffer_free(&wall->frame);
+        wall_buffer_free(&wall->gop);
+    }
+    wall_buffer_free(&wall->in);
+    free(wall->host);
+    free(wall->tile);
+    free(wall->key);
+    MUTEX_DESTROY(wall->mutex);
+    COND_DESTROY(wall->cond);
+    MUTEX_DESTROY(wall->send_mutex);
+    free(wall);
+}
@@ -0,0 +1,63 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * video wall: an "ingest" node receives the AirPlay mirror session and redistributes its h264 access units
+ * over TCP to "display" nodes, which present them at the same time on a clock shared with the ingest node.
+ */
+
+#ifndef VIDEO_WALL_H
+#define VIDEO_WALL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "logger.h"
+
+#define VIDEO_WALL_DEFAULT_PORT 7300
+
+typedef struct video_wall_s video_wall_t;
+
+typedef struct {
+    void *cls;
+    /* display node: an Annex-B access unit, to be presented at time pts (nsecs, local system clock) */
+    void  (*video_frame)(void *cls, unsigned char *data, int data_len, int nal_count, uint64_t pts);
+} video_wall_callbacks_t;
+
+/* ingest node: accepts display nodes on TCP port "port" of "address" (numeric; NULL: all IPv4 interfaces), and  *
+ * answers their clock-sync requests on UDP "port".  Only display nodes that prove they know the shared secret  *
+ * "key" receive frames or clock-sync answers                                                                     */
+video_wall_t *video_wall_ingest_init(logger_t *logger, const char *address, unsigned short port, const char *key);
+
+/* ingest node: queue an access unit with presentation time pts (nsecs, local system clock) for all display *
+ * nodes.  Never blocks: a node that cannot keep up skips frames until the next IDR frame                   */
+void video_wall_ingest_send(video_wall_t *wall, const unsigned char *data, int data_len, int nal_count, uint64_t pts);
+
+/* display node: connects (and reconnects) to the ingest node at host:port with the shared secret "key"; *
+ * tile is a label like "2x2:0,1"                                                                        */
+video_wall_t *video_wall_node_init(logger_t *logger, const char *host, unsigned short port, const char *tile,
+                                   const char *key, video_wall_callbacks_t *callbacks);
+
+/* display node: the frame with presentation time pts (as given to video_frame) reached the videosink   *
+ * "lateness" nsecs after its presentation time (negative if early); reported to the ingest node        */
+void video_wall_node_report(video_wall_t *wall, uint64_t pts, int64_t lateness);
+
+void video_wall_destroy(video_wall_t *wall);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //VIDEO_WALL_H
@@ -0,0 +1,119 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "audio_drift.h"
+
+#define NSECS_PER_SEC 1000000000.0
+
+void audio_drift_init(audio_drift_t *drift, int rate, int64_t step) {
+    memset(drift, 0, sizeof(audio_drift_t));
+    drift->rate = rate;
+    drift->step = step;
+    drift->ratio = 1.0;
+}
+
+int audio_drift_max_output(int count) {
+    return (int) ((double) count * (1.0 + AUDIO_DRIFT_MAX_RATIO)) + 2;
+}
+
+/* input frame i of the current input (i < 0: from the history) */
+static inline const float *frame_at(const audio_drift_t *drift, const float *input, int i) {
+    return (i < 0 ? drift->history[3 + i] : input + i * AUDIO_DRIFT_CHANNELS);
+}
+
+int audio_drift_process(audio_drift_t *drift, const float *input, int count, uint64_t pts,
+                        float *output, uint64_t *output_pts, bool *discont) {
+    double frame_nsecs = NSECS_PER_SEC / drift->rate;
+    *discont = false;
+    if (!drift->started) {
+        /* the first output frame is taken at input frame -1 (the history is silence) */
+        drift->position = -1.0;
+        drift->origin = (pts > (uint64_t) frame_nsecs ? pts - (uint64_t) frame_nsecs : 0);
+        drift->frames_since_origin = 0;
+        drift->started = true;
+        *discont = true;
+    }
+    uint64_t timeline = drift->origin + (uint64_t) ((double) drift->frames_since_origin * frame_nsecs);
+    int64_t target = (int64_t) pts + (int64_t) (drift->position * frame_nsecs);
+    drift->error = target - (int64_t) timeline;
+    if (drift->error > drift->step || drift->error < -drift->step) {
+        drift->origin = (uint64_t) target;
+        drift->frames_since_origin = 0;
+        drift->steps++;
+        drift->stepped += drift->error;
+        drift->error = 0;
+        timeline = drift->origin;
+        *discont = true;
+    }
+    /* a positive error (the timeline is ahead of the mapping) is taken up by making more output frames */
+    double correction = (double) drift->error / AUDIO_DRIFT_TIME_CONSTANT;
+    if (correction > AUDIO_DRIFT_MAX_RATIO) {
+        correction = AUDIO_DRIFT_MAX_RATIO;
+    } else if (correction < -AUDIO_DRIFT_MAX_RATIO) {
+        correction = -AUDIO_DRIFT_MAX_RATIO;
+    }
+    drift->ratio = 1.0 + correction;
+    double increment = 1.0 / drift->ratio;
+    *output_pts = timeline;
+
+    /* 4-point, 3rd-order Hermite interpolation between input frames i and i + 1 (needs i - 1 ... i + 2) */
+    int frames = 0;
+    double position = drift->position;
+    while (position < (double) (count - 2)) {
+        int i = (int) floor(position);
+        float t = (float) (position - i);
+        const float *xm1 = frame_at(drift, input, i - 1);
+        const float *x0 = frame_at(drift, input, i);
+        const float *x1 = frame_at(drift, input, i + 1);
+        const float *x2 = frame_at(drift, input, i + 2);
+        for (int c = 0; c < AUDIO_DRIFT_CHANNELS; c++) {
+            float c1 = 0.5f * (x1[c] - xm1[c]);
+            float c2 = xm1[c] - 2.5f * x0[c] + 2.0f * x1[c] - 0.5f * x2[c];
+            float c3 = 0.5f * (x2[c] - xm1[c]) + 1.5f * (x0[c] - x1[c]);
+            output[frames * AUDIO_DRIFT_CHANNELS + c] = ((c3 * t + c2) * t + c1) * t + x0[c];
+        }
+        frames++;
+        position += increment;
+    }
+    drift->position = position - count;
+
+    /* keep the last three frames (a short input keeps some of the old ones) */
+    for (int h = 0; h < 3; h++) {
+        int i = count - 3 + h;
+        float frame[AUDIO_DRIFT_CHANNELS];
+        memcpy(frame, frame_at(drift, input, i), sizeof(frame));
+        memcpy(drift->history[h], frame, sizeof(frame));
+    }
+    drift->frames_in += count;
+    drift->frames_out += frames;
+    drift->frames_since_origin += frames;
+    return frames;
+}
+
+double audio_drift_ppm(const audio_drift_t *drift) {
+    if (!drift->frames_in) {
+        return 0.0;
+    }
+    /* the output frames so far were taken from input positions -1 ... frames_in + position - 1 */
+    double consumed = (double) drift->frames_in + drift->position + 1.0;
+    double extra = (double) drift->frames_out - consumed + (double) drift->stepped * drift->rate / NSECS_PER_SEC;
+    return extra * 1e6 / consumed;
+}
@@ -0,0 +1,75 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * party mode (-party) drift correction: the decoded audio of a source is resampled by a ratio that is steered so
+ * that its output timeline (the count of output frames) follows the times given by its ntp mapping.  Small
+ * drift is absorbed by the ratio (a few hundred ppm at most, an inaudible pitch change); only a gross error (a
+ * jump of the mapping, or a gap in the stream) steps the timeline.  Kept free of GStreamer, so that it can be
+ * driven with synthetic timestamps.
+ */
+
+#ifndef AUDIO_DRIFT_H
+#define AUDIO_DRIFT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define AUDIO_DRIFT_CHANNELS 2
+#define AUDIO_DRIFT_TIME_CONSTANT 10.0e9      /* nsecs: an error is corrected at error / this rate */
+#define AUDIO_DRIFT_MAX_RATIO 0.0005          /* largest correction of the ratio (500 ppm, less than a cent) */
+
+typedef struct audio_drift_s {
+    int rate;
+    int64_t step;                /* errors larger than this (nsecs) step the output timeline */
+    double ratio;                /* output frames per input frame */
+    double position;             /* of the next output frame, in input frames from the start of the next input */
+    float history[3][AUDIO_DRIFT_CHANNELS];   /* the last three input frames */
+    bool started;
+    uint64_t origin;             /* time of the output timeline (nsecs) at frames_since_origin = 0 */
+    uint64_t frames_since_origin;
+    uint64_t frames_in;
+    uint64_t frames_out;
+    int64_t error;               /* time from the ntp mapping - output timeline, at the last input (nsecs) */
+    unsigned int steps;
+    int64_t stepped;             /* sum of the steps (nsecs) */
+} audio_drift_t;
+
+void audio_drift_init(audio_drift_t *drift, int rate, int64_t step);
+
+/* the most output frames for count input frames */
+int audio_drift_max_output(int count);
+
+/* resamples count interleaved input frames whose first one should be played at time pts (nsecs) into output:  *
+ * returns the number of output frames, with the time of the first one in *output_pts.  *discont is set if the *
+ * output timeline was stepped (or started) at this input                                                     */
+int audio_drift_process(audio_drift_t *drift, const float *input, int count, uint64_t pts,
+                        float *output, uint64_t *output_pts, bool *discont);
+
+/* the clock drift of the source since the start (ppm): positive if its clock is slow */
+double audio_drift_ppm(const audio_drift_t *drift);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //AUDIO_DRIFT_H
@@ -33,13 +33,31 @@ extern "C" {
 #include "../lib/logger.h"
 
 bool gstreamer_init();
+/* also send the decoded audio as RTP (Opus, or L16 if l16 is true) to clients = "host:port,host:port,..." *
+ * with RTCP to port + 1 (call before audio_renderer_init)                                               */
+void audio_renderer_set_rtp_output(const char *clients, bool l16);
+/* party mode: mix the audio of up to max_sources connections into one audiosink (call before audio_renderer_init) */
+void audio_renderer_set_mixer(int max_sources);
 void audio_renderer_init(logger_t *logger, const char* audiosink, const bool *audio_sync, const bool *video_sync);
 void audio_renderer_start(unsigned char* compression_type);
 void audio_renderer_stop();
 void audio_renderer_render_buffer(unsigned char* data, int *data_len, unsigned short *seqnum, uint64_t *ntp_time);
 void audio_renderer_set_volume(float volume);
 void audio_renderer_flush();
+/* overload: drop the late (or, without sync, excess) audio frames waiting to be decoded */
+void audio_renderer_shorten_buffer();
 void audio_renderer_destroy();
+/* (party mode) audio frame of the connection identified by source, to be played at remote_time (sender clock), *
+ * local_time (local clock, from the connection's ntp mapping), + delay (nsecs)                                 */
+void audio_renderer_mix_buffer(const void *source, unsigned char ct, unsigned char *data, int data_len,
+                               uint64_t remote_time, uint64_t local_time, int64_t delay);
+void audio_renderer_mix_set_volume(const void *source, float volume);
+/* (party mode) the source has stopped: remove it from the mix, and log its clock drift */
+void audio_renderer_mix_remove(const void *source);
+/* latency probe: callback gets the first channel of the audio that reaches the audiosink (-1.0 to 1.0), and the *
+ * time (nsecs, system clock) at which its first sample is played                                                */
+void audio_renderer_set_sample_tap(void (*callback)(void *cls, const float *samples, int count, int rate,
+                                                    uint64_t play_time), void *cls);
 
 #ifdef __cplusplus
 }
@@ -21,9 +21,11 @@
  */
 
 #include <math.h>
+#include <string.h>
 #include <gst/gst.h>
 #include <gst/app/gstappsrc.h>
 #include "audio_renderer.h"
+#include "audio_drift.h"
 #define SECOND_IN_NSECS 1000000000UL
 
 #define NFORMATS 2     /* set to 4 to enable AAC_LD and PCM:  allowed, but  never seen in real-world use */
@@ -40,6 +42,9 @@ static gboolean render_audio = FALSE;
 static gboolean async = FALSE;
 static gboolean vsync = FALSE;
 static gboolean sync = FALSE;
+/* network audio output: RTP destinations "host:port,host:port,..." (NULL: none), and payload type */
+static gchar *rtp_clients = NULL;
+static gboolean rtp_l16 = FALSE;
 
 typedef struct audio_renderer_s {
     GstElement *appsrc; 
@@ -50,6 +55,60 @@ typedef struct audio_renderer_s {
 static audio_renderer_t *renderer_type[NFORMATS];
 static audio_renderer_t *renderer = NULL;
 
+/* overload: audio_renderer_shorten_buffer() trims the (compressed) audio waiting in the queue after appsrc: *
+ * as frames leave the queue, those already late (sync), or beyond SHORTEN_TARGET_FRAMES still queued (no   *
+ * sync), are dropped, up to the first frame that is kept.  Only the backlog is lost, not the whole queue.   */
+#define SHORTEN_TARGET_FRAMES 8
+static gint shorten_pending = 0;
+static guint shorten_dropped = 0;
+
+/* party mode: the audio of up to mix_sources_max connections, each decoded once in its own branch, is    *
+ * mixed by one audiomixer (a single vectorized pass, with per-source gain on its sink pads) into one       *
+ * audiosink.  Each source is timed by its own raop_ntp mapping: its decoded audio is resampled (mix_drift_  *
+ * probe) so that it follows the mapping with a continuous timeline; the timeline is only stepped when the  *
+ * mapping is off by more than MIX_DRIFT_STEP (a jump of the mapping, or a gap in the stream)               */
+#define MIX_LATENCY (50 * GST_MSECOND)            /* how long the mixer waits for a late source */
+#define MIX_RATE 44100
+#define MIX_DRIFT_STEP ((int64_t) 20000000)       /* nsecs */
+#define MIX_REPORT_INTERVAL (60 * SECOND_IN_NSECS)
+
+/* (shared by the streaming thread of a source's branch and the mix functions) */
+typedef struct mix_drift_s {
+    GMutex mutex;
+    audio_drift_t drift;
+} mix_drift_t;
+
+typedef struct mix_source_s {
+    const void *id;                   /* NULL: free slot */
+    int number;
+    GstElement *bin;                  /* appsrc ! decoder ! audioconvert ! audioresample (NULL until the first frame) */
+    GstElement *appsrc;
+    GstPad *mixer_pad;
+    unsigned char ct;
+    gdouble gain;
+    gboolean refused;                 /* unsupported format, or the mixer is full */
+    uint64_t frames;
+    uint64_t report_time;
+    mix_drift_t *drift;               /* owned by the probe on the branch's src pad */
+} mix_source_t;
+
+static int mix_sources_max = 0;       /* 0: not party mode */
+static mix_source_t *mix_sources = NULL;
+static int mix_source_count = 0;
+static audio_renderer_t *mix = NULL;  /* (appsrc is NULL) */
+static GstElement *mixer = NULL;
+static GstClockTime mix_base_time = GST_CLOCK_TIME_NONE;
+static GMutex mix_mutex;
+
+/* latency probe */
+static void (*sample_tap)(void *cls, const float *samples, int count, int rate, uint64_t play_time) = NULL;
+static void *sample_tap_cls = NULL;
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define NATIVE_FORMAT(f) f "LE"
+#else
+#define NATIVE_FORMAT(f) f "BE"
+#endif
+
 /* GStreamer Caps strings for Airplay-defined audio compression types (ct) */
 
 /* ct = 1; linear PCM (uncompressed): 44100/16/2, S16LE */
@@ -120,11 +179,506 @@ static gboolean check_plugin_feature (const gchar *needed_feature)
     return ret;
 }
 
+void audio_renderer_set_rtp_output(const char *clients, bool l16) {
+    g_free(rtp_clients);
+    rtp_clients = (clients ? g_strdup(clients) : NULL);
+    rtp_l16 = (gboolean) l16;
+}
+
+static gboolean check_rtp_output_elements(void) {
+    const gchar *needed_opus[] = { "rtpbin", "multiudpsink", "opusenc", "rtpopuspay", NULL };
+    const gchar *needed_l16[] = { "rtpbin", "multiudpsink", "rtpL16pay", NULL };
+    const gchar **needed = (rtp_l16 ? needed_l16 : needed_opus);
+    gboolean ret = TRUE;
+    for (int i = 0; needed[i]; i++) {
+        GstElementFactory *factory = gst_element_factory_find(needed[i]);
+        if (!factory) {
+            logger_log(logger, LOGGER_ERR, "GStreamer element \"%s\" needed for RTP audio output was not found", needed[i]);
+            ret = FALSE;
+            continue;
+        }
+        gst_object_unref(factory);
+    }
+    return ret;
+}
+
+/* second branch of the audio pipeline: the decoded audio is encoded once, and the same RTP packets *
+ * are sent to every destination by one multiudpsink.  RTCP sender reports (to port + 1) map RTP   *
+ * timestamps to the pipeline clock, which runs on the (NTP-synchronized) system clock, so that     *
+ * receivers with a synchronized clock can play at the same time as the local audiosink            */
+static void append_rtp_output(GString *launch) {
+    GString *rtcp_clients = g_string_new("");
+    gchar **clients = g_strsplit(rtp_clients, ",", -1);
+    for (int i = 0; clients[i]; i++) {
+        gchar *port = strrchr(clients[i], ':');
+        if (port) {
+            g_string_append_printf(rtcp_clients, "%s%.*s:%d", (i ? "," : ""), (int) (port - clients[i]), clients[i],
+                                   atoi(port + 1) + 1);
+        }
+    }
+    g_strfreev(clients);
+
+    /* a slow network must not stall the local audiosink */
+    g_string_append(launch, " net_tee. ! queue leaky=downstream max-size-time=500000000 ! audioconvert ! audioresample ! ");
+    if (rtp_l16) {
+        g_string_append(launch, "audio/x-raw,format=S16BE,channels=2 ! rtpL16pay ! ");
+    } else {
+        g_string_append(launch, "audio/x-raw,rate=48000,channels=2 ! opusenc frame-size=10 ! rtpopuspay ! ");
+    }
+    g_string_append(launch, "net_rtpbin.send_rtp_sink_0 rtpbin name=net_rtpbin ntp-time-source=clock-time");
+#if GST_CHECK_VERSION(1,16,0)
+    g_string_append(launch, " rtcp-sync-send-time=false");
+#endif
+    g_string_append_printf(launch, " net_rtpbin.send_rtp_src_0 ! multiudpsink clients=%s sync=false async=false",
+                           rtp_clients);
+    g_string_append_printf(launch, " net_rtpbin.send_rtcp_src_0 ! multiudpsink clients=%s sync=false async=false",
+                           rtcp_clients->str);
+    g_string_free(rtcp_clients, TRUE);
+}
+
+/* (on the volume element's src pad: the audio has the format negotiated with the audiosink) */
+static GstPadProbeReturn sample_tap_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if (!sample_tap || !buffer) {
+        return GST_PAD_PROBE_OK;
+    }
+    GstCaps *caps = gst_pad_get_current_caps(pad);
+    if (!caps) {
+        return GST_PAD_PROBE_OK;
+    }
+    GstStructure *structure = gst_caps_get_structure(caps, 0);
+    const gchar *sample_format = gst_structure_get_string(structure, "format");
+    const gchar *layout = gst_structure_get_string(structure, "layout");
+    gint channels = 0, rate = 0, bytes = 0;
+    gst_structure_get_int(structure, "channels", &channels);
+    gst_structure_get_int(structure, "rate", &rate);
+    if (sample_format && !strcmp(sample_format, NATIVE_FORMAT("S16"))) {
+        bytes = 2;
+    } else if (sample_format && (!strcmp(sample_format, NATIVE_FORMAT("S32")) ||
+                                 !strcmp(sample_format, NATIVE_FORMAT("F32")))) {
+        bytes = 4;
+    }
+    if (!bytes || channels < 1 || rate < 1 || (layout && strcmp(layout, "interleaved"))) {
+        logger_log(logger, LOGGER_DEBUG, "latency probe: cannot read audio format %s", (sample_format ? sample_format : "?"));
+        gst_caps_unref(caps);
+        return GST_PAD_PROBE_OK;
+    }
+    bool is_float = (sample_format[0] == 'F');
+    gst_caps_unref(caps);
+
+    GstClock *clock = gst_element_get_clock(renderer->pipeline);
+    if (!clock) {
+        return GST_PAD_PROBE_OK;
+    }
+    GstClockTime play_time = gst_clock_get_time(clock);
+    gst_object_unref(clock);
+    if (sync && GST_BUFFER_PTS_IS_VALID(buffer)) {
+        GstClockTime target = GST_BUFFER_PTS(buffer) + gst_audio_pipeline_base_time;
+#if GST_CHECK_VERSION(1,6,0)
+        target += gst_pipeline_get_latency(GST_PIPELINE_CAST(renderer->pipeline));
+#endif
+        if (target > play_time) {
+            play_time = target;
+        }
+    }
+
+    GstMapInfo map;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        return GST_PAD_PROBE_OK;
+    }
+    int count = (int) (map.size / (bytes * channels));
+    float *samples = g_new(float, count);
+    for (int i = 0; i < count; i++) {
+        const guint8 *sample = map.data + (gsize) i * bytes * channels;
+        if (bytes == 2) {
+            samples[i] = (float) *(const gint16 *) sample / 32768.0f;
+        } else if (is_float) {
+            samples[i] = *(const gfloat *) sample;
+        } else {
+            samples[i] = (float) ((double) *(const gint32 *) sample / 2147483648.0);
+        }
+    }
+    gst_buffer_unmap(buffer, &map);
+    sample_tap(sample_tap_cls, samples, count, rate, (uint64_t) play_time);
+    g_free(samples);
+    return GST_PAD_PROBE_OK;
+}
+
+void audio_renderer_set_sample_tap(void (*callback)(void *cls, const float *samples, int count, int rate,
+                                                    uint64_t play_time), void *cls) {
+    sample_tap_cls = cls;
+    sample_tap = callback;
+}
+
 bool gstreamer_init(){
     gst_init(NULL,NULL);    
     return (bool) check_plugins ();
 }
 
+static bool valid_frame(unsigned char ct, const unsigned char *data) {
+    /* all audio received seems to be either ct = 8 (AAC_ELD 44100/2 spf 460 ) AirPlay Mirror protocol *
+     * or ct = 2 (ALAC 44100/16/2 spf 352) AirPlay protocol.                                           *
+     * first byte data[0] of ALAC frame is 0x20,                                                       *
+     * first byte of AAC_ELD is 0x8c, 0x8d or 0x8e: 0x100011(00,01,10) in modern devices               *
+     *                   but is 0x80, 0x81 or 0x82: 0x100000(00,01,10) in ios9, ios10 devices          *
+     * first byte of AAC_LC should be 0xff (ADTS) (but has never been  seen).                          */
+    switch (ct){
+    case 8: /*AAC-ELD*/
+        switch (data[0]){
+        case 0x8c:
+        case 0x8d:
+        case 0x8e:
+        case 0x80:
+        case 0x81:
+        case 0x82:
+            return true;
+        default:
+            return false;
+        }
+    case 2: /*ALAC*/
+        return (data[0] == 0x20);
+    case 4:  /*AAC_LC */
+        return (data[0] == 0xff );
+    default:
+        return true;
+    }
+}
+
+static void set_property_if_found(GstElement *element, const gchar *property, const gchar *value) {
+    if (g_object_class_find_property(G_OBJECT_GET_CLASS(element), property)) {
+        gst_util_set_object_arg(G_OBJECT(element), property, value);
+    }
+}
+
+void audio_renderer_set_mixer(int max_sources) {
+    mix_sources_max = (max_sources > 1 ? max_sources : 0);
+}
+
+static void mix_init(const char *audiosink, GstClock *clock) {
+    GError *error = NULL;
+    gchar *value;
+    GString *launch = g_string_new("audiomixer name=mixer ! ");
+    g_string_append(launch, "audio/x-raw,format=" NATIVE_FORMAT("F32") ",rate=" G_STRINGIFY(MIX_RATE)
+                    ",channels=2,layout=interleaved ! ");
+    g_string_append(launch, "audioconvert ! audioresample ! volume name=volume ! level ! ");
+    if (rtp_clients) {
+        g_string_append(launch, "tee name=net_tee ! queue ! audioconvert ! audioresample ! ");
+    }
+    g_string_append(launch, audiosink);
+    g_string_append(launch, " sync=true");    /* the sources are placed on the mixer's timeline by their timestamps */
+    if (rtp_clients) {
+        append_rtp_output(launch);
+    }
+    mix = (audio_renderer_t *) calloc(1, sizeof(audio_renderer_t));
+    g_assert(mix);
+    mix->pipeline = gst_parse_launch(launch->str, &error);
+    if (error) {
+        g_error ("gst_parse_launch error (audio mixer):\n %s\n", error->message);
+        g_clear_error (&error);
+    }
+    g_assert(mix->pipeline);
+    gst_pipeline_use_clock(GST_PIPELINE_CAST(mix->pipeline), clock);
+    logger_log(logger, LOGGER_DEBUG, "GStreamer audio mixer pipeline: \"%s\"", launch->str);
+    g_string_free(launch, TRUE);
+
+    mix->volume = gst_bin_get_by_name(GST_BIN(mix->pipeline), "volume");
+    mixer = gst_bin_get_by_name(GST_BIN(mix->pipeline), "mixer");
+    value = g_strdup_printf("%" G_GUINT64_FORMAT, (guint64) MIX_LATENCY);
+    set_property_if_found(mixer, "latency", value);
+    g_free(value);
+    set_property_if_found(mixer, "start-time-selection", "first");
+
+    mix_sources = (mix_source_t *) calloc(mix_sources_max, sizeof(mix_source_t));
+    g_assert(mix_sources);
+    g_mutex_init(&mix_mutex);
+}
+
+/* (mix_mutex locked) */
+static mix_source_t *mix_find_source(const void *id, gboolean add) {
+    mix_source_t *free_slot = NULL;
+    for (int i = 0; i < mix_sources_max; i++) {
+        if (mix_sources[i].id == id) {
+            return &mix_sources[i];
+        }
+        if (!mix_sources[i].id && !free_slot) {
+            free_slot = &mix_sources[i];
+        }
+    }
+    if (add && free_slot) {
+        static int numbers = 0;
+        memset(free_slot, 0, sizeof(mix_source_t));
+        free_slot->id = id;
+        free_slot->number = ++numbers;
+        free_slot->gain = 1.0;
+    }
+    return (add ? free_slot : NULL);
+}
+
+/* party mode: replaces a decoded buffer of a source by its resampled audio, on the source's continuous timeline */
+static GstPadProbeReturn mix_drift_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    mix_drift_t *mix_drift = (mix_drift_t *) user_data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if (!buffer || !GST_BUFFER_PTS_IS_VALID(buffer)) {
+        return GST_PAD_PROBE_OK;
+    }
+    GstMapInfo input;
+    if (!gst_buffer_map(buffer, &input, GST_MAP_READ)) {
+        return GST_PAD_PROBE_OK;
+    }
+    int count = (int) (input.size / (AUDIO_DRIFT_CHANNELS * sizeof(float)));
+    size_t frame_size = AUDIO_DRIFT_CHANNELS * sizeof(float);
+    GstBuffer *resampled = gst_buffer_new_allocate(NULL, audio_drift_max_output(count) * frame_size, NULL);
+    g_assert(resampled);
+    GstMapInfo output;
+    gst_buffer_map(resampled, &output, GST_MAP_WRITE);
+    uint64_t pts;
+    bool discont;
+    g_mutex_lock(&mix_drift->mutex);
+    int frames = audio_drift_process(&mix_drift->drift, (const float *) input.data, count, GST_BUFFER_PTS(buffer),
+                                     (float *) output.data, &pts, &discont);
+    g_mutex_unlock(&mix_drift->mutex);
+    gst_buffer_unmap(resampled, &output);
+    gst_buffer_unmap(buffer, &input);
+    if (frames == 0) {
+        gst_buffer_unref(resampled);
+        return GST_PAD_PROBE_DROP;
+    }
+    gst_buffer_set_size(resampled, frames * frame_size);
+    GST_BUFFER_PTS(resampled) = pts;
+    GST_BUFFER_DURATION(resampled) = gst_util_uint64_scale_int(frames, GST_SECOND, MIX_RATE);
+    if (discont) {
+        GST_BUFFER_FLAG_SET(resampled, GST_BUFFER_FLAG_DISCONT);
+    }
+    gst_buffer_unref(buffer);
+    GST_PAD_PROBE_INFO_DATA(info) = resampled;
+    return GST_PAD_PROBE_OK;
+}
+
+static void mix_drift_free(gpointer data) {
+    mix_drift_t *mix_drift = (mix_drift_t *) data;
+    g_mutex_clear(&mix_drift->mutex);
+    free(mix_drift);
+}
+
+/* (mix_mutex locked) */
+static gboolean mix_add_branch(mix_source_t *source, unsigned char ct) {
+    GError *error = NULL;
+    const gchar *caps_string;
+    const gchar *decoder;
+    switch (ct) {
+    case 2:
+        caps_string = alac_caps;
+        decoder = (alac ? avdec_alac : NULL);
+        break;
+    case 8:
+        caps_string = aac_eld_caps;
+        decoder = (aac ? avdec_aac : NULL);
+        break;
+    default:
+        logger_log(logger, LOGGER_ERR, "party audio: source %d has unsupported audio compression type ct = %d",
+                   source->number, ct);
+        return FALSE;
+    }
+    if (!decoder) {
+        logger_log(logger, LOGGER_INFO, "*** GStreamer libav plugin feature %s is missing, cannot decode source %d",
+                   (ct == 2 ? avdec_alac : avdec_aac), source->number);
+        return FALSE;
+    }
+    gchar *description = g_strdup_printf("appsrc name=mix_source ! queue ! %s ! audioconvert ! audioresample ! "
+                                         "audio/x-raw,format=%s,rate=%d,channels=%d,layout=interleaved", decoder,
+                                         NATIVE_FORMAT("F32"), MIX_RATE, AUDIO_DRIFT_CHANNELS);
+    source->bin = gst_parse_bin_from_description(description, TRUE, &error);
+    g_free(description);
+    if (error) {
+        logger_log(logger, LOGGER_ERR, "party audio: cannot create the branch of source %d: %s", source->number, error->message);
+        g_clear_error(&error);
+        return FALSE;
+    }
+    source->appsrc = gst_bin_get_by_name(GST_BIN(source->bin), "mix_source");
+    GstCaps *caps = gst_caps_from_string(caps_string);
+    g_object_set(source->appsrc, "caps", caps, "stream-type", 0, "is-live", TRUE, "format", GST_FORMAT_TIME, NULL);
+    gst_caps_unref(caps);
+    source->ct = ct;
+
+    gst_bin_add(GST_BIN(mix->pipeline), source->bin);
+#if GST_CHECK_VERSION(1,20,0)
+    source->mixer_pad = gst_element_request_pad_simple(mixer, "sink_%u");
+#else
+    source->mixer_pad = gst_element_get_request_pad(mixer, "sink_%u");
+#endif
+    GstPad *src_pad = gst_element_get_static_pad(source->bin, "src");
+    gst_pad_link(src_pad, source->mixer_pad);
+    source->drift = (mix_drift_t *) calloc(1, sizeof(mix_drift_t));
+    g_assert(source->drift);
+    g_mutex_init(&source->drift->mutex);
+    audio_drift_init(&source->drift->drift, MIX_RATE, MIX_DRIFT_STEP);
+    gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_BUFFER, mix_drift_probe, source->drift, mix_drift_free);
+    gst_object_unref(src_pad);
+    g_object_set(source->mixer_pad, "volume", source->gain, NULL);
+
+    if (mix_source_count++) {
+        gst_element_sync_state_with_parent(source->bin);
+    } else {
+        gst_element_set_state(mix->pipeline, GST_STATE_PLAYING);
+        mix_base_time = gst_element_get_base_time(mix->pipeline);
+    }
+    logger_log(logger, LOGGER_INFO, "party audio: source %d joined the mix (%d of %d), format %s", source->number,
+               mix_source_count, mix_sources_max, (ct == 2 ? "ALAC 44100/16/2" : "AAC-ELD 44100/2"));
+    return TRUE;
+}
+
+static void mix_report(mix_source_t *source, int level) {
+    g_mutex_lock(&source->drift->mutex);
+    const audio_drift_t *drift = &source->drift->drift;
+    logger_log(logger, level, "party audio: source %d, %.0f secs: clock drift %+.1f ppm (resampled at %+.1f ppm now), "
+               "%u steps (%+.1f ms), timing now %+.1f ms from the ntp mapping", source->number,
+               (double) drift->frames_in / MIX_RATE, audio_drift_ppm(drift), (drift->ratio - 1.0) * 1e6, drift->steps,
+               (double) drift->stepped / 1000000.0, (double) drift->error / 1000000.0);
+    g_mutex_unlock(&source->drift->mutex);
+}
+
+void audio_renderer_mix_buffer(const void *id, unsigned char ct, unsigned char *data, int data_len,
+                               uint64_t remote_time, uint64_t local_time, int64_t delay) {
+    if (!mix || data_len <= 0) {
+        return;
+    }
+    g_mutex_lock(&mix_mutex);
+    mix_source_t *source = mix_find_source(id, TRUE);    /* (NULL if full: the connection limit prevents this) */
+    if (!source || source->refused) {
+        g_mutex_unlock(&mix_mutex);
+        return;
+    }
+    if (!source->bin && !mix_add_branch(source, ct)) {
+        source->refused = TRUE;
+        g_mutex_unlock(&mix_mutex);
+        return;
+    }
+
+    /* timestamps follow the source's ntp mapping: mix_drift_probe resamples the decoded audio to match them */
+    if (!source->frames++) {
+        source->report_time = local_time;
+    }
+    if (local_time - source->report_time > MIX_REPORT_INTERVAL) {
+        source->report_time = local_time;
+        mix_report(source, LOGGER_DEBUG);
+    }
+
+    uint64_t play_time = (uint64_t) ((int64_t) local_time + delay);
+    if (play_time < mix_base_time) {
+        logger_log(logger, LOGGER_ERR, "*** party audio: source %d: invalid ntp_time < base_time", source->number);
+        g_mutex_unlock(&mix_mutex);
+        return;
+    }
+    if (!valid_frame(ct, data)) {
+        logger_log(logger, LOGGER_ERR, "*** ERROR invalid audio frame (source %d, compression_type %d) skipped", source->number, ct);
+        g_mutex_unlock(&mix_mutex);
+        return;
+    }
+    GstBuffer *buffer = gst_buffer_new_allocate(NULL, data_len, NULL);
+    g_assert(buffer != NULL);
+    GST_BUFFER_PTS(buffer) = play_time - mix_base_time;
+    gst_buffer_fill(buffer, 0, data, data_len);
+    gst_app_src_push_buffer(GST_APP_SRC(source->appsrc), buffer);
+    g_mutex_unlock(&mix_mutex);
+}
+
+void audio_renderer_mix_set_volume(const void *id, float volume) {
+    if (!mix || fabs(volume) >= 28) {
+        return;
+    }
+    g_mutex_lock(&mix_mutex);
+    mix_source_t *source = mix_find_source(id, TRUE);
+    if (source) {
+        source->gain = floor(((28 - fabs(volume)) / 28) * 10) / 10;
+        if (source->mixer_pad) {
+            g_object_set(source->mixer_pad, "volume", source->gain, NULL);
+        }
+    }
+    g_mutex_unlock(&mix_mutex);
+}
+
+/* (mix_mutex locked) */
+static void mix_remove_source(mix_source_t *source) {
+    if (source->bin) {
+        if (source->frames) {
+            mix_report(source, LOGGER_INFO);
+        }
+        gst_element_set_state(source->bin, GST_STATE_NULL);
+        GstPad *src_pad = gst_element_get_static_pad(source->bin, "src");
+        gst_pad_unlink(src_pad, source->mixer_pad);
+        gst_object_unref(src_pad);
+        gst_element_release_request_pad(mixer, source->mixer_pad);
+        gst_object_unref(source->mixer_pad);
+        gst_object_unref(source->appsrc);
+        gst_bin_remove(GST_BIN(mix->pipeline), source->bin);
+        if (--mix_source_count == 0) {
+            gst_element_set_state(mix->pipeline, GST_STATE_NULL);
+        }
+        logger_log(logger, LOGGER_INFO, "party audio: source %d left the mix (%d of %d)", source->number,
+                   mix_source_count, mix_sources_max);
+    }
+    memset(source, 0, sizeof(mix_source_t));
+}
+
+void audio_renderer_mix_remove(const void *id) {
+    if (!mix) {
+        return;
+    }
+    g_mutex_lock(&mix_mutex);
+    mix_source_t *source = mix_find_source(id, FALSE);
+    if (source) {
+        mix_remove_source(source);
+    }
+    g_mutex_unlock(&mix_mutex);
+}
+
+static void mix_destroy() {
+    for (int i = 0; i < mix_sources_max; i++) {
+        if (mix_sources[i].id) {
+            mix_remove_source(&mix_sources[i]);
+        }
+    }
+    free(mix_sources);
+    mix_sources = NULL;
+    gst_object_unref(mixer);
+    mixer = NULL;
+    gst_object_unref(mix->volume);
+    gst_object_unref(mix->pipeline);
+    free(mix);
+    mix = NULL;
+    g_mutex_clear(&mix_mutex);
+}
+
+static GstPadProbeReturn shorten_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    if (!g_atomic_int_get(&shorten_pending)) {
+        return GST_PAD_PROBE_OK;
+    }
+    GstElement *queue = GST_ELEMENT(user_data);
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    bool drop = false;
+    if (sync && GST_BUFFER_PTS_IS_VALID(buffer)) {
+        GstClock *clock = gst_element_get_clock(queue);
+        if (clock) {
+            GstClockTime now = gst_clock_get_time(clock);
+            gst_object_unref(clock);
+            drop = (now > gst_audio_pipeline_base_time && GST_BUFFER_PTS(buffer) < now - gst_audio_pipeline_base_time);
+        }
+    } else {
+        guint level = 0;
+        g_object_get(queue, "current-level-buffers", &level, NULL);
+        drop = (level > SHORTEN_TARGET_FRAMES);
+    }
+    if (drop) {
+        shorten_dropped++;
+        return GST_PAD_PROBE_DROP;
+    }
+    logger_log(logger, LOGGER_INFO, "audio overload: dropped %u %s audio frames", shorten_dropped,
+               (sync ? "late" : "backlogged"));
+    shorten_dropped = 0;
+    g_atomic_int_set(&shorten_pending, 0);
+    return GST_PAD_PROBE_OK;
+}
+
 void audio_renderer_init(logger_t *render_logger, const char* audiosink, const bool* audio_sync, const bool* video_sync) {
     GError *error = NULL;
     GstCaps *caps = NULL;
@@ -135,12 +689,20 @@ void audio_renderer_init(logger_t *render_logger, const char* audiosink, const b
 
     aac = check_plugin_feature (avdec_aac);
     alac = check_plugin_feature (avdec_alac);
+    if (rtp_clients && !check_rtp_output_elements()) {
+        logger_log(logger, LOGGER_ERR, "RTP audio output to %s is disabled", rtp_clients);
+        audio_renderer_set_rtp_output(NULL, false);
+    }
+
+    if (mix_sources_max) {
+        mix_init(audiosink, clock);
+    }
 
     for (int i = 0; i < NFORMATS ; i++) {
         renderer_type[i] = (audio_renderer_t *)  calloc(1,sizeof(audio_renderer_t));
         g_assert(renderer_type[i]);
         GString *launch = g_string_new("appsrc name=audio_source ! ");
-        g_string_append(launch, "queue ! ");
+        g_string_append(launch, "queue name=audio_queue ! ");
         switch (i) {
         case 0:    /* AAC-ELD */
         case 2:    /* AAC-LC */
@@ -157,6 +719,9 @@ void audio_renderer_init(logger_t *render_logger, const char* audiosink, const b
         g_string_append (launch, "audioconvert ! ");
         g_string_append (launch, "audioresample ! ");    /* wasapisink must resample from 44.1 kHz to 48 kHz */
         g_string_append (launch, "volume name=volume ! level ! ");
+        if (rtp_clients) {
+            g_string_append (launch, "tee name=net_tee ! queue ! audioconvert ! audioresample ! ");
+        }
         g_string_append (launch, audiosink);
         switch(i) {
         case 1:  /*ALAC*/
@@ -178,6 +743,9 @@ void audio_renderer_init(logger_t *render_logger, const char* audiosink, const b
             }
             break;
         }
+        if (rtp_clients) {
+            append_rtp_output(launch);
+        }
         renderer_type[i]->pipeline  = gst_parse_launch(launch->str, &error);
 	if (error) {
           g_error ("gst_parse_launch error (audio %d):\n %s\n", i+1, error->message);
@@ -189,6 +757,21 @@ void audio_renderer_init(logger_t *render_logger, const char* audiosink, const b
 
         renderer_type[i]->appsrc = gst_bin_get_by_name (GST_BIN (renderer_type[i]->pipeline), "audio_source");
         renderer_type[i]->volume = gst_bin_get_by_name (GST_BIN (renderer_type[i]->pipeline), "volume");
+        GstPad *volume_pad = gst_element_get_static_pad(renderer_type[i]->volume, "src");
+        if (volume_pad) {
+            gst_pad_add_probe(volume_pad, GST_PAD_PROBE_TYPE_BUFFER, sample_tap_probe, NULL, NULL);
+            gst_object_unref(volume_pad);
+        }
+        GstElement *queue = gst_bin_get_by_name (GST_BIN (renderer_type[i]->pipeline), "audio_queue");
+        GstPad *queue_pad = (queue ? gst_element_get_static_pad(queue, "src") : NULL);
+        if (queue_pad) {
+            /* (the pipeline holds the queue for as long as the probe can run) */
+            gst_pad_add_probe(queue_pad, GST_PAD_PROBE_TYPE_BUFFER, shorten_probe, queue, NULL);
+            gst_object_unref(queue_pad);
+        }
+        if (queue) {
+            gst_object_unref(queue);
+        }
         switch (i) {
         case 0:
             caps =  gst_caps_from_string(aac_eld_caps);
@@ -290,7 +873,6 @@ void  audio_renderer_start(unsigned char *ct) {
 
 void audio_renderer_render_buffer(unsigned char* data, int *data_len, unsigned short *seqnum, uint64_t *ntp_time) {
     GstBuffer *buffer;
-    bool valid;
 
     if (!render_audio) return;    /* do nothing unless render_audio == TRUE */
 
@@ -307,13 +889,6 @@ void audio_renderer_render_buffer(unsigned char* data, int *data_len, unsigned s
     }
     if (data_len == 0 || renderer == NULL) return;
 
-    /* all audio received seems to be either ct = 8 (AAC_ELD 44100/2 spf 460 ) AirPlay Mirror protocol *
-     * or ct = 2 (ALAC 44100/16/2 spf 352) AirPlay protocol.                                           *
-     * first byte data[0] of ALAC frame is 0x20,                                                       *
-     * first byte of AAC_ELD is 0x8c, 0x8d or 0x8e: 0x100011(00,01,10) in modern devices               *
-     *                   but is 0x80, 0x81 or 0x82: 0x100000(00,01,10) in ios9, ios10 devices          *
-     * first byte of AAC_LC should be 0xff (ADTS) (but has never been  seen).                          */
-    
     buffer = gst_buffer_new_allocate(NULL, *data_len, NULL);
     g_assert(buffer != NULL);
     //g_print("audio latency %8.6f\n", (double) latency / SECOND_IN_NSECS);
@@ -321,33 +896,7 @@ void audio_renderer_render_buffer(unsigned char* data, int *data_len, unsigned s
         GST_BUFFER_PTS(buffer) = pts;
     }
     gst_buffer_fill(buffer, 0, data, *data_len);
-    switch (renderer->ct){
-    case 8: /*AAC-ELD*/
-        switch (data[0]){
-        case 0x8c:
-        case 0x8d:
-        case 0x8e:
-        case 0x80:
-        case 0x81:
-        case 0x82:
-            valid = true;
-            break;          
-        default:
-            valid = false;
-            break;
-        }
-        break;
-    case 2: /*ALAC*/
-        valid = (data[0] == 0x20);
-        break;
-    case 4:  /*AAC_LC */
-        valid = (data[0] == 0xff );
- 	break;
-    default:
-        valid = true;
-        break;
-    }
-    if (valid) {
+    if (valid_frame(renderer->ct, data)) {
         gst_app_src_push_buffer(GST_APP_SRC(renderer->appsrc), buffer);
     } else {
         logger_log(logger, LOGGER_ERR, "*** ERROR invalid  audio frame (compression_type %d) skipped ", renderer->ct);
@@ -366,6 +915,13 @@ void audio_renderer_set_volume(float volume) {
 void audio_renderer_flush() {
 }
 
+/* trim the audio backlog (used when the receiver is overloaded): see shorten_probe */
+void audio_renderer_shorten_buffer() {
+    if (renderer) {
+        g_atomic_int_set(&shorten_pending, 1);
+    }
+}
+
 void audio_renderer_destroy() {
     audio_renderer_stop();
     for (int i = 0; i < NFORMATS ; i++ ) {
@@ -377,4 +933,8 @@ void audio_renderer_destroy() {
         renderer_type[i]->pipeline = NULL;
         free(renderer_type[i]);
     }
+    if (mix) {
+        mix_destroy();
+    }
+    audio_renderer_set_rtp_output(NULL, false);
 }
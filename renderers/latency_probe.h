@@ -0,0 +1,54 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * latency probe: a synthetic sender feeds the video and audio renderers with frames that carry their frame
+ * number as a pattern in the image, and with audio clicks that carry their click number as a pulse count.
+ * Taps where the frames and audio reach the sinks decode these back, giving the sender->render latency
+ * of each frame and click, and the audio/video offset.
+ */
+
+#ifndef LATENCY_PROBE_H
+#define LATENCY_PROBE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include "../lib/logger.h"
+
+typedef struct latency_probe_s latency_probe_t;
+
+/* starts sending to the video and/or audio renderer (initialized, video renderer started) for secs seconds, *
+ * video at fps frames/sec; done(cls) is called from the sender thread when it has finished.                 *
+ * Returns NULL if no h264 encoder is available (video) or the sender could not be started                  */
+latency_probe_t *latency_probe_start(logger_t *logger, bool video, bool audio, unsigned int fps, unsigned int secs,
+                                     void (*done)(void *cls), void *cls);
+
+/* stops the sender and the taps, logs the results, and returns them as a one-line JSON object (free with g_free()) */
+char *latency_probe_finish(latency_probe_t *probe);
+
+/* (after the renderers have been destroyed) */
+void latency_probe_destroy(latency_probe_t *probe);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //LATENCY_PROBE_H
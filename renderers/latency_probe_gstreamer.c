@@ -0,0 +1,545 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include "latency_probe.h"
+#include "video_renderer.h"
+#include "audio_renderer.h"
+
+/* video: I420 frames, encoded in real time (as by a sender); frame number n (24 bits) and a check byte are *
+ * drawn as 32 black (bit 0) or white (bit 1) blocks on a grey background, in two rows of 16                */
+#define PROBE_WIDTH 1280
+#define PROBE_HEIGHT 720
+#define CODE_BITS 32
+#define CODE_COLUMNS 16
+#define CODE_BLOCK 64
+#define CODE_LEFT 128
+#define CODE_TOP 128
+#define LUMA_BLACK 16
+#define LUMA_WHITE 235
+#define LUMA_GREY 128
+
+/* audio: ALAC 44100/16/2 frames of 352 samples, sent uncompressed ("escape" frames).  Click k starts at   *
+ * second k of the audio, and is (k % CLICK_CYCLE) + 1 pulses of 2 msecs, 10 msecs apart, so a click is   *
+ * identified (among those sent less than CLICK_CYCLE secs earlier) by counting its pulses                */
+#define AUDIO_CT 2
+#define AUDIO_RATE 44100
+#define AUDIO_SPF 352
+#define ALAC_FRAME_BYTES 1412   /* (23 header bits + 352 x 2 x 16 bits + 3 end bits), rounded up to bytes */
+#define PULSE_AMPLITUDE 20000
+#define PULSE_SAMPLES 88
+#define PULSE_SPACING 441
+#define CLICK_CYCLE 8
+#define PULSE_THRESHOLD 0.25f
+#define PULSE_GAP (5 * GST_MSECOND)
+#define CLICK_WINDOW (100 * GST_MSECOND)
+
+/* time for the last frames and clicks to reach the sinks after the sender stops */
+#define DRAIN_TIME (2 * G_USEC_PER_SEC)
+
+static const char h264_caps[]="video/x-h264,stream-format=(string)byte-stream,alignment=(string)au";
+
+static const char *encoders[] = { "x264enc tune=zerolatency speed-preset=ultrafast key-int-max=60",
+                                  "openh264enc", "vah264enc", "vaapih264enc", "nvh264enc",
+                                  "v4l2h264enc", "vtenc_h264", NULL };
+
+typedef struct probe_stats_s {
+    gint64 *latency;               /* nsecs */
+    unsigned int count;
+    unsigned int undecodable;
+    gint64 last;                   /* last frame or click counted (repeats are ignored) */
+} probe_stats_t;
+
+struct latency_probe_s {
+    logger_t *logger;
+    bool video, audio;
+    unsigned int fps, secs;
+    void (*done)(void *cls);
+    void *cls;
+    GThread *sender;
+    gint stop;
+
+    const char *encoder_name;
+    GstElement *encoder;           /* appsrc ! videoconvert ! h264 encoder ! h264parse ! appsink */
+    GstElement *raw_src;
+    guint8 *frame;
+
+    /* send times (nsecs, system clock) */
+    gint64 *frame_time;
+    unsigned int frames, frames_sent;
+    gint64 *click_time;
+    unsigned int clicks, clicks_sent;
+
+    GMutex mutex;
+    bool finished;
+    probe_stats_t video_stats, audio_stats;
+
+    /* click detection (audio streaming thread) */
+    GstClockTime last_loud;
+    GstClockTime burst_start;
+    unsigned int pulses;
+};
+
+static bool element_available(const char *description) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s", description);
+    char *space = strchr(name, ' ');
+    if (space) {
+        *space = '\0';
+    }
+    GstElementFactory *factory = gst_element_factory_find(name);
+    if (!factory) {
+        return false;
+    }
+    gst_object_unref(factory);
+    return true;
+}
+
+static guint8 code_check(guint32 n) {
+    return (guint8) ((n ^ (n >> 8) ^ (n >> 16) ^ 0x5a) & 0xff);
+}
+
+static void draw_frame(guint8 *frame, guint32 n) {
+    guint32 code = (n & 0xffffff) | ((guint32) code_check(n) << 24);
+    for (int bit = 0; bit < CODE_BITS; bit++) {
+        guint8 luma = ((code >> bit) & 1 ? LUMA_WHITE : LUMA_BLACK);
+        int left = CODE_LEFT + (bit % CODE_COLUMNS) * CODE_BLOCK;
+        int top = CODE_TOP + (bit / CODE_COLUMNS) * CODE_BLOCK;
+        for (int y = top; y < top + CODE_BLOCK; y++) {
+            memset(frame + y * PROBE_WIDTH + left, luma, CODE_BLOCK);
+        }
+    }
+}
+
+/* the video renderer expects each NAL unit to start with a 4-byte start code, as sent by AirPlay clients */
+static unsigned char *four_byte_start_codes(const guint8 *data, int len, int *out_len, int *nal_count) {
+    unsigned char *out = g_malloc(len + len / 3 + 4);
+    int j = 0;
+    *nal_count = 0;
+    for (int i = 0; i < len; ) {
+        if (i + 4 <= len && !data[i] && !data[i + 1] && !data[i + 2] && data[i + 3] == 1) {
+            memcpy(out + j, data + i, 4);
+            i += 4;
+        } else if (i + 3 <= len && !data[i] && !data[i + 1] && data[i + 2] == 1) {
+            out[j] = 0;
+            memcpy(out + j + 1, data + i, 3);
+            i += 3;
+        } else {
+            out[j++] = data[i++];
+            continue;
+        }
+        j += 4;
+        (*nal_count)++;
+    }
+    *out_len = j;
+    return out;
+}
+
+/* encoder streaming thread: hand the encoded frame to the renderer, with its send time as timestamp */
+static GstFlowReturn encoded_frame(GstAppSink *appsink, gpointer user_data) {
+    latency_probe_t *probe = (latency_probe_t *) user_data;
+    GstSample *sample = gst_app_sink_pull_sample(appsink);
+    if (!sample) {
+        return GST_FLOW_EOS;
+    }
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    GstMapInfo map;
+    if (buffer && GST_BUFFER_PTS_IS_VALID(buffer) && gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        guint64 n = gst_util_uint64_scale_round(GST_BUFFER_PTS(buffer), probe->fps, GST_SECOND);
+        if (n < probe->frames && !g_atomic_int_get(&probe->stop)) {
+            int len, nal_count;
+            unsigned char *data = four_byte_start_codes(map.data, (int) map.size, &len, &nal_count);
+            uint64_t ntp_time = (uint64_t) probe->frame_time[n];
+            if (len > 0) {
+                video_renderer_render_buffer(data, &len, &nal_count, &ntp_time);
+            }
+            g_free(data);
+        }
+        gst_buffer_unmap(buffer, &map);
+    }
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+}
+
+static bool start_encoder(latency_probe_t *probe) {
+    for (int i = 0; encoders[i]; i++) {
+        if (!element_available(encoders[i])) {
+            continue;
+        }
+        GError *error = NULL;
+        gchar *launch = g_strdup_printf("appsrc name=probe_raw is-live=true format=time "
+                                        "caps=video/x-raw,format=I420,width=%d,height=%d,framerate=%u/1 ! "
+                                        "videoconvert ! %s ! h264parse config-interval=-1 ! %s ! "
+                                        "appsink name=probe_h264 sync=false", PROBE_WIDTH, PROBE_HEIGHT,
+                                        probe->fps, encoders[i], h264_caps);
+        GstElement *pipeline = gst_parse_launch(launch, &error);
+        g_free(launch);
+        if (error) {
+            g_clear_error(&error);
+            if (pipeline) {
+                gst_object_unref(pipeline);
+            }
+            continue;
+        }
+        GstElement *appsink = gst_bin_get_by_name(GST_BIN(pipeline), "probe_h264");
+        GstAppSinkCallbacks callbacks;
+        memset(&callbacks, 0, sizeof(callbacks));
+        callbacks.new_sample = encoded_frame;
+        gst_app_sink_set_callbacks(GST_APP_SINK(appsink), &callbacks, probe, NULL);
+        gst_object_unref(appsink);
+        if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+            gst_element_set_state(pipeline, GST_STATE_NULL);
+            gst_object_unref(pipeline);
+            continue;
+        }
+        probe->encoder = pipeline;
+        probe->raw_src = gst_bin_get_by_name(GST_BIN(pipeline), "probe_raw");
+        probe->encoder_name = encoders[i];
+        return true;
+    }
+    return false;
+}
+
+static void send_video_frame(latency_probe_t *probe, unsigned int n) {
+    draw_frame(probe->frame, n);
+    gsize size = PROBE_WIDTH * PROBE_HEIGHT * 3 / 2;
+    GstBuffer *buffer = gst_buffer_new_allocate(NULL, size, NULL);
+    gst_buffer_fill(buffer, 0, probe->frame, size);
+    GST_BUFFER_PTS(buffer) = gst_util_uint64_scale(n, GST_SECOND, probe->fps);
+    GST_BUFFER_DURATION(buffer) = gst_util_uint64_scale(1, GST_SECOND, probe->fps);
+    probe->frame_time[n] = g_get_real_time() * 1000;
+    probe->frames_sent = n + 1;
+    gst_app_src_push_buffer(GST_APP_SRC(probe->raw_src), buffer);
+}
+
+typedef struct bit_writer_s {
+    unsigned char *data;
+    unsigned int bits;
+} bit_writer_t;
+
+static void put_bits(bit_writer_t *writer, guint32 value, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        if ((value >> i) & 1) {
+            writer->data[writer->bits / 8] |= (unsigned char) (0x80 >> (writer->bits % 8));
+        }
+        writer->bits++;
+    }
+}
+
+/* uncompressed ALAC frame: element tag (3 bits, ID_CPE), instance tag (4), unused (12), partial-frame flag (1), *
+ * bytes shifted (2), escape flag (1), the interleaved 16-bit samples, element tag ID_END (3)                    */
+static void alac_escape_frame(const gint16 *samples, unsigned char *frame) {
+    bit_writer_t writer = { frame, 0 };
+    memset(frame, 0, ALAC_FRAME_BYTES);
+    put_bits(&writer, 1, 3);
+    put_bits(&writer, 0, 4);
+    put_bits(&writer, 0, 12);
+    put_bits(&writer, 0, 1);
+    put_bits(&writer, 0, 2);
+    put_bits(&writer, 1, 1);
+    for (int i = 0; i < AUDIO_SPF * 2; i++) {
+        put_bits(&writer, (guint16) samples[i], 16);
+    }
+    put_bits(&writer, 7, 3);
+}
+
+static void send_audio_packet(latency_probe_t *probe, unsigned int packet) {
+    gint16 samples[AUDIO_SPF * 2];
+    unsigned char frame[ALAC_FRAME_BYTES];
+    gint64 now = g_get_real_time() * 1000;
+    for (int i = 0; i < AUDIO_SPF; i++) {
+        guint64 sample = (guint64) packet * AUDIO_SPF + i;
+        unsigned int click = (unsigned int) (sample / AUDIO_RATE);
+        unsigned int offset = (unsigned int) (sample % AUDIO_RATE);
+        unsigned int pulse = offset / PULSE_SPACING;
+        unsigned int phase = offset % PULSE_SPACING;
+        gint16 value = 0;
+        if (pulse <= click % CLICK_CYCLE && phase < PULSE_SAMPLES) {
+            value = (phase < PULSE_SAMPLES / 2 ? PULSE_AMPLITUDE : -PULSE_AMPLITUDE);
+        }
+        if (offset == 0 && click < probe->clicks) {
+            probe->click_time[click] = now + (gint64) i * GST_SECOND / AUDIO_RATE;
+            probe->clicks_sent = click + 1;
+        }
+        samples[2 * i] = value;
+        samples[2 * i + 1] = value;
+    }
+    alac_escape_frame(samples, frame);
+    int len = ALAC_FRAME_BYTES;
+    unsigned short seqnum = (unsigned short) packet;
+    uint64_t ntp_time = (uint64_t) now;
+    audio_renderer_render_buffer(frame, &len, &seqnum, &ntp_time);
+}
+
+static gpointer probe_sender(gpointer user_data) {
+    latency_probe_t *probe = (latency_probe_t *) user_data;
+    gint64 start = g_get_monotonic_time();
+    gint64 end = start + (gint64) probe->secs * G_USEC_PER_SEC;
+    guint64 frame = 0, packet = 0;
+    while (!g_atomic_int_get(&probe->stop)) {
+        gint64 video_due = (probe->video ? start + (gint64) (frame * G_USEC_PER_SEC / probe->fps) : G_MAXINT64);
+        gint64 audio_due = (probe->audio ? start + (gint64) (packet * AUDIO_SPF * G_USEC_PER_SEC / AUDIO_RATE) :
+                            G_MAXINT64);
+        gint64 due = MIN(video_due, audio_due);
+        if (due >= end) {
+            break;
+        }
+        gint64 now = g_get_monotonic_time();
+        if (due > now) {
+            g_usleep(due - now);
+        }
+        if (video_due <= audio_due) {
+            send_video_frame(probe, (unsigned int) frame++);
+        } else {
+            send_audio_packet(probe, (unsigned int) packet++);
+        }
+    }
+    logger_log(probe->logger, LOGGER_INFO, "latency probe: sent %u video frames, %u audio clicks",
+               probe->frames_sent, probe->clicks_sent);
+    for (gint64 drained = 0; drained < DRAIN_TIME && !g_atomic_int_get(&probe->stop); drained += G_USEC_PER_SEC / 10) {
+        g_usleep(G_USEC_PER_SEC / 10);
+    }
+    if (probe->done) {
+        probe->done(probe->cls);
+    }
+    return NULL;
+}
+
+static void add_latency(latency_probe_t *probe, probe_stats_t *stats, gint64 index, gint64 sent, gint64 rendered) {
+    g_mutex_lock(&probe->mutex);
+    if (!probe->finished && index > stats->last) {
+        stats->latency[stats->count++] = rendered - sent;
+        stats->last = index;
+    }
+    g_mutex_unlock(&probe->mutex);
+}
+
+/* videosink streaming thread: read the frame number back from the image */
+static void video_tap(void *cls, const unsigned char *pixels, int pixel_stride, int row_stride, int width, int height,
+                      uint64_t present_time) {
+    latency_probe_t *probe = (latency_probe_t *) cls;
+    guint32 code = 0;
+    for (int bit = 0; bit < CODE_BITS; bit++) {
+        int x = (CODE_LEFT + (bit % CODE_COLUMNS) * CODE_BLOCK + CODE_BLOCK / 2) * width / PROBE_WIDTH;
+        int y = (CODE_TOP + (bit / CODE_COLUMNS) * CODE_BLOCK + CODE_BLOCK / 2) * height / PROBE_HEIGHT;
+        unsigned int sum = 0;
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                sum += pixels[(y + dy) * row_stride + (x + dx) * pixel_stride];
+            }
+        }
+        if (sum > 9 * (LUMA_BLACK + LUMA_WHITE) / 2) {
+            code |= (guint32) 1 << bit;
+        }
+    }
+    guint32 n = code & 0xffffff;
+    if ((code >> 24) != code_check(n) || n >= probe->frames_sent) {
+        g_mutex_lock(&probe->mutex);
+        probe->video_stats.undecodable++;
+        g_mutex_unlock(&probe->mutex);
+        return;
+    }
+    add_latency(probe, &probe->video_stats, n, probe->frame_time[n], (gint64) present_time);
+}
+
+static void click_heard(latency_probe_t *probe, GstClockTime time, unsigned int pulses) {
+    gint64 click = -1;
+    if (pulses >= 1 && pulses <= CLICK_CYCLE) {
+        for (gint64 k = (gint64) probe->clicks_sent - 1; k >= 0; k--) {
+            if (k % CLICK_CYCLE == pulses - 1 && probe->click_time[k] <= (gint64) time) {
+                click = k;
+                break;
+            }
+        }
+    }
+    if (click < 0) {
+        g_mutex_lock(&probe->mutex);
+        probe->audio_stats.undecodable++;
+        g_mutex_unlock(&probe->mutex);
+        return;
+    }
+    add_latency(probe, &probe->audio_stats, click, probe->click_time[click], (gint64) time);
+}
+
+/* audio streaming thread: find the clicks, and count their pulses */
+static void audio_tap(void *cls, const float *samples, int count, int rate, uint64_t play_time) {
+    latency_probe_t *probe = (latency_probe_t *) cls;
+    for (int i = 0; i < count; i++) {
+        GstClockTime time = (GstClockTime) play_time + gst_util_uint64_scale(i, GST_SECOND, rate);
+        if (probe->burst_start && time - probe->burst_start > CLICK_WINDOW) {
+            click_heard(probe, probe->burst_start, probe->pulses);
+            probe->burst_start = 0;
+        }
+        if (fabsf(samples[i]) > PULSE_THRESHOLD) {
+            if (time - probe->last_loud > PULSE_GAP) {
+                if (!probe->burst_start) {
+                    probe->burst_start = time;
+                    probe->pulses = 0;
+                }
+                probe->pulses++;
+            }
+            probe->last_loud = time;
+        }
+    }
+}
+
+latency_probe_t *latency_probe_start(logger_t *logger, bool video, bool audio, unsigned int fps, unsigned int secs,
+                                     void (*done)(void *cls), void *cls) {
+    latency_probe_t *probe = g_new0(latency_probe_t, 1);
+    probe->logger = logger;
+    probe->video = video;
+    probe->audio = audio;
+    probe->fps = (fps ? fps : 30);
+    probe->secs = secs;
+    probe->done = done;
+    probe->cls = cls;
+    probe->video_stats.last = probe->audio_stats.last = -1;
+    g_mutex_init(&probe->mutex);
+
+    if (video) {
+        if (!start_encoder(probe)) {
+            logger_log(logger, LOGGER_ERR, "latency probe: no h264 encoder is available to make the test video");
+            latency_probe_destroy(probe);
+            return NULL;
+        }
+        probe->frames = probe->fps * secs + 1;
+        probe->frame_time = g_new0(gint64, probe->frames);
+        probe->video_stats.latency = g_new0(gint64, probe->frames);
+        probe->frame = g_malloc(PROBE_WIDTH * PROBE_HEIGHT * 3 / 2);
+        memset(probe->frame, LUMA_GREY, PROBE_WIDTH * PROBE_HEIGHT * 3 / 2);
+        video_renderer_set_frame_tap(video_tap, probe);
+    }
+    if (audio) {
+        unsigned char ct = AUDIO_CT;
+        probe->clicks = secs + 1;
+        probe->click_time = g_new0(gint64, probe->clicks);
+        probe->audio_stats.latency = g_new0(gint64, probe->clicks);
+        audio_renderer_set_sample_tap(audio_tap, probe);
+        audio_renderer_start(&ct);
+    }
+    logger_log(logger, LOGGER_INFO, "latency probe: sending %s%s%s for %u secs%s%s", (video ? "video" : ""),
+               (video && audio ? " and " : ""), (audio ? "audio clicks" : ""), secs, (video ? ", encoded with " : ""),
+               (video ? probe->encoder_name : ""));
+    probe->sender = g_thread_new("latency_probe", probe_sender, probe);
+    return probe;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const probe_stats_t *stats, double fraction) {
+    unsigned int index = (unsigned int) (fraction * (stats->count - 1) + 0.5);
+    return (double) stats->latency[index] / GST_MSECOND;
+}
+
+/* sorts the latencies; appends "name":{...} to json */
+static double append_stats(GString *json, const char *name, const char *sent_name, unsigned int sent,
+                           const char *count_name, probe_stats_t *stats, logger_t *logger) {
+    g_string_append_printf(json, ",\"%s\":{\"%s\":%u,\"%s\":%u,\"undecodable\":%u", name, sent_name, sent, count_name,
+                           stats->count, stats->undecodable);
+    if (!stats->count) {
+        g_string_append(json, "}");
+        logger_log(logger, LOGGER_ERR, "latency probe: no %s reached the sink (%u sent)", sent_name, sent);
+        return NAN;
+    }
+    qsort(stats->latency, stats->count, sizeof(gint64), compare_latency);
+    double total = 0;
+    for (unsigned int i = 0; i < stats->count; i++) {
+        total += (double) stats->latency[i] / GST_MSECOND;
+    }
+    double mean = total / stats->count;
+    g_string_append_printf(json, ",\"min_ms\":%.1f,\"mean_ms\":%.1f,\"p50_ms\":%.1f,\"p95_ms\":%.1f,\"p99_ms\":%.1f,"
+                           "\"max_ms\":%.1f}", percentile(stats, 0), mean, percentile(stats, 0.5),
+                           percentile(stats, 0.95), percentile(stats, 0.99), percentile(stats, 1));
+    logger_log(logger, LOGGER_INFO, "latency probe: %s: %u of %u %s, latency (msecs) min %.1f mean %.1f p50 %.1f "
+               "p95 %.1f p99 %.1f max %.1f", name, stats->count, sent, sent_name, percentile(stats, 0), mean,
+               percentile(stats, 0.5), percentile(stats, 0.95), percentile(stats, 0.99), percentile(stats, 1));
+    return mean;
+}
+
+char *latency_probe_finish(latency_probe_t *probe) {
+    g_atomic_int_set(&probe->stop, 1);
+    if (probe->sender) {
+        g_thread_join(probe->sender);
+        probe->sender = NULL;
+    }
+    if (probe->encoder) {
+        /* (its streaming thread hands frames to the video renderer) */
+        gst_element_set_state(probe->encoder, GST_STATE_NULL);
+    }
+    if (probe->video) {
+        video_renderer_set_frame_tap(NULL, NULL);
+    }
+    if (probe->audio) {
+        audio_renderer_set_sample_tap(NULL, NULL);
+    }
+    g_mutex_lock(&probe->mutex);
+    probe->finished = true;
+    g_mutex_unlock(&probe->mutex);
+
+    GString *json = g_string_new("");
+    g_string_append_printf(json, "{\"probe\":{\"secs\":%u,\"fps\":%u,\"encoder\":\"%s\"}", probe->secs, probe->fps,
+                           (probe->encoder_name ? probe->encoder_name : ""));
+    double video_mean = NAN, audio_mean = NAN;
+    if (probe->video) {
+        video_mean = append_stats(json, "video", "frames", probe->frames_sent, "rendered", &probe->video_stats,
+                                  probe->logger);
+    }
+    if (probe->audio) {
+        audio_mean = append_stats(json, "audio", "clicks", probe->clicks_sent, "played", &probe->audio_stats,
+                                  probe->logger);
+    }
+    /* > 0: audio is played later than the video sent with it */
+    if (!isnan(video_mean) && !isnan(audio_mean)) {
+        g_string_append_printf(json, ",\"av_offset_ms\":%.1f", audio_mean - video_mean);
+        logger_log(probe->logger, LOGGER_INFO, "latency probe: audio is played %.1f msecs %s than video",
+                   fabs(audio_mean - video_mean), (audio_mean > video_mean ? "later" : "earlier"));
+    }
+    g_string_append(json, "}");
+    return g_string_free(json, FALSE);
+}
+
+void latency_probe_destroy(latency_probe_t *probe) {
+    if (!probe) {
+        return;
+    }
+    if (probe->sender) {
+        g_atomic_int_set(&probe->stop, 1);
+        g_thread_join(probe->sender);
+    }
+    if (probe->encoder) {
+        gst_element_set_state(probe->encoder, GST_STATE_NULL);
+        gst_object_unref(probe->raw_src);
+        gst_object_unref(probe->encoder);
+    }
+    g_mutex_clear(&probe->mutex);
+    g_free(probe->frame);
+    g_free(probe->frame_time);
+    g_free(probe->click_time);
+    g_free(probe->video_stats.latency);
+    g_free(probe->audio_stats.latency);
+    g_free(probe);
+}
@@ -0,0 +1,44 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * AirPlay photo (JPEG) renderer using gstreamer
+ */
+
+#ifndef PHOTO_RENDERER_H
+#define PHOTO_RENDERER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "../lib/logger.h"
+
+bool photo_renderer_init (logger_t *logger, const char *videosink, unsigned short width, unsigned short height,
+                          unsigned int cache_size);
+bool photo_renderer_put (const char *asset_key, const char *data, int datalen, bool display);
+void photo_renderer_stop ();
+void photo_renderer_destroy ();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //PHOTO_RENDERER_H
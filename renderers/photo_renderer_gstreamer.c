@@ -0,0 +1,332 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include "photo_renderer.h"
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+
+#define PHOTO_DECODE_TIMEOUT (5 * GST_SECOND)
+
+/* JPEGs are decoded (on the worker thread) straight to the display size, and the decoded  *
+ * frames are kept in an LRU cache keyed by the AirPlay asset key, so "displayCached"       *
+ * requests, and photos prefetched by the client with "cacheOnly", are displayed at once.  */
+
+typedef struct photo_entry_s {
+    char *asset_key;
+    GstSample *sample;    /* NULL until decoded */
+    bool pending;         /* queued for decoding */
+    GList *link;          /* position in the LRU list */
+} photo_entry_t;
+
+typedef struct photo_job_s {
+    char *asset_key;
+    GstBuffer *jpeg;      /* NULL: already in cache */
+    bool display;
+    bool cache_hit;
+    gint64 start_time;
+    bool quit;
+} photo_job_t;
+
+typedef struct photo_renderer_s {
+    GstElement *decode_pipeline, *decode_appsrc, *decode_appsink;
+    GstElement *display_pipeline, *display_appsrc;
+    GThread *thread;
+    GAsyncQueue *jobs;
+
+    GMutex cache_mutex;
+    GHashTable *cache;
+    GQueue lru;           /* head = most recently used */
+    unsigned int cache_size;
+
+    unsigned int hits, misses;
+} photo_renderer_t;
+
+static photo_renderer_t *renderer = NULL;
+static logger_t *logger = NULL;
+static const char jpeg_caps[] = "image/jpeg,parsed=(boolean)true";
+
+static void photo_entry_free(photo_entry_t *entry) {
+    if (entry->sample) {
+        gst_sample_unref(entry->sample);
+    }
+    g_free(entry->asset_key);
+    g_free(entry);
+}
+
+static void photo_job_free(photo_job_t *job) {
+    if (job->jpeg) {
+        gst_buffer_unref(job->jpeg);
+    }
+    g_free(job->asset_key);
+    g_free(job);
+}
+
+/* call with cache_mutex locked: finds (or creates) the entry and makes it most-recently-used */
+static photo_entry_t *photo_cache_touch(const char *asset_key, bool create) {
+    photo_entry_t *entry = g_hash_table_lookup(renderer->cache, asset_key);
+    if (entry) {
+        g_queue_unlink(&renderer->lru, entry->link);
+        g_queue_push_head_link(&renderer->lru, entry->link);
+        return entry;
+    }
+    if (!create) {
+        return NULL;
+    }
+    while (g_queue_get_length(&renderer->lru) >= renderer->cache_size) {
+        photo_entry_t *oldest = g_queue_pop_tail(&renderer->lru);
+        logger_log(logger, LOGGER_DEBUG, "photo cache: evicting asset %s", oldest->asset_key);
+        g_hash_table_remove(renderer->cache, oldest->asset_key);
+        photo_entry_free(oldest);
+    }
+    entry = g_new0(photo_entry_t, 1);
+    entry->asset_key = g_strdup(asset_key);
+    g_queue_push_head(&renderer->lru, entry);
+    entry->link = g_queue_peek_head_link(&renderer->lru);
+    g_hash_table_insert(renderer->cache, entry->asset_key, entry);
+    return entry;
+}
+
+static GstSample *photo_decode(GstBuffer *jpeg) {
+    gst_app_src_push_buffer(GST_APP_SRC(renderer->decode_appsrc), gst_buffer_ref(jpeg));
+    GstSample *sample = gst_app_sink_try_pull_sample(GST_APP_SINK(renderer->decode_appsink), PHOTO_DECODE_TIMEOUT);
+    if (!sample) {
+        /* a corrupt JPEG leaves the decoding pipeline in an error state: restart it */
+        gst_element_set_state (renderer->decode_pipeline, GST_STATE_NULL);
+        gst_element_set_state (renderer->decode_pipeline, GST_STATE_PLAYING);
+    }
+    return sample;
+}
+
+static void photo_display(GstSample *sample) {
+    GstState state;
+    gst_element_get_state(renderer->display_pipeline, &state, NULL, 0);
+    if (state != GST_STATE_PLAYING) {
+        gst_element_set_state(renderer->display_pipeline, GST_STATE_PLAYING);
+    }
+    gst_app_src_set_caps(GST_APP_SRC(renderer->display_appsrc), gst_sample_get_caps(sample));
+    gst_app_src_push_buffer(GST_APP_SRC(renderer->display_appsrc), gst_buffer_ref(gst_sample_get_buffer(sample)));
+}
+
+static gpointer photo_renderer_thread(gpointer arg) {
+    while (1) {
+        photo_job_t *job = g_async_queue_pop(renderer->jobs);
+        if (job->quit) {
+            photo_job_free(job);
+            break;
+        }
+        if (job->jpeg) {
+            gint64 decode_start = g_get_monotonic_time();
+            GstSample *sample = photo_decode(job->jpeg);
+            if (!sample) {
+                logger_log(logger, LOGGER_ERR, "failed to decode photo (asset %s)", job->asset_key);
+            } else {
+                logger_log(logger, LOGGER_DEBUG, "photo asset %s decoded in %.1f ms", job->asset_key,
+                           (double) (g_get_monotonic_time() - decode_start) / 1000);
+            }
+            g_mutex_lock(&renderer->cache_mutex);
+            photo_entry_t *entry = photo_cache_touch(job->asset_key, (sample != NULL));
+            if (entry) {
+                entry->pending = false;
+                if (sample) {
+                    if (entry->sample) {
+                        gst_sample_unref(entry->sample);
+                    }
+                    entry->sample = sample;
+                }
+            }
+            g_mutex_unlock(&renderer->cache_mutex);
+        }
+        if (job->display) {
+            GstSample *sample = NULL;
+            g_mutex_lock(&renderer->cache_mutex);
+            photo_entry_t *entry = photo_cache_touch(job->asset_key, false);
+            if (entry && entry->sample) {
+                sample = gst_sample_ref(entry->sample);
+            }
+            unsigned int hits = renderer->hits;
+            unsigned int total = renderer->hits + renderer->misses;
+            g_mutex_unlock(&renderer->cache_mutex);
+            if (sample) {
+                photo_display(sample);
+                gst_sample_unref(sample);
+                logger_log(logger, LOGGER_INFO, "photo displayed in %.1f ms (%s); cache hit rate %.0f%% (%u/%u)",
+                           (double) (g_get_monotonic_time() - job->start_time) / 1000,
+                           (job->cache_hit ? "cached" : "decoded"), 100.0 * hits / total, hits, total);
+            } else {
+                logger_log(logger, LOGGER_WARNING, "photo asset %s is not available for display", job->asset_key);
+            }
+        }
+        photo_job_free(job);
+    }
+    return NULL;
+}
+
+/* returns false (and AirPlay photos are not shown) if a pipeline cannot be built */
+bool photo_renderer_init(logger_t *render_logger, const char *videosink, unsigned short width, unsigned short height,
+                         unsigned int cache_size) {
+    GError *error = NULL;
+    GstCaps *caps = NULL;
+    logger = render_logger;
+
+    renderer = calloc(1, sizeof(photo_renderer_t));
+    g_assert(renderer);
+
+    /* jpegdec has no scaled (DCT-domain) decoding, so scale to the display size right after it */
+    GString *launch = g_string_new("appsrc name=photo_source ! jpegdec ! videoconvert ! videoscale add-borders=true ! ");
+    g_string_append_printf(launch, "video/x-raw,format=BGRx,width=%u,height=%u,pixel-aspect-ratio=1/1 ! ", width, height);
+    g_string_append(launch, "appsink name=photo_decoded sync=false");
+    logger_log(logger, LOGGER_DEBUG, "GStreamer photo decoding pipeline will be:\n\"%s\"", launch->str);
+    renderer->decode_pipeline = gst_parse_launch(launch->str, &error);
+    g_string_free(launch, TRUE);
+    if (error) {
+        logger_log(logger, LOGGER_ERR, "GStreamer photo decoding pipeline failed, photos will not be shown: %s",
+                   error->message);
+        g_clear_error (&error);
+        if (renderer->decode_pipeline) {
+            gst_object_unref(renderer->decode_pipeline);
+        }
+        free(renderer);
+        renderer = NULL;
+        return false;
+    }
+    g_assert (renderer->decode_pipeline);
+
+    renderer->decode_appsrc = gst_bin_get_by_name (GST_BIN (renderer->decode_pipeline), "photo_source");
+    g_assert(renderer->decode_appsrc);
+    caps = gst_caps_from_string(jpeg_caps);
+    g_object_set(renderer->decode_appsrc, "caps", caps, "stream-type", 0, "format", GST_FORMAT_TIME, NULL);
+    gst_caps_unref(caps);
+    renderer->decode_appsink = gst_bin_get_by_name (GST_BIN (renderer->decode_pipeline), "photo_decoded");
+    g_assert(renderer->decode_appsink);
+
+    launch = g_string_new("appsrc name=photo_display ! videoconvert ! ");
+    g_string_append(launch, videosink);
+    g_string_append(launch, " name=photo_sink sync=false");
+    logger_log(logger, LOGGER_DEBUG, "GStreamer photo display pipeline will be:\n\"%s\"", launch->str);
+    renderer->display_pipeline = gst_parse_launch(launch->str, &error);
+    g_string_free(launch, TRUE);
+    if (error) {
+        logger_log(logger, LOGGER_ERR, "GStreamer photo display pipeline failed, photos will not be shown: %s",
+                   error->message);
+        g_clear_error (&error);
+        if (renderer->display_pipeline) {
+            gst_object_unref(renderer->display_pipeline);
+        }
+        gst_object_unref(renderer->decode_appsrc);
+        gst_object_unref(renderer->decode_appsink);
+        gst_object_unref(renderer->decode_pipeline);
+        free(renderer);
+        renderer = NULL;
+        return false;
+    }
+    g_assert (renderer->display_pipeline);
+    renderer->display_appsrc = gst_bin_get_by_name (GST_BIN (renderer->display_pipeline), "photo_display");
+    g_assert(renderer->display_appsrc);
+    g_object_set(renderer->display_appsrc, "stream-type", 0, "format", GST_FORMAT_TIME, NULL);
+
+    renderer->cache_size = (cache_size ? cache_size : 1);
+    renderer->cache = g_hash_table_new(g_str_hash, g_str_equal);
+    g_queue_init(&renderer->lru);
+    g_mutex_init(&renderer->cache_mutex);
+    renderer->jobs = g_async_queue_new();
+
+    gst_element_set_state (renderer->decode_pipeline, GST_STATE_PLAYING);
+    renderer->thread = g_thread_new("photo_renderer", photo_renderer_thread, NULL);
+    logger_log(logger, LOGGER_DEBUG, "Initialized GStreamer photo renderer (%ux%u, cache size %u)",
+               width, height, renderer->cache_size);
+    return true;
+}
+
+/* returns false only if the photo is to be displayed from the cache but is not cached */
+bool photo_renderer_put(const char *asset_key, const char *data, int datalen, bool display) {
+    if (!renderer) {
+        return false;
+    }
+    photo_job_t *job = g_new0(photo_job_t, 1);
+    job->start_time = g_get_monotonic_time();
+    job->display = display;
+
+    g_mutex_lock(&renderer->cache_mutex);
+    /* a photo still being decoded (e.g. prefetched with "cacheOnly") counts as cached */
+    photo_entry_t *entry = photo_cache_touch(asset_key, false);
+    job->cache_hit = (entry && (entry->sample || entry->pending));
+    if (!job->cache_hit) {
+        if (!data) {
+            if (display) {
+                renderer->misses++;
+            }
+            g_mutex_unlock(&renderer->cache_mutex);
+            g_free(job);
+            return false;
+        }
+        entry = photo_cache_touch(asset_key, true);
+        entry->pending = true;
+    }
+    if (display) {
+        if (job->cache_hit) {
+            renderer->hits++;
+        } else {
+            renderer->misses++;
+        }
+    }
+    g_mutex_unlock(&renderer->cache_mutex);
+
+    job->asset_key = g_strdup(asset_key);
+    if (!job->cache_hit) {
+        job->jpeg = gst_buffer_new_allocate(NULL, datalen, NULL);
+        g_assert(job->jpeg);
+        gst_buffer_fill(job->jpeg, 0, data, datalen);
+    }
+    g_async_queue_push(renderer->jobs, job);
+    return true;
+}
+
+void photo_renderer_stop() {
+    if (renderer) {
+        gst_element_set_state (renderer->display_pipeline, GST_STATE_NULL);
+    }
+}
+
+void photo_renderer_destroy() {
+    if (renderer) {
+        photo_job_t *job = g_new0(photo_job_t, 1);
+        job->quit = true;
+        g_async_queue_push(renderer->jobs, job);
+        g_thread_join(renderer->thread);
+        g_async_queue_unref(renderer->jobs);
+
+        gst_app_src_end_of_stream (GST_APP_SRC(renderer->decode_appsrc));
+        gst_element_set_state (renderer->decode_pipeline, GST_STATE_NULL);
+        gst_element_set_state (renderer->display_pipeline, GST_STATE_NULL);
+        gst_object_unref (renderer->decode_appsrc);
+        gst_object_unref (renderer->decode_appsink);
+        gst_object_unref (renderer->decode_pipeline);
+        gst_object_unref (renderer->display_appsrc);
+        gst_object_unref (renderer->display_pipeline);
+
+        photo_entry_t *entry;
+        while ((entry = g_queue_pop_head(&renderer->lru))) {
+            photo_entry_free(entry);
+        }
+        g_hash_table_destroy(renderer->cache);
+        g_mutex_clear(&renderer->cache_mutex);
+        free (renderer);
+        renderer = NULL;
+    }
+}
@@ -0,0 +1,50 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * measured selection of the h264 decoder, converter and videosink used by the video renderer
+ */
+
+#ifndef VIDEO_AUTOTUNE_H
+#define VIDEO_AUTOTUNE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include "../lib/logger.h"
+
+#define VIDEO_AUTOTUNE_ELEMENT_LEN 64
+
+typedef struct video_chain_s {
+    char decoder[VIDEO_AUTOTUNE_ELEMENT_LEN];
+    char converter[VIDEO_AUTOTUNE_ELEMENT_LEN];
+    char videosink[VIDEO_AUTOTUNE_ELEMENT_LEN];
+} video_chain_t;
+
+/* reads the chain from cachefile (if it was saved with the same GStreamer version and parser, and    *
+ * reprobe is false), otherwise times each available decoder ! converter ! videosink chain on a test   *
+ * clip, and saves the fastest working one in cachefile.  Returns false if no working chain was found  */
+bool video_autotune (logger_t *logger, const char *cachefile, bool reprobe, const char *parser, video_chain_t *chain);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //VIDEO_AUTOTUNE_H
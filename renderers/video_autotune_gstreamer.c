@@ -0,0 +1,341 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <stdio.h>
+#include "video_autotune.h"
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+
+/* the test clip: CLIP_FRAMES frames of 1920x1080 h264 video at CLIP_FPS, with an IDR frame every second.  *
+ * The first CLIP_PACED_FRAMES are pushed in real time to measure decode->render latency, the rest as     *
+ * fast as the chain accepts them, to measure throughput                                                  */
+#define CLIP_WIDTH 1920
+#define CLIP_HEIGHT 1080
+#define CLIP_FPS 60
+#define CLIP_FRAMES 120
+#define CLIP_PACED_FRAMES 60
+#define CHAIN_TIMEOUT (10 * GST_SECOND)
+
+static const char h264_caps[]="video/x-h264,stream-format=(string)byte-stream,alignment=(string)au";
+
+static const char *encoders[] = { "x264enc tune=zerolatency speed-preset=ultrafast key-int-max=60",
+                                  "openh264enc", "vah264enc", "vaapih264enc", "nvh264enc",
+                                  "v4l2h264enc", "vtenc_h264", NULL };
+static const char *decoders[] = { "decodebin", "avdec_h264", "v4l2h264dec", "v4l2slh264dec", "vah264dec",
+                                  "vaapih264dec", "nvh264dec", "vtdec", "d3d11h264dec", NULL };
+static const char *converters[] = { "videoconvert", "v4l2convert", "vapostproc", "vaapipostproc",
+                                    "d3d11convert", NULL };
+static const char *videosinks[] = { "autovideosink", "glimagesink", "xvimagesink", "ximagesink", "waylandsink",
+                                    "kmssink", "vaapisink", "osxvideosink", "d3d11videosink", NULL };
+
+typedef struct chain_timing_s {
+    gint64 push_time[CLIP_FRAMES];
+    gint64 render_time[CLIP_FRAMES];
+    int rendered;
+} chain_timing_t;
+
+static logger_t *logger = NULL;
+
+/* true if the (first word of the) element description is an installed element */
+static bool element_available(const char *description) {
+    char name[VIDEO_AUTOTUNE_ELEMENT_LEN];
+    snprintf(name, sizeof(name), "%s", description);
+    char *space = strchr(name, ' ');
+    if (space) {
+        *space = '\0';
+    }
+    GstElementFactory *factory = gst_element_factory_find(name);
+    if (!factory) {
+        return false;
+    }
+    gst_object_unref(factory);
+    return true;
+}
+
+static GstMessage *wait_for_end(GstElement *pipeline) {
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstMessage *message = gst_bus_timed_pop_filtered(bus, CHAIN_TIMEOUT, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    gst_object_unref(bus);
+    return message;
+}
+
+/* encode the test clip in memory with the first available h264 encoder */
+static GPtrArray *make_test_clip() {
+    for (int i = 0; encoders[i]; i++) {
+        if (!element_available(encoders[i])) {
+            continue;
+        }
+        GError *error = NULL;
+        gchar *launch = g_strdup_printf("videotestsrc num-buffers=%d pattern=smpte ! "
+                                        "video/x-raw,width=%d,height=%d,framerate=%d/1 ! videoconvert ! %s ! "
+                                        "h264parse ! %s ! appsink name=clip sync=false",
+                                        CLIP_FRAMES, CLIP_WIDTH, CLIP_HEIGHT, CLIP_FPS, encoders[i], h264_caps);
+        GstElement *pipeline = gst_parse_launch(launch, &error);
+        g_free(launch);
+        if (error) {
+            g_clear_error(&error);
+            if (pipeline) {
+                gst_object_unref(pipeline);
+            }
+            continue;
+        }
+        GstElement *appsink = gst_bin_get_by_name(GST_BIN(pipeline), "clip");
+        GPtrArray *clip = g_ptr_array_new_with_free_func((GDestroyNotify) gst_buffer_unref);
+        gst_element_set_state(pipeline, GST_STATE_PLAYING);
+        GstSample *sample;
+        while ((sample = gst_app_sink_try_pull_sample(GST_APP_SINK(appsink), CHAIN_TIMEOUT))) {
+            g_ptr_array_add(clip, gst_buffer_ref(gst_sample_get_buffer(sample)));
+            gst_sample_unref(sample);
+        }
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        gst_object_unref(appsink);
+        gst_object_unref(pipeline);
+        if (clip->len == CLIP_FRAMES) {
+            logger_log(logger, LOGGER_DEBUG, "video autotune: test clip encoded with %s", encoders[i]);
+            return clip;
+        }
+        g_ptr_array_free(clip, TRUE);
+    }
+    return NULL;
+}
+
+/* the frame index i is recovered from the pts (i * GST_SECOND / CLIP_FPS, rounded down when pushed) by rounding, *
+ * so that render_time[i] pairs with push_time[i]                                                                  */
+static GstPadProbeReturn render_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    chain_timing_t *timing = (chain_timing_t *) user_data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if (GST_BUFFER_PTS_IS_VALID(buffer)) {
+        guint64 index = gst_util_uint64_scale_round(GST_BUFFER_PTS(buffer), CLIP_FPS, GST_SECOND);
+        if (index < CLIP_FRAMES && !timing->render_time[index]) {
+            timing->render_time[index] = g_get_monotonic_time();
+            timing->rendered++;
+        }
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+/* returns false if the chain does not work; otherwise the mean latency (msecs) and throughput (fps) */
+static bool time_chain(GPtrArray *clip, const char *parser, const char *decoder, const char *converter,
+                       const char *videosink, double *latency, double *fps) {
+    GError *error = NULL;
+    gchar *launch = g_strdup_printf("appsrc name=video_source ! %s ! %s ! %s ! %s name=video_sink sync=false",
+                                    parser, decoder, converter, videosink);
+    GstElement *pipeline = gst_parse_launch(launch, &error);
+    g_free(launch);
+    if (error) {
+        g_clear_error(&error);
+        if (pipeline) {
+            gst_object_unref(pipeline);
+        }
+        return false;
+    }
+    GstElement *appsrc = gst_bin_get_by_name(GST_BIN(pipeline), "video_source");
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline), "video_sink");
+    GstCaps *caps = gst_caps_from_string(h264_caps);
+    g_object_set(appsrc, "caps", caps, "format", GST_FORMAT_TIME, "block", TRUE, NULL);
+    gst_caps_unref(caps);
+
+    chain_timing_t *timing = g_new0(chain_timing_t, 1);
+    GstPad *sink_pad = gst_element_get_static_pad(sink, "sink");
+    if (sink_pad) {
+        gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_BUFFER, render_probe, timing, NULL);
+        gst_object_unref(sink_pad);
+    }
+
+    bool works = (gst_element_set_state(pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE);
+    gint64 start = g_get_monotonic_time();
+    gint64 unpaced_start = 0;
+    for (int i = 0; works && i < CLIP_FRAMES; i++) {
+        if (i < CLIP_PACED_FRAMES) {
+            gint64 due = start + (gint64) i * G_USEC_PER_SEC / CLIP_FPS;
+            gint64 now = g_get_monotonic_time();
+            if (due > now) {
+                g_usleep(due - now);
+            }
+        } else if (i == CLIP_PACED_FRAMES) {
+            unpaced_start = g_get_monotonic_time();
+        }
+        GstBuffer *buffer = gst_buffer_copy(g_ptr_array_index(clip, i));
+        GST_BUFFER_PTS(buffer) = gst_util_uint64_scale((guint64) i, GST_SECOND, CLIP_FPS);
+        GST_BUFFER_DTS(buffer) = GST_CLOCK_TIME_NONE;
+        timing->push_time[i] = g_get_monotonic_time();
+        if (gst_app_src_push_buffer(GST_APP_SRC(appsrc), buffer) != GST_FLOW_OK) {
+            works = false;
+        }
+    }
+    if (works) {
+        gst_app_src_end_of_stream(GST_APP_SRC(appsrc));
+        GstMessage *message = wait_for_end(pipeline);
+        works = (message && GST_MESSAGE_TYPE(message) == GST_MESSAGE_EOS);
+        if (message) {
+            gst_message_unref(message);
+        }
+    }
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+
+    /* accept chains that drop a few frames (e.g. while the window opens) */
+    if (works && timing->rendered >= CLIP_FRAMES * 9 / 10 && timing->render_time[CLIP_FRAMES - 1]) {
+        double total = 0;
+        int count = 0;
+        for (int i = 0; i < CLIP_PACED_FRAMES; i++) {
+            if (timing->render_time[i]) {
+                total += (double) (timing->render_time[i] - timing->push_time[i]) / 1000;
+                count++;
+            }
+        }
+        gint64 duration = timing->render_time[CLIP_FRAMES - 1] - unpaced_start;
+        *latency = (count ? total / count : 0);
+        *fps = (duration > 0 ? (double) (CLIP_FRAMES - CLIP_PACED_FRAMES) * G_USEC_PER_SEC / duration : 0);
+    } else {
+        works = false;
+    }
+    g_free(timing);
+    gst_object_unref(sink);
+    gst_object_unref(appsrc);
+    gst_object_unref(pipeline);
+    return works;
+}
+
+static bool read_cache(const char *cachefile, const char *parser, video_chain_t *chain) {
+    gchar *contents = NULL;
+    if (!g_file_get_contents(cachefile, &contents, NULL, NULL)) {
+        return false;
+    }
+    gchar *version = gst_version_string();
+    bool version_ok = false, parser_ok = false;
+    memset(chain, 0, sizeof(video_chain_t));
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    for (int i = 0; lines[i]; i++) {
+        char *value = strchr(lines[i], '=');
+        if (!value) {
+            continue;
+        }
+        *value++ = '\0';
+        if (!strcmp(lines[i], "gstreamer")) {
+            version_ok = !strcmp(value, version);
+        } else if (!strcmp(lines[i], "parser")) {
+            parser_ok = !strcmp(value, parser);
+        } else if (!strcmp(lines[i], "decoder")) {
+            snprintf(chain->decoder, sizeof(chain->decoder), "%s", value);
+        } else if (!strcmp(lines[i], "converter")) {
+            snprintf(chain->converter, sizeof(chain->converter), "%s", value);
+        } else if (!strcmp(lines[i], "videosink")) {
+            snprintf(chain->videosink, sizeof(chain->videosink), "%s", value);
+        }
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    if (!version_ok || !parser_ok) {
+        logger_log(logger, LOGGER_INFO, "video autotune: %s was made for a different GStreamer or parser, re-probing",
+                   cachefile);
+        g_free(version);
+        return false;
+    }
+    g_free(version);
+    return (chain->decoder[0] && chain->converter[0] && chain->videosink[0]);
+}
+
+static void write_cache(const char *cachefile, const char *parser, const video_chain_t *chain) {
+    gchar *version = gst_version_string();
+    gchar *contents = g_strdup_printf("gstreamer=%s\nparser=%s\ndecoder=%s\nconverter=%s\nvideosink=%s\n",
+                                      version, parser, chain->decoder, chain->converter, chain->videosink);
+    GError *error = NULL;
+    if (!g_file_set_contents(cachefile, contents, -1, &error)) {
+        logger_log(logger, LOGGER_ERR, "video autotune: could not save %s: %s", cachefile, error->message);
+        g_clear_error(&error);
+    }
+    g_free(contents);
+    g_free(version);
+}
+
+bool video_autotune(logger_t *render_logger, const char *cachefile, bool reprobe, const char *parser,
+                    video_chain_t *chain) {
+    logger = render_logger;
+    if (!reprobe && cachefile && read_cache(cachefile, parser, chain)) {
+        logger_log(logger, LOGGER_INFO, "video autotune: using \"%s ! %s ! %s\" (from %s)",
+                   chain->decoder, chain->converter, chain->videosink, cachefile);
+        return true;
+    }
+
+    GPtrArray *clip = make_test_clip();
+    if (!clip) {
+        logger_log(logger, LOGGER_ERR, "video autotune: no h264 encoder available to make a test clip");
+        return false;
+    }
+    logger_log(logger, LOGGER_INFO, "video autotune: timing decoder ! converter ! videosink chains"
+               " (test windows may open briefly)");
+
+    /* prefer the lowest latency among chains that keep up with the clip frame rate, *
+     * otherwise the highest throughput                                              */
+    bool found = false, best_realtime = false;
+    double best_latency = 0, best_fps = 0;
+    for (int d = 0; decoders[d]; d++) {
+        if (!element_available(decoders[d])) {
+            continue;
+        }
+        for (int c = 0; converters[c]; c++) {
+            if (!element_available(converters[c])) {
+                continue;
+            }
+            for (int s = 0; videosinks[s]; s++) {
+                if (!element_available(videosinks[s])) {
+                    continue;
+                }
+                double latency, fps;
+                if (!time_chain(clip, parser, decoders[d], converters[c], videosinks[s], &latency, &fps)) {
+                    logger_log(logger, LOGGER_INFO, "video autotune: %s ! %s ! %s: does not work",
+                               decoders[d], converters[c], videosinks[s]);
+                    continue;
+                }
+                logger_log(logger, LOGGER_INFO, "video autotune: %s ! %s ! %s: latency %.1f ms, %.0f fps",
+                           decoders[d], converters[c], videosinks[s], latency, fps);
+                bool realtime = (fps >= CLIP_FPS);
+                bool better;
+                if (!found) {
+                    better = true;
+                } else if (realtime != best_realtime) {
+                    better = realtime;
+                } else {
+                    better = (realtime ? latency < best_latency : fps > best_fps);
+                }
+                if (better) {
+                    found = true;
+                    best_realtime = realtime;
+                    best_latency = latency;
+                    best_fps = fps;
+                    snprintf(chain->decoder, sizeof(chain->decoder), "%s", decoders[d]);
+                    snprintf(chain->converter, sizeof(chain->converter), "%s", converters[c]);
+                    snprintf(chain->videosink, sizeof(chain->videosink), "%s", videosinks[s]);
+                }
+            }
+        }
+    }
+    g_ptr_array_free(clip, TRUE);
+
+    if (!found) {
+        logger_log(logger, LOGGER_ERR, "video autotune: no working decoder ! converter ! videosink chain was found");
+        return false;
+    }
+    logger_log(logger, LOGGER_INFO, "video autotune: selected \"%s ! %s ! %s\" (latency %.1f ms, %.0f fps)",
+               chain->decoder, chain->converter, chain->videosink, best_latency, best_fps);
+    if (cachefile) {
+        write_cache(cachefile, parser, chain);
+    }
+    return true;
+}
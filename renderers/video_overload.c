@@ -0,0 +1,63 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <string.h>
+#include <assert.h>
+
+#include "video_renderer.h"
+#include "video_overload.h"
+
+void video_overload_init(video_overload_t *overload, uint64_t threshold) {
+    memset(overload, 0, sizeof(video_overload_t));
+    overload->threshold = threshold;
+    overload->level = OVERLOAD_NONE;
+}
+
+overload_action_t video_overload_update(video_overload_t *overload, uint64_t backlog, uint64_t now) {
+    assert(overload->threshold);
+    uint64_t level = backlog / overload->threshold;
+    overload->level = (int) (level < OVERLOAD_REJECT_SESSIONS ? level : OVERLOAD_REJECT_SESSIONS);
+    if (overload->level >= OVERLOAD_SKIP_TO_IDR && !overload->skip_to_idr) {
+        overload->skip_to_idr = true;
+        overload->skip_start = now;
+    }
+    if (overload->skip_to_idr) {
+        /* senders may not send another IDR frame for a long time (or until asked to, by a new connection) */
+        if (now - overload->skip_start > OVERLOAD_IDR_WAIT) {
+            overload->skip_to_idr = false;
+            return OVERLOAD_RESTART;
+        }
+        return OVERLOAD_CHECK;
+    }
+    return (overload->level >= OVERLOAD_DROP_NONREF ? OVERLOAD_CHECK : OVERLOAD_PASS);
+}
+
+overload_action_t video_overload_frame(video_overload_t *overload, bool idr, bool reference) {
+    if (overload->skip_to_idr) {
+        if (!idr) {
+            overload->dropped_skip++;
+            return OVERLOAD_DROP;
+        }
+        overload->skip_to_idr = false;
+    }
+    if (!reference && !idr) {
+        overload->dropped_nonref++;
+        return OVERLOAD_DROP;
+    }
+    return OVERLOAD_PASS;
+}
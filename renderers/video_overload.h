@@ -0,0 +1,63 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * video overload policy (-overload): which frames to drop for a given backlog of the video pipeline
+ * (kept free of GStreamer, so it can be driven with a synthetic backlog)
+ */
+
+#ifndef VIDEO_OVERLOAD_H
+#define VIDEO_OVERLOAD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* longest wait for an IDR frame after starting to skip to one: then the stream is restarted */
+#define OVERLOAD_IDR_WAIT 2000000000ULL
+
+typedef enum overload_action_e {
+    OVERLOAD_PASS,      /* the frame is rendered */
+    OVERLOAD_CHECK,     /* depends on the frame type: call video_overload_frame() */
+    OVERLOAD_DROP,      /* the frame is dropped */
+    OVERLOAD_RESTART,   /* no IDR frame arrived within OVERLOAD_IDR_WAIT: the stream must be restarted */
+} overload_action_t;
+
+typedef struct video_overload_s {
+    uint64_t threshold;          /* nsecs; backlog levels are multiples of this */
+    int level;                   /* overload_level_t (video_renderer.h) */
+    bool skip_to_idr;
+    uint64_t skip_start;         /* when skipping to the next IDR frame started (nsecs) */
+    unsigned int dropped_nonref;
+    unsigned int dropped_skip;
+} video_overload_t;
+
+void video_overload_init(video_overload_t *overload, uint64_t threshold);
+/* update the level for the backlog (nsecs) at time now (nsecs): OVERLOAD_PASS, OVERLOAD_CHECK or OVERLOAD_RESTART */
+overload_action_t video_overload_update(video_overload_t *overload, uint64_t backlog, uint64_t now);
+/* after OVERLOAD_CHECK: OVERLOAD_PASS or OVERLOAD_DROP for a frame of this type */
+overload_action_t video_overload_frame(video_overload_t *overload, bool idr, bool reference);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //VIDEO_OVERLOAD_H
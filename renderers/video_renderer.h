@@ -45,6 +45,14 @@ typedef enum videoflip_e {
     HFLIP,
 } videoflip_t;
 
+typedef enum overload_level_e {
+    OVERLOAD_NONE,
+    OVERLOAD_DROP_NONREF,
+    OVERLOAD_SKIP_TO_IDR,
+    OVERLOAD_SHORTEN_AUDIO,
+    OVERLOAD_REJECT_SESSIONS,
+} overload_level_t;
+
 typedef struct video_renderer_s video_renderer_t;
 
 void video_renderer_init (logger_t *logger, const char *server_name, videoflip_t videoflip[2], const char *parser,
@@ -60,6 +68,27 @@ void video_renderer_flush ();
 unsigned int video_renderer_listen(void *loop);
 void video_renderer_destroy ();
 void video_renderer_size(float *width_source, float *height_source, float *width, float *height);
+void video_renderer_set_overload_threshold(unsigned int threshold_ms);
+int video_renderer_overload_level();
+void video_renderer_set_fast_start(bool enable);
+/* display refresh rate for frame pacing (-hfr), 0 for the videosink defaults (call before video_renderer_init) */
+void video_renderer_set_frame_rate(unsigned int fps);
+/* video wall display node (call before video_renderer_init) */
+void video_renderer_set_tile(unsigned int cols, unsigned int rows, unsigned int col, unsigned int row);
+void video_renderer_set_presented_callback(void (*callback)(void *cls, uint64_t pts, int64_t lateness), void *cls);
+/* total number of video frames that reached the videosink */
+uint64_t video_renderer_frames_rendered();
+/* -hud: overlay performance text on the video (call before video_renderer_init); it is shown or hidden *
+ * with the "h" key (X11 videosinks)                                                                   */
+void video_renderer_set_hud(bool enable);
+/* true if the HUD text is currently visible (not toggled off, and the window is not hidden) */
+bool video_renderer_hud_shown();
+void video_renderer_set_hud_text(const char *text);
+/* latency probe: callback gets one component (luma, or green) of each frame that reaches the videosink, and the *
+ * time (nsecs, system clock) at which the videosink presents it                                                 */
+void video_renderer_set_frame_tap(void (*callback)(void *cls, const unsigned char *pixels, int pixel_stride,
+                                                   int row_stride, int width, int height, uint64_t present_time),
+                                  void *cls);
   
   /* not implemented for gstreamer */
 void video_renderer_update_background (int type); 
@@ -21,19 +21,35 @@
  */
 
 #include "video_renderer.h"
+#include "video_overload.h"
 #include <gst/gst.h>
 #include <gst/app/gstappsrc.h>
+#include <gst/video/video.h>
 
 #define SECOND_IN_NSECS 1000000000UL
+#define FAST_START_FRAMES 30   /* frames rendered with relaxed max-lateness after a (re)start */
 #ifdef X_DISPLAY_FIX
 #include <gst/video/navigation.h>
+#include <glib-unix.h>
+#include <time.h>
 #include "x_display_fix.h"
 static bool fullscreen = false;
 static bool alt_keypress = false;
 #define MAX_X11_SEARCH_ATTEMPTS 5   /*should be less than 256 */
 static unsigned char X11_search_attempts; 
+/* X11 calls are only made on the main-loop thread (which also handles the bus messages, e.g. F11):  *
+ * the streaming thread requests the window search, and reads the "hidden" flag that it maintains     */
+enum { X11_SEARCH_IDLE, X11_SEARCH_PENDING, X11_SEARCH_DONE };
+static gint X11_search = X11_SEARCH_IDLE;
+static guint visibility_source = 0;
+static gint64 visibility_time = 0, visibility_cpu = 0;
+static double visible_cpu_load = 0.0;
 #endif
 
+/* while the X11 window is hidden, non-reference frames are dropped before decoding, and decoded frames *
+ * before conversion                                                                                     */
+static gint hidden = 0;
+static gint hidden_dropped = 0, hidden_skipped = 0;
 static video_renderer_t *renderer = NULL;
 static GstClockTime gst_video_pipeline_base_time = GST_CLOCK_TIME_NONE;
 static logger_t *logger = NULL;
@@ -41,8 +57,66 @@ static unsigned short width, height, width_source, height_source;  /* not curren
 static bool first_packet = false;
 static bool sync = false;
 
+/* overload control: backlog thresholds are multiples of overload_threshold (0 = off) */
+static GstClockTime overload_threshold = 0;
+static video_overload_t overload = { 0 };
+static gint64 rate_window_start = 0;
+static guint64 rate_window_bytes = 0;
+static guint64 bytes_per_sec = 0;
+
+/* fast start: render from the first IDR frame, without waiting for sync or dropping late frames */
+static bool fast_start = false;
+static unsigned int fast_start_frames = 0;
+static bool waiting_for_idr = false;
+static bool first_frame_pending = false;
+static gint64 codec_data_time = 0;
+static GstElement *lateness_sink = NULL;
+static gint64 max_lateness = -1;
+
+/* in-place recovery from stream errors: more than MAX_RECOVERIES errors within RECOVERY_WINDOW secs, *
+ * or no IDR frame to restart decoding at within RECOVERY_IDR_WAIT secs, escalate to a full restart   *
+ * of the pipeline (as for errors that are not recoverable)                                           */
+#define MAX_RECOVERIES 3
+#define RECOVERY_WINDOW 10
+#define RECOVERY_IDR_WAIT 2
+/* recovery_state is set by the bus callback (main loop), advanced by the thread that pushes frames, and reset *
+ * by the pad probe (streaming thread); recovery_start and recovery_dropped are only used after reading it     */
+enum { RECOVERY_NONE, RECOVERY_WAIT_IDR, RECOVERY_RESUMED };
+static bool sink_has_rendered = false;
+static gint recovery_state = RECOVERY_NONE;
+static gint64 recovery_start = 0;
+static gint64 recovery_window_start = 0;
+static unsigned int recoveries = 0, recoveries_total = 0, recovery_dropped = 0;
+/* last SPS + PPS (+ SEI) NAL units, prepended to the first IDR frame after a recovery if needed */
+static unsigned char *codec_data = NULL;
+static int codec_data_len = 0;
+
+/* video wall display node: show tile (col, row) of a cols x rows wall, and report when frames are presented */
+static unsigned int tile_cols = 0, tile_rows = 0, tile_col = 0, tile_row = 0;
+static void (*presented_callback)(void *cls, uint64_t pts, int64_t lateness) = NULL;
+static void *presented_cls = NULL;
+/* buffers that reached the videosink (only written by its streaming thread) */
+static guint64 frames_rendered = 0;
+/* latency probe */
+static void (*frame_tap)(void *cls, const unsigned char *pixels, int pixel_stride, int row_stride, int width, int height,
+                         uint64_t present_time) = NULL;
+static void *frame_tap_cls = NULL;
+/* -hfr: frame pacing at the display refresh rate, and throughput statistics */
+#define FRAME_STATS_SECS 5
+static unsigned int frame_rate = 0;
+static GstClockTime frame_period = 0;
+static gint64 stats_window_start = 0;
+static guint64 stats_frames_rendered = 0;
+static unsigned int stats_frames_in = 0;
+static gint64 stats_cost_total = 0, stats_cost_max = 0;
+static bool paused = false;
+/* -hud: performance overlay; textoverlay renders the text again only when it changes, and otherwise just *
+ * blends the cached text image into each frame                                                           */
+static bool hud = false;
+static bool hud_shown = false;
+
 struct video_renderer_s {
-    GstElement *appsrc, *pipeline, *sink;
+    GstElement *appsrc, *pipeline, *sink, *flip, *hud;
     GstBus *bus;
 #ifdef  X_DISPLAY_FIX
     const char * server_name;  
@@ -50,62 +124,61 @@ struct video_renderer_s {
 #endif
 };
 
-static void append_videoflip (GString *launch, const videoflip_t *flip, const videoflip_t *rot) {
-    /* videoflip image transform */
-    switch (*flip) {
-    case INVERT:
-        switch (*rot)  {
-        case LEFT:
-	    g_string_append(launch, "videoflip method=clockwise ! ");
-	    break;
-        case RIGHT:
-            g_string_append(launch, "videoflip method=counterclockwise ! ");
-            break;
-        default:
-	    g_string_append(launch, "videoflip method=rotate-180 ! ");
-	    break;
-        }
-        break;
-    case HFLIP:
-        switch (*rot) {
-        case LEFT:
-            g_string_append(launch, "videoflip method=upper-left-diagonal ! ");
-            break;
-        case RIGHT: 
-            g_string_append(launch, "videoflip method=upper-right-diagonal ! ");
-            break;
-        default:
-            g_string_append(launch, "videoflip method=horizontal-flip ! ");
-            break;
-        }
-        break;
-    case VFLIP:
-        switch (*rot) {
-        case LEFT:
-            g_string_append(launch, "videoflip method=upper-right-diagonal ! ");
-            break;
-        case RIGHT: 
-            g_string_append(launch, "videoflip method=upper-left-diagonal ! ");
-            break;
-        default:
-            g_string_append(launch, "videoflip method=vertical-flip ! ");
-	  break;
-	}
-        break;
-    default:
-        switch (*rot) {
-        case LEFT:
-            g_string_append(launch, "videoflip method=counterclockwise ! ");
-            break;
-        case RIGHT: 
-            g_string_append(launch, "videoflip method=clockwise ! ");
-            break;
-        default:
-            break;
-        }
-        break;
+/* videoflip "method" values: these are also the GstVideoOrientationMethod values (GStreamer >= 1.10) *
+ * of the "rotate-method" property of videosinks that can rotate while rendering (e.g. glimagesink)  */
+typedef enum flip_method_e {
+    FLIP_IDENTITY,
+    FLIP_CLOCKWISE,
+    FLIP_ROTATE_180,
+    FLIP_COUNTERCLOCKWISE,
+    FLIP_HORIZONTAL,
+    FLIP_VERTICAL,
+    FLIP_UPPER_LEFT_DIAGONAL,
+    FLIP_UPPER_RIGHT_DIAGONAL,
+} flip_method_t;
+
+static const char *flip_method_name[] = { "none", "clockwise", "rotate-180", "counterclockwise", "horizontal-flip",
+                                          "vertical-flip", "upper-left-diagonal", "upper-right-diagonal" };
+
+static flip_method_t flip_method = FLIP_IDENTITY;
+static bool flip_in_sink = false;
+
+/* the -f flip followed by the -r rotation is a single image transform */
+static flip_method_t get_flip_method (const videoflip_t *flip, const videoflip_t *rot) {
+    static const flip_method_t method[4][3] = {
+        /*          no rotation       LEFT                      RIGHT                     */
+        /* NONE */  { FLIP_IDENTITY,   FLIP_COUNTERCLOCKWISE,    FLIP_CLOCKWISE            },
+        /* INVERT */{ FLIP_ROTATE_180, FLIP_CLOCKWISE,           FLIP_COUNTERCLOCKWISE     },
+        /* HFLIP */ { FLIP_HORIZONTAL, FLIP_UPPER_LEFT_DIAGONAL, FLIP_UPPER_RIGHT_DIAGONAL },
+        /* VFLIP */ { FLIP_VERTICAL,   FLIP_UPPER_RIGHT_DIAGONAL, FLIP_UPPER_LEFT_DIAGONAL },
+    };
+    int f = (*flip == INVERT ? 1 : *flip == HFLIP ? 2 : *flip == VFLIP ? 3 : 0);
+    int r = (*rot == LEFT ? 1 : *rot == RIGHT ? 2 : 0);
+    return method[f][r];
+}
+
+static void append_videoflip (GString *launch, flip_method_t method) {
+    /* videoflip image transform (made a passthrough if the videosink can do it, see flip_to_sink) */
+    if (method != FLIP_IDENTITY) {
+        g_string_append_printf(launch, "videoflip name=video_flip method=%s ! ", flip_method_name[method]);
     }
-}	
+}
+
+/* a videosink with a "rotate-method" property applies the flip/rotation as it renders (on the GPU for GL     *
+ * sinks): the videoflip element is then set to "none", which makes it a passthrough (no full-frame pass).    *
+ * Not used for a video wall tile, which is cropped after the flip, or with the HUD, which would be rotated.  */
+static void flip_to_sink(GstElement *element) {
+    if (flip_in_sink || flip_method == FLIP_IDENTITY || tile_cols || hud || !renderer->flip ||
+        !GST_OBJECT_FLAG_IS_SET(element, GST_ELEMENT_FLAG_SINK) ||
+        !g_object_class_find_property(G_OBJECT_GET_CLASS(element), "rotate-method")) {
+        return;
+    }
+    g_object_set(element, "rotate-method", (gint) flip_method, NULL);
+    g_object_set(renderer->flip, "method", (gint) FLIP_IDENTITY, NULL);
+    flip_in_sink = true;
+    logger_log(logger, LOGGER_INFO, "video flip/rotation \"%s\" is done by videosink %s (no videoflip pass)",
+               flip_method_name[flip_method], GST_OBJECT_NAME(element));
+}
 
 /* apple uses colorimetry=1:3:5:1                                *
  * (not recognized by v4l2 plugin in Gstreamer  < 1.20.4)        *
@@ -127,6 +200,288 @@ void video_renderer_size(float *f_width_source, float *f_height_source, float *f
     logger_log(logger, LOGGER_DEBUG, "begin video stream wxh = %dx%d; source %dx%d", width, height, width_source, height_source);
 }
 
+static void set_max_lateness(gint64 lateness) {
+    if (lateness_sink) {
+        g_object_set(lateness_sink, "max-lateness", lateness, NULL);
+    }
+}
+
+/* -hfr: a frame later than one frame period is dropped by the sink (videosinks default to 20 msecs, more than two *
+ * frame periods at 120 fps), and the sink is allowed one frame period to present a frame                       */
+static void set_frame_pacing(GstElement *sink) {
+    if (!frame_period) {
+        return;
+    }
+    max_lateness = (gint64) frame_period;
+    if (!(fast_start && fast_start_frames)) {
+        set_max_lateness(max_lateness);
+    }
+    if (g_object_class_find_property(G_OBJECT_GET_CLASS(sink), "processing-deadline")) {
+        g_object_set(sink, "processing-deadline", (guint64) frame_period, NULL);
+    }
+}
+
+/* the codec data (SPS/PPS) of a new video stream has arrived: the next frame is the "first frame" */
+static void video_renderer_restart_stream() {
+    codec_data_time = g_get_monotonic_time();
+    first_frame_pending = true;
+    if (fast_start) {
+        waiting_for_idr = true;
+        fast_start_frames = FAST_START_FRAMES;
+        set_max_lateness(-1);
+    }
+}
+
+/* hand the luma (or, for RGB formats, green) component of the frame to the latency probe, with the time *
+ * the videosink will present it: at base_time + pts + latency, or at once if it arrives late            */
+static void tap_frame(GstPad *pad, GstBuffer *buffer) {
+    GstClock *clock = gst_element_get_clock(renderer->sink);
+    if (!clock) {
+        return;
+    }
+    GstClockTime present_time = gst_clock_get_time(clock);
+    gst_object_unref(clock);
+    if (sync && GST_BUFFER_PTS_IS_VALID(buffer)) {
+        GstClockTime target = GST_BUFFER_PTS(buffer) + gst_video_pipeline_base_time;
+#if GST_CHECK_VERSION(1,6,0)
+        target += gst_pipeline_get_latency(GST_PIPELINE_CAST(renderer->pipeline));
+#endif
+        if (target > present_time) {
+            present_time = target;
+        }
+    }
+    GstCaps *caps = gst_pad_get_current_caps(pad);
+    if (!caps) {
+        return;
+    }
+    GstVideoInfo info;
+    gboolean valid = gst_video_info_from_caps(&info, caps);
+    gst_caps_unref(caps);
+    GstVideoFrame frame;
+    if (!valid || !gst_video_frame_map(&frame, &info, buffer, GST_MAP_READ)) {
+        return;
+    }
+    int comp = (GST_VIDEO_INFO_IS_RGB(&info) ? 1 : 0);
+    frame_tap(frame_tap_cls, GST_VIDEO_FRAME_COMP_DATA(&frame, comp), GST_VIDEO_FRAME_COMP_PSTRIDE(&frame, comp),
+              GST_VIDEO_FRAME_COMP_STRIDE(&frame, comp), GST_VIDEO_FRAME_COMP_WIDTH(&frame, comp),
+              GST_VIDEO_FRAME_COMP_HEIGHT(&frame, comp), (uint64_t) present_time);
+    gst_video_frame_unmap(&frame);
+}
+
+static GstPadProbeReturn sink_buffer_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    sink_has_rendered = true;
+    frames_rendered++;
+    if (frame_tap && GST_PAD_PROBE_INFO_BUFFER(info)) {
+        tap_frame(pad, GST_PAD_PROBE_INFO_BUFFER(info));
+    }
+    if (presented_callback && sync) {
+        /* the videosink presents the buffer at base_time + pts + latency, or at once if it arrives late */
+        GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+        GstClock *clock = gst_element_get_clock(renderer->sink);
+        if (clock && buffer && GST_BUFFER_PTS_IS_VALID(buffer)) {
+            GstClockTime pts = GST_BUFFER_PTS(buffer) + gst_video_pipeline_base_time;
+            GstClockTime target = pts;
+#if GST_CHECK_VERSION(1,6,0)
+            target += gst_pipeline_get_latency(GST_PIPELINE_CAST(renderer->pipeline));
+#endif
+            presented_callback(presented_cls, (uint64_t) pts, GST_CLOCK_DIFF(target, gst_clock_get_time(clock)));
+        }
+        if (clock) {
+            gst_object_unref(clock);
+        }
+    }
+    if (g_atomic_int_compare_and_exchange(&recovery_state, RECOVERY_RESUMED, RECOVERY_NONE)) {
+        logger_log(logger, LOGGER_INFO, "video pipeline recovered from error in %.1f ms (%u frames dropped waiting for IDR, "
+                   "%u recoveries since start)", (double) (g_get_monotonic_time() - recovery_start) / 1000,
+                   recovery_dropped, recoveries_total);
+    }
+    if (first_frame_pending) {
+        first_frame_pending = false;
+        logger_log(logger, LOGGER_INFO, "first video frame reached videosink %.1f ms after codec data%s",
+                   (double) (g_get_monotonic_time() - codec_data_time) / 1000, (fast_start ? " (fast start)" : ""));
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+/* crop the tile of this display node from the decoded frame, once its size is known */
+static GstPadProbeReturn tile_caps_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+    if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+        GstCaps *caps;
+        gint w, h;
+        gst_event_parse_caps(event, &caps);
+        GstStructure *structure = gst_caps_get_structure(caps, 0);
+        if (gst_structure_get_int(structure, "width", &w) && gst_structure_get_int(structure, "height", &h)) {
+            gint left = w * tile_col / tile_cols;
+            gint right = w - w * (tile_col + 1) / tile_cols;
+            gint top = h * tile_row / tile_rows;
+            gint bottom = h - h * (tile_row + 1) / tile_rows;
+            g_object_set(GST_PAD_PARENT(pad), "left", left, "right", right, "top", top, "bottom", bottom, NULL);
+            logger_log(logger, LOGGER_INFO, "video wall tile %u,%u of %ux%u: showing %dx%d at (%d,%d) of %dx%d frame",
+                       tile_col, tile_row, tile_cols, tile_rows, w - left - right, h - top - bottom, left, top, w, h);
+        }
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+void video_renderer_set_tile(unsigned int cols, unsigned int rows, unsigned int col, unsigned int row) {
+    tile_cols = cols;
+    tile_rows = rows;
+    tile_col = col;
+    tile_row = row;
+}
+
+void video_renderer_set_presented_callback(void (*callback)(void *cls, uint64_t pts, int64_t lateness), void *cls) {
+    presented_callback = callback;
+    presented_cls = cls;
+}
+
+uint64_t video_renderer_frames_rendered() {
+    return (uint64_t) frames_rendered;
+}
+
+void video_renderer_set_frame_rate(unsigned int fps) {
+    frame_rate = fps;
+    frame_period = (fps ? SECOND_IN_NSECS / fps : 0);
+}
+
+void video_renderer_set_hud(bool enable) {
+    hud = enable;
+}
+
+bool video_renderer_hud_shown() {
+    return (renderer && renderer->hud && hud_shown && !g_atomic_int_get(&hidden));
+}
+
+void video_renderer_set_hud_text(const char *text) {
+    if (renderer && renderer->hud) {
+        g_object_set(renderer->hud, "text", text, NULL);
+    }
+}
+
+void video_renderer_set_frame_tap(void (*callback)(void *cls, const unsigned char *pixels, int pixel_stride,
+                                                   int row_stride, int width, int height, uint64_t present_time),
+                                  void *cls) {
+    frame_tap_cls = cls;
+    frame_tap = callback;
+}
+
+#if GST_CHECK_VERSION(1,10,0)
+/* find the element that is the real video sink (e.g. inside autovideosink), and give decoders low-delay hints */
+static void deep_element_added(GstBin *bin, GstBin *sub_bin, GstElement *element, gpointer user_data) {
+    GObjectClass *class = G_OBJECT_GET_CLASS(element);
+    flip_to_sink(element);
+    if (!lateness_sink && g_object_class_find_property(class, "max-lateness")) {
+        lateness_sink = element;
+        g_object_get(element, "max-lateness", &max_lateness, NULL);
+        logger_log(logger, LOGGER_DEBUG, "videosink element %s: max-lateness %lld", GST_OBJECT_NAME(element),
+                   (long long) max_lateness);
+        if (fast_start && fast_start_frames) {
+            set_max_lateness(-1);
+        }
+        set_frame_pacing(element);
+    }
+    if (fast_start && g_object_class_find_property(class, "low-latency")) {
+        logger_log(logger, LOGGER_DEBUG, "fast start: setting low-latency on %s", GST_OBJECT_NAME(element));
+        g_object_set(element, "low-latency", TRUE, NULL);
+    }
+}
+#endif
+
+#ifdef X_DISPLAY_FIX
+static gint64 process_cpu_usecs() {
+    struct timespec cpu;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    return (gint64) cpu.tv_sec * G_USEC_PER_SEC + cpu.tv_nsec / 1000;
+}
+
+/* the X11 window was hidden (minimized, on another workspace, or fully obscured) or shown again: *
+ * log the process CPU load while it was in its previous state                                  */
+static void set_hidden(bool hide) {
+    gint64 now = g_get_monotonic_time();
+    gint64 cpu = process_cpu_usecs();
+    double cpu_load = 0.0;
+    if (visibility_time && now > visibility_time) {
+        cpu_load = 100.0 * (double) (cpu - visibility_cpu) / (double) (now - visibility_time);
+    }
+    if (hide) {
+        logger_log(logger, LOGGER_INFO, "video window hidden: dropping non-reference frames and not rendering "
+                   "(process CPU %.0f%% while visible)", cpu_load);
+        visible_cpu_load = cpu_load;
+        g_atomic_int_set(&hidden_dropped, 0);
+        g_atomic_int_set(&hidden_skipped, 0);
+    } else {
+        logger_log(logger, LOGGER_INFO, "video window visible after %.1f secs hidden: %d non-reference frames dropped, "
+                   "%d decoded frames not rendered; process CPU %.0f%% while hidden (%.0f%% while visible)",
+                   (double) (now - visibility_time) / G_USEC_PER_SEC, g_atomic_int_get(&hidden_dropped),
+                   g_atomic_int_get(&hidden_skipped), cpu_load, visible_cpu_load);
+    }
+    g_atomic_int_set(&hidden, hide);
+    visibility_time = now;
+    visibility_cpu = cpu;
+}
+
+/* decoded frames are not converted or rendered while the window is hidden */
+static GstPadProbeReturn hidden_buffer_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    if (g_atomic_int_get(&hidden)) {
+        g_atomic_int_inc(&hidden_skipped);
+        return GST_PAD_PROBE_DROP;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+/* main-loop thread: visibility events of the X11 window arrived */
+static gboolean visibility_events(gint fd, GIOCondition condition, gpointer user_data) {
+    if (!renderer || !renderer->gst_window || !renderer->gst_window->watch_display) {
+        visibility_source = 0;
+        return G_SOURCE_REMOVE;
+    }
+    bool visible = window_is_visible(renderer->gst_window);
+    if (visible == (bool) g_atomic_int_get(&hidden)) {
+        set_hidden(!visible);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+/* main-loop thread: look for the UxPlay X11 window (requested by the streaming thread after a frame is pushed) */
+static gboolean find_x11_window(gpointer user_data) {
+    gint next = X11_SEARCH_IDLE;
+    if (!renderer || !renderer->gst_window) {
+        return G_SOURCE_REMOVE;
+    }
+    X11_search_attempts++;
+    logger_log(logger, LOGGER_DEBUG, "Looking for X11 UxPlay Window, attempt %d", (int) X11_search_attempts);
+    get_x_window(renderer->gst_window, renderer->server_name);
+    if (renderer->gst_window->window) {
+        logger_log(logger, LOGGER_INFO, "\n*** X11 Windows: Use key F11 or (left Alt)+Enter to toggle full-screen mode\n");
+        int fd = watch_visibility(renderer->gst_window);
+        if (fd >= 0) {
+            visibility_source = g_unix_fd_add(fd, G_IO_IN, visibility_events, NULL);
+            visibility_events(fd, G_IO_IN, NULL);   /* events already read by watch_visibility */
+        }
+        if (fullscreen) {
+            set_fullscreen(renderer->gst_window, &fullscreen);
+        }
+        next = X11_SEARCH_DONE;
+    } else if (X11_search_attempts == MAX_X11_SEARCH_ATTEMPTS) {
+        logger_log(logger, LOGGER_DEBUG, "X11 UxPlay Window not found in %d search attempts", MAX_X11_SEARCH_ATTEMPTS);
+        next = X11_SEARCH_DONE;
+    }
+    g_atomic_int_set(&X11_search, next);
+    return G_SOURCE_REMOVE;
+}
+
+static void stop_visibility_watch() {
+    if (visibility_source) {
+        g_source_remove(visibility_source);
+        visibility_source = 0;
+    }
+    if (renderer && renderer->gst_window) {
+        unwatch_visibility(renderer->gst_window);
+    }
+}
+#endif
+
 void  video_renderer_init(logger_t *render_logger, const char *server_name, videoflip_t videoflip[2], const char *parser,
                           const char *decoder, const char *converter, const char *videosink, const bool *initial_fullscreen,
                           const bool *video_sync) {
@@ -154,8 +509,18 @@ void  video_renderer_init(logger_t *render_logger, const char *server_name, vide
     g_string_append(launch, decoder);
     g_string_append(launch, " ! ");
     g_string_append(launch, converter);
-    g_string_append(launch, " ! ");    
-    append_videoflip(launch, &videoflip[0], &videoflip[1]);
+    g_string_append(launch, " name=video_converter ! ");
+
+    flip_method = get_flip_method(&videoflip[0], &videoflip[1]);
+    flip_in_sink = false;
+    append_videoflip(launch, flip_method);
+    if (tile_cols) {
+        g_string_append(launch, "videocrop name=wall_tile ! ");
+    }
+    if (hud) {
+        g_string_append(launch, "textoverlay name=hud_overlay valignment=top halignment=left line-alignment=left "
+                        "font-desc=\"Monospace 10\" shaded-background=true wait-text=false ! ");
+    }
     g_string_append(launch, videosink);
     g_string_append(launch, " name=video_sink");
     if (*video_sync) {
@@ -184,8 +549,45 @@ void  video_renderer_init(logger_t *render_logger, const char *server_name, vide
 
     renderer->sink = gst_bin_get_by_name (GST_BIN (renderer->pipeline), "video_sink");
     g_assert(renderer->sink);
+    renderer->flip = gst_bin_get_by_name (GST_BIN (renderer->pipeline), "video_flip");
+    renderer->hud = gst_bin_get_by_name (GST_BIN (renderer->pipeline), "hud_overlay");
+    hud_shown = (renderer->hud != NULL);
+    flip_to_sink(renderer->sink);
+
+    lateness_sink = NULL;
+    if (g_object_class_find_property(G_OBJECT_GET_CLASS(renderer->sink), "max-lateness")) {
+        lateness_sink = renderer->sink;
+        g_object_get(lateness_sink, "max-lateness", &max_lateness, NULL);
+        set_frame_pacing(lateness_sink);
+    }
+#if GST_CHECK_VERSION(1,10,0)
+    g_signal_connect(renderer->pipeline, "deep-element-added", G_CALLBACK(deep_element_added), NULL);
+#endif
+    GstPad *sink_pad = gst_element_get_static_pad(renderer->sink, "sink");
+    if (sink_pad) {
+        gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_BUFFER, sink_buffer_probe, NULL, NULL);
+        gst_object_unref(sink_pad);
+    }
+    if (tile_cols) {
+        GstElement *crop = gst_bin_get_by_name (GST_BIN (renderer->pipeline), "wall_tile");
+        g_assert(crop);
+        GstPad *crop_pad = gst_element_get_static_pad(crop, "sink");
+        gst_pad_add_probe(crop_pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, tile_caps_probe, NULL, NULL);
+        gst_object_unref(crop_pad);
+        gst_object_unref(crop);
+    }
 
 #ifdef X_DISPLAY_FIX
+    GstElement *video_converter = gst_bin_get_by_name (GST_BIN (renderer->pipeline), "video_converter");
+    GstPad *converter_pad = (video_converter ? gst_element_get_static_pad(video_converter, "sink") : NULL);
+    if (converter_pad) {
+        gst_pad_add_probe(converter_pad, GST_PAD_PROBE_TYPE_BUFFER, hidden_buffer_probe, NULL, NULL);
+        gst_object_unref(converter_pad);
+    }
+    if (video_converter) {
+        gst_object_unref(video_converter);
+    }
+    g_atomic_int_set(&hidden, 0);
     fullscreen = *initial_fullscreen;
     renderer->server_name = server_name;
     renderer->gst_window = NULL;
@@ -221,36 +623,206 @@ void  video_renderer_init(logger_t *render_logger, const char *server_name, vide
     }
 }
 
+void video_renderer_set_overload_threshold(unsigned int threshold_ms) {
+    overload_threshold = (GstClockTime) threshold_ms * GST_MSECOND;
+    video_overload_init(&overload, overload_threshold);
+}
+
+int video_renderer_overload_level() {
+    return overload.level;
+}
+
+static const char *overload_action[] = { "none", "dropping non-reference frames", "skipping to next IDR frame",
+                                         "shortening audio buffering", "rejecting new sessions" };
+
+/* scan the h264 NAL headers of a frame: nal_ref_idc = 0 in all VCL NALs means a non-reference frame */
+static void scan_nal_units(unsigned char *data, int data_len, int nal_count, bool *idr, bool *reference) {
+    int count = 0;
+    *idr = false;
+    *reference = false;
+    for (int i = 0; i + 4 < data_len && count < nal_count; i++) {
+        if (data[i] || data[i + 1] || data[i + 2] || data[i + 3] != 0x01) {
+            continue;
+        }
+        count++;
+        unsigned char nal_type = data[i + 4] & 0x1f;
+        if (nal_type == 5) {
+            *idr = true;
+        }
+        if (nal_type >= 1 && nal_type <= 5 && (data[i + 4] & 0x60)) {
+            *reference = true;
+        }
+        i += 4;
+    }
+}
+
+/* if the frame starts with a SPS NAL unit, returns the length of the NAL units before the first VCL NAL unit */
+static int codec_data_length(unsigned char *data, int data_len) {
+    if (data_len < 5 || (data[4] & 0x1f) != 7) {
+        return 0;
+    }
+    for (int i = 4; i + 4 < data_len; i++) {
+        if (data[i] || data[i + 1] || data[i + 2] || data[i + 3] != 0x01) {
+            continue;
+        }
+        unsigned char nal_type = data[i + 4] & 0x1f;
+        if (nal_type >= 1 && nal_type <= 5) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/* estimated time for the pipeline to catch up with frames already pushed to it */
+static GstClockTime video_backlog(GstClockTime pts, int data_len) {
+    GstClockTime backlog = 0;
+    gint64 now = g_get_monotonic_time();
+    rate_window_bytes += data_len;
+    if (!rate_window_start) {
+        rate_window_start = now;
+    } else if (now - rate_window_start >= G_USEC_PER_SEC) {
+        bytes_per_sec = rate_window_bytes * G_USEC_PER_SEC / (now - rate_window_start);
+        rate_window_start = now;
+        rate_window_bytes = 0;
+    }
+    if (bytes_per_sec) {
+        guint64 level = gst_app_src_get_current_level_bytes(GST_APP_SRC(renderer->appsrc));
+        backlog = level * GST_SECOND / bytes_per_sec;
+    }
+    if (sync) {
+        gint64 position;
+        if (gst_element_query_position(renderer->pipeline, GST_FORMAT_TIME, &position) && pts > (GstClockTime) position) {
+            backlog = MAX(backlog, pts - (GstClockTime) position);
+        }
+    }
+    return backlog;
+}
+
+/* the bus callback restarts the pipeline and the connection (so the client sends a new IDR frame), as for *
+ * errors that are not recoverable                                                                         */
+static void video_renderer_request_restart(const char *reason) {
+    GError *err = g_error_new(GST_CORE_ERROR, GST_CORE_ERROR_FAILED, "%s", reason);
+    gst_element_post_message(renderer->pipeline, gst_message_new_error(GST_OBJECT(renderer->pipeline), err, NULL));
+    g_error_free(err);
+}
+
+/* returns true if the frame should be dropped */
+static bool video_overload_drop(unsigned char *data, int data_len, int nal_count, GstClockTime pts) {
+    GstClockTime backlog = video_backlog(pts, data_len);
+    int level = overload.level;
+    bool skipping = overload.skip_to_idr;
+    overload_action_t action = video_overload_update(&overload, backlog, (uint64_t) g_get_monotonic_time() * 1000);
+    if (overload.level != level) {
+        logger_log(logger, (overload.level > level ? LOGGER_INFO : LOGGER_DEBUG),
+                   "video overload level %d -> %d: backlog %.0f ms (%s); frames dropped: non-reference %u, skip-to-IDR %u",
+                   level, overload.level, (double) backlog / GST_MSECOND, overload_action[overload.level],
+                   overload.dropped_nonref, overload.dropped_skip);
+    }
+    if (action == OVERLOAD_RESTART) {
+        logger_log(logger, LOGGER_ERR, "video overload: no IDR frame within %.1f secs after skipping %u frames, restarting the stream",
+                   (double) OVERLOAD_IDR_WAIT / GST_SECOND, overload.dropped_skip);
+        video_renderer_request_restart("video overload: no IDR frame to resume at");
+        return true;
+    }
+    if (action == OVERLOAD_PASS) {
+        return false;
+    }
+
+    bool idr, reference;
+    scan_nal_units(data, data_len, nal_count, &idr, &reference);
+    action = video_overload_frame(&overload, idr, reference);
+    if (skipping && !overload.skip_to_idr) {
+        logger_log(logger, LOGGER_INFO, "video overload: resuming at IDR frame after skipping %u frames", overload.dropped_skip);
+    }
+    return (action == OVERLOAD_DROP);
+}
+
+/* while the window is hidden, only reference frames are decoded (returns true if the frame should be dropped) */
+static bool video_hidden_drop(unsigned char *data, int data_len, int nal_count) {
+    bool idr, reference;
+    scan_nal_units(data, data_len, nal_count, &idr, &reference);
+    if (!reference && !idr) {
+        g_atomic_int_inc(&hidden_dropped);
+        return true;
+    }
+    return false;
+}
+
+void video_renderer_set_fast_start(bool enable) {
+    fast_start = enable;
+}
+
 void video_renderer_pause() {
     logger_log(logger, LOGGER_DEBUG, "video renderer paused");
     gst_element_set_state(renderer->pipeline, GST_STATE_PAUSED);
+    paused = true;
+    video_renderer_restart_stream();
 }
 
+/* (called for every video frame: tracks the state set by pause(), instead of querying the pipeline) */
 void video_renderer_resume() {
-    if (video_renderer_is_paused()) {
+    if (paused) {
         logger_log(logger, LOGGER_DEBUG, "video renderer resumed");
         gst_element_set_state (renderer->pipeline, GST_STATE_PLAYING);
         gst_video_pipeline_base_time = gst_element_get_base_time(renderer->appsrc);
+        paused = false;
     }
 }
 
 bool video_renderer_is_paused() {
-    GstState state;
-    gst_element_get_state(renderer->pipeline, &state, NULL, 0);
-    return (state == GST_STATE_PAUSED);
+    return paused;
 }
 
 void video_renderer_start() {
     gst_element_set_state (renderer->pipeline, GST_STATE_PLAYING);
     gst_video_pipeline_base_time = gst_element_get_base_time(renderer->appsrc);
     renderer->bus = gst_element_get_bus(renderer->pipeline);
+    paused = false;
     first_packet = true;
+    video_renderer_restart_stream();
+    sink_has_rendered = false;
+    g_atomic_int_set(&recovery_state, RECOVERY_NONE);
+    recovery_start = recovery_window_start = 0;
+    recoveries = recoveries_total = 0;
+    video_overload_init(&overload, overload_threshold);
+    rate_window_start = 0;
+    rate_window_bytes = bytes_per_sec = 0;
+    stats_window_start = 0;
 #ifdef X_DISPLAY_FIX
     X11_search_attempts = 0;
+    g_atomic_int_set(&X11_search, X11_SEARCH_IDLE);
+    visibility_time = g_get_monotonic_time();
+    visibility_cpu = process_cpu_usecs();
 #endif
 }
 
-void video_renderer_render_buffer(unsigned char* data, int *data_len, int *nal_count, uint64_t *ntp_time) {
+/* -hfr: every FRAME_STATS_SECS, log the frame rates received and rendered, and the time spent per frame here */
+static void frame_stats(gint64 start, gint64 end) {
+    gint64 cost = end - start;
+    if (!stats_window_start) {
+        stats_window_start = start;
+        stats_frames_rendered = frames_rendered;
+        stats_frames_in = 0;
+        stats_cost_total = stats_cost_max = 0;
+    }
+    stats_frames_in++;
+    stats_cost_total += cost;
+    if (cost > stats_cost_max) {
+        stats_cost_max = cost;
+    }
+    gint64 elapsed = end - stats_window_start;
+    if (elapsed < FRAME_STATS_SECS * G_USEC_PER_SEC) {
+        return;
+    }
+    double secs = (double) elapsed / G_USEC_PER_SEC;
+    guint64 rendered = frames_rendered - stats_frames_rendered;
+    logger_log(logger, LOGGER_INFO, "video: %.1f fps received, %.1f fps rendered (display %u Hz); "
+               "%.0f usecs/frame in renderer (max %lld)", stats_frames_in / secs, rendered / secs, frame_rate,
+               (double) stats_cost_total / stats_frames_in, (long long) stats_cost_max);
+    stats_window_start = 0;
+}
+
+static void render_buffer(unsigned char* data, int *data_len, int *nal_count, uint64_t *ntp_time) {
     GstBuffer *buffer;
     GstClockTime pts = (GstClockTime) *ntp_time; /*now in nsecs */
     //GstClockTimeDiff latency = GST_CLOCK_DIFF(gst_element_get_current_clock_time (renderer->appsrc), pts);
@@ -275,32 +847,84 @@ void video_renderer_render_buffer(unsigned char* data, int *data_len, int *nal_c
             logger_log(logger, LOGGER_INFO, "Begin streaming to GStreamer video pipeline");
             first_packet = false;
         }
-        buffer = gst_buffer_new_allocate(NULL, *data_len, NULL);
+        int prefix_len = 0;
+        int sps_len = codec_data_length(data, *data_len);
+        if (sps_len) {
+            g_free(codec_data);
+            codec_data = g_malloc(sps_len);
+            memcpy(codec_data, data, sps_len);
+            codec_data_len = sps_len;
+        }
+        if (g_atomic_int_get(&recovery_state) == RECOVERY_WAIT_IDR) {
+            /* after an in-place recovery, the decoder restarts at an IDR frame, with SPS and PPS */
+            bool idr, reference;
+            scan_nal_units(data, *data_len, *nal_count, &idr, &reference);
+            if (!idr) {
+                recovery_dropped++;
+                if (g_get_monotonic_time() - recovery_start > RECOVERY_IDR_WAIT * G_USEC_PER_SEC) {
+                    logger_log(logger, LOGGER_ERR, "GStreamer video: no IDR frame within %d secs after in-place recovery "
+                               "(%u frames dropped), restarting the pipeline", RECOVERY_IDR_WAIT, recovery_dropped);
+                    g_atomic_int_set(&recovery_state, RECOVERY_NONE);
+                    video_renderer_request_restart("no IDR frame after in-place recovery");
+                }
+                return;
+            }
+            if (!sps_len && codec_data) {
+                prefix_len = codec_data_len;
+            }
+            g_atomic_int_set(&recovery_state, RECOVERY_RESUMED);
+        }
+        bool first_frame = false;
+        if (fast_start && fast_start_frames) {
+            if (waiting_for_idr) {
+                bool idr, reference;
+                scan_nal_units(data, *data_len, *nal_count, &idr, &reference);
+                if (!idr) {
+                    logger_log(logger, LOGGER_DEBUG, "fast start: dropped frame received before first IDR frame");
+                    return;
+                }
+                waiting_for_idr = false;
+                first_frame = true;
+            }
+            if (--fast_start_frames == 0) {
+                set_max_lateness(max_lateness);
+                logger_log(logger, LOGGER_DEBUG, "fast start: steady state, max-lateness restored");
+            }
+        } else if (g_atomic_int_get(&hidden) && video_hidden_drop(data, *data_len, *nal_count)) {
+            return;
+        } else if (overload_threshold && video_overload_drop(data, *data_len, *nal_count, pts)) {
+            return;
+        }
+        buffer = gst_buffer_new_allocate(NULL, prefix_len + *data_len, NULL);
         g_assert(buffer != NULL);
         //g_print("video latency %8.6f\n", (double) latency / SECOND_IN_NSECS);
-        if (sync) {
+        if (sync && !first_frame) {
+            /* (the first frame has no timestamp, so is rendered at once) */
             GST_BUFFER_PTS(buffer) = pts;
         }
-        gst_buffer_fill(buffer, 0, data, *data_len);
+        if (prefix_len) {
+            gst_buffer_fill(buffer, 0, codec_data, prefix_len);
+        }
+        gst_buffer_fill(buffer, prefix_len, data, *data_len);
         gst_app_src_push_buffer (GST_APP_SRC(renderer->appsrc), buffer);
 #ifdef X_DISPLAY_FIX
-        if (renderer->gst_window && !(renderer->gst_window->window) && X11_search_attempts < MAX_X11_SEARCH_ATTEMPTS) {
-            X11_search_attempts++;
-            logger_log(logger, LOGGER_DEBUG, "Looking for X11 UxPlay Window, attempt %d", (int) X11_search_attempts);
-            get_x_window(renderer->gst_window, renderer->server_name);
-	    if (renderer->gst_window->window) {
-                logger_log(logger, LOGGER_INFO, "\n*** X11 Windows: Use key F11 or (left Alt)+Enter to toggle full-screen mode\n");
-                if (fullscreen) {
-                    set_fullscreen(renderer->gst_window, &fullscreen);
-                }
-            } else if (X11_search_attempts == MAX_X11_SEARCH_ATTEMPTS) {
-	      logger_log(logger, LOGGER_DEBUG, "X11 UxPlay Window not found in %d search attempts", MAX_X11_SEARCH_ATTEMPTS);
-            }
+        if (renderer->gst_window && g_atomic_int_compare_and_exchange(&X11_search, X11_SEARCH_IDLE, X11_SEARCH_PENDING)) {
+            g_idle_add(find_x11_window, NULL);
         }
 #endif
     }
 }
 
+void video_renderer_render_buffer(unsigned char* data, int *data_len, int *nal_count, uint64_t *ntp_time) {
+    if (!frame_period) {
+        render_buffer(data, data_len, nal_count, ntp_time);
+        return;
+    }
+    gint64 start = g_get_monotonic_time();
+    render_buffer(data, data_len, nal_count, ntp_time);
+    frame_stats(start, g_get_monotonic_time());
+}
+
 void video_renderer_flush() {
 }
 
@@ -308,6 +932,7 @@ void video_renderer_stop() {
   if (renderer) {
             gst_app_src_end_of_stream (GST_APP_SRC(renderer->appsrc));
 	    gst_element_set_state (renderer->pipeline, GST_STATE_NULL);
+            paused = false;
   }   
 }
 
@@ -321,9 +946,20 @@ void video_renderer_destroy() {
         }
         gst_object_unref(renderer->bus);
         gst_object_unref(renderer->sink);
+        if (renderer->flip) {
+            gst_object_unref(renderer->flip);
+        }
+        if (renderer->hud) {
+            gst_object_unref(renderer->hud);
+        }
+        lateness_sink = NULL;
+        g_free(codec_data);
+        codec_data = NULL;
+        codec_data_len = 0;
         gst_object_unref (renderer->appsrc);
         gst_object_unref (renderer->pipeline);
 #ifdef X_DISPLAY_FIX
+        stop_visibility_watch();
         if (renderer->gst_window) {
             free(renderer->gst_window);
             renderer->gst_window = NULL;
@@ -338,6 +974,68 @@ void video_renderer_destroy() {
 void video_renderer_update_background(int type) {
 }
 
+/* errors in the data (e.g. a corrupted frame or a decoder hiccup) are recoverable;  errors that *
+ * show the pipeline cannot work (missing codec, wrong caps, lost display etc.) are not          */
+static bool video_error_is_recoverable(GError *err) {
+    if (err->domain != GST_STREAM_ERROR) {
+        return false;
+    }
+    switch (err->code) {
+    case GST_STREAM_ERROR_FAILED:
+    case GST_STREAM_ERROR_DECODE:
+    case GST_STREAM_ERROR_DEMUX:
+    case GST_STREAM_ERROR_FORMAT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* reset the top-level element (decoder branch) containing the element that posted the error, flush *
+ * the pipeline, and drop input until the next IDR frame:  returns false if a full restart is needed */
+static bool video_renderer_recover(GstMessage *message, GError *err) {
+    if (!sink_has_rendered || !video_error_is_recoverable(err)) {
+        return false;
+    }
+    gint64 now = g_get_monotonic_time();
+    if (!recovery_window_start || now - recovery_window_start > RECOVERY_WINDOW * G_USEC_PER_SEC) {
+        recovery_window_start = now;
+        recoveries = 0;
+    }
+    if (++recoveries > MAX_RECOVERIES) {
+        logger_log(logger, LOGGER_ERR, "GStreamer video: more than %d errors in %d secs, restarting the pipeline",
+                   MAX_RECOVERIES, RECOVERY_WINDOW);
+        return false;
+    }
+    recoveries_total++;
+    recovery_start = now;
+    recovery_dropped = 0;
+    g_atomic_int_set(&recovery_state, RECOVERY_WAIT_IDR);
+
+    GstElement *branch = NULL;
+    GstObject *object = gst_object_ref(GST_MESSAGE_SRC(message));
+    while (object) {
+        GstObject *parent = gst_object_get_parent(object);
+        if (parent == GST_OBJECT(renderer->pipeline)) {
+            branch = GST_ELEMENT(object);
+            gst_object_unref(parent);
+            break;
+        }
+        gst_object_unref(object);
+        object = parent;
+    }
+    if (branch) {
+        logger_log(logger, LOGGER_INFO, "GStreamer video: resetting %s after error (%u/%d in %d secs), "
+                   "waiting for next IDR frame", GST_OBJECT_NAME(branch), recoveries, MAX_RECOVERIES, RECOVERY_WINDOW);
+        gst_element_set_state(branch, GST_STATE_READY);
+        gst_element_sync_state_with_parent(branch);
+        gst_object_unref(branch);
+    }
+    gst_element_send_event(renderer->pipeline, gst_event_new_flush_start());
+    gst_element_send_event(renderer->pipeline, gst_event_new_flush_stop(FALSE));
+    return true;
+}
+
 gboolean gstreamer_pipeline_bus_callback(GstBus *bus, GstMessage *message, gpointer loop) {
     switch (GST_MESSAGE_TYPE (message)) {
     case GST_MESSAGE_ERROR: {
@@ -346,6 +1044,11 @@ gboolean gstreamer_pipeline_bus_callback(GstBus *bus, GstMessage *message, gpoin
         gboolean flushing;
         gst_message_parse_error (message, &err, &debug);
         logger_log(logger, LOGGER_INFO, "GStreamer error: %s", err->message);
+        if (video_renderer_recover(message, err)) {
+            g_error_free (err);
+            g_free (debug);
+            break;
+        }
         if (strstr(err->message,"Internal data stream error")) {
             logger_log(logger, LOGGER_INFO,
                      "*** This is a generic GStreamer error that usually means that GStreamer\n"
@@ -385,6 +1088,9 @@ gboolean gstreamer_pipeline_bus_callback(GstBus *bus, GstMessage *message, gpoin
                             if ((strcmp (key, "F11") == 0) || (alt_keypress && strcmp (key, "Return") == 0)) {
                                 fullscreen = !(fullscreen);
                                 set_fullscreen(renderer->gst_window, &fullscreen);
+                            } else if (renderer->hud && strcmp (key, "h") == 0) {
+                                hud_shown = !hud_shown;
+                                g_object_set(renderer->hud, "silent", !hud_shown, NULL);
                             } else if (strcmp (key, "Alt_L") == 0) {
                                 alt_keypress = true;
                             }
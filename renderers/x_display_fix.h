@@ -34,15 +34,20 @@ extern "C" {
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <stdio.h>
+#include <stdbool.h>
 
 struct X11_Window_s {
     Display * display;
     Window window;
+    Display * watch_display;
+    bool mapped;
+    int visibility;
 } typedef X11_Window_t;
 
 void get_X11_Display(X11_Window_t * X11) {
     X11->display = XOpenDisplay(NULL);
     X11->window = (Window) NULL;
+    X11->watch_display = NULL;
 }
 
 Window enum_windows(const char * str, Display * display, Window window, int depth) {
@@ -89,6 +94,58 @@ void get_x_window(X11_Window_t * X11, const char * name) {
 #endif
 }
 
+/* follow the map state and visibility of the window: the events are selected on a second connection to   *
+ * the X server, used only by the caller's thread, so they do not interfere with the videosink's event      *
+ * handling.  Returns the connection's file descriptor (to poll for events), or -1                         */
+int watch_visibility(X11_Window_t * X11) {
+    XWindowAttributes attributes;
+    X11->watch_display = XOpenDisplay(NULL);
+    if (!X11->watch_display) {
+        return -1;
+    }
+    XSetErrorHandler(X11_error_catcher);
+    X11->mapped = (XGetWindowAttributes(X11->watch_display, X11->window, &attributes) &&
+                   attributes.map_state == IsViewable);
+    X11->visibility = VisibilityUnobscured;
+    XSelectInput(X11->watch_display, X11->window, VisibilityChangeMask | StructureNotifyMask);
+    XSync(X11->watch_display, False);
+    XSetErrorHandler(NULL);
+    return ConnectionNumber(X11->watch_display);
+}
+
+void unwatch_visibility(X11_Window_t * X11) {
+    if (X11->watch_display) {
+        XCloseDisplay(X11->watch_display);
+        X11->watch_display = NULL;
+    }
+}
+
+/* processes pending events: the window is visible if it is mapped (not minimized or on another workspace)  *
+ * and not fully obscured (with a compositing window manager, a mapped window is always "unobscured")       */
+bool window_is_visible(X11_Window_t * X11) {
+    while (XPending(X11->watch_display)) {
+        XEvent event;
+        XNextEvent(X11->watch_display, &event);
+        if (event.xany.window != X11->window) {
+            continue;
+        }
+        switch (event.type) {
+        case VisibilityNotify:
+            X11->visibility = event.xvisibility.state;
+            break;
+        case MapNotify:
+            X11->mapped = true;
+            break;
+        case UnmapNotify:
+            X11->mapped = false;
+            break;
+        default:
+            break;
+        }
+    }
+    return (X11->mapped && X11->visibility != VisibilityFullyObscured);
+}
+
 void set_fullscreen(X11_Window_t * X11, bool * fullscreen) {
     XClientMessageEvent msg = {
         .type = ClientMessage,
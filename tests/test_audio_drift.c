@@ -0,0 +1,142 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * drives the party mode drift correction with synthetic timestamps: 44100 Hz stereo sources in 352-frame
+ * buffers (as ALAC), with clocks that run fast or slow, and a jump of the ntp mapping
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "audio_drift.h"
+#include "test.h"
+
+#define RATE 44100
+#define FRAMES 352
+#define MSEC 1000000LL
+#define STEP (20 * MSEC)
+#define START 1000000000000ULL
+
+static float input[FRAMES * AUDIO_DRIFT_CHANNELS];
+static float output[2 * FRAMES * AUDIO_DRIFT_CHANNELS];
+
+/* a 1 kHz sine (left) and a ramp of sample numbers (right) */
+static void fill(uint64_t first) {
+    for (int i = 0; i < FRAMES; i++) {
+        uint64_t n = first + i;
+        input[2 * i] = (float) sin(2.0 * M_PI * 1000.0 * (double) n / RATE);
+        input[2 * i + 1] = (float) (n % 1000) / 1000.0f;
+    }
+}
+
+/* seconds of a source whose clock is off by ppm (positive: slow), starting with a mapping error of offset; *
+ * returns the largest difference between successive output samples of the sine                            */
+static float run(audio_drift_t *drift, double ppm, double secs, int64_t offset, int *discontinuities) {
+    uint64_t buffers = (uint64_t) (secs * RATE / FRAMES);
+    uint64_t start = drift->frames_in;
+    float last = 0.0f, max_diff = 0.0f;
+    bool first = !drift->started;
+    *discontinuities = 0;
+    for (uint64_t b = 0; b < buffers; b++) {
+        uint64_t n = start + b * FRAMES;
+        double pts = (double) START + (double) offset + (double) n * 1e9 / RATE * (1.0 + ppm * 1e-6);
+        fill(n);
+        uint64_t output_pts;
+        bool discont;
+        int frames = audio_drift_process(drift, input, FRAMES, (uint64_t) pts, output, &output_pts, &discont);
+        CHECK(frames <= audio_drift_max_output(FRAMES));
+        if (discont) {
+            (*discontinuities)++;
+        }
+        for (int i = 0; i < frames; i++) {
+            float diff = fabsf(output[2 * i] - last);
+            if (!first && diff > max_diff) {
+                max_diff = diff;
+            }
+            first = false;
+            last = output[2 * i];
+        }
+    }
+    return max_diff;
+}
+
+/* the same clock: the output is the input (one frame later), and the ratio stays at 1 */
+static void test_no_drift() {
+    audio_drift_t drift;
+    audio_drift_init(&drift, RATE, STEP);
+    uint64_t output_pts;
+    bool discont;
+    fill(0);
+    int frames = audio_drift_process(&drift, input, FRAMES, START, output, &output_pts, &discont);
+    CHECK(discont);
+    CHECK(frames == FRAMES - 1);    /* the last frame is needed to interpolate the one before */
+    CHECK(output_pts == START - 22675);
+    CHECK(output[2 * 2 + 1] == input[2 * 1 + 1]);
+    CHECK(output[2 * (FRAMES - 2) + 1] == input[2 * (FRAMES - 3) + 1]);
+    int discontinuities;
+    run(&drift, 0.0, 60.0, 0, &discontinuities);
+    CHECK(discontinuities == 0);
+    CHECK(fabs(drift.ratio - 1.0) < 1e-9);
+    CHECK(drift.frames_out == drift.frames_in - 1);
+    CHECK(fabs(audio_drift_ppm(&drift)) < 0.1);
+}
+
+/* clocks 100 ppm slow and 250 ppm fast: followed by the ratio, without steps or audible discontinuities */
+static void test_drift(double ppm) {
+    audio_drift_t drift;
+    audio_drift_init(&drift, RATE, STEP);
+    int discontinuities;
+    float max_diff = run(&drift, ppm, 300.0, 0, &discontinuities);
+    CHECK(discontinuities == 1);    /* the start */
+    CHECK(drift.steps == 0);
+    /* P-control: the error settles at ppm x AUDIO_DRIFT_TIME_CONSTANT (1 ms at 100 ppm) */
+    double settled = ppm * 1e-6 * AUDIO_DRIFT_TIME_CONSTANT;
+    CHECK(fabs((double) drift.error - settled) < 0.1 * MSEC);
+    CHECK(fabs(drift.ratio - 1.0 - ppm * 1e-6) < 2e-6);
+    CHECK(fabs(audio_drift_ppm(&drift) - ppm) < 0.05 * fabs(ppm));
+    /* a 1 kHz sine of amplitude 1 changes by at most 2 pi 1000 / 44100 = 0.1425 per sample */
+    CHECK(max_diff < 0.143f);
+}
+
+/* a jump of the mapping by more than the step: one step, then no more */
+static void test_jump() {
+    audio_drift_t drift;
+    audio_drift_init(&drift, RATE, STEP);
+    int discontinuities;
+    run(&drift, 50.0, 10.0, 0, &discontinuities);
+    CHECK(drift.steps == 0);
+    run(&drift, 50.0, 10.0, 100 * MSEC, &discontinuities);
+    CHECK(discontinuities == 1);
+    CHECK(drift.steps == 1);
+    CHECK(drift.stepped > 99 * MSEC && drift.stepped < 101 * MSEC);
+    /* a smaller jump is slewed by the ratio */
+    run(&drift, 50.0, 30.0, 110 * MSEC, &discontinuities);
+    CHECK(discontinuities == 0);
+    CHECK(drift.steps == 1);
+    CHECK(fabs((double) drift.error) < 2 * MSEC);
+}
+
+int main() {
+    test_no_drift();
+    test_drift(100.0);
+    test_drift(-250.0);
+    test_jump();
+    return test_result("audio_drift");
+}
@@ -0,0 +1,232 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * the mirror stream reconnect path (-grace): a "client" sends encrypted video packets on the mirror TCP
+ * stream, loses the connection (reset), reconnects and restarts its keystream; the frames received after
+ * the reconnection must decrypt.  An orderly close of the stream does not start the grace period.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "raop.h"
+#include "raop_ntp.h"
+#include "raop_rtp_mirror.h"
+#include "mirror_buffer.h"
+#include "test.h"
+
+#define PACKETS 10
+#define GRACE_SECS 2
+
+static const unsigned char aeskey[16] = { 0x10, 0x21, 0x32, 0x43, 0x54, 0x65, 0x76, 0x87,
+                                          0x98, 0xa9, 0xba, 0xcb, 0xdc, 0xed, 0xfe, 0x0f };
+static uint64_t stream_connection_id = 0x1234567890abcdefULL;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static int frames = 0, frames_valid = 0, resets = 0;
+
+static void video_process(void *cls, raop_ntp_t *ntp, h264_decode_struct *data) {
+    pthread_mutex_lock(&mutex);
+    frames++;
+    /* the first byte of a frame is 0x00 (start code), or 0x01 if it failed to decrypt */
+    if (data->data[0] == 0x00 && data->nal_count == 1) {
+        frames_valid++;
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+static void video_resume(void *cls) {
+}
+
+static void conn_reset(void *cls, int timeouts, bool reset_video) {
+    pthread_mutex_lock(&mutex);
+    resets++;
+    pthread_mutex_unlock(&mutex);
+}
+
+static void counts(int *f, int *v, int *r) {
+    pthread_mutex_lock(&mutex);
+    *f = frames;
+    *v = frames_valid;
+    *r = resets;
+    pthread_mutex_unlock(&mutex);
+}
+
+/* waits up to 2 secs for n frames */
+static void wait_frames(int n) {
+    int f, v, r;
+    for (int i = 0; i < 200; i++) {
+        counts(&f, &v, &r);
+        if (f >= n) {
+            return;
+        }
+        usleep(10000);
+    }
+}
+
+static int stream_connect(unsigned short port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void put_le(unsigned char *b, uint64_t value, int len) {
+    for (int i = 0; i < len; i++) {
+        b[i] = (unsigned char) (value >> (8 * i));
+    }
+}
+
+/* sends count encrypted video packets (a single non-IDR slice NAL unit each) */
+static void send_packets(int fd, mirror_buffer_t *encrypt, int count) {
+    for (int i = 0; i < count; i++) {
+        unsigned char header[128];
+        unsigned char payload[1000];
+        int payload_size = 500 + 37 * i;    /* not a multiple of the AES block size */
+        memset(header, 0, sizeof(header));
+        put_le(header, (uint64_t) payload_size, 4);
+        header[4] = 0x00;
+        put_le(header + 8, (uint64_t) i << 24, 8);
+        int nal_size = payload_size - 4;    /* (big-endian) */
+        payload[0] = payload[1] = 0;
+        payload[2] = (unsigned char) (nal_size >> 8);
+        payload[3] = (unsigned char) nal_size;
+        payload[4] = 0x41;
+        for (int j = 5; j < payload_size; j++) {
+            payload[j] = (unsigned char) (i + j);
+        }
+        /* aes-ctr: encryption is the same as decryption */
+        mirror_buffer_decrypt(encrypt, payload, payload, payload_size);
+        CHECK(send(fd, header, sizeof(header), 0) == sizeof(header));
+        CHECK(send(fd, payload, payload_size, 0) == payload_size);
+    }
+}
+
+/* an abortive close (RST): the receiver sees a connection error, as when the network drops */
+static void stream_reset(int fd) {
+    struct linger linger = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(fd);
+}
+
+static void test_reconnect(logger_t *logger, raop_callbacks_t *callbacks, uint8_t stages) {
+    int f, v, r;
+    timing_protocol_t timing_protocol = NTP;
+    raop_ntp_t *ntp = raop_ntp_init(logger, callbacks, NULL, "127.0.0.1", 4, 7010, &timing_protocol);
+    raop_ntp_set_grace_period(ntp, GRACE_SECS);
+    raop_rtp_mirror_t *mirror = raop_rtp_mirror_init(logger, callbacks, ntp, "127.0.0.1", 4, aeskey, NULL);
+    CHECK(mirror != NULL);
+    raop_rtp_init_mirror_aes(mirror, &stream_connection_id);
+    unsigned short port = 0;
+    raop_rtp_start_mirror(mirror, &port, 0, stages);
+    CHECK(port != 0);
+
+    mirror_buffer_t *encrypt = mirror_buffer_init(logger, aeskey, NULL);
+    mirror_buffer_init_aes(encrypt, &stream_connection_id);
+    int fd = stream_connect(port);
+    CHECK(fd >= 0);
+    send_packets(fd, encrypt, PACKETS);
+    wait_frames(PACKETS);
+    counts(&f, &v, &r);
+    CHECK(f == PACKETS && v == PACKETS);
+
+    /* the connection is lost, and the client reconnects with a new keystream */
+    stream_reset(fd);
+    usleep(200000);
+    mirror_buffer_destroy(encrypt);
+    encrypt = mirror_buffer_init(logger, aeskey, NULL);
+    mirror_buffer_init_aes(encrypt, &stream_connection_id);
+    fd = stream_connect(port);
+    CHECK(fd >= 0);
+    send_packets(fd, encrypt, PACKETS);
+    wait_frames(2 * PACKETS);
+    counts(&f, &v, &r);
+    CHECK(f == 2 * PACKETS);
+    CHECK(v == 2 * PACKETS);
+    CHECK(r == 0);
+
+    /* an orderly close just drops the stream (no grace period, so no reset when it ends) */
+    close(fd);
+    usleep((GRACE_SECS + 1) * 1000000);
+    counts(&f, &v, &r);
+    CHECK(r == 0);
+
+    raop_rtp_mirror_stop(mirror);
+    raop_rtp_mirror_destroy(mirror);
+    raop_ntp_destroy(ntp);
+    mirror_buffer_destroy(encrypt);
+}
+
+/* a lost stream that is not reconnected resets the connection when the grace period ends */
+static void test_no_reconnect(logger_t *logger, raop_callbacks_t *callbacks) {
+    int f, v, r;
+    timing_protocol_t timing_protocol = NTP;
+    raop_ntp_t *ntp = raop_ntp_init(logger, callbacks, NULL, "127.0.0.1", 4, 7010, &timing_protocol);
+    raop_ntp_set_grace_period(ntp, GRACE_SECS);
+    raop_rtp_mirror_t *mirror = raop_rtp_mirror_init(logger, callbacks, ntp, "127.0.0.1", 4, aeskey, NULL);
+    raop_rtp_init_mirror_aes(mirror, &stream_connection_id);
+    unsigned short port = 0;
+    raop_rtp_start_mirror(mirror, &port, 0, 1);
+    int fd = stream_connect(port);
+    CHECK(fd >= 0);
+    stream_reset(fd);
+    for (int i = 0; i < (GRACE_SECS + 2) * 10; i++) {
+        counts(&f, &v, &r);
+        if (r) {
+            break;
+        }
+        usleep(100000);
+    }
+    CHECK(r == 1);
+    raop_rtp_mirror_stop(mirror);
+    raop_rtp_mirror_destroy(mirror);
+    raop_ntp_destroy(ntp);
+}
+
+int main() {
+    logger_t *logger = logger_init();
+    logger_set_level(logger, LOGGER_ERR);
+    raop_callbacks_t callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.video_process = video_process;
+    callbacks.video_resume = video_resume;
+    callbacks.conn_reset = conn_reset;
+
+    test_reconnect(logger, &callbacks, 1);
+    frames = frames_valid = resets = 0;
+    test_reconnect(logger, &callbacks, 3);
+    frames = frames_valid = resets = 0;
+    test_no_reconnect(logger, &callbacks);
+
+    logger_destroy(logger);
+    return test_result("mirror_reconnect");
+}
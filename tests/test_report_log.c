@@ -0,0 +1,120 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * the report log (-reportlog, -reportcsv): the numeric fields of a streaming report are extracted from
+ * its binary plist and exported as CSV.  The fixture data/report_fixture.bplist was written by Python's
+ * plistlib (not by UxPlay), with ints of 1, 2, 4 and 8 bytes, a real, a boolean, a nested dict, and
+ * objects that are not stored (a string, an array, and a key that is not ASCII):
+ *
+ *   plistlib.dumps({"fps": 59.94, "frames": 3597, "bytes": 123456789, "bigCount": 2**40, "offset": -5,
+ *                   "small": 7, "lowPower": True, "name": "iPhone", "list": [1, 2],
+ *                   "encoder": {"width": 1920, "height": 1080, "qp": 26.5, "profile": "high"},
+ *                   "größe": 3}, fmt=plistlib.FMT_BINARY, sort_keys=False)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "report_log.h"
+#include "test.h"
+
+#define T0 1700000000000000000ULL
+#define SECOND 1000000000ULL
+
+static const char *expected_csv =
+    "time,session,fps,frames,bytes,bigCount,offset,small,lowPower,encoder.width,encoder.height,encoder.qp\n"
+    "1700000001.250,1700000000.000,59.9399986,3597,123456792,1.09951163e+12,-5,7,1,1920,1080,26.5\n"
+    "1700000002.250,1700000000.000,59.9399986,3597,123456792,1.09951163e+12,-5,7,1,1920,1080,26.5\n";
+
+/* the CSV export of log (as a malloc'ed string), and the number of records written */
+static char *export_csv(report_log_t *log, uint64_t time_from, unsigned int *written) {
+    char *csv = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&csv, &size);
+    *written = report_log_export_csv(log, out, time_from, UINT64_MAX);
+    fclose(out);
+    return csv;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <report_fixture.bplist>\n", argv[0]);
+        return 1;
+    }
+    unsigned char fixture[4096];
+    FILE *fp = fopen(argv[1], "rb");
+    CHECK(fp != NULL);
+    if (!fp) {
+        return test_result("report_log");
+    }
+    int len = (int) fread(fixture, 1, sizeof(fixture), fp);
+    fclose(fp);
+    CHECK(len > 0 && len < (int) sizeof(fixture));
+
+    char filename[] = "/tmp/test_report_log_XXXXXX";
+    int fd = mkstemp(filename);
+    CHECK(fd >= 0);
+    close(fd);
+    report_log_t *log = report_log_open(filename, 60);
+    CHECK(log != NULL);
+
+    /* extraction and export */
+    report_log_append(log, T0 + SECOND + 250000000, T0, fixture, len);
+    report_log_append(log, T0 + 2 * SECOND + 250000000, T0, fixture, len);
+    unsigned int written;
+    char *csv = export_csv(log, 0, &written);
+    CHECK(written == 2);
+    CHECK(!strcmp(csv, expected_csv));
+    if (strcmp(csv, expected_csv)) {
+        fprintf(stderr, "CSV export:\n%s", csv);
+    }
+    free(csv);
+    csv = export_csv(log, T0 + 2 * SECOND, &written);
+    CHECK(written == 1);
+    free(csv);
+
+    /* a damaged report is not stored (and is not read beyond its end) */
+    for (int i = 0; i < len; i++) {
+        unsigned char *truncated = malloc(i + 1);
+        memcpy(truncated, fixture, i);
+        report_log_append(log, T0 + 3 * SECOND, T0, truncated, i);
+        free(truncated);
+    }
+    unsigned char damaged[4096];
+    memcpy(damaged, fixture, len);
+    damaged[len - 1] = 0xff;    /* the offset table is beyond the end */
+    report_log_append(log, T0 + 3 * SECOND, T0, damaged, len);
+    csv = export_csv(log, 0, &written);
+    CHECK(written == 2);
+    free(csv);
+
+    /* the file is kept, and read back by -reportcsv */
+    report_log_close(log);
+    log = report_log_open_read(filename);
+    CHECK(log != NULL);
+    csv = export_csv(log, 0, &written);
+    CHECK(!strcmp(csv, expected_csv));
+    free(csv);
+    report_log_close(log);
+    unlink(filename);
+
+    return test_result("report_log");
+}
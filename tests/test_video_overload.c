@@ -0,0 +1,117 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * drives the -overload policy with a synthetic backlog (60 fps frames, threshold 250 ms)
+ */
+
+#include <stdio.h>
+
+#include "video_renderer.h"
+#include "video_overload.h"
+#include "test.h"
+
+#define MSEC 1000000ULL
+#define THRESHOLD (250 * MSEC)
+#define FRAME (MSEC * 1000 / 60)
+
+enum { P_FRAME, NONREF_FRAME, IDR_FRAME };
+
+static uint64_t now = 0;
+
+/* one frame: the action taken for it */
+static overload_action_t frame(video_overload_t *overload, uint64_t backlog, int type) {
+    now += FRAME;
+    overload_action_t action = video_overload_update(overload, backlog, now);
+    if (action == OVERLOAD_CHECK) {
+        action = video_overload_frame(overload, type == IDR_FRAME, type != NONREF_FRAME);
+    }
+    return action;
+}
+
+static void test_levels() {
+    video_overload_t overload;
+    video_overload_init(&overload, THRESHOLD);
+    CHECK(frame(&overload, 100 * MSEC, NONREF_FRAME) == OVERLOAD_PASS);
+    CHECK(overload.level == OVERLOAD_NONE);
+    CHECK(frame(&overload, 300 * MSEC, NONREF_FRAME) == OVERLOAD_DROP);
+    CHECK(frame(&overload, 300 * MSEC, P_FRAME) == OVERLOAD_PASS);
+    CHECK(overload.level == OVERLOAD_DROP_NONREF);
+    CHECK(overload.dropped_nonref == 1);
+    CHECK(frame(&overload, 2000 * MSEC, P_FRAME) == OVERLOAD_DROP);
+    CHECK(overload.level == OVERLOAD_REJECT_SESSIONS);
+    CHECK(frame(&overload, 0, P_FRAME) == OVERLOAD_DROP);   /* still skipping to the next IDR frame */
+    CHECK(overload.level == OVERLOAD_NONE);
+}
+
+static void test_skip_to_idr() {
+    video_overload_t overload;
+    video_overload_init(&overload, THRESHOLD);
+    CHECK(frame(&overload, 600 * MSEC, P_FRAME) == OVERLOAD_DROP);
+    CHECK(overload.skip_to_idr);
+    for (int i = 0; i < 30; i++) {
+        CHECK(frame(&overload, (600 - 20 * i) * MSEC, (i % 2 ? P_FRAME : NONREF_FRAME)) == OVERLOAD_DROP);
+    }
+    CHECK(frame(&overload, 0, IDR_FRAME) == OVERLOAD_PASS);
+    CHECK(!overload.skip_to_idr);
+    CHECK(overload.dropped_skip == 31);
+    CHECK(frame(&overload, 0, P_FRAME) == OVERLOAD_PASS);
+    CHECK(frame(&overload, 0, NONREF_FRAME) == OVERLOAD_PASS);
+}
+
+/* the backlog drains while skipping, but no IDR frame arrives: the wait is bounded, then the stream is restarted */
+static void test_skip_timeout() {
+    video_overload_t overload;
+    video_overload_init(&overload, THRESHOLD);
+    uint64_t start = now + FRAME;
+    CHECK(frame(&overload, 600 * MSEC, P_FRAME) == OVERLOAD_DROP);
+    overload_action_t action = OVERLOAD_DROP;
+    int frames = 1;
+    while (action == OVERLOAD_DROP && frames < 1000) {
+        uint64_t backlog = (frames < 30 ? (600 - 20 * frames) * MSEC : 0);
+        action = frame(&overload, backlog, P_FRAME);
+        frames++;
+    }
+    CHECK(action == OVERLOAD_RESTART);
+    CHECK(now - start > OVERLOAD_IDR_WAIT);
+    CHECK(now - start <= OVERLOAD_IDR_WAIT + FRAME);
+    CHECK(!overload.skip_to_idr);
+    /* after the restart, a drained pipeline passes frames again */
+    CHECK(frame(&overload, 0, P_FRAME) == OVERLOAD_PASS);
+}
+
+/* a backlog that stays high keeps requesting restarts, at most once per OVERLOAD_IDR_WAIT */
+static void test_skip_timeout_repeats() {
+    video_overload_t overload;
+    video_overload_init(&overload, THRESHOLD);
+    int restarts = 0;
+    for (int i = 0; i < 60 * 5; i++) {
+        if (frame(&overload, 600 * MSEC, P_FRAME) == OVERLOAD_RESTART) {
+            restarts++;
+        }
+    }
+    CHECK(restarts == 2);
+}
+
+int main() {
+    test_levels();
+    test_skip_to_idr();
+    test_skip_timeout();
+    test_skip_timeout_repeats();
+    return test_result("video_overload");
+}
@@ -0,0 +1,321 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * the video wall on loopback: a display node with the shared secret receives the frames, which are not
+ * readable on the network (a proxy between the nodes records the stream); a display node with a wrong
+ * key receives nothing, and a display node takes no frames from an "ingest node" without the key.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "video_wall.h"
+#include "logger.h"
+#include "test.h"
+
+#define KEY "correct horse battery"
+#define WRONG_KEY "wrong horse battery"
+#define MARKER "UXPLAY-VIDEO-WALL-PLAINTEXT"
+#define FRAMES 10
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    int frames;
+    int frames_valid;
+} node_counts_t;
+
+static void video_frame(void *cls, unsigned char *data, int data_len, int nal_count, uint64_t pts) {
+    node_counts_t *counts = (node_counts_t *) cls;
+    pthread_mutex_lock(&mutex);
+    counts->frames++;
+    if (nal_count == 1 && data_len > 5 + (int) strlen(MARKER) && !memcmp(data, "\x00\x00\x00\x01\x65", 5) &&
+        !memcmp(data + 5, MARKER, strlen(MARKER))) {
+        counts->frames_valid++;
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+static int frames_of(node_counts_t *counts, bool valid) {
+    pthread_mutex_lock(&mutex);
+    int n = (valid ? counts->frames_valid : counts->frames);
+    pthread_mutex_unlock(&mutex);
+    return n;
+}
+
+/* an IDR frame carrying MARKER, so the frames can be looked for in the recorded stream */
+static int make_frame(unsigned char *frame, int i) {
+    int len = 0;
+    memcpy(frame, "\x00\x00\x00\x01\x65", 5);
+    len += 5;
+    for (int j = 0; j < 20; j++) {
+        memcpy(frame + len, MARKER, strlen(MARKER));
+        len += strlen(MARKER);
+    }
+    frame[len++] = (unsigned char) i;
+    return len;
+}
+
+static int bind_loopback(int type, unsigned short port) {
+    int fd = socket(AF_INET, type, 0);
+    int reuseaddr = 1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof(reuseaddr));
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static unsigned short socket_port(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *) &addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+/* a port number free for both TCP and UDP */
+static unsigned short free_port() {
+    for (int i = 0; i < 100; i++) {
+        int tcp = bind_loopback(SOCK_STREAM, 0);
+        unsigned short port = socket_port(tcp);
+        int udp = bind_loopback(SOCK_DGRAM, port);
+        close(tcp);
+        if (udp >= 0) {
+            close(udp);
+            return port;
+        }
+    }
+    return 0;
+}
+
+static int connect_loopback(int type, unsigned short port) {
+    int fd = socket(AF_INET, type, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* relays one display node's TCP connection and clock-sync requests to the ingest node, recording the stream */
+typedef struct {
+    unsigned short port;
+    unsigned short ingest_port;
+    int listen_fd;
+    int sync_fd;
+    volatile bool running;
+    unsigned char *recorded;
+    size_t recorded_len;
+    pthread_t thread;
+} proxy_t;
+
+static void *proxy_thread(void *arg) {
+    proxy_t *proxy = (proxy_t *) arg;
+    int node_fd = -1, ingest_fd = -1;
+    int ingest_sync_fd = connect_loopback(SOCK_DGRAM, proxy->ingest_port);
+    struct sockaddr_storage node_addr;
+    socklen_t node_addrlen = 0;
+    unsigned char buf[65536];
+    while (proxy->running) {
+        fd_set rfds;
+        struct timeval tv = { 0, 20000 };
+        int nfds = 0;
+        FD_ZERO(&rfds);
+#define PROXY_SET(fd) do { if ((fd) >= 0) { FD_SET((fd), &rfds); if ((fd) >= nfds) nfds = (fd) + 1; } } while (0)
+        PROXY_SET(proxy->listen_fd);
+        PROXY_SET(proxy->sync_fd);
+        PROXY_SET(ingest_sync_fd);
+        PROXY_SET(node_fd);
+        PROXY_SET(ingest_fd);
+        if (select(nfds, &rfds, NULL, NULL, &tv) <= 0) {
+            continue;
+        }
+        if (FD_ISSET(proxy->listen_fd, &rfds) && node_fd < 0) {
+            node_fd = accept(proxy->listen_fd, NULL, NULL);
+            ingest_fd = connect_loopback(SOCK_STREAM, proxy->ingest_port);
+        }
+        if (FD_ISSET(proxy->sync_fd, &rfds)) {
+            node_addrlen = sizeof(node_addr);
+            int n = recvfrom(proxy->sync_fd, buf, sizeof(buf), 0, (struct sockaddr *) &node_addr, &node_addrlen);
+            if (n > 0) {
+                send(ingest_sync_fd, buf, n, 0);
+            }
+        }
+        if (FD_ISSET(ingest_sync_fd, &rfds)) {
+            int n = recv(ingest_sync_fd, buf, sizeof(buf), 0);
+            if (n > 0 && node_addrlen) {
+                sendto(proxy->sync_fd, buf, n, 0, (struct sockaddr *) &node_addr, node_addrlen);
+            }
+        }
+        if (node_fd >= 0 && FD_ISSET(node_fd, &rfds)) {
+            int n = recv(node_fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                send(ingest_fd, buf, n, 0);
+            }
+        }
+        if (ingest_fd >= 0 && FD_ISSET(ingest_fd, &rfds)) {
+            int n = recv(ingest_fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                proxy->recorded = realloc(proxy->recorded, proxy->recorded_len + n);
+                memcpy(proxy->recorded + proxy->recorded_len, buf, n);
+                proxy->recorded_len += n;
+                send(node_fd, buf, n, 0);
+            }
+        }
+    }
+    if (node_fd >= 0) close(node_fd);
+    if (ingest_fd >= 0) close(ingest_fd);
+    close(ingest_sync_fd);
+    return NULL;
+}
+
+static bool recorded_contains(proxy_t *proxy, const char *text) {
+    size_t len = strlen(text);
+    for (size_t i = 0; i + len <= proxy->recorded_len; i++) {
+        if (!memcmp(proxy->recorded + i, text, len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* send frames (one every 50 msecs) until the display node has n of them, or until max were sent */
+static void send_frames(video_wall_t *ingest, node_counts_t *counts, int n, int max) {
+    unsigned char frame[1024];
+    for (int i = 0; i < max && frames_of(counts, false) < n; i++) {
+        int len = make_frame(frame, i);
+        video_wall_ingest_send(ingest, frame, len, 1, 0);
+        usleep(50000);
+    }
+}
+
+/* the stream between the nodes is encrypted, and the display node receives the frames intact */
+static void test_encrypted(logger_t *logger, video_wall_t *ingest, unsigned short ingest_port) {
+    proxy_t proxy;
+    memset(&proxy, 0, sizeof(proxy));
+    proxy.ingest_port = ingest_port;
+    proxy.port = free_port();
+    proxy.listen_fd = bind_loopback(SOCK_STREAM, proxy.port);
+    proxy.sync_fd = bind_loopback(SOCK_DGRAM, proxy.port);
+    CHECK(proxy.listen_fd >= 0 && proxy.sync_fd >= 0);
+    listen(proxy.listen_fd, 1);
+    proxy.running = true;
+    pthread_create(&proxy.thread, NULL, proxy_thread, &proxy);
+
+    node_counts_t counts = { 0, 0 };
+    video_wall_callbacks_t callbacks = { &counts, video_frame };
+    video_wall_t *node = video_wall_node_init(logger, "127.0.0.1", proxy.port, "1x1:0,0", KEY, &callbacks);
+    CHECK(node != NULL);
+    send_frames(ingest, &counts, FRAMES, 100);
+    video_wall_destroy(node);
+    proxy.running = false;
+    pthread_join(proxy.thread, NULL);
+
+    CHECK(frames_of(&counts, false) >= FRAMES);
+    CHECK(frames_of(&counts, true) == frames_of(&counts, false));
+    CHECK(proxy.recorded_len > FRAMES * strlen(MARKER));
+    CHECK(!recorded_contains(&proxy, MARKER));
+    close(proxy.listen_fd);
+    close(proxy.sync_fd);
+    free(proxy.recorded);
+}
+
+/* a display node with the wrong key is sent nothing */
+static void test_wrong_key(logger_t *logger, video_wall_t *ingest, unsigned short ingest_port) {
+    node_counts_t counts = { 0, 0 };
+    video_wall_callbacks_t callbacks = { &counts, video_frame };
+    video_wall_t *node = video_wall_node_init(logger, "127.0.0.1", ingest_port, "1x1:0,0", WRONG_KEY, &callbacks);
+    CHECK(node != NULL);
+    send_frames(ingest, &counts, 1, 30);
+    video_wall_destroy(node);
+    CHECK(frames_of(&counts, false) == 0);
+}
+
+/* an "ingest node" that does not know the key: it answers the HELLO with a made-up WELCOME, and sends a *
+ * frame.  The display node must not take it, and must drop the connection                              */
+static void test_fake_ingest(logger_t *logger) {
+    unsigned short port = free_port();
+    int listen_fd = bind_loopback(SOCK_STREAM, port);
+    CHECK(listen_fd >= 0);
+    listen(listen_fd, 1);
+    node_counts_t counts = { 0, 0 };
+    video_wall_callbacks_t callbacks = { &counts, video_frame };
+    video_wall_t *node = video_wall_node_init(logger, "127.0.0.1", port, "1x1:0,0", KEY, &callbacks);
+    CHECK(node != NULL);
+
+    int fd = accept(listen_fd, NULL, NULL);
+    unsigned char message[1024];
+    memset(message, 0, sizeof(message));
+    message[0] = 4;                         /* CHALLENGE */
+    message[7] = 16;
+    CHECK(send(fd, message, 8 + 16, 0) == 8 + 16);
+    int n = recv(fd, message, sizeof(message), 0);
+    CHECK(n > 8 && message[0] == 1);        /* HELLO */
+    memset(message, 0, sizeof(message));
+    message[0] = 5;                         /* WELCOME, with a made-up HMAC */
+    message[7] = 32;
+    int frame_len = make_frame(message + 8 + 32 + 8 + 16, 0);
+    message[40] = 2;                        /* FRAME */
+    message[47] = (unsigned char) (16 + frame_len);
+    message[48 + 7] = 1;                    /* nal_count */
+    send(fd, message, 8 + 32 + 8 + 16 + frame_len, 0);
+
+    /* the display node closes the connection */
+    struct timeval tv = { 3, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    CHECK(recv(fd, message, sizeof(message), 0) == 0);
+    video_wall_destroy(node);
+    CHECK(frames_of(&counts, false) == 0);
+    close(fd);
+    close(listen_fd);
+}
+
+int main() {
+    logger_t *logger = logger_init();
+    logger_set_level(logger, LOGGER_ERR);
+    unsigned short ingest_port = free_port();
+    video_wall_t *ingest = video_wall_ingest_init(logger, "127.0.0.1", ingest_port, KEY);
+    CHECK(ingest != NULL);
+    if (ingest) {
+        test_encrypted(logger, ingest, ingest_port);
+        test_wrong_key(logger, ingest, ingest_port);
+        video_wall_destroy(ingest);
+    }
+    test_fake_ingest(logger);
+    logger_destroy(logger);
+    return test_result("video_wall");
+}
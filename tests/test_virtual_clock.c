@@ -0,0 +1,284 @@
+/**
+ * UxPlay - An open-source AirPlay mirroring server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * raop_clock's virtual mode, as used by UXPLAY_VCLOCK: a manual virtual clock only moves when advanced, and
+ * drives the NTP client (raop_ntp) through its timeout, hold (-grace) and resume paths without waiting for them
+ * in real time.  A "client" socket receives the timing requests and answers them, or not.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "raop.h"
+#include "raop_clock.h"
+#include "raop_ntp.h"
+#include "test.h"
+
+#define SECOND 1000000000ULL
+#define START_TIME (1700000000ULL * SECOND)
+#define STEP (SECOND / 4)           /* how far the virtual clock is advanced at a time */
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static int resets = 0;
+
+static void conn_reset(void *cls, int timeouts, bool reset_video) {
+    pthread_mutex_lock(&mutex);
+    resets++;
+    pthread_mutex_unlock(&mutex);
+}
+
+static int get_resets() {
+    pthread_mutex_lock(&mutex);
+    int r = resets;
+    pthread_mutex_unlock(&mutex);
+    return r;
+}
+
+typedef struct wait_s {
+    raop_clock_t *clock;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int ret;
+    int done;
+} wait_t;
+
+static void *cond_wait_thread(void *arg) {
+    wait_t *wait = arg;
+    pthread_mutex_lock(&wait->mutex);
+    int ret = raop_clock_cond_wait(wait->clock, &wait->cond, &wait->mutex, SECOND);
+    pthread_mutex_unlock(&wait->mutex);
+    __atomic_store_n(&wait->ret, ret, __ATOMIC_RELAXED);
+    __atomic_store_n(&wait->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void test_manual_clock() {
+    raop_clock_t *clock = raop_clock_init(RAOP_CLOCK_VIRTUAL, START_TIME, 0);
+    CHECK(clock != NULL);
+    CHECK(raop_clock_get_type(clock) == RAOP_CLOCK_VIRTUAL);
+    CHECK(raop_clock_get_time(clock) == START_TIME);
+    usleep(10000);
+    CHECK(raop_clock_get_time(clock) == START_TIME);
+    raop_clock_advance(clock, 5 * SECOND);
+    CHECK(raop_clock_get_time(clock) == START_TIME + 5 * SECOND);
+    raop_clock_set_time(clock, START_TIME);
+    CHECK(raop_clock_get_time(clock) == START_TIME);
+
+    /* a timed wait only ends when the clock is advanced past its timeout */
+    wait_t wait;
+    memset(&wait, 0, sizeof(wait));
+    wait.clock = clock;
+    pthread_mutex_init(&wait.mutex, NULL);
+    pthread_cond_init(&wait.cond, NULL);
+    pthread_t thread;
+    pthread_create(&thread, NULL, cond_wait_thread, &wait);
+    usleep(100000);
+    raop_clock_advance(clock, SECOND / 2);
+    usleep(100000);
+    CHECK(!__atomic_load_n(&wait.done, __ATOMIC_ACQUIRE));
+    raop_clock_advance(clock, SECOND / 2);
+    pthread_join(thread, NULL);
+    CHECK(wait.done && wait.ret == ETIMEDOUT);
+    pthread_cond_destroy(&wait.cond);
+    pthread_mutex_destroy(&wait.mutex);
+    raop_clock_destroy(clock);
+}
+
+static int client_socket(unsigned short *port) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+        close(fd);
+        return -1;
+    }
+    struct timeval tv = { 0, 50000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+/* receives a timing request (waiting up to 50 msecs, real time), and answers it if asked to */
+static bool receive(int fd, bool answer) {
+    unsigned char request[128];
+    struct sockaddr_in from;
+    socklen_t len = sizeof(from);
+    ssize_t n = recvfrom(fd, request, sizeof(request), 0, (struct sockaddr *) &from, &len);
+    if (n < 32) {
+        return false;
+    }
+    if (answer) {
+        /* any reply counts as a response; echo the request, whose send time is the origin time of the reply */
+        unsigned char reply[32];
+        memset(reply, 0, sizeof(reply));
+        reply[0] = 0x80;
+        reply[1] = 0xd3;
+        memcpy(reply + 8, request + 24, 8);
+        memcpy(reply + 16, request + 24, 8);
+        memcpy(reply + 24, request + 24, 8);
+        sendto(fd, reply, sizeof(reply), 0, (struct sockaddr *) &from, len);
+    }
+    /* let the server time out (SO_RCVTIMEO 300 msecs) or handle the reply and start its wait, *
+     * so that advancing the clock counts against that wait                                   */
+    usleep(answer ? 100000 : 400000);
+    return true;
+}
+
+/* advances the virtual clock until the next request, for up to "limit" nsecs of virtual time: *
+ * returns the (virtual) time of the request, or 0 if none came                                */
+static uint64_t next_request(raop_clock_t *clock, int fd, uint64_t limit, bool answer) {
+    uint64_t end = raop_clock_get_time(clock) + limit;
+    while (1) {
+        if (receive(fd, answer)) {
+            return raop_clock_get_time(clock);
+        }
+        if (get_resets() || raop_clock_get_time(clock) >= end) {
+            return 0;
+        }
+        raop_clock_advance(clock, STEP);
+    }
+}
+
+static raop_ntp_t *start_ntp(logger_t *logger, raop_callbacks_t *callbacks, raop_clock_t *clock,
+                             unsigned short client_port, unsigned int grace_secs, int max_timeouts) {
+    timing_protocol_t timing_protocol = NTP;
+    raop_ntp_t *ntp = raop_ntp_init(logger, callbacks, clock, "127.0.0.1", 4, client_port, &timing_protocol);
+    CHECK(ntp != NULL);
+    raop_ntp_set_grace_period(ntp, grace_secs);
+    unsigned short port = 0;
+    raop_ntp_start(ntp, &port, max_timeouts);
+    CHECK(port != 0);
+    return ntp;
+}
+
+/* without -grace, the connection is reset at the -reset limit of missed replies, polling every 3 secs */
+static void test_reset(logger_t *logger, raop_callbacks_t *callbacks) {
+    unsigned short client_port = 0;
+    int fd = client_socket(&client_port);
+    CHECK(fd >= 0);
+    raop_clock_t *clock = raop_clock_init(RAOP_CLOCK_VIRTUAL, START_TIME, 0);
+    raop_ntp_t *ntp = start_ntp(logger, callbacks, clock, client_port, 0, 3);
+
+    uint64_t first = next_request(clock, fd, 0, false);
+    CHECK(first == START_TIME);
+    uint64_t second = next_request(clock, fd, 10 * SECOND, false);
+    CHECK(second == first + 3 * SECOND);
+    CHECK(get_resets() == 0);
+    uint64_t third = next_request(clock, fd, 10 * SECOND, false);
+    CHECK(third == first + 6 * SECOND);
+    CHECK(get_resets() == 1);
+    CHECK(next_request(clock, fd, 10 * SECOND, false) == 0);
+
+    raop_ntp_destroy(ntp);
+    raop_clock_destroy(clock);
+    close(fd);
+}
+
+/* with -grace, the session is held after a missed reply, with faster polling, and reset *
+ * when the client has not answered for the -reset limit plus the grace period          */
+static void test_hold_reset(logger_t *logger, raop_callbacks_t *callbacks) {
+    unsigned short client_port = 0;
+    int fd = client_socket(&client_port);
+    CHECK(fd >= 0);
+    raop_clock_t *clock = raop_clock_init(RAOP_CLOCK_VIRTUAL, START_TIME, 0);
+    raop_ntp_t *ntp = start_ntp(logger, callbacks, clock, client_port, 3, 1);
+
+    uint64_t hold_start = next_request(clock, fd, 0, false);
+    CHECK(hold_start == START_TIME);
+    CHECK(raop_ntp_is_on_hold(ntp));
+    /* polls after 0.25, 0.5, then every 1 sec */
+    const uint64_t expected[] = { 250, 750, 1750, 2750, 3750, 4750, 5750, 6750 };
+    int requests = 0;
+    uint64_t last = hold_start;
+    for (int i = 0; i < (int) (sizeof(expected) / sizeof(expected[0])); i++) {
+        uint64_t time = next_request(clock, fd, 2 * SECOND, false);
+        if (!time) {
+            break;
+        }
+        requests++;
+        last = time;
+        CHECK(time == hold_start + expected[i] * (SECOND / 1000));
+        /* the hold limit is 1 * 3 secs + 3 secs */
+        CHECK(get_resets() == (time - hold_start >= 6 * SECOND ? 1 : 0));
+    }
+    CHECK(requests == 8);
+    CHECK(last - hold_start >= 6 * SECOND);
+    CHECK(get_resets() == 1);
+    CHECK(raop_ntp_get_resumes(ntp) == 0);
+
+    raop_ntp_destroy(ntp);
+    raop_clock_destroy(clock);
+    close(fd);
+}
+
+/* a client that answers again during the hold resumes the session */
+static void test_hold_resume(logger_t *logger, raop_callbacks_t *callbacks) {
+    unsigned short client_port = 0;
+    int fd = client_socket(&client_port);
+    CHECK(fd >= 0);
+    raop_clock_t *clock = raop_clock_init(RAOP_CLOCK_VIRTUAL, START_TIME, 0);
+    raop_ntp_t *ntp = start_ntp(logger, callbacks, clock, client_port, 3, 1);
+
+    CHECK(next_request(clock, fd, 0, true) == START_TIME);
+    CHECK(!raop_ntp_is_on_hold(ntp));
+    uint64_t hold_start = next_request(clock, fd, 10 * SECOND, false);
+    CHECK(hold_start == START_TIME + 3 * SECOND);
+    CHECK(raop_ntp_is_on_hold(ntp));
+    CHECK(next_request(clock, fd, 2 * SECOND, false) == hold_start + SECOND / 4);
+    CHECK(next_request(clock, fd, 2 * SECOND, true) == hold_start + 3 * SECOND / 4);
+    CHECK(!raop_ntp_is_on_hold(ntp));
+    CHECK(raop_ntp_get_resumes(ntp) == 1);
+    /* back to polling every 3 secs, well past the hold limit, with no reset */
+    uint64_t time = next_request(clock, fd, 10 * SECOND, true);
+    CHECK(time == hold_start + 3 * SECOND / 4 + 3 * SECOND);
+    time = next_request(clock, fd, 10 * SECOND, true);
+    CHECK(time == hold_start + 3 * SECOND / 4 + 6 * SECOND);
+    CHECK(get_resets() == 0);
+
+    raop_ntp_destroy(ntp);
+    raop_clock_destroy(clock);
+    close(fd);
+}
+
+int main() {
+    logger_t *logger = logger_init();
+    logger_set_level(logger, LOGGER_ERR);
+    raop_callbacks_t callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.conn_reset = conn_reset;
+
+    test_manual_clock();
+    test_reset(logger, &callbacks);
+    resets = 0;
+    test_hold_reset(logger, &callbacks);
+    resets = 0;
+    test_hold_resume(logger, &callbacks);
+
+    logger_destroy(logger);
+    return test_result("virtual_clock");
+}
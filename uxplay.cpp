@@ -33,16 +33,19 @@
 #include <sys/stat.h>
 #include <cstdio>
 #include <stdarg.h>
+#include <errno.h>
 
 #ifdef _WIN32  /*modifications for Windows compilation */
 #include <glib.h>
 #include <unordered_map>
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #include <iphlpapi.h>
 #else
 #include <glib-unix.h>
 #include <sys/utsname.h>
 #include <sys/socket.h>
+#include <netdb.h>
 #include <ifaddrs.h>
 #include <sys/types.h>
 #include <pwd.h>
@@ -57,8 +60,12 @@
 #include "lib/stream.h"
 #include "lib/logger.h"
 #include "lib/dnssd.h"
+#include "lib/video_wall.h"
 #include "renderers/video_renderer.h"
 #include "renderers/audio_renderer.h"
+#include "renderers/photo_renderer.h"
+#include "renderers/video_autotune.h"
+#include "renderers/latency_probe.h"
 
 #define VERSION "1.67"
 
@@ -69,6 +76,13 @@
 #define LOWEST_ALLOWED_PORT 1024
 #define HIGHEST_PORT 65535
 #define NTP_TIMEOUT_LIMIT 5
+#define GRACE_SECS 10
+#define PROBE_SECS 20
+#define HFR_RATE 120
+#define PARTY_SOURCES 3
+#define PHOTO_CACHE_SIZE 8
+#define OVERLOAD_THRESHOLD 250
+#define WALL_DELAY 100
 #define BT709_FIX "capssetter caps=\"video/x-h264, colorimetry=bt709\""
 
 static std::string server_name = DEFAULT_NAME;
@@ -96,6 +110,15 @@ static std::string video_decoder = "decodebin";
 static std::string video_converter = "videoconvert";
 static bool show_client_FPS_data = false;
 static unsigned int max_ntp_timeouts = NTP_TIMEOUT_LIMIT;
+static unsigned int grace_secs = 0;
+static bool alac_fast_start = false;
+static bool perf_counters = false;
+static bool hud = false;
+static unsigned int vclock_speed = 0;
+static raop_clock_t *vclock = NULL;
+static unsigned int hfr = 0;
+static unsigned int party_sources = 0;
+static unsigned int mirror_stages = 1;
 static FILE *video_dumpfile = NULL;
 static std::string video_dumpfile_name = "videodump";
 static int video_dump_limit = 0;
@@ -131,6 +154,32 @@ static bool require_password = false;
 static unsigned short pin = 0;
 static std::string keyfile = "";
 static std::string mac_address = "";
+static bool use_photo = false;
+static unsigned int photo_cache_size = PHOTO_CACHE_SIZE;
+static unsigned int overload_threshold = 0;
+static int overload_level = OVERLOAD_NONE;
+static bool fast_start = false;
+static bool autotune = false;
+static bool autotune_reprobe = false;
+static video_wall_t *video_wall = NULL;
+static unsigned int probe_secs = 0;
+static latency_probe_t *latency_probe = NULL;
+static bool wall_ingest = false;
+static std::string wall_host = "";
+static unsigned short wall_port = VIDEO_WALL_DEFAULT_PORT;
+static std::string wall_bind = "";
+static std::string wall_key = "";
+static unsigned int wall_tile[4] = {0};  /* columns, rows, column, row */
+static unsigned int wall_delay = WALL_DELAY;
+static std::string qoe_file = "";
+static std::string qoe_udp_host = "";
+static std::string qoe_udp_port = "";
+static uint64_t qoe_rendered_start = 0;
+static std::string rtp_audio_clients = "";
+static std::string report_log_file = "";
+static unsigned int report_log_records = 0;
+static report_log_t *report_log = NULL;
+static bool rtp_audio_l16 = false;
 /* logging */
 
 void log(int level, const char* format, ...) {
@@ -662,22 +711,59 @@ static void print_info (char *name) {
     printf("-vs 0     Streamed audio only, with no video display window\n");
     printf("-v4l2     Use Video4Linux2 for GPU hardware h264 decoding\n");
     printf("-bt709    Sometimes needed for Raspberry Pi with GStreamer < 1.22 \n"); 
+    printf("-autotune [new] Use the fastest working decoder,converter,videosink\n");
+    printf("          (timed on a test clip once, and cached in $HOME/.uxplay.pipeline;\n");
+    printf("          \"new\": time them again). Options -vd,-vc,-vs,-avdec take priority\n");
+    printf("-rtpaudio h:n[,h:n,...] [L16] Also send audio as RTP (Opus, or L16) to\n");
+    printf("          unicast or multicast hosts h, port n (RTCP on port n+1)\n");
     printf("-as ...   Choose the GStreamer audiosink; default \"autoaudiosink\"\n");
     printf("          some choices:pulsesink,alsasink,pipewiresink,jackaudiosink,\n");
     printf("          osssink,oss4sink,osxaudiosink,wasapisink,directsoundsink.\n");
     printf("-as 0     (or -a)  Turn audio off, streamed video only\n");
     printf("-al x     Audio latency in seconds (default 0.25) reported to client.\n");
     printf("-ca <fn>  In Airplay Audio (ALAC) mode, write cover-art to file <fn>\n");
+    printf("-alacfast In Airplay Audio (ALAC) mode, start playing before the first timing\n");
+    printf("          sync from the client, ahead of the client's timeline at first\n");
     printf("-reset n  Reset after 3n seconds client silence (default %d, 0=never)\n", NTP_TIMEOUT_LIMIT);
+    printf("-grace [n] Hold the session from the first missed client reply, for the\n");
+    printf("          -reset limit + n secs (default %d), for the client to reconnect;\n", GRACE_SECS);
+    printf("          a lost video stream can also be reconnected (within n secs)\n");
     printf("-nc       do Not Close video window when client stops mirroring\n");
     printf("-nohold   Drop current connection when new client connects.\n");
+    printf("-party [n] Mix the audio of up to n clients (default %d) streaming at once\n", PARTY_SOURCES);
     printf("-restrict Restrict clients to those specified by \"-allow <deviceID>\"\n");
     printf("          UxPlay displays deviceID when a client attempts to connect\n");
     printf("          Use \"-restrict no\" for no client restrictions (default)\n");
     printf("-allow <i>Permit deviceID = <i> to connect if restrictions are imposed\n");
     printf("-block <i>Always block connections from deviceID = <i>\n");
     printf("-FPSdata  Show video-streaming performance reports sent by client.\n");
+    printf("-faststart Show first video frame at once (no sync) when streaming starts\n");
+    printf("-photo [n] Show AirPlay photos, caching up to n decoded photos (default %d)\n", PHOTO_CACHE_SIZE);
+    printf("-overload [n] Shed load if video falls > n ms behind (default %d):\n", OVERLOAD_THRESHOLD);
+    printf("          drop frames, skip to IDR, shorten audio, reject new clients\n");
+    printf("-wall [n] Video-wall ingest node: send mirrored video to display nodes\n");
+    printf("          on TCP and UDP port n (default %d); it is not shown locally\n", VIDEO_WALL_DEFAULT_PORT);
+    printf("-wallbind a Ingest node only accepts display nodes on local address a\n");
+    printf("-wallkey s Video-wall shared secret s (required by -wall and -wallnode)\n");
+    printf("-walldelay n Video wall shows frames n millisecs late (default %d)\n", WALL_DELAY);
+    printf("-wallnode h[:n] CxR c,r  Video-wall display node: show tile c,r (from\n");
+    printf("          0,0 = top left) of a C x R wall fed by ingest node h[:n]\n");
+    printf("-qoe <fn> At the end of each session, append a one-line JSON summary of\n");
+    printf("          its quality (latency, frames, audio gaps, ...) to file <fn>;\n");
+    printf("          -qoe udp:h:n sends it as a UDP datagram to host h, port n\n");
+    printf("-perf     Add per-stage hardware performance counters (IPC, cache and\n");
+    printf("          branch misses, context switches per frame) to the -qoe summary\n");
+    printf("-reportlog <fn> [n] Store the client's once-per-second video streaming\n");
+    printf("          reports in ring file <fn> (holding n reports, default %d)\n", REPORT_LOG_DEFAULT_RECORDS);
+    printf("-reportcsv <fn> [s] Print reports from ring file <fn> as CSV and exit\n");
+    printf("          (only those from the last s seconds, if s is given)\n");
+    printf("-mirrorstages n Threads (1-3) used to receive, decrypt+parse and deliver\n");
+    printf("          mirrored video (default 1)\n");
+    printf("-hud      Overlay performance figures (fps, bitrate, latency, audio buffer,\n");
+    printf("          resends, NTP offset) on the video; key \"h\" shows/hides them\n");
     printf("-fps n    Set maximum allowed streaming framerate, default 30\n");
+    printf("-hfr [n]  High frame rate: advertise n Hz and n fps (default %d, if not\n", HFR_RATE);
+    printf("          set by -s, -fps), pace video for n Hz, and log fps rendered\n");
     printf("-f {H|V|I}Horizontal|Vertical flip, or both=Inversion=rotate 180 deg\n");
     printf("-r {R|L}  Rotate 90 degrees Right (cw) or Left (ccw)\n");
     printf("-m [mac]  Set MAC address (also Device ID);use for concurrent UxPlays\n");
@@ -691,6 +777,8 @@ static void print_info (char *name) {
     printf("          =1,2,..; fn=\"audiodump\"; change with \"-admp [n] filename\".\n");
     printf("          x increases when audio format changes. If n is given, <= n\n");
     printf("          audio packets are dumped. \"aud\"= unknown format.\n");
+    printf("-probe [n] Measure sender->render latency of test video and audio for n\n");
+    printf("          secs (default %d), print it as JSON, and exit (no AirPlay server)\n", PROBE_SECS);
     printf("-d        Enable debug logging\n");
     printf("-v        Displays version information\n");
     printf("-h        Displays this help\n");
@@ -913,6 +1001,162 @@ static void parse_arguments (int argc, char *argv[]) {
                 exit(1);
             }
             display[3] = (unsigned short) n;
+        } else if (arg == "-hfr") {
+            hfr = HFR_RATE;
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                unsigned int n = 255;
+                if (!get_value(argv[++i], &n) || n < 60) {
+                    fprintf(stderr, "invalid \"-hfr %s\"; -hfr n requires 60 <= n <= 255, default n = %d\n",
+                            argv[i], HFR_RATE);
+                    exit(1);
+                }
+                hfr = n;
+            }
+        } else if (arg == "-photo") {
+            use_photo = true;
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                unsigned int n = 255;
+                if (!get_value(argv[++i], &n)) {
+                    fprintf(stderr, "invalid \"-photo %s\"; -photo n : 1 <= n <= 255, default n=%d\n", argv[i],
+                            PHOTO_CACHE_SIZE);
+                    exit(1);
+                }
+                photo_cache_size = n;
+            }
+        } else if (arg == "-faststart") {
+            fast_start = true;
+        } else if (arg == "-autotune") {
+            autotune = true;
+            if (i < argc - 1 && strcmp(argv[i+1], "new") == 0) {
+                autotune_reprobe = true;
+                i++;
+            }
+        } else if (arg == "-probe") {
+            probe_secs = PROBE_SECS;
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                unsigned int n = 3600;
+                if (!get_value(argv[++i], &n)) {
+                    fprintf(stderr, "invalid \"-probe %s\"; -probe n requires 1 <= n <= 3600, default n = %d\n",
+                            argv[i], PROBE_SECS);
+                    exit(1);
+                }
+                probe_secs = n;
+            }
+        } else if (arg == "-wall") {
+            wall_ingest = true;
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                if (!get_ports(1, arg, argv[++i], &wall_port)) exit(1);
+            }
+        } else if (arg == "-wallbind") {
+            if (!option_has_value(i, argc, arg, argv[i+1])) exit(1);
+            wall_bind = argv[++i];
+        } else if (arg == "-wallkey") {
+            if (!option_has_value(i, argc, arg, argv[i+1])) exit(1);
+            wall_key = argv[++i];
+            if (wall_key.length() < 8) {
+                fprintf(stderr, "invalid \"-wallkey %s\": the video-wall shared secret needs at least 8 characters\n",
+                        argv[i]);
+                exit(1);
+            }
+        } else if (arg == "-walldelay") {
+            if (!option_has_value(i, argc, arg, argv[i+1])) exit(1);
+            unsigned int n = 0;
+            if (!get_value(argv[++i], &n) || n > 10000) {
+                fprintf(stderr, "invalid \"-walldelay %s\"; -walldelay n : max n=10000 msecs, default n=%d\n",
+                        argv[i], WALL_DELAY);
+                exit(1);
+            }
+            wall_delay = n;
+        } else if (arg == "-wallnode") {
+            if (i + 3 >= argc) {
+                fprintf(stderr, "option \"-wallnode\" requires \"host[:n] CxR c,r\", e.g. \"-wallnode 192.168.1.10 2x2 0,1\"\n");
+                exit(1);
+            }
+            std::string host(argv[++i]);
+            std::size_t pos = host.find_last_of(':');
+            if (pos != std::string::npos && host.find(':') == pos) {
+                if (!get_ports(1, arg, host.substr(pos + 1).c_str(), &wall_port)) exit(1);
+                host.erase(pos);
+            }
+            wall_host = host;
+            char c1, c2;
+            if (sscanf(argv[++i], "%u%c%u%c", &wall_tile[0], &c1, &wall_tile[1], &c2) != 3 || c1 != 'x' ||
+                sscanf(argv[++i], "%u%c%u%c", &wall_tile[2], &c1, &wall_tile[3], &c2) != 3 || c1 != ',' ||
+                !wall_tile[0] || !wall_tile[1] || wall_tile[0] > 16 || wall_tile[1] > 16 ||
+                wall_tile[2] >= wall_tile[0] || wall_tile[3] >= wall_tile[1]) {
+                fprintf(stderr, "invalid \"-wallnode %s %s %s\": CxR is the wall size (max 16x16), c,r the tile "
+                        "(0,0 = top left)\n", argv[i-2], argv[i-1], argv[i]);
+                exit(1);
+            }
+        } else if (arg == "-qoe") {
+            if (!option_has_value(i, argc, arg, argv[i+1])) exit(1);
+            std::string dest(argv[++i]);
+            if (dest.compare(0, 4, "udp:") == 0) {
+                std::size_t pos = dest.find_last_of(':');
+                unsigned int port = 0;
+                if (pos <= 4 || !get_value(dest.substr(pos + 1).c_str(), &port) || port == 0 || port > HIGHEST_PORT) {
+                    fprintf(stderr, "invalid \"-qoe %s\": use \"-qoe udp:host:port\" to send session reports to host\n",
+                            dest.c_str());
+                    exit(1);
+                }
+                qoe_udp_host = dest.substr(4, pos - 4);
+                qoe_udp_port = dest.substr(pos + 1);
+            } else {
+                qoe_file = dest;
+            }
+        } else if (arg == "-perf") {
+            perf_counters = true;
+        } else if (arg == "-reportlog") {
+            if (!option_has_value(i, argc, arg, argv[i+1])) exit(1);
+            report_log_file = argv[++i];
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                if (!get_value(argv[++i], &report_log_records) || report_log_records < 60) {
+                    fprintf(stderr, "invalid \"-reportlog %s %s\": n must be at least 60\n", argv[i-1], argv[i]);
+                    exit(1);
+                }
+            }
+        } else if (arg == "-reportcsv") {
+            if (!option_has_value(i, argc, arg, argv[i+1])) exit(1);
+            const char *fn = argv[++i];
+            unsigned int secs = 0;
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                if (!get_value(argv[++i], &secs) || secs == 0) {
+                    fprintf(stderr, "invalid \"-reportcsv %s %s\": s must be a positive number of seconds\n", fn, argv[i]);
+                    exit(1);
+                }
+            }
+            report_log_t *log = report_log_open_read(fn);
+            if (!log) {
+                fprintf(stderr, "-reportcsv: cannot read report log %s: %s\n", fn, strerror(errno));
+                exit(1);
+            }
+            uint64_t from = 0;
+            if (secs) {
+                uint64_t now = raop_clock_get_time(NULL);
+                from = now - (uint64_t) secs * SECOND_IN_NSECS;
+            }
+            report_log_export_csv(log, stdout, from, UINT64_MAX);
+            report_log_close(log);
+            exit(0);
+        } else if (arg == "-mirrorstages") {
+            if (!option_has_value(i, argc, arg, argv[i+1])) exit(1);
+            if (!get_value(argv[++i], &mirror_stages) || mirror_stages < 1 || mirror_stages > 3) {
+                fprintf(stderr, "invalid \"-mirrorstages %s\": n must be 1, 2 or 3\n", argv[i]);
+                exit(1);
+            }
+        } else if (arg == "-hud") {
+            hud = true;
+        } else if (arg == "-overload") {
+            overload_threshold = OVERLOAD_THRESHOLD;
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                unsigned int n = 10000;
+                if (!get_value(argv[++i], &n) || n == 0) {
+                    fprintf(stderr, "invalid \"-overload %s\"; -overload n : 0 < n <= 10000 msecs, default n=%d\n",
+                            argv[i], OVERLOAD_THRESHOLD);
+                    exit(1);
+                }
+                overload_threshold = n;
+            }
         } else if (arg == "-o") {
             display[4] = 1;
         } else if (arg == "-f") {
@@ -986,6 +1230,27 @@ static void parse_arguments (int argc, char *argv[]) {
             if (!option_has_value(i, argc, arg, argv[i+1])) exit(1);
             videosink.erase();
             videosink.append(argv[++i]);
+        } else if (arg == "-rtpaudio") {
+            if (!option_has_value(i, argc, arg, argv[i+1])) exit(1);
+            std::string clients(argv[++i]);
+            std::stringstream ss(clients);
+            std::string client;
+            while (std::getline(ss, client, ',')) {
+                std::size_t pos = client.find_last_of(':');
+                unsigned int port = 0;
+                if (pos == std::string::npos || pos == 0 || !get_value(client.substr(pos + 1).c_str(), &port) ||
+                    port == 0 || port >= HIGHEST_PORT) {
+                    fprintf(stderr, "invalid destination \"%s\" in \"-rtpaudio %s\": use host:port,host:port,...\n",
+                            client.c_str(), clients.c_str());
+                    exit(1);
+                }
+            }
+            rtp_audio_clients = clients;
+            rtp_audio_l16 = false;
+            if (i < argc - 1 && (strcmp(argv[i+1], "L16") == 0 || strcmp(argv[i+1], "l16") == 0)) {
+                rtp_audio_l16 = true;
+                i++;
+            }
         } else if (arg == "-as") {
             if (!option_has_value(i, argc, arg, argv[i+1])) exit(1);
             audiosink.erase();
@@ -1027,6 +1292,18 @@ static void parse_arguments (int argc, char *argv[]) {
                 fprintf(stderr, "invalid \"-reset %s\"; -reset n must have n >= 0,  default n = %d\n", argv[i], NTP_TIMEOUT_LIMIT);
                 exit(1);
             }
+        } else if (arg == "-alacfast") {
+            alac_fast_start = true;
+        } else if (arg == "-grace") {
+            grace_secs = GRACE_SECS;
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                unsigned int n = 0;
+                if (!get_value(argv[++i], &n)) {
+                    fprintf(stderr, "invalid \"-grace %s\"; -grace n must have n >= 0, default n = %d\n", argv[i], GRACE_SECS);
+                    exit(1);
+                }
+                grace_secs = n;
+            }
         } else if (arg == "-vdmp") {
             dump_video = true;
             if (i < argc - 1 && *argv[i+1] != '-') {
@@ -1077,6 +1354,17 @@ static void parse_arguments (int argc, char *argv[]) {
             bt709_fix = true;
         } else if (arg == "-nohold") {
             max_connections = 3;
+        } else if (arg == "-party") {
+            party_sources = PARTY_SOURCES;
+            if (i < argc - 1 && *argv[i+1] != '-') {
+                unsigned int n = 8;
+                if (!get_value(argv[++i], &n) || n < 2) {
+                    fprintf(stderr, "invalid \"-party %s\"; -party n requires 2 <= n <= 8, default n = %d\n",
+                            argv[i], PARTY_SOURCES);
+                    exit(1);
+                }
+                party_sources = n;
+            }
         } else if (arg == "-al") {
 	    int n;
             char *end;
@@ -1378,6 +1666,7 @@ extern "C" void conn_destroy (void *cls) {
     LOGD("Open connections: %i", open_connections);
     if (open_connections == 0) {
         remote_clock_offset = 0;
+        overload_level = OVERLOAD_NONE;
         if (use_audio) {
             audio_renderer_stop();
         }
@@ -1418,13 +1707,114 @@ extern "C" void report_client_request(void *cls, char *deviceid, char * model, c
         *admit = false;
         LOGI("*** attempt to connect by blocked client (clientID %s): DENIED\n", deviceid);
     }
+    if (*admit && overload_level >= OVERLOAD_REJECT_SESSIONS) {
+        *admit = false;
+        LOGI("*** server is overloaded: connection request by client (clientID %s) DENIED\n", deviceid);
+    }
+    if (*admit && use_video) {
+        qoe_rendered_start = video_renderer_frames_rendered();
+    }
+}
+
+static void send_qoe_datagram(const char *json) {
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    int ret = getaddrinfo(qoe_udp_host.c_str(), qoe_udp_port.c_str(), &hints, &res);
+    if (ret != 0 || !res) {
+        LOGE("-qoe: cannot resolve %s: %s", qoe_udp_host.c_str(), gai_strerror(ret));
+        return;
+    }
+    int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (sock < 0 || sendto(sock, json, strlen(json), 0, res->ai_addr, res->ai_addrlen) < 0) {
+        LOGE("-qoe: failed to send session report to %s:%s", qoe_udp_host.c_str(), qoe_udp_port.c_str());
+    }
+    if (sock >= 0) {
+#ifdef _WIN32
+        closesocket(sock);
+#else
+        close(sock);
+#endif
+    }
+    freeaddrinfo(res);
+}
+
+extern "C" void report_qoe(void *cls, raop_qoe_t *qoe) {
+    if (use_video && qoe->video_frames) {
+        qoe->video_frames_rendered = (int64_t) (video_renderer_frames_rendered() - qoe_rendered_start);
+    }
+    char *json = raop_qoe_to_json(qoe);
+    if (!json) {
+        return;
+    }
+    if (perf_counters) {
+        LOGI("session report: %s", json);
+    } else {
+        LOGD("session report: %s", json);
+    }
+    if (!qoe_file.empty()) {
+        FILE *fp = fopen(qoe_file.c_str(), "a");
+        if (fp) {
+            fprintf(fp, "%s\n", json);
+            fclose(fp);
+        } else {
+            LOGE("-qoe: cannot append session report to file %s", qoe_file.c_str());
+        }
+    }
+    if (!qoe_udp_host.empty()) {
+        send_qoe_datagram(json);
+    }
+    free(json);
+}
+
+/* -hud: rates over the interval since the previous report (at most a few per second) */
+extern "C" void report_qoe_progress(void *cls, const raop_qoe_t *qoe) {
+    static uint64_t session = 0;
+    static gint64 last_time = 0;
+    static uint64_t last_frames = 0, last_bytes = 0, last_rendered = 0, last_latency_count = 0, last_latency_sum = 0;
+    static uint64_t last_resends = 0;
+    if (!video_renderer_hud_shown()) {
+        last_time = 0;
+        return;
+    }
+    gint64 now = g_get_monotonic_time();
+    uint64_t rendered = video_renderer_frames_rendered();
+    if (qoe->start_time == session && last_time && now > last_time) {
+        double secs = (double) (now - last_time) / G_USEC_PER_SEC;
+        uint64_t latency_count = qoe->latency_count - last_latency_count;
+        double latency = (latency_count ? (double) (qoe->latency_sum - last_latency_sum) / latency_count / 1000000.0 : 0.0);
+        char text[256];
+        snprintf(text, sizeof(text),
+                 "rx %.1f fps  render %.1f fps  %.2f Mbit/s\n"
+                 "latency %.1f ms  decrypt failures %llu\n"
+                 "audio buffer %u pkts  resends %.1f/s  ntp offset %+.2f ms",
+                 (double) (qoe->video_frames - last_frames) / secs, (double) (rendered - last_rendered) / secs,
+                 (double) (qoe->video_bytes - last_bytes) * 8.0 / secs / 1000000.0, latency,
+                 (unsigned long long) qoe->decrypt_failures, qoe->audio_buffered,
+                 (double) (qoe->resend_requests - last_resends) / secs, (double) qoe->ntp_offset_last / 1000000.0);
+        video_renderer_set_hud_text(text);
+    }
+    session = qoe->start_time;
+    last_time = now;
+    last_frames = qoe->video_frames;
+    last_bytes = qoe->video_bytes;
+    last_rendered = rendered;
+    last_latency_count = qoe->latency_count;
+    last_latency_sum = qoe->latency_sum;
+    last_resends = qoe->resend_requests;
 }
 
 extern "C" void audio_process (void *cls, raop_ntp_t *ntp, audio_decode_struct *data) {
     if (dump_audio) {
         dump_audio_to_file(data->data, data->data_len, (data->data)[0] & 0xf0);
     }
-    if (use_audio) {
+    if (use_audio && party_sources) {
+        /* each source keeps its own clock offset (from its ntp mapping) in the mixer */
+        int64_t delay = (data->ct == 2 ? audio_delay_alac : audio_delay_aac);
+        audio_renderer_mix_buffer(ntp, data->ct, data->data, data->data_len, data->ntp_time_remote,
+                                  data->ntp_time_local, delay);
+    } else if (use_audio) {
         if (!remote_clock_offset) {
             remote_clock_offset = data->ntp_time_local - data->ntp_time_remote;
         }
@@ -1452,12 +1842,26 @@ extern "C" void video_process (void *cls, raop_ntp_t *ntp, h264_decode_struct *d
     if (dump_video) {
         dump_video_to_file(data->data, data->data_len);
     }
+    if (video_wall) {
+        if (!remote_clock_offset) {
+            remote_clock_offset = data->ntp_time_local - data->ntp_time_remote;
+        }
+        uint64_t pts = data->ntp_time_remote + remote_clock_offset + (uint64_t) wall_delay * (SECOND_IN_NSECS / 1000);
+        video_wall_ingest_send(video_wall, data->data, data->data_len, data->nal_count, pts);
+    }
     if (use_video) {
         if (!remote_clock_offset) {
             remote_clock_offset = data->ntp_time_local - data->ntp_time_remote;
         }
         data->ntp_time_remote = data->ntp_time_remote + remote_clock_offset;
         video_renderer_render_buffer(data->data, &(data->data_len), &(data->nal_count), &(data->ntp_time_remote));
+        if (overload_threshold) {
+            int level = video_renderer_overload_level();
+            if (level >= OVERLOAD_SHORTEN_AUDIO && overload_level < OVERLOAD_SHORTEN_AUDIO && use_audio) {
+                audio_renderer_shorten_buffer();
+            }
+            overload_level = level;
+        }
     }
 }
 
@@ -1474,6 +1878,19 @@ extern "C" void video_resume (void *cls) {
 }
 
 
+extern "C" bool display_photo (void *cls, const char *asset_key, const char *data, int datalen, bool display) {
+    if (use_photo) {
+        return photo_renderer_put(asset_key, data, datalen, display);
+    }
+    return false;
+}
+
+extern "C" void stop_photo (void *cls) {
+    if (use_photo) {
+        photo_renderer_stop();
+    }
+}
+
 extern "C" void audio_flush (void *cls) {
     if (use_audio) {
         audio_renderer_flush();
@@ -1486,12 +1903,20 @@ extern "C" void video_flush (void *cls) {
     }
 }
 
-extern "C" void audio_set_volume (void *cls, float volume) {
-    if (use_audio) {
+extern "C" void audio_set_volume (void *cls, raop_ntp_t *ntp, float volume) {
+    if (use_audio && party_sources) {
+        audio_renderer_mix_set_volume(ntp, volume);
+    } else if (use_audio) {
         audio_renderer_set_volume(volume);
     }
 }
 
+extern "C" void audio_stop (void *cls, raop_ntp_t *ntp) {
+    if (use_audio && party_sources) {
+        audio_renderer_mix_remove(ntp);
+    }
+}
+
 extern "C" void audio_get_format (void *cls, unsigned char *ct, unsigned short *spf, bool *usingScreen, bool *isMedia, uint64_t *audioFormat) {
     unsigned char type;
     LOGI("ct=%d spf=%d usingScreen=%d isMedia=%d  audioFormat=0x%lx",*ct, *spf, *usingScreen, *isMedia, (unsigned long) *audioFormat);
@@ -1512,7 +1937,7 @@ extern "C" void audio_get_format (void *cls, unsigned char *ct, unsigned short *
     }
     audio_type = type;
     
-    if (use_audio) {
+    if (use_audio && !party_sources) {
       audio_renderer_start(ct);
     }
 
@@ -1585,6 +2010,20 @@ extern "C" bool check_register(void *cls, const char *client_pk_str) {
     return true;
 }
 
+extern "C" void wall_video_frame (void *cls, unsigned char *data, int data_len, int nal_count, uint64_t pts) {
+    video_renderer_render_buffer(data, &data_len, &nal_count, &pts);
+}
+
+extern "C" void wall_frame_presented (void *cls, uint64_t pts, int64_t lateness) {
+    if (video_wall) {
+        video_wall_node_report(video_wall, pts, lateness);
+    }
+}
+
+extern "C" void latency_probe_done (void *cls) {
+    reset_loop = true;
+}
+
 extern "C" void log_callback (void *cls, int level, const char *msg) {
     switch (level) {
         case LOGGER_DEBUG: {
@@ -1630,9 +2069,19 @@ int start_raop_server (unsigned short display[5], unsigned short tcp[3], unsigne
     raop_cbs.display_pin = display_pin;
     raop_cbs.register_client = register_client;
     raop_cbs.check_register = check_register;
+    if (use_photo) {
+        raop_cbs.display_photo = display_photo;
+        raop_cbs.stop_photo = stop_photo;
+    }
+    raop_cbs.report_qoe = report_qoe;
+    if (hud && use_video) {
+        raop_cbs.report_qoe_progress = report_qoe_progress;
+    }
+    raop_cbs.audio_stop = audio_stop;
 
     /* set max number of connections = 2 to protect against capture by new client */
-    raop = raop_init(max_connections, &raop_cbs, keyfile.c_str());
+    /* party mode: a connection for each source (the spare one, for -nohold, comes after them) */
+    raop = raop_init(max_connections + (party_sources ? party_sources - 1 : 0), &raop_cbs, keyfile.c_str());
     if (raop == NULL) {
         LOGE("Error initializing raop!");
         return -1;
@@ -1649,6 +2098,13 @@ int start_raop_server (unsigned short display[5], unsigned short tcp[3], unsigne
 
     if (show_client_FPS_data) raop_set_plist(raop, "clientFPSdata", 1);
     raop_set_plist(raop, "max_ntp_timeouts", max_ntp_timeouts);
+    raop_set_plist(raop, "grace_secs", (int) grace_secs);
+    raop_set_plist(raop, "alac_fast_start", (alac_fast_start ? 1 : 0));
+    raop_set_plist(raop, "perf_counters", (perf_counters ? 1 : 0));
+    if (party_sources) raop_set_plist(raop, "hold_connections", (int) party_sources + 1);
+    raop_set_plist(raop, "mirror_stages", (int) mirror_stages);
+    if (report_log) raop_set_report_log(raop, report_log);
+    if (vclock) raop_set_clock(raop, vclock);
     if (audiodelay >= 0) raop_set_plist(raop, "audio_delay_micros", audiodelay);
     if (require_password) raop_set_plist(raop, "pin", (int) pin);
 
@@ -1832,6 +2288,12 @@ int main (int argc, char *argv[]) {
     new_window_closing_behavior = false;
 #endif
 
+    if (hfr) {
+        /* refresh rate and maximum fps advertised to the client, unless set with -s wxh@r or -fps */
+        if (!display[2]) display[2] = (unsigned short) hfr;
+        if (!display[3]) display[3] = (unsigned short) hfr;
+    }
+
     if (videosink == "0") {
         use_video = false;
 	videosink.erase();
@@ -1840,16 +2302,43 @@ int main (int argc, char *argv[]) {
         display[3] = 1; /* set fps to 1 frame per sec when no video will be shown */
     }
 
-    if (fullscreen && use_video) {
-        if (videosink == "waylandsink" || videosink == "vaapisink") {
-            videosink.append(" fullscreen=true");
-	}
+    if (wall_ingest && !wall_host.empty()) {
+        LOGE("options -wall and -wallnode cannot be used together");
+        exit(1);
     }
-
-    if (videosink == "d3d11videosink"  && use_video) {
-        videosink.append(" fullscreen-toggle-mode=alt-enter");  
-        LOGI("d3d11videosink is being used with option fullscreen-toggle-mode=alt-enter\n"
-               "Use Alt-Enter key combination to toggle into/out of full-screen mode");
+    if ((wall_ingest || !wall_host.empty()) && wall_key.empty()) {
+        LOGE("options -wall and -wallnode need the video wall's shared secret: -wallkey <secret>");
+        exit(1);
+    }
+    if (!wall_bind.empty() && !wall_ingest) {
+        LOGI("option -wallbind is only used by the ingest node (-wall)");
+    }
+    if (probe_secs && (wall_ingest || !wall_host.empty())) {
+        LOGE("option -probe cannot be used with -wall or -wallnode");
+        exit(1);
+    }
+    if (probe_secs && !use_video && !use_audio) {
+        LOGE("option -probe needs video or audio to be enabled");
+        exit(1);
+    }
+    if (wall_ingest && use_video) {
+        use_video = false;
+        use_photo = false;
+        LOGI("video wall ingest node: mirrored video is only shown by display nodes (-wallnode)");
+    }
+    if (!wall_host.empty()) {
+        /* a display node is not an AirPlay server */
+        use_audio = false;
+        dump_audio = false;
+        use_photo = false;
+        if (!use_video) {
+            LOGE("option -wallnode needs a video display (not -vs 0)");
+            exit(1);
+        }
+        if (!video_sync) {
+            LOGI("video wall display node: -vsync no is ignored");
+            video_sync = true;
+        }
     }
 
     if (bt709_fix && use_video) {
@@ -1885,18 +2374,132 @@ int main (int argc, char *argv[]) {
     logger_set_callback(render_logger, log_callback, NULL);
     logger_set_level(render_logger, log_level);
 
+    if (autotune && use_video) {
+        std::string cachefile = "";
+        const char *homedir = get_homedir();
+        if (homedir) {
+            cachefile = homedir;
+            cachefile.append("/.uxplay.pipeline");
+        }
+        video_chain_t chain;
+        if (video_autotune(render_logger, (cachefile.empty() ? NULL : cachefile.c_str()), autotune_reprobe,
+                           video_parser.c_str(), &chain)) {
+            /* choices made with -vd, -vc, -vs, -avdec, -v4l2 are kept */
+            if (video_decoder == "decodebin") video_decoder = chain.decoder;
+            if (video_converter == "videoconvert") video_converter = chain.converter;
+            if (videosink == "autovideosink") videosink = chain.videosink;
+        } else {
+            LOGE("video autotune failed: using the default video pipeline");
+        }
+    }
+
+    if (fullscreen && use_video) {
+        if (videosink == "waylandsink" || videosink == "vaapisink") {
+            videosink.append(" fullscreen=true");
+	}
+    }
+
+    if (videosink == "d3d11videosink"  && use_video) {
+        videosink.append(" fullscreen-toggle-mode=alt-enter");  
+        LOGI("d3d11videosink is being used with option fullscreen-toggle-mode=alt-enter\n"
+               "Use Alt-Enter key combination to toggle into/out of full-screen mode");
+    }
+
     if (use_audio) {
+      if (!rtp_audio_clients.empty()) {
+          audio_renderer_set_rtp_output(rtp_audio_clients.c_str(), rtp_audio_l16);
+      }
+      audio_renderer_set_mixer((int) party_sources);
       audio_renderer_init(render_logger, audiosink.c_str(), &audio_sync, &video_sync);
     } else {
         LOGI("audio_disabled");
     }
 
     if (use_video) {
+        if (!wall_host.empty()) {
+            video_renderer_set_tile(wall_tile[0], wall_tile[1], wall_tile[2], wall_tile[3]);
+            video_renderer_set_presented_callback(wall_frame_presented, NULL);
+        }
+        video_renderer_set_frame_rate(hfr ? display[2] : 0);
+        video_renderer_set_hud(hud);
         video_renderer_init(render_logger, server_name.c_str(), videoflip, video_parser.c_str(),
                             video_decoder.c_str(), video_converter.c_str(), videosink.c_str(), &fullscreen, &video_sync);
+        video_renderer_set_overload_threshold(overload_threshold);
+        video_renderer_set_fast_start(fast_start);
         video_renderer_start();
     }
 
+    if (use_photo && use_video) {
+        use_photo = photo_renderer_init(render_logger, videosink.c_str(), (display[0] ? display[0] : 1920),
+                                        (display[1] ? display[1] : 1080), photo_cache_size);
+    } else {
+        use_photo = false;
+    }
+
+    if (probe_secs) {
+        /* the probe is the only sender: no AirPlay server is started */
+        latency_probe = latency_probe_start(render_logger, use_video, use_audio, display[3], probe_secs,
+                                            latency_probe_done, NULL);
+        if (latency_probe) {
+            main_loop();
+            char *results = latency_probe_finish(latency_probe);
+            printf("%s\n", results);
+            fflush(stdout);
+            g_free(results);
+        }
+        goto cleanup;
+    }
+
+    if (!wall_host.empty()) {
+        video_wall_callbacks_t wall_cbs;
+        memset(&wall_cbs, 0, sizeof(wall_cbs));
+        wall_cbs.video_frame = wall_video_frame;
+        std::string tile = std::to_string(wall_tile[0]) + "x" + std::to_string(wall_tile[1]) + ":" +
+                           std::to_string(wall_tile[2]) + "," + std::to_string(wall_tile[3]);
+        video_wall = video_wall_node_init(render_logger, wall_host.c_str(), wall_port, tile.c_str(), wall_key.c_str(),
+                                          &wall_cbs);
+        if (video_wall) {
+            LOGI("video wall display node %s: ingest node is %s:%u", tile.c_str(), wall_host.c_str(), wall_port);
+            main_loop();
+        }
+        goto cleanup;
+    }
+    if (wall_ingest) {
+        video_wall = video_wall_ingest_init(render_logger, (wall_bind.empty() ? NULL : wall_bind.c_str()), wall_port,
+                                            wall_key.c_str());
+        if (!video_wall) {
+            goto cleanup;
+        }
+    }
+
+    /* testing only (not a user option): UXPLAY_VCLOCK=n runs the session timing on a virtual clock, n times *
+     * faster than real time (tests/test_virtual_clock.c drives the same clock directly)                    */
+    if (getenv("UXPLAY_VCLOCK")) {
+        vclock_speed = 100000;
+        if (!get_value(getenv("UXPLAY_VCLOCK"), &vclock_speed) || vclock_speed < 2) {
+            LOGE("invalid UXPLAY_VCLOCK=%s: must be n with 2 <= n <= 100000", getenv("UXPLAY_VCLOCK"));
+            goto cleanup;
+        }
+    }
+    if (vclock_speed) {
+        /* starts at the current time, so that timestamps in logs and -qoe reports stay readable */
+        vclock = raop_clock_init(RAOP_CLOCK_VIRTUAL, raop_clock_get_time(NULL), (double) vclock_speed);
+        if (!vclock) {
+            LOGE("UXPLAY_VCLOCK: cannot create the virtual clock");
+            goto cleanup;
+        }
+        LOGI("session timing uses a virtual clock running at %u times real time", vclock_speed);
+    }
+
+    if (!report_log_file.empty()) {
+        report_log = report_log_open(report_log_file.c_str(), report_log_records);
+        if (!report_log) {
+            LOGE("-reportlog: cannot open report log %s: %s", report_log_file.c_str(), strerror(errno));
+            goto cleanup;
+        }
+        LOGI("storing client streaming reports in %s", report_log_file.c_str());
+    }
+
     if (udp[0]) {
         LOGI("using network ports UDP %d %d %d TCP %d %d %d", udp[0], udp[1], udp[2], tcp[0], tcp[1], tcp[2]);
     }
@@ -1970,12 +2573,32 @@ int main (int argc, char *argv[]) {
         stop_dnssd();
     }
     cleanup:
+    if (vclock) {
+        raop_clock_destroy(vclock);
+        vclock = NULL;
+    }
+    if (report_log) {
+        report_log_close(report_log);
+        report_log = NULL;
+    }
+    if (video_wall) {
+        video_wall_t *wall = video_wall;
+        video_wall = NULL;
+        video_wall_destroy(wall);
+    }
     if (use_audio) {
         audio_renderer_destroy();
     }
     if (use_video)  {
         video_renderer_destroy();
     }
+    if (use_photo) {
+        photo_renderer_destroy();
+    }
+    if (latency_probe) {
+        latency_probe_destroy(latency_probe);
+        latency_probe = NULL;
+    }
     logger_destroy(render_logger);
     render_logger = NULL;
     if(audio_dumpfile) {